@@ -0,0 +1,366 @@
+#include "AHE.hpp"
+#include <cryptopp/filters.h>
+#include <cryptopp/hex.h>
+#include <cryptopp/nbtheory.h>
+#include <stdexcept>
+#include "Parallel.hpp"
+
+namespace {
+///@brief Componentwise product of two ElGamal ciphertexts, adding their
+/// messages
+CryptoPP::SecByteBlock multiplyCiphertexts(const ModPGroup& group,
+                                           const CryptoPP::SecByteBlock& a,
+                                           const CryptoPP::SecByteBlock& b,
+                                           size_t elementSize) {
+  CryptoPP::SecByteBlock result(2 * elementSize);
+  for (size_t offset = 0; offset < result.size(); offset += elementSize) {
+    CryptoPP::Integer product = group.convertOut(group.combine(
+        group.convertIn(CryptoPP::Integer(a.data() + offset, elementSize)),
+        group.convertIn(CryptoPP::Integer(b.data() + offset, elementSize))));
+    product.Encode(result.data() + offset, elementSize);
+  }
+  return result;
+}
+
+///@brief Componentwise sum of two EC ElGamal ciphertexts, adding their
+/// messages
+CryptoPP::SecByteBlock addCiphertexts(const ECGroup& group,
+                                      const CryptoPP::SecByteBlock& a,
+                                      const CryptoPP::SecByteBlock& b) {
+  const CryptoPP::ECP& curve = group.getCurve();
+  size_t pointSize = curve.EncodedPointSize(true);
+  CryptoPP::SecByteBlock result(2 * pointSize);
+  for (size_t offset = 0; offset < result.size(); offset += pointSize) {
+    CryptoPP::ECP::Point aPoint, bPoint;
+    curve.DecodePoint(aPoint, a.data() + offset, pointSize);
+    curve.DecodePoint(bPoint, b.data() + offset, pointSize);
+    curve.EncodePoint(result.data() + offset, group.combine(aPoint, bPoint),
+                      true);
+  }
+  return result;
+}
+}  // namespace
+
+std::string toHex(const CryptoPP::byte* data, size_t size) {
+  std::string hex;
+  CryptoPP::StringSource(data, size, true,
+                         new CryptoPP::HexEncoder(new CryptoPP::StringSink(hex),
+                                                  false));
+  return hex;
+}
+
+CryptoPP::SecByteBlock fromHex(const std::string& hex) {
+  if (hex.empty() || hex.size() % 2 != 0 ||
+      hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+    throw std::invalid_argument("AHE: malformed hex encoding");
+  std::string bytes;
+  CryptoPP::StringSource(
+      hex, true, new CryptoPP::HexDecoder(new CryptoPP::StringSink(bytes)));
+  return CryptoPP::SecByteBlock(
+      reinterpret_cast<const CryptoPP::byte*>(bytes.data()), bytes.size());
+}
+
+///@brief Encrypt every rating, splitting the batch across threads which each
+/// hold their own random pool and group workspace
+///@param threads - number of threads, 0 for the hardware count
+std::vector<EncryptedRatingAHE> AHEEncryptor::encryptBatch(
+    const std::vector<PlainRating>& ratings,
+    size_t threads) const {
+  std::vector<CryptoPP::SecByteBlock> ciphertexts(ratings.size());
+  parallelFor(
+      ratings.size(),
+      [&](size_t begin, size_t end) {
+        encryptRange(ratings, begin, end, ciphertexts);
+      },
+      threads);
+
+  std::vector<EncryptedRatingAHE> result;
+  result.reserve(ratings.size());
+  for (size_t i = 0; i < ratings.size(); i++) {
+    result.emplace_back(ratings[i].userID, ratings[i].itemID, ciphertexts[i]);
+  }
+  return result;
+}
+
+///@brief Homomorphically add values[i] to ciphertexts[i], splitting the batch
+/// across threads
+std::vector<CryptoPP::SecByteBlock> AHEEncryptor::addPlainBatch(
+    const std::vector<CryptoPP::SecByteBlock>& ciphertexts,
+    const std::vector<uint64_t>& values,
+    size_t threads) const {
+  std::vector<CryptoPP::SecByteBlock> result(ciphertexts.size());
+  parallelFor(
+      ciphertexts.size(),
+      [&](size_t begin, size_t end) {
+        addPlainRange(ciphertexts, values, begin, end, result);
+      },
+      threads);
+  return result;
+}
+
+/// ElGamalAHEEncryptor Constructor - builds the fixed-base tables for the
+/// generator and the CSP's public element
+///@param window - bits of exponent handled per table row
+ElGamalAHEEncryptor::ElGamalAHEEncryptor(
+    const CryptoPP::ElGamalKeys::PublicKey& publicKey,
+    int window)
+    : modulus(publicKey.GetGroupParameters().GetModulus()),
+      subgroupOrder(publicKey.GetGroupParameters().GetSubgroupOrder()),
+      group(modulus),
+      elementSize(modulus.ByteCount()) {
+  unsigned int exponentBits = subgroupOrder.BitCount();
+  generatorTable = std::make_unique<FixedBaseTable<ModPGroup>>(
+      group,
+      group.convertIn(publicKey.GetGroupParameters().GetSubgroupGenerator()),
+      exponentBits, window);
+  publicTable = std::make_unique<FixedBaseTable<ModPGroup>>(
+      group, group.convertIn(publicKey.GetPublicElement()), exponentBits,
+      window);
+}
+
+///@brief (g^k, g^m * h^k) encoded as two fixed width big endian integers
+CryptoPP::SecByteBlock ElGamalAHEEncryptor::encryptWith(
+    const ModPGroup& threadGroup,
+    CryptoPP::RandomNumberGenerator& rng,
+    uint64_t message) const {
+  CryptoPP::Integer k(rng, CryptoPP::Integer::One(),
+                      subgroupOrder - CryptoPP::Integer::One());
+  CryptoPP::Integer c1 = generatorTable->exponentiate(threadGroup, k);
+  CryptoPP::Integer c2 = threadGroup.combine(
+      generatorTable->exponentiate(threadGroup,
+                                   CryptoPP::Integer((long)message)),
+      publicTable->exponentiate(threadGroup, k));
+
+  CryptoPP::SecByteBlock ciphertext(ciphertextSize());
+  threadGroup.convertOut(c1).Encode(ciphertext.data(), elementSize);
+  threadGroup.convertOut(c2).Encode(ciphertext.data() + elementSize,
+                                    elementSize);
+  return ciphertext;
+}
+
+CryptoPP::SecByteBlock ElGamalAHEEncryptor::encrypt(
+    CryptoPP::RandomNumberGenerator& rng,
+    uint64_t message) const {
+  ModPGroup threadGroup(group);
+  return encryptWith(threadGroup, rng, message);
+}
+
+void ElGamalAHEEncryptor::encryptRange(
+    const std::vector<PlainRating>& ratings,
+    size_t begin,
+    size_t end,
+    std::vector<CryptoPP::SecByteBlock>& out) const {
+  ModPGroup threadGroup(group);
+  CryptoPP::AutoSeededRandomPool rng;
+  for (size_t i = begin; i < end; i++) {
+    out[i] = encryptWith(threadGroup, rng, ratings[i].rating);
+  }
+}
+
+void ElGamalAHEEncryptor::addPlainRange(
+    const std::vector<CryptoPP::SecByteBlock>& ciphertexts,
+    const std::vector<uint64_t>& values,
+    size_t begin,
+    size_t end,
+    std::vector<CryptoPP::SecByteBlock>& out) const {
+  ModPGroup threadGroup(group);
+  CryptoPP::AutoSeededRandomPool rng;
+  for (size_t i = begin; i < end; i++) {
+    out[i] = multiplyCiphertexts(threadGroup, ciphertexts[i],
+                                 encryptWith(threadGroup, rng, values[i]),
+                                 elementSize);
+  }
+}
+
+/// ECElGamalAHEEncryptor Constructor - builds the fixed-base tables for the
+/// curve generator and the CSP's public point
+///@param window - bits of scalar handled per table row
+ECElGamalAHEEncryptor::ECElGamalAHEEncryptor(
+    const CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP>& groupParameters,
+    const CryptoPP::ECP::Point& publicElement,
+    int window)
+    : parameters(groupParameters), group(groupParameters.GetCurve()) {
+  unsigned int scalarBits = parameters.GetSubgroupOrder().BitCount();
+  generatorTable = std::make_unique<FixedBaseTable<ECGroup>>(
+      group, parameters.GetSubgroupGenerator(), scalarBits, window);
+  publicTable = std::make_unique<FixedBaseTable<ECGroup>>(group, publicElement,
+                                                          scalarBits, window);
+}
+
+///@brief Two compressed points
+size_t ECElGamalAHEEncryptor::ciphertextSize() const {
+  return 2 * group.getCurve().EncodedPointSize(true);
+}
+
+///@brief (kG, mG + kH) encoded as two compressed points
+CryptoPP::SecByteBlock ECElGamalAHEEncryptor::encryptWith(
+    const ECGroup& threadGroup,
+    CryptoPP::RandomNumberGenerator& rng,
+    uint64_t message) const {
+  CryptoPP::Integer k(rng, CryptoPP::Integer::One(),
+                      parameters.GetSubgroupOrder() - CryptoPP::Integer::One());
+  CryptoPP::ECP::Point c1 = generatorTable->exponentiate(threadGroup, k);
+  CryptoPP::ECP::Point c2 = threadGroup.combine(
+      generatorTable->exponentiate(threadGroup,
+                                   CryptoPP::Integer((long)message)),
+      publicTable->exponentiate(threadGroup, k));
+
+  size_t pointSize = threadGroup.getCurve().EncodedPointSize(true);
+  CryptoPP::SecByteBlock ciphertext(2 * pointSize);
+  threadGroup.getCurve().EncodePoint(ciphertext.data(), c1, true);
+  threadGroup.getCurve().EncodePoint(ciphertext.data() + pointSize, c2, true);
+  return ciphertext;
+}
+
+CryptoPP::SecByteBlock ECElGamalAHEEncryptor::encrypt(
+    CryptoPP::RandomNumberGenerator& rng,
+    uint64_t message) const {
+  ECGroup threadGroup(group);
+  return encryptWith(threadGroup, rng, message);
+}
+
+void ECElGamalAHEEncryptor::encryptRange(
+    const std::vector<PlainRating>& ratings,
+    size_t begin,
+    size_t end,
+    std::vector<CryptoPP::SecByteBlock>& out) const {
+  ECGroup threadGroup(group);
+  CryptoPP::AutoSeededRandomPool rng;
+  for (size_t i = begin; i < end; i++) {
+    out[i] = encryptWith(threadGroup, rng, ratings[i].rating);
+  }
+}
+
+void ECElGamalAHEEncryptor::addPlainRange(
+    const std::vector<CryptoPP::SecByteBlock>& ciphertexts,
+    const std::vector<uint64_t>& values,
+    size_t begin,
+    size_t end,
+    std::vector<CryptoPP::SecByteBlock>& out) const {
+  ECGroup threadGroup(group);
+  CryptoPP::AutoSeededRandomPool rng;
+  for (size_t i = begin; i < end; i++) {
+    out[i] = addCiphertexts(threadGroup, ciphertexts[i],
+                            encryptWith(threadGroup, rng, values[i]));
+  }
+}
+
+///@brief Decrypt every ciphertext, splitting the batch across threads
+///@return messages, or decryptionFailed where a message is out of range
+std::vector<uint64_t> AHEDecryptor::decryptBatch(
+    const std::vector<CryptoPP::SecByteBlock>& ciphertexts,
+    size_t threads) const {
+  std::vector<uint64_t> result(ciphertexts.size(), decryptionFailed);
+  parallelFor(
+      ciphertexts.size(),
+      [&](size_t begin, size_t end) {
+        decryptRange(ciphertexts, begin, end, result);
+      },
+      threads);
+  return result;
+}
+
+/// ElGamalAHEDecryptor Constructor - builds the baby step table
+ElGamalAHEDecryptor::ElGamalAHEDecryptor(
+    const CryptoPP::ElGamalKeys::PrivateKey& privateKey,
+    int maxMessageBits)
+    : modulus(privateKey.GetGroupParameters().GetModulus()),
+      subgroupOrder(privateKey.GetGroupParameters().GetSubgroupOrder()),
+      generator(privateKey.GetGroupParameters().GetSubgroupGenerator()),
+      privateExponent(privateKey.GetPrivateExponent()),
+      elementSize(modulus.ByteCount()) {
+  babySteps = 1ULL << ((maxMessageBits + 1) / 2);
+  giantSteps = ((1ULL << maxMessageBits) + babySteps - 1) / babySteps;
+  CryptoPP::Integer value = CryptoPP::Integer::One();
+  for (uint64_t j = 0; j < babySteps; j++) {
+    babyTable.emplace(value.GetBits(0, 64), j);
+    value = CryptoPP::a_times_b_mod_c(value, generator, modulus);
+  }
+  giantStep = value.InverseMod(modulus);
+}
+
+void ElGamalAHEDecryptor::decryptRange(
+    const std::vector<CryptoPP::SecByteBlock>& in,
+    size_t begin,
+    size_t end,
+    std::vector<uint64_t>& out) const {
+  CryptoPP::Integer inverseExponent =
+      modulus - CryptoPP::Integer::One() - privateExponent;
+  for (size_t i = begin; i < end; i++) {
+    CryptoPP::Integer c1(in[i].data(), elementSize);
+    CryptoPP::Integer c2(in[i].data() + elementSize, elementSize);
+
+    // g^m = c2 * c1^-x
+    CryptoPP::Integer gm = CryptoPP::a_times_b_mod_c(
+        c2, CryptoPP::a_exp_b_mod_c(c1, inverseExponent, modulus), modulus);
+
+    // Giant steps of g^-babySteps until a baby step matches
+    CryptoPP::Integer y = gm;
+    for (uint64_t step = 0; step <= giantSteps; step++) {
+      auto baby = babyTable.find(y.GetBits(0, 64));
+      if (baby != babyTable.end()) {
+        uint64_t candidate = step * babySteps + baby->second;
+        if (CryptoPP::a_exp_b_mod_c(generator,
+                                    CryptoPP::Integer((long)candidate),
+                                    modulus) == gm) {
+          out[i] = candidate;
+          break;
+        }
+      }
+      y = CryptoPP::a_times_b_mod_c(y, giantStep, modulus);
+    }
+  }
+}
+
+/// ECElGamalAHEDecryptor Constructor - builds the baby step table
+ECElGamalAHEDecryptor::ECElGamalAHEDecryptor(
+    const CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP>& groupParameters,
+    const CryptoPP::Integer& privateKey,
+    int maxMessageBits)
+    : parameters(groupParameters), privateExponent(privateKey) {
+  babySteps = 1ULL << ((maxMessageBits + 1) / 2);
+  giantSteps = ((1ULL << maxMessageBits) + babySteps - 1) / babySteps;
+  CryptoPP::ECP curve = parameters.GetCurve();
+  const CryptoPP::ECP::Point& generator = parameters.GetSubgroupGenerator();
+  CryptoPP::ECP::Point value = curve.Identity();
+  for (uint64_t j = 0; j < babySteps; j++) {
+    babyTable.emplace(value.x.GetBits(0, 64), j);
+    value = curve.Add(value, generator);
+  }
+  giantStep = curve.Inverse(value);
+}
+
+void ECElGamalAHEDecryptor::decryptRange(
+    const std::vector<CryptoPP::SecByteBlock>& in,
+    size_t begin,
+    size_t end,
+    std::vector<uint64_t>& out) const {
+  CryptoPP::ECP curve = parameters.GetCurve();
+  const CryptoPP::ECP::Point& generator = parameters.GetSubgroupGenerator();
+  size_t pointSize = curve.EncodedPointSize(true);
+  for (size_t i = begin; i < end; i++) {
+    CryptoPP::ECP::Point c1, c2;
+    curve.DecodePoint(c1, in[i].data(), pointSize);
+    curve.DecodePoint(c2, in[i].data() + pointSize, pointSize);
+
+    // mG = c2 - x * c1
+    CryptoPP::ECP::Point xc1 = curve.ScalarMultiply(c1, privateExponent);
+    CryptoPP::ECP::Point negatedxc1 = curve.Inverse(xc1);
+    CryptoPP::ECP::Point mG = curve.Add(c2, negatedxc1);
+
+    // Giant steps of -babySteps * G until a baby step matches
+    CryptoPP::ECP::Point y = mG;
+    for (uint64_t step = 0; step <= giantSteps; step++) {
+      auto baby = babyTable.find(y.identity ? 0 : y.x.GetBits(0, 64));
+      if (baby != babyTable.end()) {
+        uint64_t candidate = step * babySteps + baby->second;
+        if (curve.ScalarMultiply(generator,
+                                 CryptoPP::Integer((long)candidate)) == mG) {
+          out[i] = candidate;
+          break;
+        }
+      }
+      y = curve.Add(y, giantStep);
+    }
+  }
+}
@@ -0,0 +1,257 @@
+#pragma once
+#include <cryptopp/eccrypto.h>
+#include <cryptopp/elgamal.h>
+#include <cryptopp/integer.h>
+#include <cryptopp/modarith.h>
+#include <cryptopp/osrng.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Ratings.hpp"
+
+// Additively homomorphic ElGamal used for the upload phase. Ratings are
+// encrypted in the exponent, (g^k, g^m * h^k), so that multiplying ciphertexts
+// adds the ratings and the CSP can recover small values after decryption
+
+enum class AHEScheme { ElGamal, ECElGamal };
+
+// Hex encoding of AHE ciphertexts and keys for text protocols, such as the
+// PPRSDaemon socket. fromHex throws on anything but pairs of hex digits
+std::string toHex(const CryptoPP::byte* data, size_t size);
+CryptoPP::SecByteBlock fromHex(const std::string& hex);
+
+// Multiplicative group mod p, in Montgomery form. Not thread safe, each thread
+// needs its own copy
+class ModPGroup {
+  CryptoPP::MontgomeryRepresentation mr;
+
+ public:
+  typedef CryptoPP::Integer Element;
+
+  explicit ModPGroup(const CryptoPP::Integer& modulus) : mr(modulus) {}
+  Element identity() const { return mr.MultiplicativeIdentity(); }
+  Element combine(const Element& a, const Element& b) const {
+    return mr.Multiply(a, b);
+  }
+  Element convertIn(const CryptoPP::Integer& a) const {
+    return mr.ConvertIn(a);
+  }
+  CryptoPP::Integer convertOut(const Element& a) const {
+    return mr.ConvertOut(a);
+  }
+};
+
+// Elliptic curve group, written additively. Not thread safe, each thread needs
+// its own copy
+class ECGroup {
+  CryptoPP::ECP curve;
+
+ public:
+  typedef CryptoPP::ECP::Point Element;
+
+  explicit ECGroup(const CryptoPP::ECP& ec) : curve(ec) {}
+  Element identity() const { return curve.Identity(); }
+  Element combine(const Element& a, const Element& b) const {
+    return curve.Add(a, b);
+  }
+  const CryptoPP::ECP& getCurve() const { return curve; }
+};
+
+// Fixed-base precomputation: row i holds base^(j * 2^(window * i)) for every
+// window digit j, so an exponentiation is one group operation per window
+template <class Group>
+class FixedBaseTable {
+  int window;
+  std::vector<std::vector<typename Group::Element>> table;
+
+ public:
+  FixedBaseTable(const Group& group,
+                 const typename Group::Element& base,
+                 unsigned int exponentBits,
+                 int windowBits)
+      : window(windowBits) {
+    int rows = (exponentBits + window - 1) / window;
+    int digits = 1 << window;
+    typename Group::Element rowBase = base;
+    table.resize(rows);
+    for (int i = 0; i < rows; i++) {
+      table[i].reserve(digits);
+      table[i].push_back(group.identity());
+      for (int j = 1; j < digits; j++) {
+        table[i].push_back(group.combine(table[i][j - 1], rowBase));
+      }
+      // Next row base is base^(2^(window * (i + 1)))
+      rowBase = group.combine(table[i][digits - 1], rowBase);
+    }
+  }
+
+  ///@brief base^exponent using the calling thread's group
+  typename Group::Element exponentiate(
+      const Group& group,
+      const CryptoPP::Integer& exponent) const {
+    typename Group::Element result = group.identity();
+    size_t rows = (exponent.BitCount() + window - 1) / window;
+    for (size_t i = 0; i < rows && i < table.size(); i++) {
+      unsigned long digit = exponent.GetBits(i * window, window);
+      if (digit != 0)
+        result = group.combine(result, table[i][digit]);
+    }
+    return result;
+  }
+};
+
+// Batched client side encryption of ratings under the CSP's AHE public key
+class AHEEncryptor {
+ protected:
+  // Encrypt ratings [begin, end) into out with thread-local group state
+  virtual void encryptRange(const std::vector<PlainRating>& ratings,
+                            size_t begin,
+                            size_t end,
+                            std::vector<CryptoPP::SecByteBlock>& out) const = 0;
+  // Add values [begin, end) to the matching ciphertexts, writing into out
+  virtual void addPlainRange(
+      const std::vector<CryptoPP::SecByteBlock>& ciphertexts,
+      const std::vector<uint64_t>& values,
+      size_t begin,
+      size_t end,
+      std::vector<CryptoPP::SecByteBlock>& out) const = 0;
+
+ public:
+  virtual ~AHEEncryptor() = default;
+  virtual CryptoPP::SecByteBlock encrypt(CryptoPP::RandomNumberGenerator& rng,
+                                         uint64_t message) const = 0;
+  virtual size_t ciphertextSize() const = 0;
+
+  std::vector<EncryptedRatingAHE> encryptBatch(
+      const std::vector<PlainRating>& ratings,
+      size_t threads = 0) const;
+  std::vector<CryptoPP::SecByteBlock> addPlainBatch(
+      const std::vector<CryptoPP::SecByteBlock>& ciphertexts,
+      const std::vector<uint64_t>& values,
+      size_t threads = 0) const;
+};
+
+class ElGamalAHEEncryptor : public AHEEncryptor {
+  CryptoPP::Integer modulus, subgroupOrder;
+  ModPGroup group;
+  std::unique_ptr<FixedBaseTable<ModPGroup>> generatorTable, publicTable;
+  size_t elementSize;
+
+  CryptoPP::SecByteBlock encryptWith(const ModPGroup& threadGroup,
+                                     CryptoPP::RandomNumberGenerator& rng,
+                                     uint64_t message) const;
+
+ protected:
+  void encryptRange(const std::vector<PlainRating>& ratings,
+                    size_t begin,
+                    size_t end,
+                    std::vector<CryptoPP::SecByteBlock>& out) const override;
+  void addPlainRange(const std::vector<CryptoPP::SecByteBlock>& ciphertexts,
+                     const std::vector<uint64_t>& values,
+                     size_t begin,
+                     size_t end,
+                     std::vector<CryptoPP::SecByteBlock>& out) const override;
+
+ public:
+  ElGamalAHEEncryptor(const CryptoPP::ElGamalKeys::PublicKey& publicKey,
+                      int window = 6);
+  CryptoPP::SecByteBlock encrypt(CryptoPP::RandomNumberGenerator& rng,
+                                 uint64_t message) const override;
+  size_t ciphertextSize() const override { return 2 * elementSize; }
+};
+
+class ECElGamalAHEEncryptor : public AHEEncryptor {
+  CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP> parameters;
+  ECGroup group;
+  std::unique_ptr<FixedBaseTable<ECGroup>> generatorTable, publicTable;
+
+  CryptoPP::SecByteBlock encryptWith(const ECGroup& threadGroup,
+                                     CryptoPP::RandomNumberGenerator& rng,
+                                     uint64_t message) const;
+
+ protected:
+  void encryptRange(const std::vector<PlainRating>& ratings,
+                    size_t begin,
+                    size_t end,
+                    std::vector<CryptoPP::SecByteBlock>& out) const override;
+  void addPlainRange(const std::vector<CryptoPP::SecByteBlock>& ciphertexts,
+                     const std::vector<uint64_t>& values,
+                     size_t begin,
+                     size_t end,
+                     std::vector<CryptoPP::SecByteBlock>& out) const override;
+
+ public:
+  ECElGamalAHEEncryptor(
+      const CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP>& groupParameters,
+      const CryptoPP::ECP::Point& publicElement,
+      int window = 8);
+  CryptoPP::SecByteBlock encrypt(CryptoPP::RandomNumberGenerator& rng,
+                                 uint64_t message) const override;
+  size_t ciphertextSize() const override;
+};
+
+// CSP side decryption of AHE ciphertexts. Decryption gives g^m, so m is
+// recovered with baby-step giant-step and must be below 2^maxMessageBits
+class AHEDecryptor {
+ protected:
+  // Decrypt ciphertexts [begin, end) into out with thread-local group state
+  virtual void decryptRange(const std::vector<CryptoPP::SecByteBlock>& in,
+                            size_t begin,
+                            size_t end,
+                            std::vector<uint64_t>& out) const = 0;
+
+ public:
+  // Result for a ciphertext whose message is out of range
+  static constexpr uint64_t decryptionFailed = UINT64_MAX;
+
+  virtual ~AHEDecryptor() = default;
+  std::vector<uint64_t> decryptBatch(
+      const std::vector<CryptoPP::SecByteBlock>& ciphertexts,
+      size_t threads = 0) const;
+};
+
+class ElGamalAHEDecryptor : public AHEDecryptor {
+  CryptoPP::Integer modulus, subgroupOrder, generator, privateExponent;
+  size_t elementSize;
+
+  // Baby steps keyed by the low 64 bits of g^j, and g^-babySteps
+  uint64_t babySteps, giantSteps;
+  std::unordered_map<uint64_t, uint64_t> babyTable;
+  CryptoPP::Integer giantStep;
+
+ protected:
+  void decryptRange(const std::vector<CryptoPP::SecByteBlock>& in,
+                    size_t begin,
+                    size_t end,
+                    std::vector<uint64_t>& out) const override;
+
+ public:
+  ElGamalAHEDecryptor(const CryptoPP::ElGamalKeys::PrivateKey& privateKey,
+                      int maxMessageBits);
+};
+
+class ECElGamalAHEDecryptor : public AHEDecryptor {
+  CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP> parameters;
+  CryptoPP::Integer privateExponent;
+
+  // Baby steps keyed by the low 64 bits of the x coordinate of jG, and
+  // -babySteps * G
+  uint64_t babySteps, giantSteps;
+  std::unordered_map<uint64_t, uint64_t> babyTable;
+  CryptoPP::ECP::Point giantStep;
+
+ protected:
+  void decryptRange(const std::vector<CryptoPP::SecByteBlock>& in,
+                    size_t begin,
+                    size_t end,
+                    std::vector<uint64_t>& out) const override;
+
+ public:
+  ECElGamalAHEDecryptor(
+      const CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP>& groupParameters,
+      const CryptoPP::Integer& privateKey,
+      int maxMessageBits);
+};
@@ -0,0 +1,1829 @@
+#include <seal/ciphertext.h>
+#include <seal/plaintext.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <cryptopp/oids.h>
+#include "AHE.hpp"
+#include "CSP.hpp"
+#include "CSPService.hpp"
+#include "CiphertextStore.hpp"
+#include "Dataset.hpp"
+#include "FixedPoint.hpp"
+#include "MessageHandler.hpp"
+#include "PlainRecSys.hpp"
+#include "PredictionScheduler.hpp"
+#include "Profiler.hpp"
+#include "RecSys.hpp"
+#include "Replay.hpp"
+#include "ShardedCSP.hpp"
+#include "Setup.hpp"
+#include "WorkPlan.hpp"
+#include "seal/seal.h"
+
+namespace {
+///@brief Mean of a vector of timings, 0 if empty
+double mean(const std::vector<double>& values) {
+  if (values.empty())
+    return 0;
+  return std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+}
+
+///@brief Milliseconds between two time points
+double elapsedMs(std::chrono::high_resolution_clock::time_point start,
+                 std::chrono::high_resolution_clock::time_point stop) {
+  return std::chrono::duration<double, std::milli>(stop - start).count();
+}
+
+///@brief Interpret a decoded slot as a signed fixed point value with alpha
+/// fractional bits
+double decodeFixedPoint(uint64_t value, uint64_t plainModulus, int alpha) {
+  double signedValue = value > plainModulus / 2
+                           ? -static_cast<double>(plainModulus - value)
+                           : static_cast<double>(value);
+  return std::ldexp(signedValue, -alpha);
+}
+
+///@brief Decrypt the packed predictions of computePredictions, one value per
+/// item
+std::vector<double> decodePredictions(
+    const RecSys& recSys,
+    size_t itemCount,
+    const std::vector<seal::Ciphertext>& results,
+    seal::Decryptor& decryptor,
+    const seal::BatchEncoder& batchEncoder,
+    uint64_t plainModulus) {
+  std::vector<std::vector<uint64_t>> decoded(results.size());
+  for (size_t k = 0; k < results.size(); k++) {
+    seal::Plaintext resultPlain;
+    decryptor.decrypt(results[k], resultPlain);
+    batchEncoder.decode(resultPlain, decoded[k]);
+  }
+  std::vector<double> predictions(itemCount);
+  for (size_t i = 0; i < itemCount; i++) {
+    auto [k, slot] = recSys.predictionSlot(i);
+    predictions[i] = decodeFixedPoint(decoded.at(k).at(slot), plainModulus,
+                                      recSys.getPredictionScaleBits());
+  }
+  return predictions;
+}
+
+///@brief Print one row of the comparison table
+void printRow(const std::string& engine,
+              const std::vector<double>& epochTimes,
+              double rmse) {
+  std::cout << std::left << std::setw(12) << engine << std::right
+            << std::setw(8) << epochTimes.size() << std::setw(16)
+            << std::fixed << std::setprecision(2) << mean(epochTimes)
+            << std::setw(12) << std::setprecision(4) << rmse << std::endl;
+}
+
+///@brief A fresh key pair's public key
+seal::PublicKey createPublicKey(const seal::KeyGenerator& keygen) {
+  seal::PublicKey publicKey;
+  keygen.create_public_key(publicKey);
+  return publicKey;
+}
+
+// The SEAL context, keys, encoder and message handler of a scenario, set up
+// as main does, with the CSP and the encrypted model built on them. Encoder
+// is seal::BatchEncoder on BGV parameters and seal::CKKSEncoder on CKKS
+template <class Encoder>
+struct Fixture {
+  seal::EncryptionParameters parms;
+  seal::SEALContext context;
+  seal::KeyGenerator keygen;
+  seal::SecretKey secretKey;
+  seal::PublicKey publicKey;
+  seal::Encryptor encryptor;
+  seal::Decryptor decryptor;
+  Encoder encoder;
+  std::shared_ptr<MessageHandler> messageHandler{};
+
+  explicit Fixture(const seal::EncryptionParameters& parameters)
+      : parms(parameters),
+        context(parms),
+        keygen(context),
+        secretKey(keygen.secret_key()),
+        publicKey(createPublicKey(keygen)),
+        encryptor(context, publicKey),
+        decryptor(context, secretKey),
+        encoder(context) {}
+
+  size_t slotCount() const { return encoder.slot_count(); }
+  uint64_t plainModulus() const { return parms.plain_modulus().value(); }
+
+  ///@brief A CSP holding the secret key, for the rating space M
+  std::shared_ptr<CSP> createCSP(const std::vector<std::pair<int, int>>& M) {
+    return std::make_shared<CSP>(messageHandler, context, publicKey, secretKey,
+                                 M);
+  }
+
+  ///@brief Encrypt the ratings and initial embeddings of a dataset into
+  /// recSys
+  void encryptModel(RecSys& recSys,
+                    const Dataset& dataset,
+                    const SetupOptions& options = SetupOptions()) {
+    if constexpr (std::is_same_v<Encoder, seal::CKKSEncoder>) {
+      recSys.setRatings(
+          encryptRatingsCKKS(dataset.ratings, encryptor, encoder, options));
+      auto [U, V, UHat, VHat] =
+          createEmbeddingsCKKS(dataset.M, encryptor, encoder, options);
+      recSys.setEmbeddings(U, V, UHat, VHat);
+    } else {
+      recSys.setRatings(
+          encryptRatings(dataset.ratings, encryptor, encoder, options));
+      auto [U, V, UHat, VHat] =
+          createEmbeddings(dataset.M, encryptor, encoder, options);
+      recSys.setEmbeddings(U, V, UHat, VHat);
+    }
+  }
+};
+using BGVFixture = Fixture<seal::BatchEncoder>;
+using CKKSFixture = Fixture<seal::CKKSEncoder>;
+
+// Profile dimension of compare. All ones profiles of a larger dimension start
+// with predictions far above the ratings, and gradient descent diverges
+constexpr int compareDimension = 16;
+
+///@brief Train the plaintext reference and encrypted engines on the same
+/// split and report RMSE, per-epoch time and the encryption overhead
+///@param args - [train file] [test file] [max train lines] [threads] [seed]
+/// With a seed the run is replayable and max train lines are sampled from the
+/// whole file rather than taken from the start
+int compareEngines(const std::vector<std::string>& args) {
+  std::string trainPath = args.size() > 0 ? args[0] : "../res/u1.base";
+  std::string testPath = args.size() > 1 ? args[1] : "../res/u1.test";
+  int maxLines = args.size() > 2 ? std::stoi(args[2]) : 1050;
+  size_t threads = args.size() > 3 ? std::stoul(args[3]) : 0;
+  bool replay = args.size() > 4;
+  ReplaySeeds seeds = deriveReplaySeeds(replay ? std::stoull(args[4]) : 0);
+
+  Dataset train, test;
+  if (!train.load(trainPath, replay ? -1 : maxLines, 50) ||
+      !test.load(testPath, -1, 0))
+    return 1;
+  if (replay)
+    train.sample(maxLines, seeds.dataset);
+  std::cout << "Training entries: " << train.size()
+            << ", test entries: " << test.size() << std::endl;
+
+  // Set up seal as main does
+  BGVFixture fixture(replay ? replayEncryptionParameters(seeds.seal)
+                            : defaultEncryptionParameters());
+
+  // Plaintext reference, with all ones profiles as createEmbeddings encrypts
+  std::cout << "Training plaintext reference" << std::endl;
+  PlainRecSys plainRecSys(train.M, train.ratings, compareDimension, threads);
+  plainRecSys.gradientDescent();
+  double plainRMSE = plainRecSys.rootMeanSquaredError(test.M, test.ratings);
+
+  // Encrypted engine, encrypting in a fixed order when replaying
+  std::cout << "Encrypting" << std::endl;
+  SetupOptions setupOptions;
+  setupOptions.threads = replay ? 1 : threads;
+  setupOptions.dimension = compareDimension;
+  auto setupStartTime = std::chrono::high_resolution_clock::now();
+  std::vector<seal::Ciphertext> encryptedRatings =
+      encryptRatings(train.ratings, fixture.encryptor, fixture.encoder,
+                     setupOptions);
+  auto [U, V, UHat, VHat] = createEmbeddings(train.M, fixture.encryptor,
+                                             fixture.encoder, setupOptions);
+  auto setupStopTime = std::chrono::high_resolution_clock::now();
+  std::cout << "Setup: " << elapsedMs(setupStartTime, setupStopTime) << " ms"
+            << std::endl;
+  std::cout << "Training encrypted engine" << std::endl;
+  auto CSPInstance = fixture.createCSP(train.M);
+  RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context, train.M);
+  recSys.setDimension(compareDimension);
+  if (replay) {
+    CSPInstance->setSeed(seeds.csp);
+    recSys.setSeed(seeds.masks);
+  }
+  recSys.setRatings(encryptedRatings);
+  recSys.setEmbeddings(U, V, UHat, VHat);
+  recSys.gradientDescent();
+
+  // Decrypt the predictions of every trained user that appears in the test set
+  std::set<int> trainedUsers;
+  for (auto [user, item] : train.M) {
+    trainedUsers.insert(user);
+  }
+  std::map<std::pair<int, int>, double> encryptedPredictions;
+  std::set<int> testUsers;
+  for (auto [user, item] : test.M) {
+    if (trainedUsers.find(user) != trainedUsers.end())
+      testUsers.insert(user);
+  }
+  uint64_t digest = ciphertextDigest({});
+  for (int user : testUsers) {
+    auto [items, results] = recSys.computePredictions(user);
+    digest = ciphertextDigest(results, digest);
+    std::vector<double> predictions =
+        decodePredictions(recSys, items.size(), results, fixture.decryptor,
+                          fixture.encoder, fixture.plainModulus());
+    for (int i = 0; i < items.size(); i++) {
+      encryptedPredictions[{user, items.at(i)}] = predictions[i];
+    }
+  }
+  if (replay)
+    std::cout << "Trace digest: " << std::hex << digest << std::dec
+              << std::endl;
+  double squareSum = 0;
+  int count = 0;
+  for (int i = 0; i < test.size(); i++) {
+    auto prediction = encryptedPredictions.find(test.M[i]);
+    if (prediction != encryptedPredictions.end()) {
+      squareSum += std::pow(prediction->second - test.ratings[i], 2);
+      count++;
+    }
+  }
+  double encryptedRMSE = count == 0 ? 0 : std::sqrt(squareSum / count);
+
+  // Report
+  std::cout << std::left << std::setw(12) << "Engine" << std::right
+            << std::setw(8) << "Epochs" << std::setw(16) << "ms/epoch"
+            << std::setw(12) << "RMSE" << std::endl;
+  printRow("Plaintext", plainRecSys.getEpochTimes(), plainRMSE);
+  printRow("Encrypted", recSys.getEpochTimes(), encryptedRMSE);
+  double plainEpoch = mean(plainRecSys.getEpochTimes());
+  std::cout << "Encryption overhead: "
+            << (plainEpoch > 0 ? mean(recSys.getEpochTimes()) / plainEpoch : 0)
+            << "x per epoch" << std::endl;
+  std::cout << "Active entries per epoch:";
+  for (size_t entries : recSys.getEpochActiveEntries()) {
+    std::cout << " " << entries;
+  }
+  std::cout << " of " << train.size() << std::endl;
+  return 0;
+}
+
+///@brief Throughput of client side AHE encryption, per rating with the
+/// Crypto++ ElGamal encryptor and batched with the fixed-base engines
+///@param args - [ratings] [threads]
+int benchmarkAHE(const std::vector<std::string>& args) {
+  int count = args.size() > 0 ? std::stoi(args[0]) : 1000;
+  size_t threads = args.size() > 1 ? std::stoul(args[1]) : 0;
+  std::vector<PlainRating> ratings(count);
+  for (int i = 0; i < count; i++) {
+    ratings[i] = PlainRating{1, i, 1 + i % 5};
+  }
+
+  // Key generation as done by the CSP
+  CryptoPP::AutoSeededRandomPool rng;
+  CryptoPP::ElGamal::Decryptor decryptor;
+  decryptor.AccessKey().GenerateRandomWithKeySize(rng, 2048);
+  CryptoPP::ElGamal::Encryptor encryptor(decryptor);
+  CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP> curve(
+      CryptoPP::ASN1::secp256r1());
+  CryptoPP::Integer ecPrivateKey(
+      rng, CryptoPP::Integer::One(),
+      curve.GetSubgroupOrder() - CryptoPP::Integer::One());
+  CryptoPP::ECP::Point ecPublicKey = curve.ExponentiateBase(ecPrivateKey);
+
+  auto report = [count](const std::string& engine, double ms, size_t bytes) {
+    std::cout << std::left << std::setw(20) << engine << std::right
+              << std::setw(14) << std::fixed << std::setprecision(1)
+              << count / (ms / 1000) << " ratings/s" << std::setw(8) << bytes
+              << " bytes" << std::endl;
+  };
+
+  // Per rating, as User::encryptRatingsAHE used to
+  auto startTime = std::chrono::high_resolution_clock::now();
+  for (const PlainRating& pt : ratings) {
+    CryptoPP::SecByteBlock rating(sizeof(pt.rating));
+    *rating = pt.rating;
+    CryptoPP::SecByteBlock ratingEnc(encryptor.CiphertextLength(rating.size()));
+    encryptor.Encrypt(rng, rating, rating.size(), ratingEnc);
+  }
+  auto stopTime = std::chrono::high_resolution_clock::now();
+  report("Crypto++ ElGamal",
+         elapsedMs(startTime, stopTime),
+         encryptor.CiphertextLength(sizeof(int)));
+
+  // Batched engines, including the table precomputation
+  startTime = std::chrono::high_resolution_clock::now();
+  ElGamalAHEEncryptor elGamal(encryptor.GetKey());
+  auto tableTime = std::chrono::high_resolution_clock::now();
+  elGamal.encryptBatch(ratings, threads);
+  stopTime = std::chrono::high_resolution_clock::now();
+  std::cout << "ElGamal tables built in "
+            << elapsedMs(startTime, tableTime)
+            << " ms" << std::endl;
+  report("Batched ElGamal",
+         elapsedMs(tableTime, stopTime),
+         elGamal.ciphertextSize());
+
+  startTime = std::chrono::high_resolution_clock::now();
+  ECElGamalAHEEncryptor ecElGamal(curve, ecPublicKey);
+  tableTime = std::chrono::high_resolution_clock::now();
+  ecElGamal.encryptBatch(ratings, threads);
+  stopTime = std::chrono::high_resolution_clock::now();
+  std::cout << "EC ElGamal tables built in "
+            << elapsedMs(startTime, tableTime)
+            << " ms" << std::endl;
+  report("Batched EC ElGamal",
+         elapsedMs(tableTime, stopTime),
+         ecElGamal.ciphertextSize());
+  return 0;
+}
+
+///@brief Throughput of the upload phase, converting AHE ratings one at a time
+/// and as masked, packed batches
+///@param args - [ratings] [elgamal|ec]
+int benchmarkUpload(const std::vector<std::string>& args) {
+  int count = args.size() > 0 ? std::stoi(args[0]) : 1000;
+  AHEScheme scheme = args.size() > 1 && args[1] == "ec" ? AHEScheme::ECElGamal
+                                                        : AHEScheme::ElGamal;
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  auto CSPInstance = fixture.createCSP(std::vector<std::pair<int, int>>());
+  CSPInstance->generateKeys();
+  RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context,
+                std::vector<std::pair<int, int>>());
+
+  // Ratings encrypted by the users
+  std::vector<PlainRating> ratings(count);
+  for (int i = 0; i < count; i++) {
+    ratings[i] = PlainRating{1 + i / 100, 1 + i % 100, 1 + i % 5};
+  }
+  std::shared_ptr<AHEEncryptor> userEncryptor;
+  if (scheme == AHEScheme::ECElGamal) {
+    userEncryptor = std::make_shared<ECElGamalAHEEncryptor>(
+        CSPInstance->getGroupParametersECAHE(),
+        CSPInstance->getPublicKeyECAHE());
+  } else {
+    userEncryptor =
+        std::make_shared<ElGamalAHEEncryptor>(CSPInstance->getPublicKeyAHE());
+  }
+  std::vector<EncryptedRatingAHE> encrypted =
+      userEncryptor->encryptBatch(ratings);
+
+  // One ciphertext per rating
+  if (scheme == AHEScheme::ElGamal) {
+    int singleCount = std::min(count, 100);
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < singleCount; i++) {
+      CSPInstance->convertRatingAHEtoFHE(encrypted[i]);
+    }
+    auto stopTime = std::chrono::high_resolution_clock::now();
+    std::cout << "Per rating: " << std::fixed << std::setprecision(1)
+              << singleCount / (elapsedMs(startTime, stopTime) / 1000)
+              << " ratings/s, 3 ciphertexts per rating" << std::endl;
+  }
+
+  // Batched and packed
+  auto startTime = std::chrono::high_resolution_clock::now();
+  recSys.uploadRatings(encrypted, scheme);
+  auto stopTime = std::chrono::high_resolution_clock::now();
+  std::cout << "Batched: " << std::fixed << std::setprecision(1)
+            << count / (elapsedMs(startTime, stopTime) / 1000)
+            << " ratings/s, " << recSys.getPackedRatings().size()
+            << " ciphertexts" << std::endl;
+
+  // Check the packed ratings
+  int mismatches = 0;
+  std::vector<std::vector<uint64_t>> decoded(recSys.getPackedRatings().size());
+  for (int k = 0; k < decoded.size(); k++) {
+    seal::Plaintext packedPlain;
+    fixture.decryptor.decrypt(recSys.getPackedRatings()[k], packedPlain);
+    fixture.encoder.decode(packedPlain, decoded[k]);
+  }
+  for (int i = 0; i < count; i++) {
+    auto [ciphertext, slot] = recSys.getUploadedSlots()[i];
+    if (decoded[ciphertext][slot] != static_cast<uint64_t>(ratings[i].rating))
+      mismatches++;
+  }
+  std::cout << "Mismatched ratings: " << mismatches << std::endl;
+
+  // Into the per entry layout of setRatings, for training
+  recSys.setM(recSys.getUploadedM());
+  startTime = std::chrono::high_resolution_clock::now();
+  size_t loaded = recSys.loadUploadedRatings();
+  stopTime = std::chrono::high_resolution_clock::now();
+  std::cout << "Unpacked into r: " << std::fixed << std::setprecision(1)
+            << loaded / (elapsedMs(startTime, stopTime) / 1000)
+            << " ratings/s" << std::endl;
+  return mismatches == 0 && loaded == static_cast<size_t>(count) ? 0 : 1;
+}
+
+///@brief Slot summation through the CSP round trip against Galois rotations,
+/// for raw ciphertexts and for computePredictions
+///@param args - [ciphertexts] [entries of M]
+int benchmarkSlotSum(const std::vector<std::string>& args) {
+  int count = args.size() > 0 ? std::stoi(args[0]) : 20;
+  int entries = args.size() > 1 ? std::stoi(args[1]) : 50;
+  const int alpha = ProtocolFixedPoint::alpha;
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  size_t slotCount = fixture.slotCount();
+
+  // Small rating space, 10 ratings per user
+  std::vector<std::pair<int, int>> M(entries);
+  std::vector<int> ratings(entries);
+  for (int i = 0; i < entries; i++) {
+    M[i] = {1 + i / 10, 1 + i % 10};
+    ratings[i] = 1 + i % 5;
+  }
+  auto CSPInstance = fixture.createCSP(M);
+
+  auto [U, V, UHat, VHat] =
+      createEmbeddings(M, fixture.encryptor, fixture.encoder);
+  RecSys csp(CSPInstance, fixture.messageHandler, fixture.context, M),
+      rotations(CSPInstance, fixture.messageHandler, fixture.context, M);
+
+  // Only the rotation steps used by sumSlots
+  std::vector<int> steps = rotations.slotSumRotationSteps();
+  auto startTime = std::chrono::high_resolution_clock::now();
+  auto [relinKeys, galoisKeys] = CSPInstance->generateSlotSumKeys(steps);
+  auto stopTime = std::chrono::high_resolution_clock::now();
+  std::cout << "Galois keys for " << steps.size() << " steps built in "
+            << elapsedMs(startTime, stopTime) << " ms" << std::endl;
+  for (RecSys* recSys : {&csp, &rotations}) {
+    recSys->setRatings(
+        encryptRatings(ratings, fixture.encryptor, fixture.encoder));
+    recSys->setEmbeddings(U, V, UHat, VHat);
+  }
+  rotations.enableSlotSum(relinKeys, galoisKeys);
+
+  // Raw ciphertexts with a small value in every slot
+  std::vector<seal::Ciphertext> f(count);
+  for (int i = 0; i < count; i++) {
+    std::vector<uint64_t> values(slotCount);
+    for (size_t j = 0; j < slotCount; j++) {
+      values[j] = static_cast<uint64_t>(i + j % 7) << alpha;
+    }
+    seal::Plaintext plain;
+    fixture.encoder.encode(values, plain);
+    fixture.encryptor.encrypt(plain, f[i]);
+  }
+
+  startTime = std::chrono::high_resolution_clock::now();
+  std::vector<seal::Ciphertext> cspSums = CSPInstance->sumF(f);
+  stopTime = std::chrono::high_resolution_clock::now();
+  double cspMs = elapsedMs(startTime, stopTime);
+  std::vector<seal::Ciphertext> rotationSums(count);
+  startTime = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < count; i++) {
+    rotations.sumSlots(f[i], rotationSums[i]);
+  }
+  stopTime = std::chrono::high_resolution_clock::now();
+  double rotationMs = elapsedMs(startTime, stopTime);
+
+  auto decodeSlot = [&](const seal::Ciphertext& ciphertext) {
+    seal::Plaintext plain;
+    std::vector<uint64_t> decoded;
+    fixture.decryptor.decrypt(ciphertext, plain);
+    fixture.encoder.decode(plain, decoded);
+    return decoded.at(0);
+  };
+  int mismatches = 0;
+  for (int i = 0; i < count; i++) {
+    if (decodeSlot(cspSums[i]) != decodeSlot(rotationSums[i]) >> alpha)
+      mismatches++;
+  }
+
+  // Predictions, which are off by at most one from the CSP's rounding
+  startTime = std::chrono::high_resolution_clock::now();
+  auto [cspItems, cspPredictions] = csp.computePredictions(1);
+  stopTime = std::chrono::high_resolution_clock::now();
+  double cspPredictMs = elapsedMs(startTime, stopTime);
+  startTime = std::chrono::high_resolution_clock::now();
+  auto [rotationItems, rotationPredictions] = rotations.computePredictions(1);
+  stopTime = std::chrono::high_resolution_clock::now();
+  double rotationPredictMs = elapsedMs(startTime, stopTime);
+  for (int i = 0; i < cspPredictions.size(); i++) {
+    int64_t difference =
+        static_cast<int64_t>(decodeSlot(cspPredictions[i])) -
+        static_cast<int64_t>(decodeSlot(rotationPredictions[i]) >> alpha);
+    if (difference > 1 || difference < -1)
+      mismatches++;
+  }
+
+  std::cout << std::left << std::setw(20) << "Path" << std::right
+            << std::setw(16) << "sum ms/ct" << std::setw(16) << "predict ms"
+            << std::endl;
+  std::cout << std::left << std::setw(20) << "CSP round trip" << std::right
+            << std::fixed << std::setprecision(2) << std::setw(16)
+            << cspMs / count << std::setw(16) << cspPredictMs << std::endl;
+  std::cout << std::left << std::setw(20) << "Galois rotations" << std::right
+            << std::setw(16) << rotationMs / count << std::setw(16)
+            << rotationPredictMs << std::endl;
+  std::cout << "Mismatched sums: " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+///@brief Step 8 and 9 CSP throughput in one process against worker processes
+/// sharded by user and item, checking both give the same values
+///@param args - [workers] [entries of M]
+int benchmarkShards(const std::vector<std::string>& args) {
+  size_t workerCount = args.size() > 0 ? std::stoul(args[0]) : 4;
+  int entries = args.size() > 1 ? std::stoi(args[1]) : 200;
+  const int alpha = ProtocolFixedPoint::alpha;
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  size_t slotCount = fixture.slotCount();
+
+  // 10 ratings per user over 25 items, sorted by user
+  std::vector<std::pair<int, int>> M(entries);
+  std::vector<int> allEntries(entries);
+  for (int i = 0; i < entries; i++) {
+    M[i] = {1 + i / 10, 1 + (i * 7) % 25};
+    allEntries[i] = i;
+  }
+  std::vector<seal::Ciphertext> masked(entries);
+  for (int i = 0; i < entries; i++) {
+    std::vector<uint64_t> values(slotCount);
+    for (size_t j = 0; j < slotCount; j++) {
+      values[j] = static_cast<uint64_t>(1 + (i + j) % 13) << alpha;
+    }
+    seal::Plaintext plain;
+    fixture.encoder.encode(values, plain);
+    fixture.encryptor.encrypt(plain, masked[i]);
+  }
+
+  CSP single(fixture.messageHandler, fixture.context, fixture.publicKey,
+             fixture.secretKey, M);
+  auto startTime = std::chrono::high_resolution_clock::now();
+  ShardedCSP sharded(fixture.messageHandler, fixture.context,
+                     fixture.publicKey, fixture.secretKey, M, workerCount);
+  auto stopTime = std::chrono::high_resolution_clock::now();
+  std::cout << sharded.getWorkerCount() << " workers started in "
+            << elapsedMs(startTime, stopTime) << " ms" << std::endl;
+
+  // Steps 8 and 9 on both sides of the rating space
+  auto runSteps = [&](CSP& csp) {
+    std::vector<seal::Ciphertext> out;
+    auto [newU, newUHat] = csp.calculateNewUandUHat(masked, allEntries, alpha);
+    auto [newV, newVHat] = csp.calculateNewVandVHat(masked, allEntries, alpha);
+    for (auto* part : {&newU, &newUHat, &newV, &newVHat}) {
+      out.insert(out.end(), part->begin(), part->end());
+    }
+    for (auto&& part :
+         {csp.calculateNewUGradient(masked, allEntries, alpha),
+          csp.calculateNewVGradient(masked, allEntries, alpha)}) {
+      out.insert(out.end(), part.begin(), part.end());
+    }
+    return out;
+  };
+  startTime = std::chrono::high_resolution_clock::now();
+  std::vector<seal::Ciphertext> singleOut = runSteps(single);
+  stopTime = std::chrono::high_resolution_clock::now();
+  double singleMs = elapsedMs(startTime, stopTime);
+  startTime = std::chrono::high_resolution_clock::now();
+  std::vector<seal::Ciphertext> shardedOut = runSteps(sharded);
+  stopTime = std::chrono::high_resolution_clock::now();
+  double shardedMs = elapsedMs(startTime, stopTime);
+
+  int mismatches = singleOut.size() == shardedOut.size() ? 0 : 1;
+  for (size_t i = 0; i < singleOut.size() && mismatches == 0; i++) {
+    seal::Plaintext singlePlain, shardedPlain;
+    std::vector<uint64_t> singleDecoded, shardedDecoded;
+    fixture.decryptor.decrypt(singleOut[i], singlePlain);
+    fixture.decryptor.decrypt(shardedOut[i], shardedPlain);
+    fixture.encoder.decode(singlePlain, singleDecoded);
+    fixture.encoder.decode(shardedPlain, shardedDecoded);
+    if (singleDecoded != shardedDecoded)
+      mismatches++;
+  }
+
+  std::cout << "Single process: " << std::fixed << std::setprecision(1)
+            << singleMs << " ms" << std::endl
+            << "Sharded: " << shardedMs << " ms ("
+            << (shardedMs > 0 ? singleMs / shardedMs : 0) << "x)" << std::endl
+            << "Mismatched ciphertexts: " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+///@brief CSP Steps 8 and 9 re-encrypting with the public key, with the
+/// secret key, and through the encryption pool, with an idle gap between
+/// rounds as between protocol steps. Checks every variant decrypts the same
+///@param args - [entries of M] [pool depth] [idle ms] [rounds]
+int benchmarkEncryptionPool(const std::vector<std::string>& args) {
+  int entries = args.size() > 0 ? std::stoi(args[0]) : 200;
+  size_t depth = args.size() > 1 ? std::stoul(args[1]) : 0;
+  int idleMs = args.size() > 2 ? std::stoi(args[2]) : 2000;
+  int rounds = args.size() > 3 ? std::stoi(args[3]) : 3;
+  const int alpha = ProtocolFixedPoint::alpha;
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  size_t slotCount = fixture.slotCount();
+
+  // 10 ratings per user over 25 items, sorted by user
+  std::vector<std::pair<int, int>> M(entries);
+  std::vector<int> allEntries(entries);
+  for (int i = 0; i < entries; i++) {
+    M[i] = {1 + i / 10, 1 + (i * 7) % 25};
+    allEntries[i] = i;
+  }
+  std::vector<seal::Ciphertext> masked(entries);
+  for (int i = 0; i < entries; i++) {
+    std::vector<uint64_t> values(slotCount);
+    for (size_t j = 0; j < slotCount; j++) {
+      values[j] = static_cast<uint64_t>(1 + (i + j) % 13) << alpha;
+    }
+    seal::Plaintext plain;
+    fixture.encoder.encode(values, plain);
+    fixture.encryptor.encrypt(plain, masked[i]);
+  }
+  // A round encrypts U, the zeros of UHat and the gradients - 2 per entry
+  if (depth == 0)
+    depth = 2 * entries;
+
+  auto decode = [&](const std::vector<seal::Ciphertext>& ciphertexts) {
+    std::vector<std::vector<uint64_t>> decoded(ciphertexts.size());
+    for (size_t i = 0; i < ciphertexts.size(); i++) {
+      seal::Plaintext plain;
+      fixture.decryptor.decrypt(ciphertexts[i], plain);
+      fixture.encoder.decode(plain, decoded[i]);
+    }
+    return decoded;
+  };
+  std::vector<std::vector<uint64_t>> reference;
+  int mismatches = 0;
+
+  std::cout << std::left << std::setw(20) << "Re-encryption" << std::right
+            << std::setw(12) << "ms/round" << std::setw(12) << "hit rate"
+            << std::endl;
+  for (int variant = 0; variant < 3; variant++) {
+    CSP csp(fixture.messageHandler, fixture.context, fixture.publicKey,
+            fixture.secretKey, M);
+    EncryptionPool::Options options;
+    options.symmetric = variant > 0;
+    options.depth = variant == 2 ? depth : 0;
+    if (variant > 0)
+      csp.setEncryptionPool(options);
+
+    std::vector<double> roundTimes;
+    for (int round = 0; round < rounds; round++) {
+      // Idle, as the CSP is while RecSys works between steps
+      if (variant == 2)
+        std::this_thread::sleep_for(std::chrono::milliseconds(idleMs));
+      auto startTime = std::chrono::high_resolution_clock::now();
+      auto [newU, newUHat] =
+          csp.calculateNewUandUHat(masked, allEntries, alpha);
+      std::vector<seal::Ciphertext> gradient =
+          csp.calculateNewUGradient(masked, allEntries, alpha);
+      auto stopTime = std::chrono::high_resolution_clock::now();
+      roundTimes.push_back(elapsedMs(startTime, stopTime));
+
+      std::vector<seal::Ciphertext> out = newUHat;
+      out.insert(out.end(), gradient.begin(), gradient.end());
+      std::vector<std::vector<uint64_t>> decoded = decode(out);
+      if (reference.empty())
+        reference = decoded;
+      else if (decoded != reference)
+        mismatches++;
+    }
+
+    EncryptionPool::Metrics metrics = csp.getEncryptionPoolMetrics();
+    uint64_t requests = metrics.hits + metrics.misses;
+    const char* names[] = {"public key", "secret key", "pool"};
+    std::cout << std::left << std::setw(20) << names[variant] << std::right
+              << std::fixed << std::setprecision(1) << std::setw(12)
+              << mean(roundTimes) << std::setw(11) << std::setprecision(0)
+              << (requests > 0 ? 100.0 * metrics.hits / requests : 0) << "%"
+              << std::endl;
+  }
+  std::cout << "Pool depth: " << depth << ", idle: " << idleMs << " ms"
+            << std::endl
+            << "Mismatched rounds: " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+///@brief Streaming throughput of the out-of-core ciphertext store, writing
+/// then reading every ciphertext in protocol order twice
+///@param args - [ciphertexts] [chunk size] [resident chunks] [spill directory]
+int benchmarkStore(const std::vector<std::string>& args) {
+  size_t count = args.size() > 0 ? std::stoul(args[0]) : 2000;
+  CiphertextStore::Options options;
+  options.chunkSize = args.size() > 1 ? std::stoul(args[1]) : 64;
+  options.maxResidentChunks = args.size() > 2 ? std::stoul(args[2]) : 4;
+  if (args.size() > 3)
+    options.spillDirectory = args[3];
+
+  BGVFixture fixture(defaultEncryptionParameters());
+
+  // A handful of distinct ciphertexts, reused so encryption is not timed
+  std::vector<seal::Ciphertext> samples(8);
+  for (size_t k = 0; k < samples.size(); k++) {
+    std::vector<uint64_t> values(fixture.slotCount(), k);
+    seal::Plaintext plain;
+    fixture.encoder.encode(values, plain);
+    fixture.encryptor.encrypt(plain, samples[k]);
+  }
+
+  CiphertextStore store(fixture.context, "bench");
+  store.configure(options);
+  store.resize(count);
+  auto startTime = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < count; i++) {
+    store.set(i, samples[i % samples.size()]);
+  }
+  store.flush();
+  auto stopTime = std::chrono::high_resolution_clock::now();
+  double writeMs = elapsedMs(startTime, stopTime);
+
+  int mismatches = 0;
+  startTime = std::chrono::high_resolution_clock::now();
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < count; i++) {
+      seal::Ciphertext ciphertext = store.get(i);
+      if (i % 97 == 0) {
+        seal::Plaintext plain;
+        std::vector<uint64_t> decoded;
+        fixture.decryptor.decrypt(ciphertext, plain);
+        fixture.encoder.decode(plain, decoded);
+        if (decoded.at(0) != i % samples.size())
+          mismatches++;
+      }
+    }
+  }
+  stopTime = std::chrono::high_resolution_clock::now();
+  double readMs = elapsedMs(startTime, stopTime);
+
+  CiphertextStore::Metrics metrics = store.getMetrics();
+  std::cout << std::fixed << std::setprecision(1) << "Write: "
+            << count / (writeMs / 1000) << " ciphertexts/s" << std::endl
+            << "Read: " << 2 * count / (readMs / 1000) << " ciphertexts/s"
+            << std::endl
+            << "Resident limit: " << options.maxResidentChunks << " chunks of "
+            << options.chunkSize << ", peak " << metrics.peakResidentChunks
+            << std::endl
+            << "Hit rate: " << std::setprecision(3) << metrics.hitRate()
+            << " (" << metrics.hits << " hits, " << metrics.prefetchHits
+            << " read-ahead, " << metrics.misses << " misses)" << std::endl
+            << "Spilled: " << metrics.bytesWritten / (1 << 20)
+            << " MiB written, " << metrics.bytesRead / (1 << 20)
+            << " MiB read" << std::endl
+            << "Mismatched ciphertexts: " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+///@brief Predictions with d-dimensional profiles packed slot count / d to a
+/// ciphertext against the same profiles in their own ciphertexts
+///@param args - [dimension] [entries of M]
+int benchmarkDimension(const std::vector<std::string>& args) {
+  size_t dimension = args.size() > 0 ? std::stoul(args[0]) : 64;
+  int entries = args.size() > 1 ? std::stoi(args[1]) : 200;
+  const int alpha = ProtocolFixedPoint::alpha;
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  size_t slotCount = fixture.slotCount();
+  if (!isValidDimension(dimension, slotCount)) {
+    std::cout << "Dimension must be a power of two up to " << slotCount / 2
+              << std::endl;
+    return 1;
+  }
+
+  // 10 ratings per user over 40 items, with small distinct profiles in the
+  // first d slots
+  std::vector<std::pair<int, int>> M(entries);
+  for (int i = 0; i < entries; i++) {
+    M[i] = {1 + i / 10, 1 + (i * 7) % 40};
+  }
+  auto profile = [&](int key, int offset) {
+    std::vector<uint64_t> values(slotCount, 0ULL);
+    for (size_t j = 0; j < dimension; j++) {
+      values[j] = static_cast<uint64_t>(1 + (key * offset + j) % 7)
+                  << (alpha / 2);
+    }
+    return values;
+  };
+  Embeddings embeddings;
+  std::set<int> observedItems;
+  for (int i = 0; i < entries; i++) {
+    seal::Plaintext UPlain, VPlain;
+    fixture.encoder.encode(profile(M[i].first, 3), UPlain);
+    fixture.encoder.encode(profile(M[i].second, 5), VPlain);
+    embeddings.U.emplace_back();
+    embeddings.V.emplace_back();
+    fixture.encryptor.encrypt(UPlain, embeddings.U.back());
+    fixture.encryptor.encrypt(VPlain, embeddings.V.back());
+    bool firstOfUser = i == 0 || M[i - 1].first != M[i].first;
+    bool firstOfItem = observedItems.insert(M[i].second).second;
+    embeddings.UHat.push_back(embeddings.U.back());
+    embeddings.VHat.push_back(embeddings.V.back());
+    if (!firstOfUser)
+      fixture.encryptor.encrypt_zero(embeddings.UHat.back());
+    if (!firstOfItem)
+      fixture.encryptor.encrypt_zero(embeddings.VHat.back());
+  }
+
+  // Every slot against d slots, with the same profiles
+  struct Run {
+    const char* name = "";
+    double predictMs = 0;
+    size_t ciphertexts = 0;
+    uint64_t bytes = 0;
+    std::vector<double> predictions = {};
+  };
+  std::vector<Run> runs = {{"Every slot"}, {"Packed"}};
+  std::vector<int> items;
+  for (Run& run : runs) {
+    auto CSPInstance = fixture.createCSP(M);
+    RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context, M);
+    if (&run == &runs[1])
+      recSys.setDimension(static_cast<int>(dimension));
+    recSys.setEmbeddings(embeddings.U, embeddings.V, embeddings.UHat,
+                         embeddings.VHat);
+    auto startTime = std::chrono::high_resolution_clock::now();
+    auto [predictedItems, results] = recSys.computePredictions(1);
+    auto stopTime = std::chrono::high_resolution_clock::now();
+    run.predictMs = elapsedMs(startTime, stopTime);
+    run.ciphertexts = results.size();
+    run.bytes = recSys.getTraffic().bytesSent +
+                recSys.getTraffic().bytesReceived;
+    run.predictions =
+        decodePredictions(recSys, predictedItems.size(), results,
+                          fixture.decryptor, fixture.encoder,
+                          fixture.plainModulus());
+    items = predictedItems;
+  }
+
+  // Both must match the plaintext inner products, up to mask rounding
+  std::vector<uint64_t> user = profile(1, 3);
+  int mismatches = 0;
+  for (size_t i = 0; i < items.size(); i++) {
+    std::vector<uint64_t> item = profile(items[i], 5);
+    uint64_t expected = 0;
+    for (size_t j = 0; j < dimension; j++) {
+      expected += user[j] * item[j];
+    }
+    double expectedValue = static_cast<double>(expected >> alpha);
+    for (const Run& run : runs) {
+      if (std::abs(std::ldexp(run.predictions[i], alpha) - expectedValue) > 1)
+        mismatches++;
+    }
+  }
+
+  std::cout << std::left << std::setw(12) << "Layout" << std::right
+            << std::setw(14) << "ciphertexts" << std::setw(14) << "MiB sent"
+            << std::setw(14) << "predict ms" << std::endl;
+  for (const Run& run : runs) {
+    std::cout << std::left << std::setw(12) << run.name << std::right
+              << std::setw(14) << run.ciphertexts << std::setw(14)
+              << run.bytes / (1 << 20) << std::setw(14) << std::fixed
+              << std::setprecision(1) << run.predictMs << std::endl;
+  }
+  std::cout << "Mismatched predictions: " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+///@brief Root mean squared error of predictions keyed by (user, item) over
+/// the test entries that have one
+double predictionRMSE(
+    const std::map<std::pair<int, int>, double>& predictions,
+    const Dataset& test) {
+  double squareSum = 0;
+  int count = 0;
+  for (int i = 0; i < test.size(); i++) {
+    auto prediction = predictions.find(test.M[i]);
+    if (prediction != predictions.end()) {
+      squareSum += std::pow(prediction->second - test.ratings[i], 2);
+      count++;
+    }
+  }
+  return count == 0 ? 0 : std::sqrt(squareSum / count);
+}
+
+///@brief Train the plaintext reference, BGV and CKKS engines with profiles of
+/// dimension d, and report the time per epoch, the size of a fresh
+/// ciphertext and the RMSE of each
+///@param args - [train file] [test file] [max train lines] [d]
+int compareSchemes(const std::vector<std::string>& args) {
+  std::string trainPath = args.size() > 0 ? args[0] : "../res/u1.base";
+  std::string testPath = args.size() > 1 ? args[1] : "../res/u1.test";
+  int maxLines = args.size() > 2 ? std::stoi(args[2]) : 1050;
+  size_t dimension = args.size() > 3 ? std::stoul(args[3]) : 16;
+
+  Dataset train, test;
+  if (!train.load(trainPath, maxLines, 50) || !test.load(testPath, -1, 0))
+    return 1;
+  std::set<int> trainedUsers;
+  for (auto [user, item] : train.M) {
+    trainedUsers.insert(user);
+  }
+  std::set<int> testUsers;
+  for (auto [user, item] : test.M) {
+    if (trainedUsers.find(user) != trainedUsers.end())
+      testUsers.insert(user);
+  }
+  SetupOptions setupOptions;
+  setupOptions.dimension = dimension;
+
+  struct Run {
+    const char* name;
+    std::vector<double> epochTimes;
+    uint64_t ciphertextBytes;
+    double rmse;
+  };
+  std::vector<Run> runs;
+
+  std::cout << "Training plaintext reference" << std::endl;
+  PlainRecSys plainRecSys(train.M, train.ratings, dimension);
+  plainRecSys.gradientDescent();
+  runs.push_back({"Plaintext", plainRecSys.getEpochTimes(), 0,
+                  plainRecSys.rootMeanSquaredError(test.M, test.ratings)});
+
+  // BGV, as compare with profiles of dimension d
+  {
+    std::cout << "Training BGV engine" << std::endl;
+    BGVFixture fixture(defaultEncryptionParameters());
+    if (!isValidDimension(dimension, fixture.slotCount())) {
+      std::cout << "Dimension must be a power of two up to "
+                << fixture.slotCount() / 2 << std::endl;
+      return 1;
+    }
+    std::vector<seal::Ciphertext> encryptedRatings =
+        encryptRatings(train.ratings, fixture.encryptor, fixture.encoder,
+                       setupOptions);
+    auto [U, V, UHat, VHat] = createEmbeddings(train.M, fixture.encryptor,
+                                               fixture.encoder, setupOptions);
+    auto CSPInstance = fixture.createCSP(train.M);
+    RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context,
+                  train.M);
+    recSys.setDimension(static_cast<int>(dimension));
+    recSys.setRatings(encryptedRatings);
+    recSys.setEmbeddings(U, V, UHat, VHat);
+    recSys.gradientDescent();
+
+    std::map<std::pair<int, int>, double> predictions;
+    for (int user : testUsers) {
+      auto [items, results] = recSys.computePredictions(user);
+      std::vector<double> values =
+          decodePredictions(recSys, items.size(), results, fixture.decryptor,
+                            fixture.encoder, fixture.plainModulus());
+      for (int i = 0; i < items.size(); i++) {
+        predictions[{user, items.at(i)}] = values[i];
+      }
+    }
+    runs.push_back({"BGV", recSys.getEpochTimes(),
+                    U.front().save_size(seal::compr_mode_type::none),
+                    predictionRMSE(predictions, test)});
+  }
+
+  // CKKS, on the same RecSys and CSP with real valued predictions
+  {
+    std::cout << "Training CKKS engine" << std::endl;
+    CKKSFixture fixture(ckksEncryptionParameters());
+    std::vector<seal::Ciphertext> encryptedRatings =
+        encryptRatingsCKKS(train.ratings, fixture.encryptor, fixture.encoder,
+                           setupOptions);
+    auto [U, V, UHat, VHat] =
+        createEmbeddingsCKKS(train.M, fixture.encryptor, fixture.encoder,
+                             setupOptions);
+    auto CSPInstance = fixture.createCSP(train.M);
+    RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context,
+                  train.M);
+    recSys.setDimension(static_cast<int>(dimension));
+    recSys.setRatings(encryptedRatings);
+    recSys.setEmbeddings(U, V, UHat, VHat);
+    recSys.gradientDescent();
+
+    std::map<std::pair<int, int>, double> predictions;
+    for (int user : testUsers) {
+      auto [items, results] = recSys.computePredictions(user);
+      std::vector<std::vector<double>> decoded(results.size());
+      for (size_t k = 0; k < results.size(); k++) {
+        seal::Plaintext resultPlain;
+        fixture.decryptor.decrypt(results[k], resultPlain);
+        fixture.encoder.decode(resultPlain, decoded[k]);
+      }
+      for (int i = 0; i < items.size(); i++) {
+        auto [k, slot] = recSys.predictionSlot(i);
+        predictions[{user, items.at(i)}] = decoded[k][slot];
+      }
+    }
+    runs.push_back({"CKKS", recSys.getEpochTimes(),
+                    U.front().save_size(seal::compr_mode_type::none),
+                    predictionRMSE(predictions, test)});
+  }
+
+  std::cout << std::left << std::setw(12) << "Scheme" << std::right
+            << std::setw(8) << "Epochs" << std::setw(16) << "ms/epoch"
+            << std::setw(16) << "KiB/ciphertext" << std::setw(12) << "RMSE"
+            << std::endl;
+  for (const Run& run : runs) {
+    std::cout << std::left << std::setw(12) << run.name << std::right
+              << std::setw(8) << run.epochTimes.size() << std::setw(16)
+              << std::fixed << std::setprecision(2) << mean(run.epochTimes)
+              << std::setw(16) << run.ciphertextBytes / 1024 << std::setw(12)
+              << std::setprecision(4) << run.rmse << std::endl;
+  }
+  return 0;
+}
+
+///@brief Peak resident set size of the process so far, in MiB
+double peakRssMiB() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;  // Kilobytes on Linux
+}
+
+// A fixed synthetic rating set and the budgets the encrypted pipeline must
+// stay within on it. Both engines train profiles of the given dimension from
+// all ones. A case with a reference shift adds it to the ratings the
+// reference trains on, and passes only if the predictions are reported as a
+// mismatch. Traffic is in fresh ciphertexts so the budget follows the
+// encryption parameters
+struct RegressionCase {
+  const char* name;
+  int users, items, ratingsPerUser;
+  uint64_t seed;
+  int dimension;
+  int referenceShift;
+  double maxEpochMs;
+  double maxPeakRssMiB;
+  double maxCiphertextsExchanged;
+};
+
+// The budgets are placeholders, not yet measured with PPRSBenchmark regress.
+// A change that moves one on purpose updates it in the same commit. Peak RSS
+// is for the whole process, so the cases run in increasing size
+const RegressionCase regressionCases[] = {
+    {"tiny", 4, 3, 2, 1, 4, 0, 10000, 1024, 1600},
+    {"shifted", 4, 3, 2, 1, 4, 2, 10000, 1024, 1600},
+    {"small", 10, 6, 3, 2, 4, 0, 30000, 4096, 6500},
+};
+
+///@brief Ratings from 1 to 5 for ratingsPerUser distinct items of each of
+/// users users, drawn from itemCount items and sorted by user and then item
+Dataset syntheticDataset(int users,
+                         int itemCount,
+                         int ratingsPerUser,
+                         uint64_t seed) {
+  std::mt19937_64 gen(seed);
+  Dataset dataset;
+  for (int user = 1; user <= users; user++) {
+    std::vector<int> items(itemCount);
+    std::iota(items.begin(), items.end(), 1);
+    std::shuffle(items.begin(), items.end(), gen);
+    items.resize(std::min(ratingsPerUser, itemCount));
+    std::sort(items.begin(), items.end());
+    for (int item : items) {
+      dataset.M.emplace_back(user, item);
+      dataset.ratings.push_back(1 + static_cast<int>(gen() % 5));
+    }
+  }
+  return dataset;
+}
+
+///@brief Run load, encrypt, gradientDescent and computePredictions on one
+/// case in replay mode, comparing against the plaintext reference and the
+/// budgets. A prediction that is not finite in either engine is a mismatch
+///@return true if the predictions match, or mismatch for a case with a
+/// reference shift, and every budget holds
+bool runRegressionCase(const RegressionCase& regressionCase,
+                       double budgetScale,
+                       double tolerance) {
+  Dataset train =
+      syntheticDataset(regressionCase.users, regressionCase.items,
+                       regressionCase.ratingsPerUser, regressionCase.seed);
+  ReplaySeeds seeds = deriveReplaySeeds(regressionCase.seed);
+  BGVFixture fixture(replayEncryptionParameters(seeds.seal));
+
+  std::vector<int> referenceRatings = train.ratings;
+  for (int& rating : referenceRatings) {
+    rating += regressionCase.referenceShift;
+  }
+  PlainRecSys plainRecSys(train.M, referenceRatings, regressionCase.dimension);
+  plainRecSys.gradientDescent();
+
+  // One thread keeps the replayed encryptions in order
+  SetupOptions setupOptions;
+  setupOptions.threads = 1;
+  setupOptions.dimension = regressionCase.dimension;
+  std::vector<seal::Ciphertext> encryptedRatings =
+      encryptRatings(train.ratings, fixture.encryptor, fixture.encoder,
+                     setupOptions);
+  auto [U, V, UHat, VHat] = createEmbeddings(train.M, fixture.encryptor,
+                                             fixture.encoder, setupOptions);
+  auto CSPInstance = fixture.createCSP(train.M);
+  CSPInstance->setSeed(seeds.csp);
+  RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context, train.M);
+  recSys.setDimension(regressionCase.dimension);
+  recSys.setSeed(seeds.masks);
+  recSys.setRatings(encryptedRatings);
+  recSys.setEmbeddings(U, V, UHat, VHat);
+  recSys.gradientDescent();
+
+  // Largest error of a decrypted prediction relative to the reference
+  double maxError = 0;
+  int compared = 0;
+  bool finite = true;
+  std::set<int> users;
+  for (auto [user, item] : train.M) {
+    users.insert(user);
+  }
+  for (int user : users) {
+    auto [items, results] = recSys.computePredictions(user);
+    std::vector<double> predictions =
+        decodePredictions(recSys, items.size(), results, fixture.decryptor,
+                          fixture.encoder, fixture.plainModulus());
+    for (int i = 0; i < items.size(); i++) {
+      double expected;
+      if (!plainRecSys.predict(user, items.at(i), expected))
+        continue;
+      double actual = predictions[i];
+      if (!std::isfinite(expected) || !std::isfinite(actual)) {
+        finite = false;
+      } else {
+        maxError = std::max(maxError, std::abs(actual - expected) /
+                                          std::max(1.0, std::abs(expected)));
+      }
+      compared++;
+    }
+  }
+
+  // A fresh ciphertext as the unit of traffic
+  seal::Ciphertext fresh;
+  fixture.encryptor.encrypt_zero(fresh);
+  const RecSys::Traffic& traffic = recSys.getTraffic();
+  double ciphertextsExchanged =
+      static_cast<double>(traffic.bytesSent + traffic.bytesReceived) /
+      fresh.save_size(seal::compr_mode_type::none);
+  double epochMs = mean(recSys.getEpochTimes());
+  double rssMiB = peakRssMiB();
+
+  bool correct = compared > 0 && finite && maxError <= tolerance;
+  bool predictionsOk = regressionCase.referenceShift == 0
+                           ? correct
+                           : compared > 0 && !correct;
+  bool epochOk = epochMs <= regressionCase.maxEpochMs * budgetScale;
+  bool rssOk = rssMiB <= regressionCase.maxPeakRssMiB * budgetScale;
+  bool trafficOk = ciphertextsExchanged <=
+                   regressionCase.maxCiphertextsExchanged * budgetScale;
+  auto verdict = [](bool ok) { return ok ? "ok" : "OVER BUDGET"; };
+  std::cout << std::fixed << std::setprecision(2) << regressionCase.name
+            << " (" << train.size() << " entries)" << std::endl
+            << "  Predictions: " << compared << " compared, max error "
+            << std::setprecision(6) << maxError
+            << (finite ? " " : ", not finite ")
+            << (correct ? "ok" : "MISMATCH")
+            << (regressionCase.referenceShift == 0 ? ""
+                                                   : ", a mismatch expected")
+            << std::endl
+            << std::setprecision(1) << "  Epoch: " << epochMs << " ms of "
+            << regressionCase.maxEpochMs * budgetScale << " "
+            << verdict(epochOk) << std::endl
+            << "  Peak RSS: " << rssMiB << " MiB of "
+            << regressionCase.maxPeakRssMiB * budgetScale << " "
+            << verdict(rssOk) << std::endl
+            << "  Exchanged: " << ciphertextsExchanged << " ciphertexts ("
+            << (traffic.bytesSent + traffic.bytesReceived) / (1 << 20)
+            << " MiB, " << traffic.roundTrips << " round trips) of "
+            << regressionCase.maxCiphertextsExchanged * budgetScale << " "
+            << verdict(trafficOk) << std::endl;
+  return predictionsOk && epochOk && rssOk && trafficOk;
+}
+
+///@brief End to end regression over fixed synthetic datasets, failing when the
+/// predictions drift from the plaintext reference or a budget is exceeded
+///@param args - [budget scale] [relative tolerance] [case], every case unless
+/// one is named
+int regressionSuite(const std::vector<std::string>& args) {
+  double budgetScale = args.size() > 0 ? std::stod(args[0]) : 1;
+  double tolerance = args.size() > 1 ? std::stod(args[1]) : 0.01;
+  std::string only = args.size() > 2 ? args[2] : "";
+  int failures = 0, run = 0;
+  for (const RegressionCase& regressionCase : regressionCases) {
+    if (!only.empty() && only != regressionCase.name)
+      continue;
+    run++;
+    if (!runRegressionCase(regressionCase, budgetScale, tolerance))
+      failures++;
+  }
+  if (run == 0) {
+    std::cout << "No regression case named " << only << std::endl;
+    return 1;
+  }
+  std::cout << failures << " of " << run << " cases failed" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
+
+///@brief Prediction latency on the initial embeddings without the cache, and
+/// with it for the first and repeat queries of each user
+///@param args - [users] [repeat queries per user] [cache MiB]
+int benchmarkPredictionCache(const std::vector<std::string>& args) {
+  int users = args.size() > 0 ? std::stoi(args[0]) : 4;
+  int repeats = args.size() > 1 ? std::stoi(args[1]) : 5;
+  uint64_t limitMiB = args.size() > 2 ? std::stoull(args[2]) : 256;
+  Dataset train = syntheticDataset(users, 20, 5, 1);
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  auto CSPInstance = fixture.createCSP(train.M);
+  RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context, train.M);
+  fixture.encryptModel(recSys, train);
+
+  // Mean milliseconds per query over every user, repeated
+  auto queryAll = [&](int rounds) {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (int round = 0; round < rounds; round++) {
+      for (int user = 1; user <= users; user++) {
+        recSys.computePredictions(user);
+      }
+    }
+    auto stopTime = std::chrono::high_resolution_clock::now();
+    return elapsedMs(startTime, stopTime) / (rounds * users);
+  };
+  double uncachedMs = queryAll(1);
+  recSys.setPredictionCacheLimit(limitMiB << 20);
+  uint64_t roundTrips = recSys.getTraffic().roundTrips;
+  double firstMs = queryAll(1);
+  uint64_t firstRoundTrips = recSys.getTraffic().roundTrips - roundTrips;
+  double repeatMs = queryAll(repeats);
+  const RecSys::PredictionCacheMetrics& metrics =
+      recSys.getPredictionCacheMetrics();
+
+  std::cout << std::fixed << std::setprecision(3)
+            << "Uncached: " << uncachedMs << " ms/query" << std::endl
+            << "Cached, first query: " << firstMs << " ms/query, "
+            << firstRoundTrips << " CSP round trips" << std::endl
+            << "Cached, repeat query: " << repeatMs << " ms/query"
+            << std::endl
+            << "Hits: " << metrics.hits << ", misses: " << metrics.misses
+            << ", evictions: " << metrics.evictions
+            << ", held: " << (metrics.bytes >> 20) << " MiB of predictions, "
+            << (metrics.itemVectorBytes >> 20) << " MiB of item vectors"
+            << std::endl;
+  return 0;
+}
+
+///@brief Memory and hardware counters of each gradientDescent step and CSP
+/// method on a synthetic dataset, then of the predictions of every user.
+/// Prints the table and writes the JSON report
+///@param args - [users] [items] [ratings per user] [JSON path]
+int profileSteps(const std::vector<std::string>& args) {
+  int users = args.size() > 0 ? std::stoi(args[0]) : 20;
+  int items = args.size() > 1 ? std::stoi(args[1]) : 10;
+  int ratingsPerUser = args.size() > 2 ? std::stoi(args[2]) : 4;
+  std::string jsonPath = args.size() > 3 ? args[3] : "../data/profile.json";
+  Dataset train = syntheticDataset(users, items, ratingsPerUser, 1);
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  auto profiler = std::make_shared<Profiler>();
+  auto CSPInstance = fixture.createCSP(train.M);
+  CSPInstance->setProfiler(profiler);
+  RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context, train.M);
+  recSys.setProfiler(profiler);
+  fixture.encryptModel(recSys, train);
+
+  recSys.gradientDescent();
+  std::vector<int> allUsers(users);
+  std::iota(allUsers.begin(), allUsers.end(), 1);
+  recSys.computePredictions(allUsers);
+
+  profiler->writeTable(std::cout);
+  std::ofstream json(jsonPath);
+  if (!json) {
+    std::cerr << "Cannot write " << jsonPath << std::endl;
+    return 1;
+  }
+  profiler->writeJson(json);
+  std::cout << "Profile written to " << jsonPath << std::endl;
+  return 0;
+}
+
+///@brief Several RecSys models, each with its own keys and rating space,
+/// training at once against one CSPService, against each on its own CSP in
+/// turn. Tenant t has t + 1 times the users of the first, so the per tenant
+/// queue times show whether the small tenants wait on the large ones
+///@param args - [tenants] [users of the first tenant] [epochs] [workers]
+int benchmarkTenants(const std::vector<std::string>& args) {
+  int tenantCount = args.size() > 0 ? std::stoi(args[0]) : 3;
+  int users = args.size() > 1 ? std::stoi(args[1]) : 4;
+  int epochs = args.size() > 2 ? std::stoi(args[2]) : 1;
+  CSPService::Options options;
+  options.workers = args.size() > 3 ? std::stoul(args[3]) : 2;
+
+  seal::EncryptionParameters parms = defaultEncryptionParameters();
+  std::shared_ptr<CSPService> service = CSPService::create(options);
+  std::shared_ptr<seal::SEALContext> context = service->getContext(parms);
+  seal::BatchEncoder batchEncoder(*context);
+  std::shared_ptr<MessageHandler> messageHandlerInstance{};
+
+  struct Tenant {
+    Dataset train;
+    seal::SecretKey secretKey;
+    seal::PublicKey publicKey;
+    std::unique_ptr<RecSys> recSys;
+  };
+  std::vector<Tenant> tenants(tenantCount);
+  for (int t = 0; t < tenantCount; t++) {
+    Tenant& tenant = tenants[t];
+    tenant.train = syntheticDataset(users * (t + 1), 20, 3, t + 1);
+    seal::KeyGenerator keygen(*context);
+    tenant.secretKey = keygen.secret_key();
+    keygen.create_public_key(tenant.publicKey);
+  }
+  // Fresh ratings and embeddings for each run, so both train the same model
+  auto buildModel = [&](Tenant& tenant, std::shared_ptr<CSP> csp) {
+    seal::Encryptor encryptor(*context, tenant.publicKey);
+    tenant.recSys = std::make_unique<RecSys>(csp, messageHandlerInstance,
+                                             *context, tenant.train.M);
+    tenant.recSys->setRatings(
+        encryptRatings(tenant.train.ratings, encryptor, batchEncoder));
+    auto [U, V, UHat, VHat] =
+        createEmbeddings(tenant.train.M, encryptor, batchEncoder);
+    tenant.recSys->setEmbeddings(U, V, UHat, VHat);
+  };
+  auto train = [&](Tenant& tenant) {
+    for (int epoch = 0; epoch < epochs; epoch++) {
+      tenant.recSys->gradientDescent();
+    }
+  };
+
+  // One CSP per model, trained one after another
+  for (Tenant& tenant : tenants) {
+    buildModel(tenant,
+               std::make_shared<CSP>(messageHandlerInstance, *context,
+                                     tenant.publicKey, tenant.secretKey,
+                                     tenant.train.M));
+  }
+  auto startTime = std::chrono::high_resolution_clock::now();
+  for (Tenant& tenant : tenants) {
+    train(tenant);
+  }
+  auto stopTime = std::chrono::high_resolution_clock::now();
+  double separateMs = elapsedMs(startTime, stopTime);
+
+  // The same models as tenants of the service, trained concurrently
+  std::vector<double> tenantMs(tenantCount);
+  for (int t = 0; t < tenantCount; t++) {
+    buildModel(tenants[t], service->addTenant("tenant " + std::to_string(t),
+                                              parms, tenants[t].publicKey,
+                                              tenants[t].secretKey,
+                                              tenants[t].train.M));
+  }
+  std::vector<std::thread> threads;
+  startTime = std::chrono::high_resolution_clock::now();
+  for (int t = 0; t < tenantCount; t++) {
+    threads.emplace_back([&, t] {
+      auto tenantStart = std::chrono::high_resolution_clock::now();
+      train(tenants[t]);
+      tenantMs[t] =
+          elapsedMs(tenantStart, std::chrono::high_resolution_clock::now());
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  stopTime = std::chrono::high_resolution_clock::now();
+  double serviceMs = elapsedMs(startTime, stopTime);
+
+  CSPService::Metrics metrics = service->getMetrics();
+  std::cout << std::fixed << std::setprecision(1)
+            << "Separate CSPs, in turn: " << separateMs << " ms" << std::endl
+            << "CSP service, concurrent: " << serviceMs << " ms, "
+            << metrics.steps << " steps" << std::endl;
+  for (int t = 0; t < tenantCount; t++) {
+    const CSPService::TenantMetrics& tenant = metrics.tenants[t];
+    std::cout << tenant.name << " (" << tenants[t].train.M.size()
+              << " ratings): " << tenantMs[t] << " ms, " << tenant.steps
+              << " steps, " << tenant.ciphertextsPerSecond()
+              << " ciphertexts/s, " << tenant.queuedMs << " ms queued"
+              << std::endl;
+  }
+  return 0;
+}
+
+///@brief Concurrent prediction queries run one at a time against the same
+/// queries coalesced by the PredictionScheduler, checking both decrypt alike
+///@param args - [users] [clients] [window ms] [max batch]
+int benchmarkCoalescing(const std::vector<std::string>& args) {
+  int users = args.size() > 0 ? std::stoi(args[0]) : 16;
+  int clients = args.size() > 1 ? std::stoi(args[1]) : 8;
+  PredictionScheduler::Options options;
+  options.windowMs = args.size() > 2 ? std::stod(args[2]) : 5;
+  options.maxBatch = args.size() > 3 ? std::stoul(args[3]) : 16;
+  Dataset train = syntheticDataset(users, 20, 5, 1);
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  auto CSPInstance = fixture.createCSP(train.M);
+  RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context, train.M);
+  fixture.encryptModel(recSys, train);
+
+  auto decode = [&](const std::vector<seal::Ciphertext>& results) {
+    std::vector<uint64_t> values;
+    for (const seal::Ciphertext& result : results) {
+      seal::Plaintext plain;
+      std::vector<uint64_t> decoded;
+      fixture.decryptor.decrypt(result, plain);
+      fixture.encoder.decode(plain, decoded);
+      values.insert(values.end(), decoded.begin(), decoded.end());
+    }
+    return values;
+  };
+
+  // Each client asks for users / clients users, one query at a time. Without
+  // the scheduler the queries take turns on the model
+  std::mutex model;
+  std::vector<std::vector<uint64_t>> serial(users + 1), coalesced(users + 1);
+  auto runClients = [&](const std::function<void(int)>& query) {
+    std::vector<std::thread> threads;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (int c = 0; c < clients; c++) {
+      threads.emplace_back([&, c] {
+        for (int user = 1 + c; user <= users; user += clients) {
+          query(user);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    auto stopTime = std::chrono::high_resolution_clock::now();
+    return elapsedMs(startTime, stopTime);
+  };
+
+  uint64_t roundTrips = recSys.getTraffic().roundTrips;
+  double serialMs = runClients([&](int user) {
+    std::lock_guard<std::mutex> lock(model);
+    serial[user] = decode(recSys.computePredictions(user).second);
+  });
+  uint64_t serialRoundTrips = recSys.getTraffic().roundTrips - roundTrips;
+
+  roundTrips = recSys.getTraffic().roundTrips;
+  PredictionScheduler::Metrics metrics;
+  double coalescedMs;
+  {
+    PredictionScheduler scheduler(
+        [&](const std::vector<int>& batch) {
+          std::lock_guard<std::mutex> lock(model);
+          return recSys.computePredictions(batch);
+        },
+        options);
+    coalescedMs = runClients([&](int user) {
+      auto predictions = scheduler.submit(user).get();
+      std::vector<uint64_t> values = decode(predictions.second);
+      std::lock_guard<std::mutex> lock(model);
+      coalesced[user] = values;
+    });
+    metrics = scheduler.getMetrics();
+  }
+  uint64_t coalescedRoundTrips = recSys.getTraffic().roundTrips - roundTrips;
+
+  int mismatches = 0;
+  for (int user = 1; user <= users; user++) {
+    if (serial[user] != coalesced[user])
+      mismatches++;
+  }
+  std::cout << std::fixed << std::setprecision(1) << "One at a time: "
+            << users / (serialMs / 1000) << " queries/s, " << serialRoundTrips
+            << " CSP round trips" << std::endl
+            << "Coalesced: " << users / (coalescedMs / 1000)
+            << " queries/s, " << coalescedRoundTrips << " CSP round trips in "
+            << metrics.batches << " batches" << std::endl
+            << "Latency p50 <= " << metrics.latencyMs.percentile(0.5)
+            << " ms, p99 <= " << metrics.latencyMs.percentile(0.99) << " ms"
+            << std::endl
+            << "Batch size p50 <= " << metrics.batchSize.percentile(0.5)
+            << ", p99 <= " << metrics.batchSize.percentile(0.99) << std::endl
+            << "Mismatched users: " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+///@brief Row sums of CSP Steps 8 and 9 on a MovieLens-like rating space, in
+/// which user activity and item popularity follow a Zipf law. Prints the
+/// entries and time of each thread with rows split evenly by count, as
+/// parallelFor would, and by cost with heavy rows split, then checks the CSP
+/// aggregation on several threads matches one thread
+///@param args - [users] [items] [entries of M] [threads] [Zipf exponent]
+int benchmarkSkew(const std::vector<std::string>& args) {
+  int users = args.size() > 0 ? std::stoi(args[0]) : 500;
+  int items = args.size() > 1 ? std::stoi(args[1]) : 1000;
+  size_t entries = args.size() > 2 ? std::stoul(args[2]) : 3000;
+  size_t threads = args.size() > 3 ? std::stoul(args[3]) : 4;
+  double exponent = args.size() > 4 ? std::stod(args[4]) : 1.0;
+
+  // A few users rate most and a few items are rated most, sorted by user
+  std::mt19937_64 rng(42);
+  auto zipf = [&](int count) {
+    std::vector<double> weights(count);
+    for (int rank = 0; rank < count; rank++) {
+      weights[rank] = 1.0 / std::pow(rank + 1, exponent);
+    }
+    return std::discrete_distribution<int>(weights.begin(), weights.end());
+  };
+  auto userRank = zipf(users), itemRank = zipf(items);
+  std::set<std::pair<int, int>> rated;
+  entries = std::min(entries, static_cast<size_t>(users) * items);
+  for (size_t draws = 0; rated.size() < entries && draws < 100 * entries;
+       draws++) {
+    rated.emplace(1 + userRank(rng), 1 + itemRank(rng));
+  }
+  std::vector<std::pair<int, int>> M(rated.begin(), rated.end());
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  size_t slotCount = fixture.slotCount();
+  std::vector<std::vector<uint64_t>> decoded(M.size());
+  for (size_t i = 0; i < M.size(); i++) {
+    decoded[i].resize(slotCount);
+    for (size_t j = 0; j < slotCount; j++) {
+      decoded[i][j] = (i * 31 + j) % 8191;
+    }
+  }
+  std::cout << M.size() << " entries of M, " << threads << " threads, Zipf "
+            << exponent << std::endl;
+
+  // Rows as RecSys lays them out - runs of a user, items by first appearance
+  for (bool byUser : {true, false}) {
+    std::vector<std::vector<size_t>> groups;
+    std::map<int, size_t> groupOfRow;
+    for (size_t i = 0; i < M.size(); i++) {
+      int row = byUser ? M[i].first : M[i].second;
+      auto [position, added] = groupOfRow.emplace(row, groups.size());
+      if (added)
+        groups.emplace_back();
+      groups[position->second].push_back(i);
+    }
+    std::vector<uint64_t> units;
+    for (const auto& group : groups) {
+      units.push_back(group.size());
+    }
+    std::cout << std::endl
+              << (byUser ? "Users" : "Items") << ": " << groups.size()
+              << " rows, heaviest "
+              << *std::max_element(units.begin(), units.end()) << " entries"
+              << std::endl;
+
+    for (bool byCost : {false, true}) {
+      WorkPlan plan = byCost ? WorkPlan::byCost(units, threads)
+                             : WorkPlan::byCount(units, threads);
+      std::vector<std::vector<uint64_t>> sums(
+          threads, std::vector<uint64_t>(slotCount, 0ULL));
+      std::vector<double> ms =
+          plan.run([&](size_t worker, const WorkSegment& segment) {
+            for (size_t k = segment.begin; k < segment.end; k++) {
+              const auto& row = decoded[groups[segment.group][k]];
+              for (size_t j = 0; j < slotCount; j++) {
+                sums[worker][j] += row[j];
+              }
+            }
+          });
+      std::cout << std::left << std::setw(10)
+                << (byCost ? "By cost" : "By count") << std::right
+                << "imbalance " << std::fixed << std::setprecision(2)
+                << plan.imbalance() << ", heavy rows split "
+                << plan.heavyGroups << ", slowest thread "
+                << std::setprecision(1)
+                << *std::max_element(ms.begin(), ms.end()) << " ms"
+                << std::endl;
+      for (size_t t = 0; t < threads; t++) {
+        std::cout << "  thread " << t << ": " << std::setw(7) << plan.loads[t]
+                  << " entries " << std::setw(8) << ms[t] << " ms"
+                  << std::endl;
+      }
+    }
+  }
+
+  // The CSP aggregation itself, one thread against the cost based schedule
+  CSP csp(fixture.messageHandler, fixture.context, fixture.publicKey,
+          fixture.secretKey, M);
+  std::cout << std::endl;
+  int mismatches = 0;
+  for (bool byUser : {true, false}) {
+    std::vector<std::vector<std::vector<uint64_t>>> results;
+    std::vector<double> timings;
+    for (size_t aggregationThreads : {size_t{1}, threads}) {
+      csp.setAggregationThreads(aggregationThreads);
+      auto startTime = std::chrono::high_resolution_clock::now();
+      results.push_back(byUser ? csp.aggregateUser(decoded, M)
+                               : csp.aggregateItem(decoded, M));
+      auto stopTime = std::chrono::high_resolution_clock::now();
+      timings.push_back(elapsedMs(startTime, stopTime));
+    }
+    if (results[0] != results[1])
+      mismatches++;
+    std::cout << (byUser ? "aggregateUser" : "aggregateItem") << ": "
+              << timings[0] << " ms on 1 thread, " << timings[1] << " ms on "
+              << threads << " ("
+              << (timings[1] > 0 ? timings[0] / timings[1] : 0) << "x)"
+              << std::endl;
+  }
+  std::cout << "Mismatched aggregations: " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+///@brief Plain gradient descent against heavy ball momentum, on the
+/// plaintext reference and the BGV engine. Prints the test RMSE after every
+/// epoch and the epochs momentum needs to reach the final RMSE of plain
+/// gradient descent, with the time and round trips of a BGV epoch
+///@param args - [train file] [test file] [max train lines] [momentum]
+/// [epochs] [d]
+int benchmarkMomentum(const std::vector<std::string>& args) {
+  std::string trainPath = args.size() > 0 ? args[0] : "../res/u1.base";
+  std::string testPath = args.size() > 1 ? args[1] : "../res/u1.test";
+  int maxLines = args.size() > 2 ? std::stoi(args[2]) : 1050;
+  double momentum = args.size() > 3 ? std::stod(args[3]) : 0.3;
+  int epochs = args.size() > 4 ? std::stoi(args[4]) : 10;
+  size_t dimension = args.size() > 5 ? std::stoul(args[5]) : 16;
+
+  Dataset train, test;
+  if (!train.load(trainPath, maxLines, 50) || !test.load(testPath, -1, 0))
+    return 1;
+  std::set<int> trainedUsers;
+  for (auto [user, item] : train.M) {
+    trainedUsers.insert(user);
+  }
+  std::set<int> testUsers;
+  for (auto [user, item] : test.M) {
+    if (trainedUsers.find(user) != trainedUsers.end())
+      testUsers.insert(user);
+  }
+
+  BGVFixture fixture(defaultEncryptionParameters());
+  if (!isValidDimension(dimension, fixture.slotCount())) {
+    std::cout << "Dimension must be a power of two up to "
+              << fixture.slotCount() / 2 << std::endl;
+    return 1;
+  }
+  SetupOptions setupOptions;
+  setupOptions.dimension = dimension;
+  std::vector<seal::Ciphertext> encryptedRatings =
+      encryptRatings(train.ratings, fixture.encryptor, fixture.encoder,
+                     setupOptions);
+
+  struct Run {
+    std::string name;
+    std::vector<double> rmse = {};  // After each epoch
+    double epochMs = 0, roundTripsPerEpoch = 0;
+  };
+  std::vector<Run> runs;
+  for (double weight : {0.0, momentum}) {
+    std::string rule = weight == 0 ? "plain" : "momentum";
+    std::cout << "Training with the " << rule << " update" << std::endl;
+
+    Run reference{"Reference " + rule};
+    PlainRecSys plainRecSys(train.M, train.ratings, dimension);
+    plainRecSys.setParameters(0.1, 0.05, 0.5, 1);
+    plainRecSys.setMomentum(weight);
+    for (int epoch = 0; epoch < epochs; epoch++) {
+      plainRecSys.gradientDescent();
+      reference.rmse.push_back(
+          plainRecSys.rootMeanSquaredError(test.M, test.ratings));
+    }
+    reference.epochMs = mean(plainRecSys.getEpochTimes());
+
+    // One epoch per call, decrypting the test predictions in between
+    Run encrypted{"BGV " + rule};
+    auto [U, V, UHat, VHat] =
+        createEmbeddings(train.M, fixture.encryptor, fixture.encoder,
+                         setupOptions);
+    auto CSPInstance = fixture.createCSP(train.M);
+    RecSys recSys(CSPInstance, fixture.messageHandler, fixture.context,
+                  train.M);
+    recSys.setDimension(static_cast<int>(dimension));
+    recSys.setRatings(encryptedRatings);
+    recSys.setEmbeddings(U, V, UHat, VHat);
+    recSys.setMomentum(weight);
+    recSys.setMaxEpochs(1);
+    uint64_t trainingRoundTrips = 0;
+    for (int epoch = 0; epoch < epochs; epoch++) {
+      uint64_t roundTrips = recSys.getTraffic().roundTrips;
+      recSys.gradientDescent();
+      trainingRoundTrips += recSys.getTraffic().roundTrips - roundTrips;
+      std::map<std::pair<int, int>, double> predictions;
+      for (int user : testUsers) {
+        auto [items, results] = recSys.computePredictions(user);
+        std::vector<double> values =
+            decodePredictions(recSys, items.size(), results, fixture.decryptor,
+                              fixture.encoder, fixture.plainModulus());
+        for (int i = 0; i < items.size(); i++) {
+          predictions[{user, items.at(i)}] = values[i];
+        }
+      }
+      encrypted.rmse.push_back(predictionRMSE(predictions, test));
+    }
+    encrypted.epochMs = mean(recSys.getEpochTimes());
+    encrypted.roundTripsPerEpoch =
+        static_cast<double>(trainingRoundTrips) /
+        std::max<size_t>(recSys.getEpochTimes().size(), 1);
+    runs.push_back(reference);
+    runs.push_back(encrypted);
+  }
+
+  std::cout << std::left << std::setw(8) << "Epoch" << std::right;
+  for (const Run& run : runs) {
+    std::cout << std::setw(22) << run.name;
+  }
+  std::cout << std::endl << std::fixed << std::setprecision(4);
+  for (int epoch = 0; epoch < epochs; epoch++) {
+    std::cout << std::left << std::setw(8) << epoch + 1 << std::right;
+    for (const Run& run : runs) {
+      std::cout << std::setw(22) << run.rmse[epoch];
+    }
+    std::cout << std::endl;
+  }
+
+  // Runs are plain then momentum, reference then BGV
+  for (size_t engine = 0; engine < 2; engine++) {
+    const Run& plain = runs[engine];
+    const Run& withMomentum = runs[2 + engine];
+    double target = plain.rmse.back();
+    int reached = 0;
+    for (int epoch = 0; epoch < epochs && reached == 0; epoch++) {
+      if (withMomentum.rmse[epoch] <= target)
+        reached = epoch + 1;
+    }
+    std::cout << withMomentum.name << ": RMSE " << std::setprecision(4)
+              << target << " ";
+    if (reached > 0)
+      std::cout << "after " << reached << " of " << epochs << " epochs";
+    else
+      std::cout << "not reached in " << epochs << " epochs";
+    std::cout << std::setprecision(1) << ", " << withMomentum.epochMs
+              << " ms/epoch against " << plain.epochMs << std::endl;
+  }
+  std::cout << "BGV round trips per epoch: " << runs[1].roundTripsPerEpoch
+            << " plain, " << runs[3].roundTripsPerEpoch << " momentum"
+            << std::endl;
+  return 0;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string scenario = argc > 1 ? argv[1] : "compare";
+  std::vector<std::string> args;
+  for (int i = 2; i < argc; i++) {
+    args.push_back(argv[i]);
+  }
+
+  if (scenario == "compare")
+    return compareEngines(args);
+  if (scenario == "ahe")
+    return benchmarkAHE(args);
+  if (scenario == "upload")
+    return benchmarkUpload(args);
+  if (scenario == "slotsum")
+    return benchmarkSlotSum(args);
+  if (scenario == "shards")
+    return benchmarkShards(args);
+  if (scenario == "store")
+    return benchmarkStore(args);
+  if (scenario == "dimension")
+    return benchmarkDimension(args);
+  if (scenario == "schemes")
+    return compareSchemes(args);
+  if (scenario == "cache")
+    return benchmarkPredictionCache(args);
+  if (scenario == "regress")
+    return regressionSuite(args);
+  if (scenario == "pool")
+    return benchmarkEncryptionPool(args);
+  if (scenario == "coalesce")
+    return benchmarkCoalescing(args);
+  if (scenario == "tenants")
+    return benchmarkTenants(args);
+  if (scenario == "profile")
+    return profileSteps(args);
+  if (scenario == "skew")
+    return benchmarkSkew(args);
+  if (scenario == "momentum")
+    return benchmarkMomentum(args);
+
+  std::cout << "Usage: PPRSBenchmark <scenario> [args]" << std::endl
+            << "Scenarios:" << std::endl
+            << "  compare [train] [test] [max lines] [threads] [seed]"
+            << std::endl
+            << "  ahe [ratings] [threads]" << std::endl
+            << "  upload [ratings] [elgamal|ec]" << std::endl
+            << "  slotsum [ciphertexts] [entries of M]" << std::endl
+            << "  shards [workers] [entries of M]" << std::endl
+            << "  store [ciphertexts] [chunk size] [resident chunks] [dir]"
+            << std::endl
+            << "  dimension [d] [entries of M]" << std::endl
+            << "  schemes [train] [test] [max lines] [d]" << std::endl
+            << "  regress [budget scale] [tolerance] [case]" << std::endl
+            << "  cache [users] [repeats] [cache MiB]" << std::endl
+            << "  pool [entries of M] [depth] [idle ms] [rounds]"
+            << std::endl
+            << "  coalesce [users] [clients] [window ms] [max batch]"
+            << std::endl
+            << "  tenants [tenants] [users] [epochs] [workers]" << std::endl
+            << "  profile [users] [items] [ratings per user] [JSON path]"
+            << std::endl
+            << "  skew [users] [items] [entries of M] [threads] [exponent]"
+            << std::endl
+            << "  momentum [train] [test] [max lines] [momentum] [epochs] [d]"
+            << std::endl;
+  return 1;
+}
@@ -1,147 +1,447 @@
 #include "CSP.hpp"
+#include <cryptopp/oids.h>
 #include <seal/ciphertext.h>
 #include <seal/plaintext.h>
+#include <algorithm>
 #include <cstdint>
+#include <iostream>
 #include <ostream>
 #include <set>
+#include <stdexcept>
+#include <string>
 #include <vector>
+#include "Parallel.hpp"
+#include "Setup.hpp"
+#include "WorkPlan.hpp"
 
 int CSP::generateKeys() {
+  generateKeysAHE();
   return 2;
 }
 
+///@brief Load the AHE keys from keystore, generating and saving them on the
+/// first run
+int CSP::generateKeys(Keystore& keystore) {
+  CryptoPP::ElGamalKeys::PrivateKey elGamalKey;
+  CryptoPP::Integer ecKey;
+  if (keystore.loadKeysAHE(elGamalKey, ecKey)) {
+    setKeysAHE(elGamalKey, ecKey);
+    return 2;
+  }
+  generateKeysAHE();
+  keystore.saveKeysAHE(ahe_PrivateKey, ahe_ECPrivateKey);
+  return 2;
+}
+
+///@brief Replay mode - generate the AHE keys from a seeded generator so runs
+/// with the same seed are identical
+void CSP::setSeed(uint64_t seed) {
+  replayRng = std::make_shared<ReplayRandomNumberGenerator>(seed);
+}
+
+///@brief Generator for key material, seeded in replay mode
+CryptoPP::RandomNumberGenerator& CSP::keyRng() {
+  if (replayRng)
+    return *replayRng;
+  return rng;
+}
+
+///@brief Profiles take the first d slots of a ciphertext, and for predictions
+/// slot count / d profiles are packed to a ciphertext. Must match RecSys
+void CSP::setDimension(size_t profileDimension) {
+  if (!isValidDimension(profileDimension, sealSlotCount))
+    throw std::invalid_argument("CSP: invalid profile dimension " +
+                                std::to_string(profileDimension));
+  dimension = profileDimension;
+}
+
+///@brief Replace the rating space, when RecSys adds entries to M. Must match
+/// the M of RecSys
+void CSP::setM(const std::vector<std::pair<int, int>>& providedM) {
+  M = providedM;
+}
+
+///@brief Re-encrypt CSP results through a pool of encryptions of zero made
+/// by background threads, and optionally with the secret key. Replaces any
+/// previous pool
+void CSP::setEncryptionPool(const EncryptionPool::Options& options) {
+  encryptionPool.reset();
+  encryptionPool = std::make_shared<EncryptionPool>(
+      sealContext, sealHpk, sealPrivateKey, options);
+}
+
+///@brief Profile each protocol method, see RecSys::setProfiler. Null turns
+/// it off
+void CSP::setProfiler(std::shared_ptr<Profiler> methodProfiler) {
+  profiler = std::move(methodProfiler);
+}
+
+///@brief Threads summing rows in aggregateUser and aggregateItem, 0 for the
+/// hardware count
+void CSP::setAggregationThreads(size_t threads) {
+  aggregationThreads = threads;
+}
+
+///@brief Hits and misses of the encryption pool, all zero without one
+EncryptionPool::Metrics CSP::getEncryptionPoolMetrics() {
+  if (!encryptionPool)
+    return EncryptionPool::Metrics();
+  return encryptionPool->getMetrics();
+}
+
+///@brief Encrypt a result, through the encryption pool if set
+void CSP::encryptFHE(const seal::Plaintext& plain, seal::Ciphertext& out) {
+  if (encryptionPool)
+    encryptionPool->encrypt(plain, out);
+  else
+    sealEncryptor.encrypt(plain, out);
+}
+
+///@brief Encrypt zero, through the encryption pool if set. A CKKS zero takes
+/// the scale of the other results, so products with it stay precise
+void CSP::encryptZeroFHE(seal::Ciphertext& out) {
+  if (encryptionPool)
+    encryptionPool->encryptZero(out);
+  else
+    sealEncryptor.encrypt_zero(out);
+  out.scale() = fheScheme->freshScale();
+}
+
 ///@brief getter for ElGamal AHE public key
-CryptoPP::ElGamalKeys::PublicKey CSP::getPublicKeyAHE() {
+CryptoPP::ElGamalKeys::PublicKey CSP::getPublicKeyAHE() const {
   return ahe_PublicKey;
 }
 
+///@brief getter for the curve of the elliptic curve AHE scheme
+CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP> CSP::getGroupParametersECAHE()
+    const {
+  return ahe_ECGroup;
+}
+
+///@brief getter for elliptic curve AHE public key
+CryptoPP::ECP::Point CSP::getPublicKeyECAHE() const {
+  return ahe_ECPublicKey;
+}
+
 /// @brief Generates the Keys and populates the variables for AHE scheme
 /// @return Result status - true if successfull
 bool CSP::generateKeysAHE() {
-  ahe_Decryptor.AccessKey().GenerateRandomWithKeySize(rng, 2048);
-  ahe_PrivateKey = ahe_Decryptor.AccessKey();
+  CryptoPP::ElGamalKeys::PrivateKey elGamalKey;
+  elGamalKey.GenerateRandomWithKeySize(keyRng(), 2048);
+
+  // Elliptic curve variant, h = xG on P-256
+  ahe_ECGroup.Initialize(CryptoPP::ASN1::secp256r1());
+  CryptoPP::Integer ecKey(
+      keyRng(), CryptoPP::Integer::One(),
+      ahe_ECGroup.GetSubgroupOrder() - CryptoPP::Integer::One());
+  setKeysAHE(elGamalKey, ecKey);
+  return true;
+}
+
+///@brief Populate the AHE variables from the private keys, dropping any
+/// decryptors built for previous keys
+void CSP::setKeysAHE(const CryptoPP::ElGamalKeys::PrivateKey& elGamalKey,
+                     const CryptoPP::Integer& ecKey) {
+  ahe_Decryptor.AccessKey() = elGamalKey;
+  ahe_PrivateKey = elGamalKey;
   ahe_Encryptor = CryptoPP::ElGamal::Encryptor(ahe_Decryptor);
   ahe_PublicKey = ahe_Encryptor.AccessKey();
-  return true;
+
+  ahe_ECGroup.Initialize(CryptoPP::ASN1::secp256r1());
+  ahe_ECPrivateKey = ecKey;
+  ahe_ECPublicKey = ahe_ECGroup.ExponentiateBase(ahe_ECPrivateKey);
+  aheDecryptorElGamal.reset();
+  aheDecryptorEC.reset();
+}
+
+///@brief Relinearization keys and Galois keys for the given rotation steps
+/// only, so RecSys can sum slots without a round trip to the CSP
+std::pair<seal::RelinKeys, seal::GaloisKeys> CSP::generateSlotSumKeys(
+    const std::vector<int>& steps) {
+  seal::KeyGenerator keygen(sealContext, sealPrivateKey);
+  seal::RelinKeys relinKeys;
+  seal::GaloisKeys galoisKeys;
+  keygen.create_relin_keys(relinKeys);
+  keygen.create_galois_keys(steps, galoisKeys);
+  return {relinKeys, galoisKeys};
+}
+
+///@brief Batch decryptor for the given AHE scheme, building its baby step
+/// table on first use
+std::shared_ptr<AHEDecryptor> CSP::getDecryptorAHE(AHEScheme scheme) {
+  if (scheme == AHEScheme::ECElGamal) {
+    if (!aheDecryptorEC)
+      aheDecryptorEC = std::make_shared<ECElGamalAHEDecryptor>(
+          ahe_ECGroup, ahe_ECPrivateKey, aheMaxMessageBits);
+    return aheDecryptorEC;
+  }
+  if (!aheDecryptorElGamal)
+    aheDecryptorElGamal = std::make_shared<ElGamalAHEDecryptor>(
+        ahe_PrivateKey, aheMaxMessageBits);
+  return aheDecryptorElGamal;
 }
 
 ///@brief Take a AHE encryptedRating and convert it to a standard (FHE)
 /// Encrypted Rating - Upload Phase
 EncryptedRating CSP::convertRatingAHEtoFHE(EncryptedRatingAHE rating) {
-  return EncryptedRating();
+  EncryptedRating result;
+  std::vector<uint64_t> value =
+      getDecryptorAHE(AHEScheme::ElGamal)->decryptBatch({rating.rating}, 1);
+  if (value[0] == AHEDecryptor::decryptionFailed)
+    throw std::runtime_error("CSP: AHE rating could not be decrypted");
+
+  // Encrypt the IDs and rating into slot 0 of their own ciphertexts
+  std::vector<uint64_t> encodingVector(sealSlotCount, 0ULL);
+  seal::Plaintext encodedPlain;
+  encodingVector[0] = fheScheme->fromInteger(rating.userID);
+  fheScheme->encode(encodingVector, encodedPlain);
+  encryptFHE(encodedPlain, result.userID);
+  encodingVector[0] = fheScheme->fromInteger(rating.itemID);
+  fheScheme->encode(encodingVector, encodedPlain);
+  encryptFHE(encodedPlain, result.itemID);
+  encodingVector[0] = fheScheme->fromInteger(value[0]);
+  fheScheme->encode(encodingVector, encodedPlain);
+  encryptFHE(encodedPlain, result.rating);
+  return result;
+}
+
+///@brief Convert a batch of masked AHE ratings to FHE, decrypting in parallel
+/// and packing consecutive ratings into the slots of each ciphertext - Upload
+/// Phase
+///@return ceil(|maskedRatings| / slot count) ciphertexts, rating i in slot
+/// i % slot count of ciphertext i / slot count. Throws, rejecting the whole
+/// batch, if any rating cannot be decrypted
+std::vector<seal::Ciphertext> CSP::convertRatingsAHEtoFHE(
+    const std::vector<EncryptedRatingAHE>& maskedRatings,
+    AHEScheme scheme) {
+  Profiler::Scope step(profiler.get(), "CSP::convertRatingsAHEtoFHE");
+  std::vector<CryptoPP::SecByteBlock> ciphertexts;
+  ciphertexts.reserve(maskedRatings.size());
+  for (const auto& rating : maskedRatings) {
+    ciphertexts.push_back(rating.rating);
+  }
+
+  // Decrypt in parallel
+  std::vector<uint64_t> values =
+      getDecryptorAHE(scheme)->decryptBatch(ciphertexts);
+  size_t failed = std::count(values.begin(), values.end(),
+                             AHEDecryptor::decryptionFailed);
+  if (failed > 0) {
+    size_t first = std::find(values.begin(), values.end(),
+                             AHEDecryptor::decryptionFailed) -
+                   values.begin();
+    throw std::runtime_error(
+        "CSP: " + std::to_string(failed) +
+        " AHE ratings could not be decrypted, the first at index " +
+        std::to_string(first));
+  }
+
+  // Pack, encode and encrypt in parallel
+  size_t packedCount = (values.size() + sealSlotCount - 1) / sealSlotCount;
+  std::vector<seal::Ciphertext> packed(packedCount);
+  parallelFor(packedCount, [&](size_t begin, size_t end) {
+    for (size_t k = begin; k < end; k++) {
+      std::vector<uint64_t> slots(sealSlotCount, 0ULL);
+      for (size_t s = 0; s < sealSlotCount; s++) {
+        size_t index = k * sealSlotCount + s;
+        if (index < values.size())
+          slots[s] = fheScheme->fromInteger(values[index]);
+      }
+      seal::Plaintext slotsPlain;
+      fheScheme->encode(slots, slotsPlain);
+      encryptFHE(slotsPlain, packed[k]);
+    }
+  });
+  return packed;
+}
+
+///@brief Move masked packed ratings into slot 0 of a ciphertext each, as
+/// encryptRatings lays them out - Upload Phase
+///@param slots - (ciphertext, slot) of each rating to unpack, in output order
+std::vector<seal::Ciphertext> CSP::unpackRatings(
+    const std::vector<seal::Ciphertext>& maskedPacked,
+    const std::vector<std::pair<size_t, size_t>>& slots) {
+  Profiler::Scope step(profiler.get(), "CSP::unpackRatings");
+  step.track("input", maskedPacked);
+  std::vector<std::vector<uint64_t>> decoded(maskedPacked.size());
+  for (size_t k = 0; k < maskedPacked.size(); k++) {
+    seal::Plaintext packedPlain;
+    sealDecryptor.decrypt(maskedPacked[k], packedPlain);
+    fheScheme->decode(packedPlain, decoded[k]);
+  }
+
+  std::vector<seal::Ciphertext> result(slots.size());
+  parallelFor(slots.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      std::vector<uint64_t> ratingSlots(sealSlotCount, 0ULL);
+      ratingSlots[0] = decoded.at(slots[i].first).at(slots[i].second);
+      seal::Plaintext ratingPlain;
+      fheScheme->encode(ratingSlots, ratingPlain);
+      encryptFHE(ratingPlain, result[i]);
+    }
+  });
+  return result;
 }
 
 /// @brief Sum f vector produced by RecSys - Step 3 and 4 of GDS
 /// @return R''
 std::vector<seal::Ciphertext> CSP::sumF(const std::vector<seal::Ciphertext> f) {
+  Profiler::Scope step(profiler.get(), "CSP::sumF");
+  step.track("input", f);
   // Declare result
-  std::vector<uint64_t> rprime(sealSlotCount);
+  std::vector<uint64_t> rprime(f.size());
 
   // Decrypt f and sum
-  std::vector<seal::Plaintext> f_dec(CSP::M.size());
-  std::vector<std::vector<uint64_t>> f_decode(CSP::M.size());
-  for (int i = 0; i < CSP::M.size(); i++) {
+  std::vector<seal::Plaintext> f_dec(f.size());
+  std::vector<std::vector<uint64_t>> f_decode(f.size());
+  for (int i = 0; i < f.size(); i++) {
     // Decrypt and decode
     sealDecryptor.decrypt(f[i], f_dec[i]);
-    sealBatchEncoder.decode(f_dec[i], f_decode[i]);
+    fheScheme->decode(f_dec[i], f_decode[i]);
 
-    // sum f[i]
-    rprime[i] = 0;
-    for (int j = 0; j < sealSlotCount; j++) {
-      rprime[i] += f_decode[i][j];
-    }
-
-    // Scale
-    rprime[i] = (uint64_t)std::floor(rprime[i] / twoPowerAlpha);
+    // sum f[i] over the profile and scale
+    rprime[i] = fheScheme->sum(f_decode[i].data(), dimension, alpha);
   }
 
   // Encode, encrypt and return rprime
-  std::vector<seal::Ciphertext> rprimeEncrypt(M.size());
+  std::vector<seal::Ciphertext> rprimeEncrypt(f.size());
   // Encode
-  for (int i = 0; i < CSP::M.size(); i++) {
+  for (int i = 0; i < f.size(); i++) {
     std::vector<uint64_t> rprimeEncodingVector(sealSlotCount);
     seal::Plaintext rprimeEncode;
     for (int j = 0; j < sealSlotCount; j++) {
       rprimeEncodingVector[j] = rprime[i];
     }
-    sealBatchEncoder.encode(rprimeEncodingVector, rprimeEncode);
-    sealEncryptor.encrypt(rprimeEncode, rprimeEncrypt[i]);
+    fheScheme->encode(rprimeEncodingVector, rprimeEncode);
+    encryptFHE(rprimeEncode, rprimeEncrypt[i]);
   }
   return rprimeEncrypt;
 }
 
+/// @brief The entries of M at the given indices, in the order given
+std::vector<std::pair<int, int>> CSP::entriesOfM(
+    const std::vector<int>& entries) {
+  std::vector<std::pair<int, int>> result;
+  result.reserve(entries.size());
+  for (int i : entries) {
+    result.push_back(M.at(i));
+  }
+  return result;
+}
+
+/// @brief Sum the rows of A in each group. Groups are scheduled by their
+/// number of rows, and a heavy group is summed in parts by several threads
+/// whose partial sums are then added together
+/// @param groups - indices into A of the rows of each group
+std::vector<std::vector<uint64_t>> CSP::sumGroups(
+    const std::vector<std::vector<uint64_t>>& A,
+    const std::vector<std::vector<size_t>>& groups) {
+  std::vector<uint64_t> units(groups.size());
+  for (size_t g = 0; g < groups.size(); g++) {
+    units[g] = groups[g].size();
+  }
+  size_t threads =
+      aggregationThreads == 0 ? defaultThreadCount() : aggregationThreads;
+  WorkPlan plan = WorkPlan::byCost(units, threads);
+
+  // First level - whole groups straight into the result, split groups into
+  // one partial sum per segment
+  std::vector<std::vector<uint64_t>> result(
+      groups.size(), std::vector<uint64_t>(sealSlotCount, 0ULL));
+  std::vector<std::vector<std::vector<uint64_t>>> partials(groups.size());
+  for (size_t g = 0; g < groups.size(); g++) {
+    if (plan.parts[g] > 1)
+      partials[g].assign(plan.parts[g],
+                         std::vector<uint64_t>(sealSlotCount, 0ULL));
+  }
+  plan.run([&](size_t, const WorkSegment& segment) {
+    std::vector<uint64_t>& sum = plan.parts[segment.group] > 1
+                                     ? partials[segment.group][segment.part]
+                                     : result[segment.group];
+    for (size_t k = segment.begin; k < segment.end; k++) {
+      const std::vector<uint64_t>& row = A.at(groups[segment.group][k]);
+      for (size_t j = 0; j < sealSlotCount; j++) {
+        sum[j] = fheScheme->add(sum[j], row.at(j));
+      }
+    }
+  });
+
+  // Second level - add up the partial sums of the split groups, slots spread
+  // over the threads
+  for (size_t g = 0; g < groups.size(); g++) {
+    if (plan.parts[g] <= 1)
+      continue;
+    parallelFor(
+        sealSlotCount,
+        [&](size_t begin, size_t end) {
+          for (const std::vector<uint64_t>& partial : partials[g]) {
+            for (size_t j = begin; j < end; j++) {
+              result[g][j] = fheScheme->add(result[g][j], partial[j]);
+            }
+          }
+        },
+        std::min(threads, plan.parts[g]));
+  }
+  return result;
+}
+
 /// Sum d-dimensional vector of A vector, grouped by user
 /// @brief aggu operation in paper
 /// @param A - decoded plaintext vector
+/// @param ratingSpace - entries of M that A corresponds to
 std::vector<std::vector<uint64_t>> CSP::aggregateUser(
-    const std::vector<std::vector<uint64_t>> A) {
-  std::vector<std::vector<uint64_t>> result;
-  std::vector<uint64_t> curResult = std::vector<uint64_t>(sealSlotCount, 0ULL);
+    const std::vector<std::vector<uint64_t>> A,
+    const std::vector<std::pair<int, int>>& ratingSpace) {
+  // Each run of entries of one user is a group. No entries still gives one
+  // row of zeros
+  std::vector<std::vector<size_t>> groups;
   int prevUser = -1;
-
-  for (int i = 0; i < A.size(); i++) {
-    // Get corresponding user at index of M
-    int curUser = M.at(i).first;
-
-    // If current user is not the same as the last, push result and move onto
-    // the next user
-    if (curUser != prevUser) {
-      if (prevUser != -1) {
-        result.push_back(curResult);
-        std::fill(curResult.begin(), curResult.end(), 0);
-      }
+  for (size_t i = 0; i < A.size(); i++) {
+    int curUser = ratingSpace.at(i).first;
+    if (groups.empty() || curUser != prevUser) {
+      groups.emplace_back();
       prevUser = curUser;
     }
-    // Add current entry to the running total for the current user
-    for (int j = 0; j < sealSlotCount; j++) {
-      curResult[j] += A.at(i).at(j);
-    }
+    groups.back().push_back(i);
   }
-  result.push_back(curResult);
-  return result;
+  if (groups.empty())
+    groups.emplace_back();
+  return sumGroups(A, groups);
 }
 
 /// Sum d-dimensional vector of A vector, grouped by item
 /// @brief aggv operation in paper
 /// @param A - decoded plaintext vector
+/// @param ratingSpace - entries of M that A corresponds to
 std::vector<std::vector<uint64_t>> CSP::aggregateItem(
-    const std::vector<std::vector<uint64_t>> A) {
-  std::vector<std::vector<uint64_t>> result;
-  std::map<int, int> indexMap{};
-  int maxIndex = -1;
-
-  // Map of indicies
-  // If not in index map, push back and increase index
-  for (int i = 0; i < A.size(); i++) {
-    // Get corresponding item at index of M
-    int curItem = M.at(i).second;
-
-    // If this item has already been seen (and thus initialised the result
-    // vector at i) then add otherwise set
-    if (indexMap.find(curItem) != indexMap.end()) {
-      for (int j = 0; j < sealSlotCount; j++) {
-        result[indexMap.find(curItem)->second][j] += A[i][j];
-      }
-    } else {
-      maxIndex++;
-      indexMap.insert(std::make_pair(curItem, maxIndex));
-      result.push_back(A[i]);
-    }
+    const std::vector<std::vector<uint64_t>> A,
+    const std::vector<std::pair<int, int>>& ratingSpace) {
+  // Items in the order they first appear
+  std::vector<std::vector<size_t>> groups;
+  std::map<int, size_t> indexMap{};
+  for (size_t i = 0; i < A.size(); i++) {
+    int curItem = ratingSpace.at(i).second;
+    auto [position, added] = indexMap.emplace(curItem, groups.size());
+    if (added)
+      groups.emplace_back();
+    groups[position->second].push_back(i);
   }
-  return result;
+  return sumGroups(A, groups);
 }
 
 /// Reconstitute A, grouping by User
 /// @brief recu in paper
 /// @param A - decoded plaintext vector
+/// @param ratingSpace - entries of M to reconstitute A over
 std::vector<std::vector<uint64_t>> CSP::reconstituteUser(
-    std::vector<std::vector<uint64_t>> A) {
+    std::vector<std::vector<uint64_t>> A,
+    const std::vector<std::pair<int, int>>& ratingSpace) {
   std::vector<std::vector<uint64_t>> result;
   int prevUser = -1;
   int aIndex = -1;
 
   // Go through M
-  for (auto [i, j] : CSP::M) {
+  for (auto [i, j] : ratingSpace) {
     // If new user, increase index
     if (i != prevUser) {
       aIndex++;
@@ -156,13 +456,15 @@ std::vector<std::vector<uint64_t>> CSP::reconstituteUser(
 /// Reconstitute A, grouping by Item
 /// @brief recv in paper
 /// @param A - decoded plaintext vector
+/// @param ratingSpace - entries of M to reconstitute A over
 std::vector<std::vector<uint64_t>> CSP::reconstituteItem(
-    std::vector<std::vector<uint64_t>> A) {
+    std::vector<std::vector<uint64_t>> A,
+    const std::vector<std::pair<int, int>>& ratingSpace) {
   std::vector<std::vector<uint64_t>> result;
   std::map<int, int> indexMap;
   int maxIndex = -1;
   // Go through M
-  for (auto [i, j] : CSP::M) {
+  for (auto [i, j] : ratingSpace) {
     if (indexMap.find(j) != indexMap.end()) {
       result.push_back(A.at(indexMap.find(j)->second));
     } else {
@@ -174,285 +476,360 @@ std::vector<std::vector<uint64_t>> CSP::reconstituteItem(
   return result;
 }
 
+/// @brief Step 8 - Encrypt each aggregated row once and give every entry of
+/// the row a copy, and the first entry of the row a copy as its hat. The other
+/// hats share one encryption of zero. Copying a ciphertext is far cheaper than
+/// encrypting one, and RecSys keeps a single buffer per row
+/// @param rowOfEntry - index into rows of each entry of the output
+void CSP::encryptRows(const std::vector<std::vector<uint64_t>>& rows,
+                      const std::vector<int>& rowOfEntry,
+                      std::vector<seal::Ciphertext>& profiles,
+                      std::vector<seal::Ciphertext>& hats) {
+  std::vector<seal::Ciphertext> encryptedRows(rows.size());
+  for (size_t row = 0; row < rows.size(); row++) {
+    seal::Plaintext rowPlain;
+    fheScheme->encode(rows[row], rowPlain);
+    encryptFHE(rowPlain, encryptedRows[row]);
+  }
+  profiles.resize(rowOfEntry.size());
+  hats.resize(rowOfEntry.size());
+  std::vector<bool> seen(rows.size(), false);
+  seal::Ciphertext zeroEnc;
+  for (size_t k = 0; k < rowOfEntry.size(); k++) {
+    int row = rowOfEntry[k];
+    profiles[k] = encryptedRows.at(row);
+    if (!seen[row]) {
+      hats[k] = encryptedRows[row];
+      seen[row] = true;
+    } else {
+      if (zeroEnc.size() == 0)
+        encryptZeroFHE(zeroEnc);
+      hats[k] = zeroEnc;
+    }
+  }
+}
+
 /// @brief Step 8 - Calculate new U and UHat
+/// @param entries - indices of M that maskedUPrime corresponds to
+/// @param rescaleBits - number of fractional bits to remove, normally
+/// alpha+beta
 /// @return Pair containing new U and UHat in that order
 std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
-CSP::calculateNewUandUHat(std::vector<seal::Ciphertext> maskedUPrime) {
-  std::vector<seal::Ciphertext> newU(CSP::M.size());
-  std::vector<seal::Ciphertext> newUHat;
+CSP::calculateNewUandUHat(std::vector<seal::Ciphertext> maskedUPrime,
+                          const std::vector<int>& entries,
+                          int rescaleBits) {
+  Profiler::Scope step(profiler.get(), "CSP::calculateNewUandUHat");
+  step.track("input", maskedUPrime);
+  std::vector<std::pair<int, int>> ratingSpace = entriesOfM(entries);
+  std::vector<seal::Ciphertext> newU, newUHat;
 
   // Decrypt and decode maskedUPrime
   std::vector<seal::Plaintext> maskedUPrimePlaintext(maskedUPrime.size());
   std::vector<std::vector<uint64_t>> maskedUPrimeDecoded(maskedUPrime.size());
   for (int i = 0; i < maskedUPrime.size(); i++) {
     sealDecryptor.decrypt(maskedUPrime[i], maskedUPrimePlaintext[i]);
-    sealBatchEncoder.decode(maskedUPrimePlaintext[i], maskedUPrimeDecoded[i]);
+    fheScheme->decode(maskedUPrimePlaintext[i], maskedUPrimeDecoded[i]);
     // Scale
-    for (int j = 0; j < sealSlotCount; j++) {
-      maskedUPrimeDecoded[i][j] = (uint64_t)maskedUPrimeDecoded[i][j] >> alpha;
-    }
-  }
-
-  // Calculate new U
-  std::vector<std::vector<uint64_t>> newUDecoded =
-      reconstituteUser(aggregateUser(maskedUPrimeDecoded));
-  std::vector<seal::Plaintext> newUPlaintext(newUDecoded.size());
-  for (int i = 0; i < newUDecoded.size(); i++) {
-    sealBatchEncoder.encode(newUDecoded[i], newUPlaintext[i]);
-    sealEncryptor.encrypt(newUPlaintext[i], newU[i]);
+    fheScheme->rescale(maskedUPrimeDecoded[i], rescaleBits);
   }
 
-  // Calculate new UHat
+  // Calculate new U and UHat, with the users in order of M
+  std::vector<int> rowOfEntry(ratingSpace.size());
   int prevUser = -1;
-  int uIndex = 0;
-  // Go through M
-  for (auto [i, j] : CSP::M) {
-    // If not new user, push zero, otherwise push value of newU
-    if (i == prevUser) {
-      std::vector<uint64_t> zeroVector(sealSlotCount, 0ULL);
-      seal::Plaintext zeroPlain;
-      seal::Ciphertext zeroEnc;
-
-      sealBatchEncoder.encode(zeroVector, zeroPlain);
-      sealEncryptor.encrypt(zeroPlain, zeroEnc);
-      newUHat.push_back(zeroEnc);
-    } else {
-      newUHat.push_back(newU.at(uIndex));
-      prevUser = i;
+  int row = -1;
+  for (int k = 0; k < ratingSpace.size(); k++) {
+    if (ratingSpace[k].first != prevUser) {
+      row++;
+      prevUser = ratingSpace[k].first;
     }
-    uIndex++;
+    rowOfEntry[k] = row;
   }
+  encryptRows(aggregateUser(maskedUPrimeDecoded, ratingSpace), rowOfEntry,
+              newU, newUHat);
   return std::make_pair(newU, newUHat);
 }
 
 /// @brief Step 8 - Calculate new  and VHat
+/// @param entries - indices of M that maskedVPrime corresponds to
+/// @param rescaleBits - number of fractional bits to remove, normally
+/// alpha+beta
 /// @return Pair containing new V and VHat in that order
 std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
-CSP::calculateNewVandVHat(std::vector<seal::Ciphertext> maskedVPrime) {
-  std::vector<seal::Ciphertext> newV(CSP::M.size());
-  std::vector<seal::Ciphertext> newVHat;
+CSP::calculateNewVandVHat(std::vector<seal::Ciphertext> maskedVPrime,
+                          const std::vector<int>& entries,
+                          int rescaleBits) {
+  Profiler::Scope step(profiler.get(), "CSP::calculateNewVandVHat");
+  step.track("input", maskedVPrime);
+  std::vector<std::pair<int, int>> ratingSpace = entriesOfM(entries);
+  std::vector<seal::Ciphertext> newV, newVHat;
 
   // Decrypt and decode maskedVPrime
-  std::vector<seal::Plaintext> maskedVPrimePlaintext(CSP::M.size());
-  std::vector<std::vector<uint64_t>> maskedVPrimeDecoded(CSP::M.size());
+  std::vector<seal::Plaintext> maskedVPrimePlaintext(maskedVPrime.size());
+  std::vector<std::vector<uint64_t>> maskedVPrimeDecoded(maskedVPrime.size());
   for (int i = 0; i < maskedVPrime.size(); i++) {
     sealDecryptor.decrypt(maskedVPrime[i], maskedVPrimePlaintext[i]);
-    sealBatchEncoder.decode(maskedVPrimePlaintext[i], maskedVPrimeDecoded[i]);
+    fheScheme->decode(maskedVPrimePlaintext[i], maskedVPrimeDecoded[i]);
     // Scale
-    for (int j = 0; j < sealSlotCount; j++) {
-      maskedVPrimeDecoded[i][j] =
-          (uint64_t)std::floor(maskedVPrimeDecoded[i][j] >> alpha);
-    }
+    fheScheme->rescale(maskedVPrimeDecoded[i], rescaleBits);
   }
 
-  // Calculate new V
-  std::vector<std::vector<uint64_t>> newVDecoded =
-      reconstituteItem(aggregateItem(maskedVPrimeDecoded));
-  std::vector<seal::Plaintext> newVPlaintext(newVDecoded.size());
-  for (int i = 0; i < newVDecoded.size(); i++) {
-    sealBatchEncoder.encode(newVDecoded[i], newVPlaintext[i]);
-    sealEncryptor.encrypt(newVPlaintext[i], newV[i]);
-  }
-
-  // Calculate new VHat
-  int prevItem = -1;
-  int vIndex = 0;
-  // Go through M
-  for (auto [i, j] : CSP::M) {
-    // If not new user, push zero, otherwise push value of newV
-    if (j == prevItem) {
-      std::vector<uint64_t> zeroVector(sealSlotCount, 0ULL);
-      seal::Plaintext zeroPlain;
-      seal::Ciphertext zeroEnc;
-
-      sealBatchEncoder.encode(zeroVector, zeroPlain);
-      sealEncryptor.encrypt(zeroPlain, zeroEnc);
-      newVHat.push_back(zeroEnc);
-    } else {
-      newVHat.push_back(newV.at(vIndex));
-      prevItem = j;
-    }
-    vIndex++;
+  // Calculate new V and VHat, with the items in order of first appearance as
+  // aggregateItem orders them
+  std::vector<int> rowOfEntry(ratingSpace.size());
+  std::map<int, int> itemRows;
+  for (int k = 0; k < ratingSpace.size(); k++) {
+    rowOfEntry[k] =
+        itemRows.emplace(ratingSpace[k].second, itemRows.size()).first->second;
   }
+  encryptRows(aggregateItem(maskedVPrimeDecoded, ratingSpace), rowOfEntry,
+              newV, newVHat);
   return std::make_pair(newV, newVHat);
 }
 
 /// @brief Calculate new U Gradient - Step 9
+/// @param entries - indices of M that maskedUGradientPrime corresponds to
+/// @param rescaleBits - number of fractional bits to remove, normally alpha
+/// @return One gradient per user in entries
 std::vector<seal::Ciphertext> CSP::calculateNewUGradient(
-    std::vector<seal::Ciphertext> maskedUGradientPrime) {
+    std::vector<seal::Ciphertext> maskedUGradientPrime,
+    const std::vector<int>& entries,
+    int rescaleBits) {
+  Profiler::Scope step(profiler.get(), "CSP::calculateNewUGradient");
+  step.track("input", maskedUGradientPrime);
   // Decrypt and decode input
   std::vector<std::vector<uint64_t>> maskedUGradientDecoded(
       maskedUGradientPrime.size());
   for (int i = 0; i < maskedUGradientPrime.size(); i++) {
     seal::Plaintext maskedUGradientDecrypt;
     sealDecryptor.decrypt(maskedUGradientPrime[i], maskedUGradientDecrypt);
-    sealBatchEncoder.decode(maskedUGradientDecrypt, maskedUGradientDecoded[i]);
+    fheScheme->decode(maskedUGradientDecrypt, maskedUGradientDecoded[i]);
     // Scale
-    for (int j = 0; j < sealSlotCount; j++) {
-      maskedUGradientDecoded[i][j] =
-          (uint64_t)std::floor(maskedUGradientDecoded[i][j] / twoPowerAlpha);
-    }
+    fheScheme->rescale(maskedUGradientDecoded[i], rescaleBits);
   }
 
   // Get aggregation
   std::vector<std::vector<uint64_t>> newUGradientDecoded =
-      aggregateUser(maskedUGradientDecoded);
+      aggregateUser(maskedUGradientDecoded, entriesOfM(entries));
 
   // Re-encode and re-encrypt
   std::vector<seal::Ciphertext> newUGradient(newUGradientDecoded.size());
   for (int i = 0; i < newUGradientDecoded.size(); i++) {
     seal::Plaintext newUGradientPlaintext;
-    sealBatchEncoder.encode(newUGradientDecoded[i], newUGradientPlaintext);
-    sealEncryptor.encrypt(newUGradientPlaintext, newUGradient[i]);
+    fheScheme->encode(newUGradientDecoded[i], newUGradientPlaintext);
+    encryptFHE(newUGradientPlaintext, newUGradient[i]);
   }
 
   return newUGradient;
 }
 
 /// @brief Calculate new V Gradient - Step 9
+/// @param entries - indices of M that maskedVGradientPrime corresponds to
+/// @param rescaleBits - number of fractional bits to remove, normally alpha
+/// @return One gradient per item in entries, in order of first appearance
 std::vector<seal::Ciphertext> CSP::calculateNewVGradient(
-    std::vector<seal::Ciphertext> maskedVGradientPrime) {
+    std::vector<seal::Ciphertext> maskedVGradientPrime,
+    const std::vector<int>& entries,
+    int rescaleBits) {
+  Profiler::Scope step(profiler.get(), "CSP::calculateNewVGradient");
+  step.track("input", maskedVGradientPrime);
   // Decrypt and decode input
   std::vector<std::vector<uint64_t>> maskedVGradientDecoded(
       maskedVGradientPrime.size());
   for (int i = 0; i < maskedVGradientPrime.size(); i++) {
     seal::Plaintext maskedVGradientDecrypt;
     sealDecryptor.decrypt(maskedVGradientPrime[i], maskedVGradientDecrypt);
-    sealBatchEncoder.decode(maskedVGradientDecrypt, maskedVGradientDecoded[i]);
+    fheScheme->decode(maskedVGradientDecrypt, maskedVGradientDecoded[i]);
     // Scale
-    for (int j = 0; j < sealSlotCount; j++) {
-      maskedVGradientDecoded[i][j] =
-          (uint64_t)std::floor(maskedVGradientDecoded[i][j] / twoPowerAlpha);
-    }
+    fheScheme->rescale(maskedVGradientDecoded[i], rescaleBits);
   }
 
   // Get aggregation
   std::vector<std::vector<uint64_t>> newVGradientDecoded =
-      aggregateItem(maskedVGradientDecoded);
+      aggregateItem(maskedVGradientDecoded, entriesOfM(entries));
 
   // Re-encode and re-encrypt
   std::vector<seal::Ciphertext> newVGradient(newVGradientDecoded.size());
   for (int i = 0; i < newVGradientDecoded.size(); i++) {
     seal::Plaintext newVGradientPlaintext;
-    sealBatchEncoder.encode(newVGradientDecoded[i], newVGradientPlaintext);
-    sealEncryptor.encrypt(newVGradientPlaintext, newVGradient[i]);
+    fheScheme->encode(newVGradientDecoded[i], newVGradientPlaintext);
+    encryptFHE(newVGradientPlaintext, newVGradient[i]);
   }
 
   return newVGradient;
 }
 
-/// @brief Calculate the boolean pair for whether the Stopping Criterion is
-/// met for the user and the items respectivesly
-/// @return pair of bools {User threshold met, Item threshold met}
-std::pair<bool, bool> CSP::calculateStoppingVector(
+/// @brief Calculate whether the Stopping Criterion is met for each user row
+/// and each item row
+/// @param Su - per user row mask plus threshold, over the first d slots
+/// @param Sv - per item row mask plus threshold, over the first d slots
+/// @return pair of per-row flags {User thresholds met, Item thresholds met}
+std::pair<std::vector<bool>, std::vector<bool>> CSP::calculateStoppingVector(
     std::vector<seal::Ciphertext> maskedUGradientSquare,
     std::vector<seal::Ciphertext> maskedVGradientSquare,
-    std::vector<uint64_t> Su,
-    std::vector<uint64_t> Sv) {
-  std::vector<uint64_t> maskedUGradientSquareSum(sealSlotCount, 0ULL),
-      maskedVGradientSquareSum(sealSlotCount, 0ULL);
-  bool UThresholdMet = false;
-  bool VThresholdMet = false;
-
-  // Decrypt and sum maskedUGradientSquared
+    std::vector<std::vector<uint64_t>> Su,
+    std::vector<std::vector<uint64_t>> Sv) {
+  Profiler::Scope step(profiler.get(), "CSP::calculateStoppingVector");
+  step.track("input U", maskedUGradientSquare);
+  step.track("input V", maskedVGradientSquare);
+  std::vector<bool> UThresholdMet(maskedUGradientSquare.size(), true);
+  std::vector<bool> VThresholdMet(maskedVGradientSquare.size(), true);
+
+  // Decrypt maskedUGradientSquared, a row has converged once every slot is
+  // within the threshold
   for (int i = 0; i < maskedUGradientSquare.size(); i++) {
     seal::Plaintext maskedUGradientSquarePlain;
     std::vector<uint64_t> maskedUGradientSquareDecoded;
     sealDecryptor.decrypt(maskedUGradientSquare[i], maskedUGradientSquarePlain);
-    sealBatchEncoder.decode(maskedUGradientSquarePlain,
-                            maskedUGradientSquareDecoded);
+    fheScheme->decode(maskedUGradientSquarePlain,
+                      maskedUGradientSquareDecoded);
 
-    for (int j = 0; j < sealSlotCount; j++) {
-      maskedUGradientSquareSum[j] += maskedUGradientSquareDecoded[j];
+    for (int j = 0; j < dimension; j++) {
+      if (maskedUGradientSquareDecoded[j] > Su[i][j]) {
+        UThresholdMet[i] = false;
+        break;
+      }
     }
   }
-  // Decrypt and sum maskedVGradientSquared
+  // Decrypt maskedVGradientSquared
   for (int i = 0; i < maskedVGradientSquare.size(); i++) {
     seal::Plaintext maskedVGradientSquarePlain;
     std::vector<uint64_t> maskedVGradientSquareDecoded;
     sealDecryptor.decrypt(maskedVGradientSquare[i], maskedVGradientSquarePlain);
-    sealBatchEncoder.decode(maskedVGradientSquarePlain,
-                            maskedVGradientSquareDecoded);
+    fheScheme->decode(maskedVGradientSquarePlain,
+                      maskedVGradientSquareDecoded);
 
-    for (int j = 0; j < sealSlotCount; j++) {
-      maskedVGradientSquareSum[j] += maskedVGradientSquareDecoded[j];
+    for (int j = 0; j < dimension; j++) {
+      if (maskedVGradientSquareDecoded[j] > Sv[i][j]) {
+        VThresholdMet[i] = false;
+        break;
+      }
     }
   }
 
-  // Set the value of whether the gradient is less than the threshold for both
-  // users and items
-  for (int i = 0; i < sealSlotCount; i++) {
-    if (maskedUGradientSquareSum[i] <= Su[i])
-      UThresholdMet = true;
-    if (maskedVGradientSquareSum[i] <= Sv[i])
-      VThresholdMet = true;
-  }
-
   return {UThresholdMet, VThresholdMet};
 }
 
-///@brief Return a pair of j-length masked vectors, the requested user vector j
-/// times and all the movie vectos respectively - Computing Predictions
+///@brief Return a pair of masked vectors, the requested user profile and
+/// the profiles of every item in order of first appearance, packed slot count
+/// / d profiles to a ciphertext. Item k is in block k % (slot count / d) of
+/// ciphertext k / (slot count / d), and every block of the user ciphertexts
+/// holds the user profile - Computing Predictions
 std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
 CSP::calculateUiandVVectors(int requestedUser,
                             std::vector<seal::Ciphertext> maskedUHat,
                             std::vector<seal::Ciphertext> maskedVHat) {
-  std::vector<std::vector<uint64_t>> maskedUHatDecoded(maskedUHat.size()),
-      maskedVHatDecoded(maskedVHat.size());
-  std::vector<seal::Ciphertext> uResult, vResult(maskedVHat.size());
-
-  // Decrypt vectors
-  for (int i = 0; i < maskedUHat.size(); i++) {
-    seal::Plaintext UHatPlain;
-    sealDecryptor.decrypt(maskedUHat.at(i), UHatPlain);
-    sealBatchEncoder.decode(UHatPlain, maskedUHatDecoded[i]);
-  }
+  Profiler::Scope step(profiler.get(), "CSP::calculateUiandVVectors");
+  step.track("input U", maskedUHat);
+  step.track("input V", maskedVHat);
+  size_t perCiphertext = sealSlotCount / dimension;
 
-  for (int i = 0; i < maskedVHat.size(); i++) {
-    seal::Plaintext VHatPlain;
-    sealDecryptor.decrypt(maskedVHat.at(i), VHatPlain);
-    sealBatchEncoder.decode(VHatPlain, maskedVHatDecoded[i]);
-  }
-
-  // Go through M
-  // if i == requestedUser found for first time, set the u ciphertext
-  seal::Ciphertext uVectorEnc;
+  // Decrypt the user's first entry, which holds the profile
+  std::vector<uint64_t> uPacked(sealSlotCount, 0ULL);
   for (int i = 0; i < CSP::M.size(); i++) {
     if (M.at(i).first == requestedUser) {
-      std::vector<uint64_t> uVector = maskedUHatDecoded.at(i);
-      seal::Plaintext uVectorPlain;
-      sealBatchEncoder.encode(uVector, uVectorPlain);
-      sealEncryptor.encrypt(uVectorPlain, uVectorEnc);
+      seal::Plaintext UHatPlain;
+      std::vector<uint64_t> uVector;
+      sealDecryptor.decrypt(maskedUHat.at(i), UHatPlain);
+      fheScheme->decode(UHatPlain, uVector);
+      for (size_t b = 0; b < perCiphertext; b++) {
+        std::copy(uVector.begin(), uVector.begin() + dimension,
+                  uPacked.begin() + b * dimension);
+      }
       break;
     }
   }
 
+  // Encrypt, with one copy of the user ciphertext per item ciphertext
+  seal::Plaintext uPackedPlain;
+  seal::Ciphertext uPackedEnc;
+  fheScheme->encode(uPacked, uPackedPlain);
+  encryptFHE(uPackedPlain, uPackedEnc);
+  std::vector<seal::Ciphertext> vResult = calculateVVectors(maskedVHat);
+  std::vector<seal::Ciphertext> uResult(vResult.size(), uPackedEnc);
+
+  // return pair
+  return {uResult, vResult};
+}
+
+///@brief The masked profiles of every item in order of first appearance,
+/// packed slot count / d to a ciphertext as calculateUiandVVectors packs
+/// them - Computing Predictions
+std::vector<seal::Ciphertext> CSP::calculateVVectors(
+    const std::vector<seal::Ciphertext>& maskedVHat) {
+  Profiler::Scope step(profiler.get(), "CSP::calculateVVectors");
+  step.track("input", maskedVHat);
+  size_t perCiphertext = sealSlotCount / dimension;
+
   // Go through M
-  // keep track of found js in set and push back to vResult if first time
+  // keep track of found js in set and pack the first entry of each item
   std::set<int> observedItems{};
-  int index = 0;
+  std::vector<std::vector<uint64_t>> vPacked;
+  size_t index = 0;
   for (int i = 0; i < CSP::M.size(); i++) {
     if (observedItems.find(M.at(i).second) == observedItems.end()) {
       observedItems.insert(M.at(i).second);
-      seal::Plaintext plainRes;
-      sealBatchEncoder.encode(maskedVHatDecoded.at(i), plainRes);
-      sealEncryptor.encrypt(plainRes, vResult[index++]);
+      if (index % perCiphertext == 0)
+        vPacked.emplace_back(sealSlotCount, 0ULL);
+      seal::Plaintext VHatPlain;
+      std::vector<uint64_t> vVector;
+      sealDecryptor.decrypt(maskedVHat.at(i), VHatPlain);
+      fheScheme->decode(VHatPlain, vVector);
+      std::copy(vVector.begin(), vVector.begin() + dimension,
+                vPacked.back().begin() + (index % perCiphertext) * dimension);
+      index++;
     }
   }
-  vResult.resize(index);
 
-  // Go through vResult and push back u ciphertext to uResult
-  for (int i = 0; i < vResult.size(); i++) {
-    uResult.push_back(uVectorEnc);
+  std::vector<seal::Ciphertext> vResult(vPacked.size());
+  for (size_t k = 0; k < vPacked.size(); k++) {
+    seal::Plaintext vPackedPlain;
+    fheScheme->encode(vPacked[k], vPackedPlain);
+    encryptFHE(vPackedPlain, vResult[k]);
   }
+  return vResult;
+}
 
-  // return pair
-  return {uResult, vResult};
+///@brief The masked profile in the hat of a user's first entry, repeated in
+/// every block as calculateUiandVVectors packs it. Used when RecSys already
+/// holds the item vectors for the current model - Computing Predictions
+seal::Ciphertext CSP::calculateUiVector(const seal::Ciphertext& maskedUHat) {
+  Profiler::Scope step(profiler.get(), "CSP::calculateUiVector");
+  seal::Plaintext UHatPlain;
+  std::vector<uint64_t> uVector;
+  sealDecryptor.decrypt(maskedUHat, UHatPlain);
+  fheScheme->decode(UHatPlain, uVector);
+  std::vector<uint64_t> uPacked(sealSlotCount, 0ULL);
+  for (size_t block = 0; block < sealSlotCount; block += dimension) {
+    std::copy(uVector.begin(), uVector.begin() + dimension,
+              uPacked.begin() + block);
+  }
+
+  seal::Plaintext uPackedPlain;
+  seal::Ciphertext uPackedEnc;
+  fheScheme->encode(uPacked, uPackedPlain);
+  encryptFHE(uPackedPlain, uPackedEnc);
+  return uPackedEnc;
+}
+
+///@brief calculateUiVector for the first entry of each of several users, in
+/// one exchange - Computing Predictions for a batch
+std::vector<seal::Ciphertext> CSP::calculateUiVectors(
+    const std::vector<seal::Ciphertext>& maskedUHats) {
+  Profiler::Scope step(profiler.get(), "CSP::calculateUiVectors");
+  step.track("input", maskedUHats);
+  std::vector<seal::Ciphertext> result(maskedUHats.size());
+  for (size_t i = 0; i < maskedUHats.size(); i++) {
+    result[i] = calculateUiVector(maskedUHats[i]);
+  }
+  return result;
 }
 
-/// @brief sum entrywise d dimension vector to reduce to masked prediction
+/// @brief sum each d dimension block to reduce to masked predictions, the sum
+/// of block b going to its first slot b * d
 std::vector<seal::Ciphertext> CSP::reducePredictionVector(
     std::vector<seal::Ciphertext> predictionVector) {
+  Profiler::Scope step(profiler.get(), "CSP::reducePredictionVector");
+  step.track("input", predictionVector);
   std::vector<std::vector<uint64_t>> predictionVectorDecoded(
       predictionVector.size());
   std::vector<seal::Ciphertext> result(predictionVector.size());
@@ -460,19 +837,19 @@ std::vector<seal::Ciphertext> CSP::reducePredictionVector(
     // Decrypt and decode
     seal::Plaintext curRowPlain;
     sealDecryptor.decrypt(predictionVector.at(i), curRowPlain);
-    sealBatchEncoder.decode(curRowPlain, predictionVectorDecoded[i]);
+    fheScheme->decode(curRowPlain, predictionVectorDecoded[i]);
 
-    // Sum
+    // Sum, exactly as in sumF
     std::vector<uint64_t> rowSum(sealSlotCount, 0ULL);
-    for (int j = 0; j < sealSlotCount; j++) {
-      rowSum[0] += (uint64_t)predictionVectorDecoded.at(i).at(j);
+    for (size_t block = 0; block < sealSlotCount; block += dimension) {
+      rowSum[block] = fheScheme->sum(
+          predictionVectorDecoded.at(i).data() + block, dimension, alpha);
     }
 
-    rowSum[0] = rowSum[0] >> alpha;
     // Re-encode and re-encrypt
     seal::Plaintext curRowSumPlain;
-    sealBatchEncoder.encode(rowSum, curRowSumPlain);
-    sealEncryptor.encrypt(curRowSumPlain, result[i]);
+    fheScheme->encode(rowSum, curRowSumPlain);
+    encryptFHE(curRowSumPlain, result[i]);
   }
   return result;
-}
\ No newline at end of file
+}
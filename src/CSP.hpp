@@ -1,4 +1,5 @@
 #pragma once
+#include <cryptopp/eccrypto.h>
 #include <cryptopp/elgamal.h>
 #include <cryptopp/osrng.h>
 #include <math.h>
@@ -8,21 +9,40 @@
 #include <memory>
 #include <utility>
 #include <vector>
+#include "AHE.hpp"
+#include "EncryptionPool.hpp"
+#include "FHEScheme.hpp"
+#include "FixedPoint.hpp"
+#include "Keystore.hpp"
 #include "MessageHandler.hpp"
+#include "Profiler.hpp"
 #include "Ratings.hpp"
+#include "Replay.hpp"
 
 class CSP {
   int generateKeysFHE();
   bool generateKeysAHE();
+  void setKeysAHE(const CryptoPP::ElGamalKeys::PrivateKey& elGamalKey,
+                  const CryptoPP::Integer& ecKey);
   int encryptAHE(int input);
   int decryptAHE(int input);
 
   // Keep track of the AHE scheme (ElGamal)
   CryptoPP::AutoSeededRandomPool rng;
+  std::shared_ptr<ReplayRandomNumberGenerator> replayRng;  // Set by setSeed
+  CryptoPP::RandomNumberGenerator& keyRng();
   CryptoPP::ElGamalKeys::PrivateKey ahe_PrivateKey;
   CryptoPP::ElGamalKeys::PublicKey ahe_PublicKey;
   CryptoPP::ElGamal::Decryptor ahe_Decryptor;
   CryptoPP::ElGamal::Encryptor ahe_Encryptor;
+  // Elliptic curve variant of the AHE scheme
+  CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP> ahe_ECGroup;
+  CryptoPP::Integer ahe_ECPrivateKey;
+  CryptoPP::ECP::Point ahe_ECPublicKey;
+  // Batch decryptors for the upload phase, built on first use
+  int aheMaxMessageBits = 22;  // Bound on masked ratings
+  std::shared_ptr<AHEDecryptor> aheDecryptorElGamal, aheDecryptorEC;
+  std::shared_ptr<AHEDecryptor> getDecryptorAHE(AHEScheme scheme);
 
   // SEAL FHE values and variables
   std::shared_ptr<MessageHandler> messageHandlerInstance;
@@ -31,54 +51,113 @@ class CSP {
   seal::SecretKey sealPrivateKey;
   seal::Encryptor sealEncryptor;
   seal::Decryptor sealDecryptor;
-  seal::BatchEncoder sealBatchEncoder;
+  std::shared_ptr<FHEScheme> fheScheme;  // Encodes and sums decoded slots
   size_t sealSlotCount;
+  size_t dimension;  // Profile dimension d, see setDimension
+  // Pooled re-encryption, off unless setEncryptionPool is called
+  std::shared_ptr<EncryptionPool> encryptionPool;
+  void encryptFHE(const seal::Plaintext& plain, seal::Ciphertext& out);
+  void encryptZeroFHE(seal::Ciphertext& out);
+  size_t aggregationThreads = 0;  // 0 for the hardware count
+  std::vector<std::vector<uint64_t>> sumGroups(
+      const std::vector<std::vector<uint64_t>>& A,
+      const std::vector<std::vector<size_t>>& groups);
 
   // Algorithmic parameters
-  int alpha = 20;
-  int beta = 20;
-  int twoPowerAlpha;
-  int twoPowerBeta;
+  using Encoding = ProtocolFixedPoint;
+  static constexpr int alpha = Encoding::alpha;
+  static constexpr int beta = Encoding::beta;
+
+ protected:
+  std::shared_ptr<Profiler> profiler;  // Null unless setProfiler is called
 
   // Rating space information
   std::vector<std::pair<int, int>> M;
+  std::vector<std::pair<int, int>> entriesOfM(const std::vector<int>& entries);
+  void encryptRows(const std::vector<std::vector<uint64_t>>& rows,
+                   const std::vector<int>& rowOfEntry,
+                   std::vector<seal::Ciphertext>& profiles,
+                   std::vector<seal::Ciphertext>& hats);
 
  public:
+  virtual ~CSP() = default;
   int generateKeys();
-  CryptoPP::ElGamalKeys::PublicKey getPublicKeyAHE();
+  int generateKeys(Keystore& keystore);
+  void setSeed(uint64_t seed);
+  void setDimension(size_t profileDimension);
+  size_t getDimension() const { return dimension; }
+  virtual void setM(const std::vector<std::pair<int, int>>& providedM);
+  virtual void setEncryptionPool(const EncryptionPool::Options& options);
+  virtual EncryptionPool::Metrics getEncryptionPoolMetrics();
+  virtual void setProfiler(std::shared_ptr<Profiler> methodProfiler);
+  void setAggregationThreads(size_t threads);
+  CryptoPP::ElGamalKeys::PublicKey getPublicKeyAHE() const;
+  CryptoPP::DL_GroupParameters_EC<CryptoPP::ECP> getGroupParametersECAHE()
+      const;
+  CryptoPP::ECP::Point getPublicKeyECAHE() const;
   EncryptedRating convertRatingAHEtoFHE(EncryptedRatingAHE rating);
-  std::vector<seal::Ciphertext> sumF(std::vector<seal::Ciphertext> f);
+  virtual std::vector<seal::Ciphertext> convertRatingsAHEtoFHE(
+      const std::vector<EncryptedRatingAHE>& maskedRatings,
+      AHEScheme scheme);
+  virtual std::vector<seal::Ciphertext> unpackRatings(
+      const std::vector<seal::Ciphertext>& maskedPacked,
+      const std::vector<std::pair<size_t, size_t>>& slots);
+  std::pair<seal::RelinKeys, seal::GaloisKeys> generateSlotSumKeys(
+      const std::vector<int>& steps);
+  virtual std::vector<seal::Ciphertext> sumF(std::vector<seal::Ciphertext> f);
 
   std::vector<std::vector<uint64_t>> aggregateUser(
-      std::vector<std::vector<uint64_t>> A);
+      std::vector<std::vector<uint64_t>> A,
+      const std::vector<std::pair<int, int>>& ratingSpace);
   std::vector<std::vector<uint64_t>> aggregateItem(
-      std::vector<std::vector<uint64_t>> A);
+      std::vector<std::vector<uint64_t>> A,
+      const std::vector<std::pair<int, int>>& ratingSpace);
   std::vector<std::vector<uint64_t>> reconstituteUser(
-      std::vector<std::vector<uint64_t>> A);
+      std::vector<std::vector<uint64_t>> A,
+      const std::vector<std::pair<int, int>>& ratingSpace);
   std::vector<std::vector<uint64_t>> reconstituteItem(
-      std::vector<std::vector<uint64_t>> A);
+      std::vector<std::vector<uint64_t>> A,
+      const std::vector<std::pair<int, int>>& ratingSpace);
 
-  std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
-  calculateNewUandUHat(std::vector<seal::Ciphertext> maskedUPrime);
-  std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
-  calculateNewVandVHat(std::vector<seal::Ciphertext> maskedVPrime);
-  std::vector<seal::Ciphertext> calculateNewUGradient(
-      std::vector<seal::Ciphertext> maskedUGradientPrime);
-  std::vector<seal::Ciphertext> calculateNewVGradient(
-      std::vector<seal::Ciphertext> maskedVGradientPrime);
+  virtual std::pair<std::vector<seal::Ciphertext>,
+                    std::vector<seal::Ciphertext>>
+  calculateNewUandUHat(std::vector<seal::Ciphertext> maskedUPrime,
+                       const std::vector<int>& entries,
+                       int rescaleBits);
+  virtual std::pair<std::vector<seal::Ciphertext>,
+                    std::vector<seal::Ciphertext>>
+  calculateNewVandVHat(std::vector<seal::Ciphertext> maskedVPrime,
+                       const std::vector<int>& entries,
+                       int rescaleBits);
+  virtual std::vector<seal::Ciphertext> calculateNewUGradient(
+      std::vector<seal::Ciphertext> maskedUGradientPrime,
+      const std::vector<int>& entries,
+      int rescaleBits);
+  virtual std::vector<seal::Ciphertext> calculateNewVGradient(
+      std::vector<seal::Ciphertext> maskedVGradientPrime,
+      const std::vector<int>& entries,
+      int rescaleBits);
 
   std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
   calculateUiandVVectors(int requestedUser,
                          std::vector<seal::Ciphertext> maskedUHat,
                          std::vector<seal::Ciphertext> maskedVHat);
 
-  std::pair<bool, bool> calculateStoppingVector(
+  virtual std::vector<seal::Ciphertext> calculateVVectors(
+      const std::vector<seal::Ciphertext>& maskedVHat);
+  virtual seal::Ciphertext calculateUiVector(
+      const seal::Ciphertext& maskedUHat);
+  virtual std::vector<seal::Ciphertext> calculateUiVectors(
+      const std::vector<seal::Ciphertext>& maskedUHats);
+
+  virtual std::pair<std::vector<bool>, std::vector<bool>>
+  calculateStoppingVector(
       std::vector<seal::Ciphertext> maskedUGradientSquare,
       std::vector<seal::Ciphertext> maskedVGradientSquare,
-      std::vector<uint64_t> Su,
-      std::vector<uint64_t> Sv);
+      std::vector<std::vector<uint64_t>> Su,
+      std::vector<std::vector<uint64_t>> Sv);
 
-  std::vector<seal::Ciphertext> reducePredictionVector(
+  virtual std::vector<seal::Ciphertext> reducePredictionVector(
       std::vector<seal::Ciphertext> predictionVector);
 
   CSP(std::shared_ptr<MessageHandler> messagehandler,
@@ -92,10 +171,9 @@ class CSP {
         sealPrivateKey(sealprivatekey),
         sealEncryptor(sealcontext, sealhpk),
         sealDecryptor(sealcontext, sealprivatekey),
-        sealBatchEncoder(sealcontext),
+        fheScheme(FHEScheme::create(sealcontext)),
         M(providedM) {
-    sealSlotCount = sealBatchEncoder.slot_count();
-    twoPowerAlpha = (int)pow(2, alpha);
-    twoPowerBeta = (int)pow(2, beta);
+    sealSlotCount = fheScheme->slotCount();
+    dimension = sealSlotCount;
   }
 };
\ No newline at end of file
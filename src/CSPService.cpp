@@ -0,0 +1,271 @@
+#include "CSPService.hpp"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+thread_local bool insideStep = false;
+
+double msBetween(std::chrono::steady_clock::time_point start,
+                 std::chrono::steady_clock::time_point stop) {
+  return std::chrono::duration<double, std::milli>(stop - start).count();
+}
+}  // namespace
+
+std::vector<seal::Ciphertext> TenantCSP::convertRatingsAHEtoFHE(
+    const std::vector<EncryptedRatingAHE>& maskedRatings,
+    AHEScheme scheme) {
+  return run(maskedRatings.size(), [&] {
+    return CSP::convertRatingsAHEtoFHE(maskedRatings, scheme);
+  });
+}
+
+std::vector<seal::Ciphertext> TenantCSP::unpackRatings(
+    const std::vector<seal::Ciphertext>& maskedPacked,
+    const std::vector<std::pair<size_t, size_t>>& slots) {
+  return run(maskedPacked.size(),
+             [&] { return CSP::unpackRatings(maskedPacked, slots); });
+}
+
+std::vector<seal::Ciphertext> TenantCSP::sumF(std::vector<seal::Ciphertext> f) {
+  return run(f.size(), [&] { return CSP::sumF(std::move(f)); });
+}
+
+std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
+TenantCSP::calculateNewUandUHat(std::vector<seal::Ciphertext> maskedUPrime,
+                                const std::vector<int>& entries,
+                                int rescaleBits) {
+  return run(maskedUPrime.size(), [&] {
+    return CSP::calculateNewUandUHat(std::move(maskedUPrime), entries,
+                                     rescaleBits);
+  });
+}
+
+std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
+TenantCSP::calculateNewVandVHat(std::vector<seal::Ciphertext> maskedVPrime,
+                                const std::vector<int>& entries,
+                                int rescaleBits) {
+  return run(maskedVPrime.size(), [&] {
+    return CSP::calculateNewVandVHat(std::move(maskedVPrime), entries,
+                                     rescaleBits);
+  });
+}
+
+std::vector<seal::Ciphertext> TenantCSP::calculateNewUGradient(
+    std::vector<seal::Ciphertext> maskedUGradientPrime,
+    const std::vector<int>& entries,
+    int rescaleBits) {
+  return run(maskedUGradientPrime.size(), [&] {
+    return CSP::calculateNewUGradient(std::move(maskedUGradientPrime),
+                                      entries, rescaleBits);
+  });
+}
+
+std::vector<seal::Ciphertext> TenantCSP::calculateNewVGradient(
+    std::vector<seal::Ciphertext> maskedVGradientPrime,
+    const std::vector<int>& entries,
+    int rescaleBits) {
+  return run(maskedVGradientPrime.size(), [&] {
+    return CSP::calculateNewVGradient(std::move(maskedVGradientPrime),
+                                      entries, rescaleBits);
+  });
+}
+
+std::pair<std::vector<bool>, std::vector<bool>>
+TenantCSP::calculateStoppingVector(
+    std::vector<seal::Ciphertext> maskedUGradientSquare,
+    std::vector<seal::Ciphertext> maskedVGradientSquare,
+    std::vector<std::vector<uint64_t>> Su,
+    std::vector<std::vector<uint64_t>> Sv) {
+  size_t ciphertexts =
+      maskedUGradientSquare.size() + maskedVGradientSquare.size();
+  return run(ciphertexts, [&] {
+    return CSP::calculateStoppingVector(std::move(maskedUGradientSquare),
+                                        std::move(maskedVGradientSquare),
+                                        std::move(Su), std::move(Sv));
+  });
+}
+
+std::vector<seal::Ciphertext> TenantCSP::calculateVVectors(
+    const std::vector<seal::Ciphertext>& maskedVHat) {
+  return run(maskedVHat.size(),
+             [&] { return CSP::calculateVVectors(maskedVHat); });
+}
+
+seal::Ciphertext TenantCSP::calculateUiVector(
+    const seal::Ciphertext& maskedUHat) {
+  return run(1, [&] { return CSP::calculateUiVector(maskedUHat); });
+}
+
+std::vector<seal::Ciphertext> TenantCSP::calculateUiVectors(
+    const std::vector<seal::Ciphertext>& maskedUHats) {
+  return run(maskedUHats.size(),
+             [&] { return CSP::calculateUiVectors(maskedUHats); });
+}
+
+std::vector<seal::Ciphertext> TenantCSP::reducePredictionVector(
+    std::vector<seal::Ciphertext> predictionVector) {
+  return run(predictionVector.size(), [&] {
+    return CSP::reducePredictionVector(std::move(predictionVector));
+  });
+}
+
+CSPService::CSPService(const Options& serviceOptions)
+    : options(serviceOptions) {
+  if (options.workers == 0 || options.queueDepth == 0)
+    throw std::invalid_argument(
+        "CSPService: workers and queue depth must be positive");
+  for (size_t w = 0; w < options.workers; w++) {
+    workers.emplace_back(&CSPService::work, this);
+  }
+}
+
+///@brief A service owned by the caller and by each tenant added to it
+std::shared_ptr<CSPService> CSPService::create(const Options& serviceOptions) {
+  return std::shared_ptr<CSPService>(new CSPService(serviceOptions));
+}
+
+///@brief Finish the queued steps, then stop the workers. Runs once the
+/// caller and every tenant have released the service
+CSPService::~CSPService() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  jobReady.notify_all();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+///@brief The context shared by the tenants with these parameters
+std::shared_ptr<seal::SEALContext> CSPService::getContext(
+    const seal::EncryptionParameters& parms) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const auto& [contextParms, context] : contexts) {
+    if (contextParms == parms)
+      return context;
+  }
+  contexts.emplace_back(parms, std::make_shared<seal::SEALContext>(parms));
+  return contexts.back().second;
+}
+
+///@brief Register a tenant. The RecSys of the tenant uses the returned CSP,
+/// and should use getContext(parms) for its own SEAL objects
+///@param M - the tenant's rating space
+std::shared_ptr<CSP> CSPService::addTenant(
+    const std::string& name,
+    const seal::EncryptionParameters& parms,
+    const seal::PublicKey& publicKey,
+    const seal::SecretKey& secretKey,
+    std::vector<std::pair<int, int>> M) {
+  std::shared_ptr<seal::SEALContext> context = getContext(parms);
+  std::lock_guard<std::mutex> lock(mutex);
+  Tenant tenant;
+  tenant.context = context;
+  std::shared_ptr<TenantCSP> csp = std::make_shared<TenantCSP>(
+      shared_from_this(), tenants.size(), std::shared_ptr<MessageHandler>{},
+      *context, publicKey, secretKey, std::move(M));
+  tenant.metrics.name = name;
+  // A new tenant starts level with the least served one, so it cannot claim
+  // the workers until it has caught up with everyone
+  uint64_t leastServed = std::numeric_limits<uint64_t>::max();
+  for (const Tenant& other : tenants) {
+    leastServed = std::min(leastServed, other.served);
+  }
+  tenant.served = tenants.empty() ? 0 : leastServed;
+  tenants.push_back(std::move(tenant));
+  return csp;
+}
+
+///@brief Queue a step of a tenant, waiting while its queue is full
+void CSPService::submit(size_t tenant,
+                        size_t ciphertexts,
+                        std::function<void()> step) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (tenants.at(tenant).queue.size() >= options.queueDepth) {
+    tenants[tenant].metrics.queueFullWaits++;
+    roomReady.wait(lock, [&] {
+      return tenants[tenant].queue.size() < options.queueDepth;
+    });
+  }
+  tenants[tenant].queue.push_back(
+      {std::move(step), ciphertexts, std::chrono::steady_clock::now()});
+  lock.unlock();
+  jobReady.notify_one();
+}
+
+bool CSPService::onWorker() {
+  return insideStep;
+}
+
+///@brief The next step of the least served idle tenant with work, marking
+/// the tenant running. False if no idle tenant has work. Called with the
+/// mutex held
+bool CSPService::takeJob(size_t& tenant, Job& job) {
+  size_t next = tenants.size();
+  for (size_t t = 0; t < tenants.size(); t++) {
+    if (tenants[t].running || tenants[t].queue.empty())
+      continue;
+    if (next == tenants.size() || tenants[t].served < tenants[next].served)
+      next = t;
+  }
+  if (next == tenants.size())
+    return false;
+  tenant = next;
+  tenants[next].running = true;
+  job = std::move(tenants[next].queue.front());
+  tenants[next].queue.pop_front();
+  return true;
+}
+
+///@brief Worker thread - run steps until stopped with nothing queued
+void CSPService::work() {
+  insideStep = true;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    size_t t = 0;
+    Job job;
+    bool taken = false;
+    jobReady.wait(lock, [&] {
+      taken = takeJob(t, job);
+      if (taken)
+        return true;
+      return stopping && std::none_of(tenants.begin(), tenants.end(),
+                                      [](const Tenant& tenant) {
+                                        return !tenant.queue.empty();
+                                      });
+    });
+    if (!taken)
+      return;
+    steps++;
+    lock.unlock();
+    roomReady.notify_all();
+
+    auto start = std::chrono::steady_clock::now();
+    // Errors reach the caller through the step's future
+    job.step();
+    auto stop = std::chrono::steady_clock::now();
+
+    lock.lock();
+    Tenant& tenant = tenants[t];
+    tenant.running = false;
+    tenant.served += job.ciphertexts;
+    tenant.metrics.steps++;
+    tenant.metrics.ciphertexts += job.ciphertexts;
+    tenant.metrics.busyMs += msBetween(start, stop);
+    tenant.metrics.queuedMs += msBetween(job.arrival, start);
+    // The tenant may have another step waiting for any worker
+    jobReady.notify_one();
+  }
+}
+
+CSPService::Metrics CSPService::getMetrics() {
+  std::lock_guard<std::mutex> lock(mutex);
+  Metrics metrics;
+  metrics.steps = steps;
+  for (const Tenant& tenant : tenants) {
+    metrics.tenants.push_back(tenant.metrics);
+  }
+  return metrics;
+}
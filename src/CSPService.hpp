@@ -0,0 +1,174 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "CSP.hpp"
+#include "MessageHandler.hpp"
+
+class CSPService;
+
+// CSP of one tenant of a CSPService. It holds the tenant's rating space and
+// keys like any CSP, and runs each protocol step as a job on the service's
+// workers instead of on the calling thread. The tenant shares ownership of
+// the service, which stays up until its last tenant is released
+class TenantCSP : public CSP {
+  std::shared_ptr<CSPService> service;
+  size_t tenant;
+
+  template <class F>
+  auto run(size_t ciphertexts, F&& step) -> decltype(step());
+
+ public:
+  TenantCSP(std::shared_ptr<CSPService> owner,
+            size_t tenantIndex,
+            std::shared_ptr<MessageHandler> messagehandler,
+            seal::SEALContext& sealcontext,
+            seal::PublicKey const& sealhpk,
+            seal::SecretKey const& sealprivatekey,
+            std::vector<std::pair<int, int>> providedM)
+      : CSP(messagehandler, sealcontext, sealhpk, sealprivatekey, providedM),
+        service(std::move(owner)),
+        tenant(tenantIndex) {}
+
+  std::vector<seal::Ciphertext> convertRatingsAHEtoFHE(
+      const std::vector<EncryptedRatingAHE>& maskedRatings,
+      AHEScheme scheme) override;
+  std::vector<seal::Ciphertext> unpackRatings(
+      const std::vector<seal::Ciphertext>& maskedPacked,
+      const std::vector<std::pair<size_t, size_t>>& slots) override;
+  std::vector<seal::Ciphertext> sumF(std::vector<seal::Ciphertext> f) override;
+  std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
+  calculateNewUandUHat(std::vector<seal::Ciphertext> maskedUPrime,
+                       const std::vector<int>& entries,
+                       int rescaleBits) override;
+  std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
+  calculateNewVandVHat(std::vector<seal::Ciphertext> maskedVPrime,
+                       const std::vector<int>& entries,
+                       int rescaleBits) override;
+  std::vector<seal::Ciphertext> calculateNewUGradient(
+      std::vector<seal::Ciphertext> maskedUGradientPrime,
+      const std::vector<int>& entries,
+      int rescaleBits) override;
+  std::vector<seal::Ciphertext> calculateNewVGradient(
+      std::vector<seal::Ciphertext> maskedVGradientPrime,
+      const std::vector<int>& entries,
+      int rescaleBits) override;
+  std::pair<std::vector<bool>, std::vector<bool>> calculateStoppingVector(
+      std::vector<seal::Ciphertext> maskedUGradientSquare,
+      std::vector<seal::Ciphertext> maskedVGradientSquare,
+      std::vector<std::vector<uint64_t>> Su,
+      std::vector<std::vector<uint64_t>> Sv) override;
+  std::vector<seal::Ciphertext> calculateVVectors(
+      const std::vector<seal::Ciphertext>& maskedVHat) override;
+  seal::Ciphertext calculateUiVector(
+      const seal::Ciphertext& maskedUHat) override;
+  std::vector<seal::Ciphertext> calculateUiVectors(
+      const std::vector<seal::Ciphertext>& maskedUHats) override;
+  std::vector<seal::Ciphertext> reducePredictionVector(
+      std::vector<seal::Ciphertext> predictionVector) override;
+};
+
+// One CSP deployment serving several RecSys instances, each a tenant with its
+// own rating space, keys and TenantCSP. Tenants with the same encryption
+// parameters share one SEALContext. Protocol steps queue per tenant, at most
+// queueDepth deep, with callers blocking while their queue is full. A free
+// worker takes the next step of the idle tenant that has been served the
+// fewest ciphertexts, so busy tenants each get a worker of their own. A tenant
+// runs one step at a time, so its CSP state is never shared between workers.
+// Made with create, as the tenants share ownership of the service
+class CSPService : public std::enable_shared_from_this<CSPService> {
+ public:
+  struct Options {
+    size_t workers = 2;     // Threads running protocol steps
+    size_t queueDepth = 4;  // Steps waiting per tenant before callers block
+  };
+
+  struct TenantMetrics {
+    std::string name;
+    uint64_t steps = 0, ciphertexts = 0;
+    uint64_t queueFullWaits = 0;  // Steps that waited for room in the queue
+    double busyMs = 0;            // Time running steps
+    double queuedMs = 0;          // Time steps waited for a worker
+    double ciphertextsPerSecond() const {
+      return busyMs > 0 ? ciphertexts / (busyMs / 1000) : 0;
+    }
+  };
+
+  struct Metrics {
+    uint64_t steps = 0;
+    std::vector<TenantMetrics> tenants;
+  };
+
+ private:
+  struct Job {
+    std::function<void()> step;
+    size_t ciphertexts;
+    std::chrono::steady_clock::time_point arrival;
+  };
+
+  struct Tenant {
+    std::shared_ptr<seal::SEALContext> context;  // Shared per parameter set
+    std::deque<Job> queue;
+    bool running = false;
+    uint64_t served = 0;  // Ciphertexts, orders the tenants for fairness
+    TenantMetrics metrics;
+  };
+
+  Options options;
+  std::vector<std::pair<seal::EncryptionParameters,
+                        std::shared_ptr<seal::SEALContext>>>
+      contexts;
+  std::mutex mutex;
+  std::condition_variable jobReady, roomReady;
+  std::vector<Tenant> tenants;
+  uint64_t steps = 0;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  explicit CSPService(const Options& serviceOptions);
+  bool takeJob(size_t& tenant, Job& job);
+  void work();
+
+ public:
+  static std::shared_ptr<CSPService> create(const Options& serviceOptions);
+  ~CSPService();
+  CSPService(const CSPService&) = delete;
+  CSPService& operator=(const CSPService&) = delete;
+
+  std::shared_ptr<seal::SEALContext> getContext(
+      const seal::EncryptionParameters& parms);
+  std::shared_ptr<CSP> addTenant(const std::string& name,
+                                 const seal::EncryptionParameters& parms,
+                                 const seal::PublicKey& publicKey,
+                                 const seal::SecretKey& secretKey,
+                                 std::vector<std::pair<int, int>> M);
+  void submit(size_t tenant, size_t ciphertexts, std::function<void()> step);
+  static bool onWorker();
+  Metrics getMetrics();
+};
+
+///@brief Run a protocol step as a job of this tenant and wait for it. Steps
+/// called from a step already on a worker, such as calculateUiVector from
+/// calculateUiVectors, run in place
+///@param ciphertexts - size of the step, for fairness and metrics
+template <class F>
+auto TenantCSP::run(size_t ciphertexts, F&& step) -> decltype(step()) {
+  if (CSPService::onWorker())
+    return step();
+  std::packaged_task<decltype(step())()> task(std::forward<F>(step));
+  auto result = task.get_future();
+  service->submit(tenant, ciphertexts, [&task] { task(); });
+  return result.get();
+}
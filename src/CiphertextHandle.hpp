@@ -0,0 +1,45 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <memory>
+#include <utility>
+
+// Reference counted ciphertext. Copies of a handle share one buffer, so
+// logically duplicated ciphertexts - the entries of one row of U, or a row's
+// profile and its hat - cost one ciphertext of memory. mutate gives the
+// handle a buffer of its own before it is written if the buffer is shared.
+// A handle reads as a const ciphertext, and an empty handle reads as an
+// empty ciphertext. Handles shared between threads must only be read
+class CiphertextHandle {
+  std::shared_ptr<seal::Ciphertext> ciphertext;
+
+  static const seal::Ciphertext& empty() {
+    static const seal::Ciphertext emptyCiphertext;
+    return emptyCiphertext;
+  }
+
+ public:
+  CiphertextHandle() = default;
+  CiphertextHandle(seal::Ciphertext value)
+      : ciphertext(std::make_shared<seal::Ciphertext>(std::move(value))) {}
+
+  const seal::Ciphertext& operator*() const {
+    return ciphertext ? *ciphertext : empty();
+  }
+  const seal::Ciphertext* operator->() const { return &**this; }
+  operator const seal::Ciphertext&() const { return **this; }
+
+  ///@brief The ciphertext to write, copied first if another handle shares it
+  seal::Ciphertext& mutate() {
+    if (!ciphertext)
+      ciphertext = std::make_shared<seal::Ciphertext>();
+    else if (ciphertext.use_count() > 1)
+      ciphertext = std::make_shared<seal::Ciphertext>(*ciphertext);
+    return *ciphertext;
+  }
+
+  bool shares(const CiphertextHandle& other) const {
+    return ciphertext && ciphertext == other.ciphertext;
+  }
+  // Identifies the buffer, for counting distinct ciphertexts
+  const seal::Ciphertext* buffer() const { return ciphertext.get(); }
+};
@@ -0,0 +1,437 @@
+#include "CiphertextStore.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <set>
+#include <stdexcept>
+
+namespace {
+// Distinguishes the spill files of stores in the same process
+std::atomic<uint64_t> nextStoreId{0};
+
+// Length marking a spilled entry that shares an earlier entry's buffer
+constexpr uint64_t sharedEntry = UINT64_MAX;
+}  // namespace
+
+CiphertextStore::Metrics& CiphertextStore::Metrics::operator+=(
+    const Metrics& other) {
+  hits += other.hits;
+  prefetchHits += other.prefetchHits;
+  misses += other.misses;
+  evictions += other.evictions;
+  bytesWritten += other.bytesWritten;
+  bytesRead += other.bytesRead;
+  residentChunks += other.residentChunks;
+  peakResidentChunks += other.peakResidentChunks;
+  return *this;
+}
+
+CiphertextStore::CiphertextStore(const seal::SEALContext& sealcontext,
+                                 std::string storeName,
+                                 size_t size)
+    : context(sealcontext),
+      name(storeName + "_" + std::to_string(::getpid()) + "_" +
+           std::to_string(nextStoreId++)) {
+  resize(size);
+}
+
+CiphertextStore::~CiphertextStore() {
+  stopIO();
+  for (size_t c = 0; c < chunks.size(); c++) {
+    if (chunks[c].onDisk)
+      std::remove(chunkPath(c).c_str());
+  }
+}
+
+///@brief Change the chunking and memory limit. Existing contents are carried
+/// over through memory, so configure before filling a large store
+void CiphertextStore::configure(const Options& newOptions) {
+  std::vector<CiphertextHandle> contents(count);
+  for (size_t i = 0; i < count; i++) {
+    contents[i] = get(i);
+  }
+  reset();
+  options = newOptions;
+  options.chunkSize = std::max<size_t>(options.chunkSize, 1);
+  resize(contents.size());
+  for (size_t i = 0; i < contents.size(); i++) {
+    set(i, contents[i]);
+  }
+}
+
+///@brief Resize the store, discarding its contents
+void CiphertextStore::resize(size_t size) {
+  reset();
+  count = size;
+  chunks = std::vector<Chunk>((count + options.chunkSize - 1) /
+                              options.chunkSize);
+  if (options.maxResidentChunks > 0)
+    startIO();
+}
+
+///@brief Replace the contents, spilling chunks as the memory limit is reached
+void CiphertextStore::assign(const std::vector<seal::Ciphertext>& ciphertexts) {
+  resize(ciphertexts.size());
+  for (size_t i = 0; i < ciphertexts.size(); i++) {
+    set(i, ciphertexts[i]);
+  }
+}
+
+CiphertextHandle CiphertextStore::get(size_t i) {
+  std::unique_lock<std::mutex> guard(lock);
+  waitForWrites(guard, std::max<size_t>(options.maxResidentChunks, 1));
+  Chunk& chunk = acquire(i / options.chunkSize, guard);
+  return chunk.data.at(i % options.chunkSize);
+}
+
+///@brief Store a handle, sharing its buffer. A ciphertext is copied into a
+/// buffer of its own
+void CiphertextStore::set(size_t i, CiphertextHandle ciphertext) {
+  std::unique_lock<std::mutex> guard(lock);
+  waitForWrites(guard, std::max<size_t>(options.maxResidentChunks, 1));
+  Chunk& chunk = acquire(i / options.chunkSize, guard);
+  chunk.data.at(i % options.chunkSize) = std::move(ciphertext);
+  chunk.dirty = true;
+}
+
+///@brief Every ciphertext in order, in memory
+std::vector<seal::Ciphertext> CiphertextStore::toVector() {
+  std::vector<seal::Ciphertext> result(count);
+  for (size_t i = 0; i < count; i++) {
+    result[i] = get(i);
+  }
+  return result;
+}
+
+///@brief Wait for the write-behind queue to drain
+void CiphertextStore::flush() {
+  std::unique_lock<std::mutex> guard(lock);
+  waitForWrites(guard, 0);
+}
+
+CiphertextStore::Metrics CiphertextStore::getMetrics() {
+  std::lock_guard<std::mutex> guard(lock);
+  Metrics result = metrics;
+  result.residentChunks = lru.size();
+  return result;
+}
+
+///@brief Distinct ciphertexts held in memory, resident or waiting to be
+/// written
+Profiler::Usage CiphertextStore::getMemoryUsage() {
+  std::lock_guard<std::mutex> guard(lock);
+  Profiler::Usage usage;
+  std::set<const seal::Ciphertext*> counted;
+  auto add = [&](const std::vector<CiphertextHandle>& data) {
+    for (const CiphertextHandle& ciphertext : data) {
+      if (ciphertext->size() == 0 ||
+          !counted.insert(ciphertext.buffer()).second)
+        continue;
+      usage.count++;
+      usage.bytes += Profiler::bytesOf(*ciphertext);
+    }
+  };
+  for (const Chunk& chunk : chunks) {
+    add(chunk.data);
+  }
+  for (const auto& pending : writeQueue) {
+    add(pending.second);
+  }
+  return usage;
+}
+
+std::string CiphertextStore::chunkPath(size_t chunk) const {
+  return options.spillDirectory + "/" + name + "_" + std::to_string(chunk) +
+         ".ct";
+}
+
+size_t CiphertextStore::chunkLength(size_t chunk) const {
+  return std::min(options.chunkSize, count - chunk * options.chunkSize);
+}
+
+///@brief Write a chunk to its spill file, uncompressed, with a zero length
+/// for ciphertexts that were never set. A buffer shared with an earlier entry
+/// of the chunk is written as sharedEntry and that entry's position
+///@return bytes written
+uint64_t CiphertextStore::writeChunk(
+    size_t chunk,
+    const std::vector<CiphertextHandle>& data) const {
+  std::ofstream out(chunkPath(chunk), std::ios::binary | std::ios::trunc);
+  uint64_t total = 0;
+  std::vector<std::byte> buffer;
+  std::map<const seal::Ciphertext*, uint64_t> written;
+  for (uint64_t k = 0; k < data.size(); k++) {
+    const seal::Ciphertext& ciphertext = *data[k];
+    auto earlier = written.find(data[k].buffer());
+    if (ciphertext.size() > 0 && earlier != written.end()) {
+      uint64_t reference[] = {sharedEntry, earlier->second};
+      out.write(reinterpret_cast<const char*>(reference), sizeof(reference));
+      total += sizeof(reference);
+      continue;
+    }
+    uint64_t size = 0;
+    if (ciphertext.size() > 0) {
+      buffer.resize(ciphertext.save_size(seal::compr_mode_type::none));
+      size = ciphertext.save(buffer.data(), buffer.size(),
+                             seal::compr_mode_type::none);
+      written.emplace(data[k].buffer(), k);
+    }
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.write(reinterpret_cast<const char*>(buffer.data()), size);
+    total += sizeof(size) + size;
+  }
+  if (!out)
+    throw std::runtime_error("CiphertextStore: failed to write " +
+                             chunkPath(chunk));
+  return total;
+}
+
+///@return bytes read
+uint64_t CiphertextStore::readChunk(
+    size_t chunk,
+    std::vector<CiphertextHandle>& data) const {
+  std::ifstream in(chunkPath(chunk), std::ios::binary);
+  data.assign(chunkLength(chunk), CiphertextHandle());
+  uint64_t total = 0;
+  std::vector<std::byte> buffer;
+  for (uint64_t k = 0; k < data.size(); k++) {
+    uint64_t size = 0;
+    in.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (size == sharedEntry) {
+      uint64_t earlier = data.size();
+      in.read(reinterpret_cast<char*>(&earlier), sizeof(earlier));
+      if (!in || earlier >= k)
+        throw std::runtime_error("CiphertextStore: bad shared entry in " +
+                                 chunkPath(chunk));
+      data[k] = data[earlier];
+      total += 2 * sizeof(uint64_t);
+      continue;
+    }
+    if (!in)
+      throw std::runtime_error("CiphertextStore: failed to read " +
+                               chunkPath(chunk));
+    if (size > 0) {
+      buffer.resize(size);
+      in.read(reinterpret_cast<char*>(buffer.data()), size);
+      data[k].mutate().load(context, buffer.data(), size);
+    }
+    total += sizeof(size) + size;
+  }
+  return total;
+}
+
+///@brief Bring a chunk into memory, evict down to the limit and start
+/// read-ahead. Only chunk switches are counted in the metrics
+CiphertextStore::Chunk& CiphertextStore::acquire(
+    size_t c,
+    std::unique_lock<std::mutex>& guard) {
+  if (!ioError.empty())
+    throw std::runtime_error(ioError);
+  Chunk& chunk = chunks.at(c);
+  bool counted = c != lastChunk;
+  bool prefetched = false;
+
+  while (chunk.state != State::Resident) {
+    if (chunk.state == State::Empty) {
+      chunk.data.assign(chunkLength(c), CiphertextHandle());
+      makeResident(c);
+    } else if (chunk.state == State::Loading) {
+      changed.wait(guard);
+      prefetched = true;
+    } else if (chunk.state == State::Writing) {
+      // Take the data back if the write has not started yet
+      auto queued = std::find_if(
+          writeQueue.begin(), writeQueue.end(),
+          [c](const auto& job) { return job.first == c; });
+      if (queued == writeQueue.end()) {
+        changed.wait(guard);
+        continue;
+      }
+      chunk.data = std::move(queued->second);
+      writeQueue.erase(queued);
+      makeResident(c);
+    } else {
+      metrics.bytesRead += readChunk(c, chunk.data);
+      if (counted)
+        metrics.misses++;
+      counted = false;
+      chunk.dirty = false;
+      makeResident(c);
+    }
+  }
+
+  if (counted) {
+    if (prefetched)
+      metrics.prefetchHits++;
+    else
+      metrics.hits++;
+  }
+  lru.splice(lru.begin(), lru, chunk.lruPosition);
+
+  if (c != lastChunk) {
+    lastChunk = c;
+    evict(c);
+    for (size_t n = c + 1; n <= c + options.readAhead && n < chunks.size();
+         n++) {
+      prefetch(n);
+    }
+  }
+  return chunk;
+}
+
+void CiphertextStore::makeResident(size_t c) {
+  chunks[c].state = State::Resident;
+  lru.push_front(c);
+  chunks[c].lruPosition = lru.begin();
+  metrics.peakResidentChunks =
+      std::max(metrics.peakResidentChunks, lru.size());
+}
+
+///@brief Evict least recently used chunks down to the limit, never the chunk
+/// in use or keep. Dirty chunks are queued for the I/O thread
+void CiphertextStore::evict(size_t keep) {
+  if (options.maxResidentChunks == 0)
+    return;
+  auto victim = lru.end();
+  while (lru.size() > options.maxResidentChunks && victim != lru.begin()) {
+    --victim;
+    size_t c = *victim;
+    if (c == keep || c == lastChunk)
+      continue;
+    victim = lru.erase(victim);
+    metrics.evictions++;
+
+    Chunk& chunk = chunks[c];
+    if (chunk.dirty) {
+      chunk.state = State::Writing;
+      writeQueue.emplace_back(c, std::move(chunk.data));
+      changed.notify_all();
+    } else {
+      chunk.state = chunk.onDisk ? State::Spilled : State::Empty;
+    }
+    chunk.data = std::vector<CiphertextHandle>();
+  }
+}
+
+///@brief Block while more than limit chunks are waiting to be written
+void CiphertextStore::waitForWrites(std::unique_lock<std::mutex>& guard,
+                                    size_t limit) {
+  changed.wait(guard, [&] {
+    return !ioError.empty() ||
+           writeQueue.size() + writesInFlight <= limit;
+  });
+}
+
+void CiphertextStore::prefetch(size_t c) {
+  if (chunks[c].state != State::Spilled)
+    return;
+  chunks[c].state = State::Loading;
+  loadQueue.push_back(c);
+  changed.notify_all();
+}
+
+///@brief Background thread, writing evicted chunks before loading prefetched
+/// ones
+void CiphertextStore::ioLoop() {
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    changed.wait(guard, [&] {
+      return stopping || !writeQueue.empty() || !loadQueue.empty();
+    });
+    if (stopping)
+      return;
+
+    if (!writeQueue.empty()) {
+      auto job = std::move(writeQueue.front());
+      writeQueue.pop_front();
+      writesInFlight++;
+      guard.unlock();
+      uint64_t bytes = 0;
+      std::string error;
+      try {
+        bytes = writeChunk(job.first, job.second);
+      } catch (const std::exception& e) {
+        error = e.what();
+      }
+      guard.lock();
+      writesInFlight--;
+      Chunk& chunk = chunks[job.first];
+      if (error.empty()) {
+        metrics.bytesWritten += bytes;
+        chunk.onDisk = true;
+        chunk.dirty = false;
+        chunk.state = State::Spilled;
+      } else {
+        // Keep the data so nothing is lost, and report on the next access
+        ioError = error;
+        chunk.data = std::move(job.second);
+        makeResident(job.first);
+      }
+      changed.notify_all();
+      continue;
+    }
+
+    size_t c = loadQueue.front();
+    loadQueue.pop_front();
+    if (chunks[c].state != State::Loading)
+      continue;
+    guard.unlock();
+    std::vector<CiphertextHandle> data;
+    uint64_t bytes = 0;
+    std::string error;
+    try {
+      bytes = readChunk(c, data);
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+    guard.lock();
+    if (error.empty()) {
+      metrics.bytesRead += bytes;
+      chunks[c].data = std::move(data);
+      chunks[c].dirty = false;
+      makeResident(c);
+      evict(c);
+    } else {
+      // Leave it for a synchronous load
+      chunks[c].state = State::Spilled;
+    }
+    changed.notify_all();
+  }
+}
+
+void CiphertextStore::startIO() {
+  std::lock_guard<std::mutex> guard(lock);
+  stopping = false;
+  if (!ioThread.joinable())
+    ioThread = std::thread(&CiphertextStore::ioLoop, this);
+}
+
+///@brief Stop the I/O thread. Queued writes are dropped, so only use when the
+/// contents are being discarded or already copied out
+void CiphertextStore::stopIO() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  changed.notify_all();
+  if (ioThread.joinable())
+    ioThread.join();
+  writeQueue.clear();
+  loadQueue.clear();
+}
+
+///@brief Drop every chunk and its spill file
+void CiphertextStore::reset() {
+  stopIO();
+  for (size_t c = 0; c < chunks.size(); c++) {
+    if (chunks[c].onDisk)
+      std::remove(chunkPath(c).c_str());
+  }
+  chunks.clear();
+  lru.clear();
+  lastChunk = SIZE_MAX;
+  ioError.clear();
+}
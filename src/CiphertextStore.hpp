@@ -0,0 +1,115 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "CiphertextHandle.hpp"
+#include "Profiler.hpp"
+
+// Vector of |M| ciphertexts which can live mostly on disk. Ciphertexts are
+// grouped into chunks in protocol order and at most maxResidentChunks are kept
+// in memory, least recently used first out. Evicted chunks are written to the
+// spill directory by a background thread (write-behind), and sequential access
+// loads the next readAhead chunks before they are needed. With no limit the
+// store is an in-memory vector and no thread is started. Entries are
+// CiphertextHandles, so setting one handle at several indices keeps one
+// buffer, in memory and within a spilled chunk
+class CiphertextStore {
+ public:
+  struct Options {
+    size_t chunkSize = 256;         // Ciphertexts per chunk
+    size_t maxResidentChunks = 0;   // 0 keeps everything in memory
+    size_t readAhead = 1;           // Chunks to prefetch on sequential access
+    std::string spillDirectory = "../data";
+  };
+
+  struct Metrics {
+    uint64_t hits = 0;          // Accesses to a chunk already in memory
+    uint64_t prefetchHits = 0;  // Accesses to a chunk loaded by read-ahead
+    uint64_t misses = 0;        // Accesses that loaded a chunk from disk
+    uint64_t evictions = 0;
+    uint64_t bytesWritten = 0, bytesRead = 0;
+    size_t residentChunks = 0, peakResidentChunks = 0;
+
+    double hitRate() const {
+      uint64_t total = hits + prefetchHits + misses;
+      return total == 0 ? 1 : static_cast<double>(hits + prefetchHits) / total;
+    }
+    Metrics& operator+=(const Metrics& other);
+  };
+
+ private:
+  enum class State { Empty, Resident, Writing, Spilled, Loading };
+
+  struct Chunk {
+    State state = State::Empty;
+    bool dirty = false;   // Changed since it was last written
+    bool onDisk = false;  // Has a spill file
+    std::vector<CiphertextHandle> data;
+    std::list<size_t>::iterator lruPosition;
+  };
+
+  seal::SEALContext context;
+  std::string name;
+  Options options;
+  size_t count = 0;
+  std::vector<Chunk> chunks;
+  std::list<size_t> lru;  // Resident chunks, most recently used first
+  size_t lastChunk = SIZE_MAX;
+  Metrics metrics;
+
+  // Background I/O - chunks waiting to be written with their data, and chunks
+  // to prefetch
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<std::pair<size_t, std::vector<CiphertextHandle>>> writeQueue;
+  std::deque<size_t> loadQueue;
+  std::thread ioThread;
+  bool stopping = false;
+  size_t writesInFlight = 0;
+  std::string ioError;
+
+  std::string chunkPath(size_t chunk) const;
+  size_t chunkLength(size_t chunk) const;
+  uint64_t writeChunk(size_t chunk,
+                      const std::vector<CiphertextHandle>& data) const;
+  uint64_t readChunk(size_t chunk, std::vector<CiphertextHandle>& data) const;
+  Chunk& acquire(size_t chunk, std::unique_lock<std::mutex>& guard);
+  void makeResident(size_t chunk);
+  void evict(size_t keep);
+  void waitForWrites(std::unique_lock<std::mutex>& guard, size_t limit);
+  void prefetch(size_t chunk);
+  void ioLoop();
+  void startIO();
+  void stopIO();
+  void reset();
+
+ public:
+  CiphertextStore(const seal::SEALContext& sealcontext,
+                  std::string storeName,
+                  size_t size = 0);
+  ~CiphertextStore();
+  CiphertextStore(const CiphertextStore&) = delete;
+  CiphertextStore& operator=(const CiphertextStore&) = delete;
+
+  void configure(const Options& newOptions);
+  const Options& getOptions() const { return options; }
+  size_t size() const { return count; }
+  void resize(size_t size);
+  void assign(const std::vector<seal::Ciphertext>& ciphertexts);
+
+  CiphertextHandle get(size_t i);
+  void set(size_t i, CiphertextHandle ciphertext);
+  std::vector<seal::Ciphertext> toVector();
+  void flush();
+  Metrics getMetrics();
+  Profiler::Usage getMemoryUsage();
+};
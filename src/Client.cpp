@@ -0,0 +1,169 @@
+#include <cryptopp/filters.h>
+#include <cryptopp/osrng.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "AHE.hpp"
+#include "Ratings.hpp"
+
+namespace {
+// Reads the daemon's response a line at a time
+class LineReader {
+  int socket;
+  std::string buffer;
+
+ public:
+  explicit LineReader(int fd) : socket(fd) {}
+
+  bool next(std::string& line) {
+    size_t newline;
+    while ((newline = buffer.find('\n')) == std::string::npos) {
+      char chunk[4096];
+      ssize_t received = ::recv(socket, chunk, sizeof(chunk), 0);
+      if (received < 0 && errno == EINTR)
+        continue;
+      if (received <= 0)
+        return false;
+      buffer.append(chunk, received);
+    }
+    line = buffer.substr(0, newline);
+    buffer.erase(0, newline + 1);
+    return true;
+  }
+};
+
+///@return false if the daemon has gone
+bool sendAll(int socket, const std::string& data) {
+  const char* bytes = data.data();
+  size_t size = data.size();
+  while (size > 0) {
+    ssize_t written = ::send(socket, bytes, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+///@brief Send a command and read its response
+///@param lines - set to the lines of an ok response
+///@return the status line, "ok <lines>" or "error <reason>"
+std::string exchange(int socket,
+                     LineReader& reader,
+                     const std::string& command,
+                     std::vector<std::string>& lines) {
+  if (!sendAll(socket, command + "\n"))
+    throw std::runtime_error("Could not send the command");
+  std::string status;
+  if (!reader.next(status))
+    throw std::runtime_error("No response");
+  lines.clear();
+  if (status.rfind("ok ", 0) == 0) {
+    lines.resize(std::stoul(status.substr(3)));
+    for (std::string& line : lines) {
+      if (!reader.next(line))
+        throw std::runtime_error("Truncated response");
+    }
+  }
+  return status;
+}
+
+///@brief Encrypt the (user, item, rating) triples of an upload command under
+/// the daemon's ElGamal key, fetched with the key command
+std::string encryptUpload(int socket, LineReader& reader, int argc,
+                          char* argv[]) {
+  if (argc < 6 || (argc - 3) % 3 != 0)
+    throw std::invalid_argument("upload takes user item rating triples");
+  std::vector<PlainRating> ratings;
+  for (int i = 3; i < argc; i += 3) {
+    ratings.push_back(
+        {std::stoi(argv[i]), std::stoi(argv[i + 1]), std::stoi(argv[i + 2])});
+    if (ratings.back().rating < 1 || ratings.back().rating > 5)
+      throw std::invalid_argument("ratings are from 1 to 5");
+  }
+
+  std::vector<std::string> lines;
+  std::string status = exchange(socket, reader, "key", lines);
+  if (lines.size() != 1)
+    throw std::runtime_error("No key: " + status);
+  CryptoPP::SecByteBlock encoded = fromHex(lines[0]);
+  CryptoPP::ArraySource source(encoded.data(), encoded.size(), true);
+  CryptoPP::ElGamalKeys::PublicKey publicKey;
+  publicKey.Load(source);
+
+  std::string command = "upload";
+  for (const EncryptedRatingAHE& rating :
+       ElGamalAHEEncryptor(publicKey).encryptBatch(ratings)) {
+    command += " " + std::to_string(rating.userID) + " " +
+               std::to_string(rating.itemID) + " " +
+               toHex(rating.rating.data(), rating.rating.size());
+  }
+  return command;
+}
+}  // namespace
+
+///@brief Send one command to PPRSDaemon and print the response. Upload
+/// ratings are encrypted here, so the daemon never sees them in the clear
+///@param argv - <socket path> <command> [arguments], as in
+/// `PPRSClient ../data/pprs.sock predict 1`
+///@return 0 if the daemon answered ok
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: PPRSClient <socket> <command> [arguments]" << std::endl
+              << "Commands: key, train, upload u i r [u i r ...], "
+                 "predict u, metrics, shutdown"
+              << std::endl;
+    return 2;
+  }
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+  int socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket < 0 || ::connect(socket, reinterpret_cast<sockaddr*>(&address),
+                              sizeof(address)) != 0) {
+    std::cerr << "Could not connect to " << argv[1] << std::endl;
+    return 1;
+  }
+
+  auto startTime = std::chrono::steady_clock::now();
+  LineReader reader(socket);
+  std::vector<std::string> lines;
+  std::string status;
+  try {
+    std::string command = argv[2];
+    if (command == "upload") {
+      command = encryptUpload(socket, reader, argc, argv);
+    } else {
+      for (int i = 3; i < argc; i++) {
+        command += std::string(" ") + argv[i];
+      }
+    }
+    status = exchange(socket, reader, command, lines);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  bool ok = status.rfind("ok ", 0) == 0;
+  for (const std::string& line : lines) {
+    std::cout << line << std::endl;
+  }
+  if (!ok)
+    std::cerr << status << std::endl;
+  auto stopTime = std::chrono::steady_clock::now();
+  ::close(socket);
+  std::cerr << "("
+            << std::chrono::duration<double, std::milli>(stopTime - startTime)
+                   .count()
+            << " ms)" << std::endl;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,517 @@
+#include "Daemon.hpp"
+#include <cryptopp/filters.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include "ResultContainer.hpp"
+
+namespace {
+///@return false if the client has gone or stopped reading
+bool sendAll(int socket, const std::string& data) {
+  const char* bytes = data.data();
+  size_t size = data.size();
+  while (size > 0) {
+    ssize_t written = ::send(socket, bytes, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+double msSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+const char* const commandNames[] = {"key",     "train",   "upload",
+                                    "predict", "metrics", "shutdown"};
+}  // namespace
+
+///@brief Load or create the key material and build the model from the
+/// initial data. The model is trained when run is called
+Daemon::Daemon(const Dataset& initialData, const Options& daemonOptions)
+    : options(daemonOptions),
+      startTime(std::chrono::steady_clock::now()),
+      keystore(daemonOptions.keyDirectory),
+      context(keystore.getParameters(defaultEncryptionParameters)),
+      secretKey(keystore.getSecretKey(context)),
+      publicKey(keystore.getPublicKey(context, secretKey)),
+      encryptor(context, publicKey),
+      decryptor(context, secretKey),
+      batchEncoder(context) {
+  buildModel(initialData);
+  predictionDimension = recSysInstance->getDimension();
+  predictionScaleBits = recSysInstance->getPredictionScaleBits();
+  scheduler = std::make_unique<PredictionScheduler>(
+      [this](const std::vector<int>& users) {
+        std::lock_guard<std::timed_mutex> model(modelMutex);
+        return recSysInstance->computePredictions(users);
+      },
+      options.scheduler);
+}
+
+Daemon::~Daemon() {
+  stop();
+  for (auto& worker : workers) {
+    if (worker.joinable())
+      worker.join();
+  }
+  if (listenSocket >= 0)
+    ::close(listenSocket);
+  scheduler.reset();
+}
+
+///@brief Encrypt the ratings and fresh embeddings of the initial data and
+/// build the CSP and RecSys around them
+void Daemon::buildModel(const Dataset& data) {
+  std::vector<seal::Ciphertext> encryptedRatings =
+      encryptRatings(data.ratings, encryptor, batchEncoder, options.setup);
+  auto [U, V, UHat, VHat] =
+      createEmbeddings(data.M, encryptor, batchEncoder, options.setup);
+
+  CSPInstance = std::make_shared<CSP>(messageHandlerInstance, context,
+                                      publicKey, secretKey, data.M);
+  CSPInstance->generateKeys(keystore);
+  recSysInstance = std::make_unique<RecSys>(
+      CSPInstance, messageHandlerInstance, context, data.M);
+  if (options.setup.dimension > 0)
+    recSysInstance->setDimension(options.setup.dimension);
+  recSysInstance->setRatings(encryptedRatings);
+  recSysInstance->setEmbeddings(U, V, UHat, VHat);
+}
+
+///@brief The CSP's ElGamal public key, DER encoded as hex, which clients
+/// encrypt their uploads under
+std::vector<std::string> Daemon::key() {
+  std::string encoded;
+  CryptoPP::StringSink sink(encoded);
+  CSPInstance->getPublicKeyAHE().Save(sink);
+  return {toHex(reinterpret_cast<const CryptoPP::byte*>(encoded.data()),
+                encoded.size())};
+}
+
+///@brief Add the uploaded ratings to the model, keeping the trained profiles,
+/// then continue gradient descent from where it stopped
+std::vector<std::string> Daemon::train() {
+  size_t loaded = 0;
+  if (!recSysInstance->getUploadedM().empty())
+    loaded = recSysInstance->addUploadedEntries(encryptor, options.setup);
+  size_t epochsBefore = recSysInstance->getEpochTimes().size();
+  auto start = std::chrono::steady_clock::now();
+  recSysInstance->gradientDescent();
+  double ms = msSince(start);
+  epochs += recSysInstance->getEpochTimes().size() - epochsBefore;
+
+  std::ostringstream line;
+  line << "entries " << recSysInstance->getM().size() << " loaded " << loaded
+       << " epochs " << recSysInstance->getEpochTimes().size() - epochsBefore
+       << " ms " << std::llround(ms);
+  return {line.str()};
+}
+
+///@brief Hand (user, item, ciphertext) triples to RecSys, which masks them
+/// and has the CSP convert them to FHE. They join the model at the next train
+std::vector<std::string> Daemon::upload(
+    const std::vector<std::string>& command) {
+  if (command.size() < 4 || (command.size() - 1) % 3 != 0)
+    throw std::invalid_argument("upload takes user item ciphertext triples");
+  size_t ciphertextSize =
+      2 * CSPInstance->getPublicKeyAHE().GetGroupParameters().GetModulus()
+              .ByteCount();
+  std::vector<EncryptedRatingAHE> ratings;
+  for (size_t k = 1; k < command.size(); k += 3) {
+    CryptoPP::SecByteBlock rating = fromHex(command[k + 2]);
+    if (rating.size() != ciphertextSize)
+      throw std::invalid_argument("ciphertexts are " +
+                                  std::to_string(ciphertextSize) + " bytes");
+    ratings.emplace_back(std::stoi(command[k]), std::stoi(command[k + 1]),
+                         rating);
+  }
+  recSysInstance->uploadRatings(ratings);
+  return {"uploaded " + std::to_string(recSysInstance->getUploadedM().size())};
+}
+
+///@brief Decrypted predictions of a user, one "item prediction" per line.
+/// The query goes through the scheduler, so it may share a batch with others
+std::vector<std::string> Daemon::predict(int user) {
+  std::future<PredictionScheduler::Predictions> query =
+      scheduler->submit(user);
+  if (query.wait_for(std::chrono::milliseconds(options.timeoutMs)) !=
+      std::future_status::ready) {
+    std::lock_guard<std::mutex> lock(metricsMutex);
+    timeouts++;
+    throw std::runtime_error("timeout waiting for the predictions");
+  }
+  auto [items, results] = query.get();
+  std::vector<std::vector<uint64_t>> decoded(results.size());
+  std::vector<std::string> lines;
+  for (size_t i = 0; i < items.size(); i++) {
+    auto [k, slot] = ResultContainer::predictionSlot(
+        i, batchEncoder.slot_count(), predictionDimension);
+    if (decoded[k].empty()) {
+      seal::Plaintext curRowPlain;
+      decryptor.decrypt(results.at(k), curRowPlain);
+      batchEncoder.decode(curRowPlain, decoded[k]);
+    }
+    std::ostringstream line;
+    line << items.at(i) << " "
+         << std::ldexp(static_cast<double>(decoded[k].at(slot)),
+                       -predictionScaleBits);
+    lines.push_back(line.str());
+  }
+  return lines;
+}
+
+///@brief Uptime, connections, per command latencies and, unless a command
+/// holds the model, its protocol traffic and prediction cache counts
+std::vector<std::string> Daemon::metrics() {
+  std::vector<std::string> lines;
+  {
+    std::lock_guard<std::mutex> lock(metricsMutex);
+    lines.push_back("uptime_ms " +
+                    std::to_string(std::llround(msSince(startTime))));
+    lines.push_back("connections " + std::to_string(connectionsServed));
+    lines.push_back("timeouts " + std::to_string(timeouts));
+    for (const auto& [name, command] : commandMetrics) {
+      std::ostringstream line;
+      line << name << " requests " << command.requests << " errors "
+           << command.errors << " mean_ms "
+           << (command.requests > 0 ? command.totalMs / command.requests : 0)
+           << " max_ms " << command.maxMs;
+      lines.push_back(line.str());
+    }
+  }
+
+  PredictionScheduler::Metrics predictions = scheduler->getMetrics();
+  std::ostringstream line;
+  line << "predict_batches " << predictions.batches << " queries "
+       << predictions.queries << " latency_p50_ms "
+       << predictions.latencyMs.percentile(0.5) << " latency_p99_ms "
+       << predictions.latencyMs.percentile(0.99) << " batch_p50 "
+       << predictions.batchSize.percentile(0.5) << " batch_p99 "
+       << predictions.batchSize.percentile(0.99);
+  lines.push_back(line.str());
+  for (const auto* histogram :
+       {&predictions.latencyMs, &predictions.batchSize}) {
+    std::ostringstream buckets;
+    buckets << (histogram == &predictions.latencyMs ? "latency_ms"
+                                                    : "batch_size");
+    for (size_t b = 0; b < histogram->getCounts().size(); b++) {
+      buckets << " ";
+      if (b < histogram->getBounds().size())
+        buckets << "<=" << histogram->getBounds()[b];
+      else
+        buckets << "more";
+      buckets << ":" << histogram->getCounts()[b];
+    }
+    lines.push_back(buckets.str());
+  }
+
+  std::unique_lock<std::timed_mutex> model(modelMutex, std::try_to_lock);
+  if (!model.owns_lock()) {
+    lines.push_back("model busy");
+    return lines;
+  }
+  const RecSys::Traffic& traffic = recSysInstance->getTraffic();
+  const RecSys::PredictionCacheMetrics& cache =
+      recSysInstance->getPredictionCacheMetrics();
+  lines.push_back("entries " + std::to_string(recSysInstance->getM().size()));
+  lines.push_back("uploaded " +
+                  std::to_string(recSysInstance->getUploadedM().size()));
+  lines.push_back("epochs " + std::to_string(epochs));
+  lines.push_back("bytes_sent " + std::to_string(traffic.bytesSent));
+  lines.push_back("bytes_received " + std::to_string(traffic.bytesReceived));
+  lines.push_back("round_trips " + std::to_string(traffic.roundTrips));
+  lines.push_back("cache_hits " + std::to_string(cache.hits));
+  lines.push_back("cache_misses " + std::to_string(cache.misses));
+  return lines;
+}
+
+///@brief Run one command, waiting at most the timeout for the model
+std::vector<std::string> Daemon::execute(
+    const std::vector<std::string>& command) {
+  const std::string& name = command.at(0);
+  if (name == "metrics")
+    return metrics();
+  if (name == "shutdown") {
+    stop();
+    return {};
+  }
+  if (name == "predict") {
+    if (command.size() != 2)
+      throw std::invalid_argument("predict takes a user");
+    return predict(std::stoi(command[1]));
+  }
+  if (name != "key" && name != "train" && name != "upload")
+    throw std::invalid_argument("unknown command " + name);
+
+  std::unique_lock<std::timed_mutex> model(modelMutex, std::defer_lock);
+  if (!model.try_lock_for(std::chrono::milliseconds(options.timeoutMs))) {
+    std::lock_guard<std::mutex> lock(metricsMutex);
+    timeouts++;
+    throw std::runtime_error("timeout waiting for the model");
+  }
+  if (name == "key")
+    return key();
+  if (name == "train")
+    return train();
+  return upload(command);
+}
+
+void Daemon::recordCommand(const std::string& name, double ms, bool error) {
+  std::string key = "other";
+  for (const char* known : commandNames) {
+    if (name == known)
+      key = name;
+  }
+  std::lock_guard<std::mutex> lock(metricsMutex);
+  CommandMetrics& command = commandMetrics[key];
+  command.requests++;
+  command.errors += error ? 1 : 0;
+  command.totalMs += ms;
+  command.maxMs = std::max(command.maxMs, ms);
+}
+
+///@brief Read and answer one command of a client, waiting at most the
+/// timeout for the rest of the line
+///@return false once the client has gone or the connection should close
+bool Daemon::handleCommand(Connection& connection) {
+  std::string& buffer = connection.buffer;
+  size_t newline;
+  char chunk[4096];
+  while ((newline = buffer.find('\n')) == std::string::npos) {
+    if (buffer.size() > options.maxLineBytes) {
+      sendAll(connection.socket, "error command too long\n");
+      return false;
+    }
+    ssize_t received = ::recv(connection.socket, chunk, sizeof(chunk), 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      return false;
+    buffer.append(chunk, received);
+  }
+
+  std::istringstream line(buffer.substr(0, newline));
+  buffer.erase(0, newline + 1);
+  std::vector<std::string> command;
+  for (std::string word; line >> word;) {
+    command.push_back(word);
+  }
+  if (command.empty())
+    return true;
+
+  auto start = std::chrono::steady_clock::now();
+  std::string response;
+  bool error = false;
+  try {
+    std::vector<std::string> lines = execute(command);
+    response = "ok " + std::to_string(lines.size()) + "\n";
+    for (const std::string& responseLine : lines) {
+      response += responseLine + "\n";
+    }
+  } catch (const std::exception& e) {
+    error = true;
+    response = std::string("error ") + e.what() + "\n";
+  }
+  recordCommand(command[0], msSince(start), error);
+  return sendAll(connection.socket, response);
+}
+
+///@brief Hand a connection back after a command. One with another command
+/// already received goes straight back to the workers, and the rest are
+/// polled by run until they send one
+void Daemon::release(Connection connection) {
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    if (connection.buffer.find('\n') != std::string::npos) {
+      ready.push_back(std::move(connection));
+      queueReady.notify_one();
+      return;
+    }
+    connection.idleSince = std::chrono::steady_clock::now();
+    idle.push_back(std::move(connection));
+  }
+  wake();
+}
+
+void Daemon::closeConnection(int socket) {
+  ::close(socket);
+  std::lock_guard<std::mutex> lock(metricsMutex);
+  connectionsServed++;
+}
+
+///@brief Interrupt the poll in run
+void Daemon::wake() {
+  if (wakePipe[1] >= 0) {
+    char byte = 0;
+    ssize_t written = ::write(wakePipe[1], &byte, 1);
+    (void)written;  // A full pipe will wake the poll anyway
+  }
+}
+
+///@brief Worker - serve one command of a ready connection at a time until
+/// the daemon stops
+void Daemon::serve() {
+  while (true) {
+    Connection connection;
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueReady.wait(lock, [this] { return stopping || !ready.empty(); });
+      if (stopping)
+        return;
+      connection = std::move(ready.front());
+      ready.pop_front();
+    }
+    if (handleCommand(connection) && !stopping)
+      release(std::move(connection));
+    else
+      closeConnection(connection.socket);
+  }
+}
+
+///@brief Accept new connections and wait for idle ones to send a command,
+/// queueing them for the workers. Connections idle past the timeout are
+/// closed
+void Daemon::pollConnections() {
+  while (!stopping) {
+    std::vector<Connection> polled;
+    {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      polled.swap(idle);
+    }
+    std::vector<pollfd> fds{{listenSocket, POLLIN, 0},
+                            {wakePipe[0], POLLIN, 0}};
+    for (const Connection& connection : polled) {
+      fds.push_back({connection.socket, POLLIN, 0});
+    }
+    int events = ::poll(fds.data(), fds.size(), options.timeoutMs);
+    if (events < 0 && errno != EINTR)
+      break;
+
+    if (fds[1].revents != 0) {
+      char drain[64];
+      while (::read(wakePipe[0], drain, sizeof(drain)) > 0) {
+      }
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::vector<int> expired;
+    size_t readied = 0;
+    {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      for (size_t c = 0; c < polled.size(); c++) {
+        if (events > 0 && fds[c + 2].revents != 0) {
+          ready.push_back(std::move(polled[c]));
+          readied++;
+        } else if (now - polled[c].idleSince >=
+                   std::chrono::milliseconds(options.timeoutMs)) {
+          expired.push_back(polled[c].socket);
+        } else {
+          idle.push_back(std::move(polled[c]));
+        }
+      }
+    }
+    for (int socket : expired) {
+      closeConnection(socket);
+    }
+    if (readied > 0)
+      queueReady.notify_all();
+
+    if (events > 0 && fds[0].revents != 0) {
+      int client = ::accept(listenSocket, nullptr, nullptr);
+      if (client < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED)
+          continue;
+        break;
+      }
+      timeval timeout{options.timeoutMs / 1000,
+                      (options.timeoutMs % 1000) * 1000};
+      ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      std::lock_guard<std::mutex> lock(queueMutex);
+      idle.push_back({client, "", now});
+    }
+  }
+}
+
+///@brief Train the initial model, then listen on the socket and hand
+/// commands to the workers until a shutdown command or stop
+void Daemon::run() {
+  {
+    std::lock_guard<std::timed_mutex> model(modelMutex);
+    std::cout << "Training initial model: " << train().front() << std::endl;
+  }
+
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (options.socketPath.size() >= sizeof(address.sun_path))
+    throw std::invalid_argument("Daemon: socket path too long");
+  std::strcpy(address.sun_path, options.socketPath.c_str());
+  listenSocket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenSocket < 0)
+    throw std::runtime_error("Daemon: socket failed");
+  ::unlink(options.socketPath.c_str());
+  if (::bind(listenSocket, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) != 0 ||
+      ::listen(listenSocket, SOMAXCONN) != 0)
+    throw std::runtime_error("Daemon: cannot listen on " + options.socketPath);
+  if (::pipe2(wakePipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    throw std::runtime_error("Daemon: pipe failed");
+
+  for (size_t w = 0; w < std::max<size_t>(options.workers, 1); w++) {
+    workers.emplace_back(&Daemon::serve, this);
+  }
+  std::cout << "Listening on " << options.socketPath << " with "
+            << workers.size() << " workers" << std::endl;
+
+  pollConnections();
+
+  stop();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+  for (const Connection& connection : ready) {
+    closeConnection(connection.socket);
+  }
+  for (const Connection& connection : idle) {
+    closeConnection(connection.socket);
+  }
+  ready.clear();
+  idle.clear();
+  for (int& end : wakePipe) {
+    ::close(end);
+    end = -1;
+  }
+  ::close(listenSocket);
+  listenSocket = -1;
+  ::unlink(options.socketPath.c_str());
+}
+
+///@brief Stop accepting connections and commands. Workers finish their
+/// current command
+void Daemon::stop() {
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    stopping = true;
+  }
+  if (listenSocket >= 0)
+    ::shutdown(listenSocket, SHUT_RDWR);
+  wake();
+  queueReady.notify_all();
+}
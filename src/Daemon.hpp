@@ -0,0 +1,130 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "CSP.hpp"
+#include "Dataset.hpp"
+#include "Keystore.hpp"
+#include "MessageHandler.hpp"
+#include "PredictionScheduler.hpp"
+#include "Ratings.hpp"
+#include "RecSys.hpp"
+#include "Setup.hpp"
+
+// Long running service holding the SEAL context, the keys from the keystore
+// and a trained RecSys model, so a query pays for the protocol steps only.
+// Clients connect to a Unix socket and send one command per line:
+//   key                     - the CSP's ElGamal public key, hex encoded
+//   upload u i c [u i c..]  - ratings as hex ElGamal ciphertexts c under key
+//   train                   - add the uploads to the model and train further
+//   predict u               - decrypted predictions of user u, item per line
+//   metrics                 - request counts and latencies, traffic and cache
+//   shutdown                - stop accepting and exit once idle
+// Each response starts with "ok <lines>" followed by that many lines, or is a
+// single "error <reason>" line. Uploads are masked and converted to FHE as
+// they arrive, and train folds them into the trained model rather than
+// starting again. A worker of the pool serves one command and hands the
+// connection back, so idle clients hold no worker. Commands wait at most the
+// timeout for the model, which runs one command at a time. Concurrent
+// predict commands are coalesced into batches by a PredictionScheduler
+class Daemon {
+ public:
+  struct Options {
+    std::string socketPath = "../data/pprs.sock";
+    std::string keyDirectory = "../data/keys";
+    size_t workers = 4;             // Threads serving commands
+    int timeoutMs = 30000;          // Socket I/O, idle clients and the model
+    size_t maxLineBytes = 1 << 20;  // Longest command accepted
+    SetupOptions setup;
+    PredictionScheduler::Options scheduler;
+  };
+
+ private:
+  // Per command request counts and latencies
+  struct CommandMetrics {
+    uint64_t requests = 0, errors = 0;
+    double totalMs = 0, maxMs = 0;
+  };
+
+  Options options;
+  std::chrono::steady_clock::time_point startTime;
+
+  // Key material and SEAL objects, in initialisation order
+  Keystore keystore;
+  seal::SEALContext context;
+  seal::SecretKey secretKey;
+  seal::PublicKey publicKey;
+  seal::Encryptor encryptor;
+  seal::Decryptor decryptor;
+  seal::BatchEncoder batchEncoder;
+  std::shared_ptr<MessageHandler> messageHandlerInstance;
+
+  // Model, guarded by modelMutex. Uploads wait in RecSys until the next train
+  std::timed_mutex modelMutex;
+  std::shared_ptr<CSP> CSPInstance;
+  std::unique_ptr<RecSys> recSysInstance;
+  int epochs = 0;
+  // Layout of the predictions, fixed for the life of the daemon
+  size_t predictionDimension;
+  int predictionScaleBits;
+  std::unique_ptr<PredictionScheduler> scheduler;
+
+  // A client connection, with what it has sent past its last command
+  struct Connection {
+    int socket;
+    std::string buffer;
+    std::chrono::steady_clock::time_point idleSince;
+  };
+
+  // Connections with a command waiting for a worker, and idle connections
+  // polled by run until they send one. The wake pipe interrupts the poll when
+  // a connection goes idle or the daemon stops
+  int listenSocket = -1;
+  int wakePipe[2] = {-1, -1};
+  std::atomic<bool> stopping{false};
+  std::mutex queueMutex;
+  std::condition_variable queueReady;
+  std::deque<Connection> ready;
+  std::vector<Connection> idle;
+  std::vector<std::thread> workers;
+
+  std::mutex metricsMutex;
+  std::map<std::string, CommandMetrics> commandMetrics;
+  uint64_t connectionsServed = 0, timeouts = 0;
+
+  void buildModel(const Dataset& data);
+  void serve();
+  bool handleCommand(Connection& connection);
+  void release(Connection connection);
+  void closeConnection(int socket);
+  void pollConnections();
+  void wake();
+  std::vector<std::string> execute(const std::vector<std::string>& command);
+  std::vector<std::string> key();
+  std::vector<std::string> train();
+  std::vector<std::string> upload(const std::vector<std::string>& command);
+  std::vector<std::string> predict(int user);
+  std::vector<std::string> metrics();
+  void recordCommand(const std::string& name, double ms, bool error);
+
+ public:
+  Daemon(const Dataset& initialData, const Options& daemonOptions);
+  ~Daemon();
+  Daemon(const Daemon&) = delete;
+  Daemon& operator=(const Daemon&) = delete;
+
+  void run();
+  void stop();
+};
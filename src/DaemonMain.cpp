@@ -0,0 +1,27 @@
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include "Daemon.hpp"
+#include "Dataset.hpp"
+
+///@param argv - [socket path] [workers] [max lines] [profile dimension],
+/// serving the model trained on the first lines of u1.base as PPRS does
+int main(int argc, char* argv[]) {
+  Daemon::Options options;
+  if (argc > 1)
+    options.socketPath = argv[1];
+  if (argc > 2)
+    options.workers = std::stoul(argv[2]);
+  int maxLines = argc > 3 ? std::stoi(argv[3]) : 1050;
+  options.setup.dimension = argc > 4 ? std::stoul(argv[4]) : 0;
+
+  std::cout << "Reading data" << std::endl;
+  Dataset dataset;
+  if (!dataset.load("../res/u1.base", maxLines, 50))
+    return 1;
+
+  Daemon daemon(dataset, options);
+  daemon.run();
+  std::cout << "Finished" << std::endl;
+  return 0;
+}
@@ -0,0 +1,89 @@
+#include "Dataset.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <tuple>
+
+///@brief Read a MovieLens style (user, item, rating, timestamp) tab separated
+/// file into M and the rating vector
+///@param maxLines - number of lines of the file to read, -1 for all
+///@param skipLines - number of lines to skip at the start of the file
+///@return true if the file could be read
+bool Dataset::load(const std::string& path, int maxLines, int skipLines) {
+  std::set<std::tuple<int, int, int>> data;
+  int curLine = 0;
+  // Use read file stream
+  if (std::ifstream fileReader(path); fileReader.is_open()) {
+    std::string line;
+
+    // Get each line
+    while ((maxLines < 0 || curLine++ < maxLines) &&
+           std::getline(fileReader, line)) {
+      if (skipLines-- < 0) {
+        std::string column;       // Hold current column entry in line
+        int columnIndex = 0;      // Count which column of line we're in
+        int user, movie, rating;  // Variables for output
+
+        // Create a stringstream for current line so we can use getline to split
+        // by delimiter
+        std::stringstream ss;
+        ss.str(line);
+
+        // Separate line by tab delimiter
+        while (std::getline(ss, column, '\t')) {
+          // Assign the entries by column to the correct variable, ignoring the
+          // timestamp and coverting to int
+          if (columnIndex % 4 == 0)
+            user = std::stoi(column);
+          if (columnIndex % 4 == 1)
+            movie = std::stoi(column);
+          if (columnIndex % 4 == 2)
+            rating = std::stoi(column);
+          columnIndex++;
+        }
+
+        // Push current line to our set
+        data.insert(std::make_tuple(user, movie, rating));
+      }
+    }
+    fileReader.close();
+  } else {
+    std::cout << "Could not open file " << path << std::endl;
+    return false;
+  }
+
+  // Populate M and rating vectors
+  M.clear();
+  ratings.clear();
+  for (auto [user, movie, rating] : data) {
+    M.push_back(std::make_pair(user, movie));
+    ratings.push_back(rating);
+  }
+  return true;
+}
+
+///@brief Keep count entries chosen uniformly with a seeded generator, staying
+/// sorted by user and then item
+void Dataset::sample(size_t count, uint64_t seed) {
+  if (count >= M.size())
+    return;
+  std::vector<size_t> indices(M.size());
+  std::iota(indices.begin(), indices.end(), 0);
+  std::mt19937_64 gen(seed);
+  std::shuffle(indices.begin(), indices.end(), gen);
+  indices.resize(count);
+  std::sort(indices.begin(), indices.end());
+
+  std::vector<std::pair<int, int>> sampledM;
+  std::vector<int> sampledRatings;
+  for (size_t i : indices) {
+    sampledM.push_back(M[i]);
+    sampledRatings.push_back(ratings[i]);
+  }
+  M = sampledM;
+  ratings = sampledRatings;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Dataset {
+ public:
+  // Rating space (user, item), sorted by user and then item, and the rating of
+  // each entry
+  std::vector<std::pair<int, int>> M;
+  std::vector<int> ratings;
+
+  bool load(const std::string& path, int maxLines, int skipLines);
+  void sample(size_t count, uint64_t seed);
+  size_t size() const { return M.size(); }
+};
@@ -0,0 +1,100 @@
+#include "EncryptionPool.hpp"
+
+EncryptionPool::EncryptionPool(const seal::SEALContext& context,
+                               const seal::PublicKey& publicKey,
+                               const seal::SecretKey& secretKey,
+                               const Options& poolOptions)
+    : encryptor(context, publicKey, secretKey),
+      evaluator(context),
+      options(poolOptions) {
+  if (options.depth == 0)
+    return;
+  for (size_t t = 0; t < options.threads; t++) {
+    workers.emplace_back(&EncryptionPool::fill, this);
+  }
+}
+
+EncryptionPool::~EncryptionPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  refill.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+///@brief A new encryption of zero, with the secret key when symmetric. This
+/// skips the product with the public key and adds less noise
+void EncryptionPool::freshZero(seal::Ciphertext& out) const {
+  if (options.symmetric)
+    encryptor.encrypt_zero_symmetric(out);
+  else
+    encryptor.encrypt_zero(out);
+}
+
+///@brief Take a pooled encryption of zero, waking a thread to replace it
+///@return false if the pool is empty
+bool EncryptionPool::take(seal::Ciphertext& out) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (pool.empty()) {
+    metrics.misses++;
+    return false;
+  }
+  out = std::move(pool.front());
+  pool.pop_front();
+  metrics.hits++;
+  lock.unlock();
+  refill.notify_one();
+  return true;
+}
+
+///@brief Background thread - keep the pool at its depth until destruction
+void EncryptionPool::fill() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      refill.wait(lock,
+                  [this] { return stopping || pool.size() < options.depth; });
+      if (stopping)
+        return;
+    }
+
+    seal::Ciphertext zero;
+    freshZero(zero);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    pool.push_back(std::move(zero));
+    metrics.generated++;
+  }
+}
+
+///@brief Encrypt plain. A fresh encryption is an encryption of zero plus the
+/// plaintext, so adding plain onto a pooled one gives the same ciphertext
+/// distribution. A zero is one at any scale, so it takes that of a CKKS plain
+void EncryptionPool::encrypt(const seal::Plaintext& plain,
+                             seal::Ciphertext& out) {
+  if (!take(out)) {
+    if (options.symmetric)
+      encryptor.encrypt_symmetric(plain, out);
+    else
+      encryptor.encrypt(plain, out);
+    return;
+  }
+  out.scale() = plain.scale();
+  evaluator.add_plain_inplace(out, plain);
+}
+
+///@brief An encryption of zero, from the pool when one is ready
+void EncryptionPool::encryptZero(seal::Ciphertext& out) {
+  if (!take(out))
+    freshZero(out);
+}
+
+EncryptionPool::Metrics EncryptionPool::getMetrics() {
+  std::lock_guard<std::mutex> lock(mutex);
+  Metrics current = metrics;
+  current.available = pool.size();
+  return current;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Encryptions of zero made ahead of time by background threads, so that the
+// CSP re-encrypts a result with an encode and a plaintext add onto a pooled
+// ciphertext rather than a full encryption. The threads refill the pool to
+// its depth whenever it runs low, which is mostly while the CSP waits between
+// protocol steps. When the pool is empty the encryption is done inline.
+// Pooled ciphertexts are taken in thread order, so replay digests only match
+// with a depth of 0
+class EncryptionPool {
+ public:
+  struct Options {
+    size_t depth = 0;       // Encryptions of zero kept ready, 0 for none
+    size_t threads = 1;     // Background threads refilling the pool
+    bool symmetric = true;  // Encrypt with the secret key the CSP holds
+  };
+
+  struct Metrics {
+    uint64_t hits = 0, misses = 0;  // Encryptions served from the pool or not
+    uint64_t generated = 0;         // Encryptions of zero made by the threads
+    size_t available = 0;           // In the pool now
+  };
+
+ private:
+  seal::Encryptor encryptor;
+  seal::Evaluator evaluator;
+  Options options;
+
+  std::mutex mutex;
+  std::condition_variable refill;
+  std::deque<seal::Ciphertext> pool;
+  Metrics metrics;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  void freshZero(seal::Ciphertext& out) const;
+  bool take(seal::Ciphertext& out);
+  void fill();
+
+ public:
+  EncryptionPool(const seal::SEALContext& context,
+                 const seal::PublicKey& publicKey,
+                 const seal::SecretKey& secretKey,
+                 const Options& poolOptions);
+  ~EncryptionPool();
+  EncryptionPool(const EncryptionPool&) = delete;
+  EncryptionPool& operator=(const EncryptionPool&) = delete;
+
+  void encrypt(const seal::Plaintext& plain, seal::Ciphertext& out);
+  void encryptZero(seal::Ciphertext& out);
+  Metrics getMetrics();
+};
@@ -0,0 +1,325 @@
+#include "FHEScheme.hpp"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include "Setup.hpp"
+
+///@brief The scheme of a context's parameters, BGV or CKKS
+std::shared_ptr<FHEScheme> FHEScheme::create(const seal::SEALContext& context) {
+  switch (context.first_context_data()->parms().scheme()) {
+    case seal::scheme_type::bgv:
+      return std::make_shared<BGVScheme>(context);
+    case seal::scheme_type::ckks:
+      return std::make_shared<CKKSScheme>(context);
+    default:
+      throw std::invalid_argument("FHEScheme: only BGV and CKKS are supported");
+  }
+}
+
+BGVScheme::BGVScheme(const seal::SEALContext& sealContext)
+    : context(sealContext), evaluator(sealContext), encoder(sealContext) {
+  slots = encoder.slot_count();
+  const seal::Modulus& modulus =
+      context.first_context_data()->parms().plain_modulus();
+  plainModulus = modulus.value();
+  plainModulusBits = modulus.bit_count();
+  if (plainModulus <= 4 * (1ULL << Encoding::maskedValueBits))
+    throw std::invalid_argument(
+        "BGVScheme: plain modulus leaves no room for masks");
+}
+
+void BGVScheme::encode(const std::vector<uint64_t>& slotWords,
+                       seal::Plaintext& plain) const {
+  encoder.encode(slotWords, plain);
+}
+
+///@brief BGV plaintexts have no scale, so like is not needed
+void BGVScheme::encode(const std::vector<uint64_t>& slotWords,
+                       const seal::Ciphertext&,
+                       seal::Plaintext& plain) const {
+  encoder.encode(slotWords, plain);
+}
+
+void BGVScheme::decode(const seal::Plaintext& plain,
+                       std::vector<uint64_t>& slotWords) const {
+  encoder.decode(plain, slotWords);
+}
+
+/// @brief a + b modulo the plain modulus, for slots already below it
+uint64_t BGVScheme::add(uint64_t a, uint64_t b) const {
+  uint64_t sum = a + b;
+  return sum >= plainModulus ? sum - plainModulus : sum;
+}
+
+///@brief The masked slots never wrap, so their sum is exact before the
+/// rescale
+uint64_t BGVScheme::sum(const uint64_t* slotWords,
+                        size_t count,
+                        int bits) const {
+  unsigned __int128 total = 0;
+  for (size_t j = 0; j < count; j++) {
+    total += slotWords[j];
+  }
+  return static_cast<uint64_t>((total >> bits) % plainModulus);
+}
+
+void BGVScheme::rescale(std::vector<uint64_t>& slotWords, int bits) const {
+  Encoding::rescale(slotWords, bits);
+}
+
+///@brief value * 2^bits, truncated towards zero as Encoding::encode
+uint64_t BGVScheme::fromReal(double value, int bits) const {
+  return static_cast<uint64_t>(value * std::ldexp(1.0, bits));
+}
+
+uint64_t BGVScheme::fromInteger(uint64_t value) const {
+  return value % plainModulus;
+}
+
+///@brief The mask is a multiple of 2^bits, so the CSP's rescale leaves
+/// mask >> bits
+std::vector<uint64_t> BGVScheme::maskFromSeed(uint64_t seed,
+                                              size_t count,
+                                              int bits) const {
+  std::vector<uint64_t> maskVector(slots, 0ULL);
+  addMaskFromSeed(seed, count, maskVector, bits);
+  for (size_t i = 0; i < count; i++) {
+    maskVector[i] <<= bits;
+  }
+  return maskVector;
+}
+
+void BGVScheme::addMaskFromSeed(uint64_t seed,
+                                size_t count,
+                                std::vector<uint64_t>& sum,
+                                int bits) const {
+  const uint64_t margin = 1ULL << Encoding::maskedValueBits;
+  std::mt19937_64 maskGen(seed);
+  std::uniform_int_distribution<uint64_t> maskDistr(
+      margin >> bits, (plainModulus - margin - 1) >> bits);
+  for (size_t i = 0; i < count; i++) {
+    sum[i] = (sum[i] + maskDistr(maskGen)) % plainModulus;
+  }
+}
+
+///@brief The constant in every slot, encoded on first use
+const seal::Plaintext& BGVScheme::constant(double value, int bits) {
+  std::lock_guard<std::mutex> lock(constantsMutex);
+  auto found = constantPlains.find({value, bits});
+  if (found == constantPlains.end()) {
+    found = constantPlains.emplace(std::make_pair(value, bits),
+                                   seal::Plaintext())
+                .first;
+    encoder.encode(std::vector<uint64_t>(slots, fromReal(value, bits)),
+                   found->second);
+  }
+  return found->second;
+}
+
+void BGVScheme::multiplyConstant(const seal::Ciphertext& in,
+                                 double value,
+                                 int bits,
+                                 seal::Ciphertext& out) {
+  evaluator.multiply_plain(in, constant(value, bits), out);
+}
+
+///@brief The fixed-point bits of value already give out the bits of like
+void BGVScheme::multiplyConstant(const seal::Ciphertext& in,
+                                 double value,
+                                 int bits,
+                                 const seal::Ciphertext&,
+                                 seal::Ciphertext& out) {
+  multiplyConstant(in, value, bits, out);
+}
+
+///@brief Powers of two up to a quarter of the slots for the row rotations,
+/// and 0 for the column swap
+std::vector<int> BGVScheme::slotSumRotationSteps() const {
+  std::vector<int> steps;
+  for (size_t step = 1; step < slots / 2; step <<= 1) {
+    steps.push_back(static_cast<int>(step));
+  }
+  steps.push_back(0);
+  return steps;
+}
+
+///@brief Rotate and add along the rows in log(width) steps, then add the
+/// swapped rows when summing every slot
+void BGVScheme::sumSlots(const seal::Ciphertext& in,
+                         seal::Ciphertext& out,
+                         size_t width,
+                         const seal::RelinKeys& relinKeys,
+                         const seal::GaloisKeys& galoisKeys) const {
+  out = in;
+  // Rotations need a size 2 ciphertext
+  if (out.size() > 2)
+    evaluator.relinearize_inplace(out, relinKeys);
+
+  seal::Ciphertext rotated;
+  for (size_t step = 1; step < std::min(width, slots / 2); step <<= 1) {
+    evaluator.rotate_rows(out, static_cast<int>(step), galoisKeys, rotated);
+    evaluator.add_inplace(out, rotated);
+  }
+  if (width < slots)
+    return;
+  evaluator.rotate_columns(out, galoisKeys, rotated);
+  evaluator.add_inplace(out, rotated);
+}
+
+///@brief U' carries 2^(3alpha+beta) when training keeps the extra 2^alpha,
+/// which must fit below the mask margin of the plain modulus
+bool BGVScheme::slotSumTrainingFits() const {
+  return Encoding::slotSumTrainingFits &&
+         3 * Encoding::alpha + Encoding::beta < plainModulusBits - 3;
+}
+
+///@brief A slot sum keeps the 2^alpha the CSP would have removed
+int BGVScheme::predictionScaleBits(bool slotSum) const {
+  return slotSum ? 2 * Encoding::alpha : Encoding::alpha;
+}
+
+std::vector<seal::Plaintext> BGVScheme::constants() const {
+  std::lock_guard<std::mutex> lock(constantsMutex);
+  std::vector<seal::Plaintext> plains;
+  for (const auto& [key, plain] : constantPlains) {
+    plains.push_back(plain);
+  }
+  return plains;
+}
+
+CKKSScheme::CKKSScheme(const seal::SEALContext& sealContext)
+    : context(sealContext), evaluator(sealContext), encoder(sealContext) {
+  slots = encoder.slot_count();
+  scale = std::ldexp(1.0, ckksScaleBits);
+  // U' and its masks, summed over a row, below half the modulus
+  int maskedPrimeBits = 2 * ckksScaleBits + ProtocolFixedPoint::beta +
+                        maskBits + 1 + maskSumBits;
+  if (maskedPrimeBits >=
+      context.first_context_data()->total_coeff_modulus_bit_count())
+    throw std::invalid_argument(
+        "CKKSScheme: coefficient modulus cannot hold masked U'");
+}
+
+///@brief Words as reals at a given level and scale
+void CKKSScheme::encodeWords(const std::vector<uint64_t>& slotWords,
+                             seal::parms_id_type parmsId,
+                             double wordScale,
+                             seal::Plaintext& plain) const {
+  std::vector<double> values(slots, 0.0);
+  for (size_t i = 0; i < slotWords.size() && i < slots; i++) {
+    values[i] = std::ldexp(static_cast<double>(
+                               static_cast<int64_t>(slotWords[i])),
+                           -fractionalBits);
+  }
+  encoder.encode(values, parmsId, wordScale, plain);
+}
+
+///@brief Top level and the fresh scale, as the CSP encrypts
+void CKKSScheme::encode(const std::vector<uint64_t>& slotWords,
+                        seal::Plaintext& plain) const {
+  encodeWords(slotWords, context.first_parms_id(), scale, plain);
+}
+
+void CKKSScheme::encode(const std::vector<uint64_t>& slotWords,
+                        const seal::Ciphertext& like,
+                        seal::Plaintext& plain) const {
+  encodeWords(slotWords, like.parms_id(), like.scale(), plain);
+}
+
+///@brief The decoder divides by the scale of the plaintext, whatever
+/// products it carries, so the words are the real values
+void CKKSScheme::decode(const seal::Plaintext& plain,
+                        std::vector<uint64_t>& slotWords) const {
+  std::vector<double> values;
+  encoder.decode(plain, values);
+  slotWords.resize(values.size());
+  for (size_t i = 0; i < values.size(); i++) {
+    slotWords[i] = fromReal(values[i], 0);
+  }
+}
+
+///@brief Wrapping sum. The real values are already unscaled, so there are
+/// no bits to remove
+uint64_t CKKSScheme::sum(const uint64_t* slotWords, size_t count, int) const {
+  uint64_t total = 0;
+  for (size_t j = 0; j < count; j++) {
+    total += slotWords[j];
+  }
+  return total;
+}
+
+uint64_t CKKSScheme::fromReal(double value, int) const {
+  return static_cast<uint64_t>(std::llround(std::ldexp(value, fractionalBits)));
+}
+
+uint64_t CKKSScheme::fromInteger(uint64_t value) const {
+  return value << fractionalBits;
+}
+
+std::vector<uint64_t> CKKSScheme::maskFromSeed(uint64_t seed,
+                                               size_t count,
+                                               int bits) const {
+  std::vector<uint64_t> maskVector(slots, 0ULL);
+  addMaskFromSeed(seed, count, maskVector, bits);
+  return maskVector;
+}
+
+void CKKSScheme::addMaskFromSeed(uint64_t seed,
+                                 size_t count,
+                                 std::vector<uint64_t>& sum,
+                                 int) const {
+  std::mt19937_64 maskGen(seed);
+  std::uniform_int_distribution<uint64_t> maskDistr(
+      1ULL << (fractionalBits + maskBits),
+      (2ULL << (fractionalBits + maskBits)) - 1);
+  for (size_t i = 0; i < count; i++) {
+    sum[i] += maskDistr(maskGen);
+  }
+}
+
+void CKKSScheme::multiplyConstant(const seal::Ciphertext& in,
+                                  double value,
+                                  int bits,
+                                  seal::Ciphertext& out) {
+  seal::Plaintext valuePlain;
+  encoder.encode(value, in.parms_id(), std::ldexp(1.0, bits), valuePlain);
+  evaluator.multiply_plain(in, valuePlain, out);
+}
+
+void CKKSScheme::multiplyConstant(const seal::Ciphertext& in,
+                                  double value,
+                                  int,
+                                  const seal::Ciphertext& like,
+                                  seal::Ciphertext& out) {
+  seal::Plaintext valuePlain;
+  encoder.encode(value, in.parms_id(), like.scale() / in.scale(), valuePlain);
+  evaluator.multiply_plain(in, valuePlain, out);
+}
+
+///@brief Powers of two below the slot count, for rotate_vector
+std::vector<int> CKKSScheme::slotSumRotationSteps() const {
+  std::vector<int> steps;
+  for (size_t step = 1; step < slots; step <<= 1) {
+    steps.push_back(static_cast<int>(step));
+  }
+  return steps;
+}
+
+///@brief Rotate and add over the whole vector in log(width) steps, as CKKS
+/// slots form a single row
+void CKKSScheme::sumSlots(const seal::Ciphertext& in,
+                          seal::Ciphertext& out,
+                          size_t width,
+                          const seal::RelinKeys& relinKeys,
+                          const seal::GaloisKeys& galoisKeys) const {
+  out = in;
+  if (out.size() > 2)
+    evaluator.relinearize_inplace(out, relinKeys);
+
+  seal::Ciphertext rotated;
+  for (size_t step = 1; step < std::min(width, slots); step <<= 1) {
+    evaluator.rotate_vector(out, static_cast<int>(step), galoisKeys, rotated);
+    evaluator.add_inplace(out, rotated);
+  }
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "FixedPoint.hpp"
+
+// The parts of the protocol which depend on the FHE scheme - encoding,
+// rescaling and summing slots - so RecSys and the CSP run one engine on BGV
+// and on CKKS. The CSP handles decoded slots as 64 bit words: BGV slots
+// modulo the plain modulus, whose fixed-point bits it removes by shifting,
+// and CKKS real slots as two's complement integers with fractionalBits
+// fractional bits, summed with wrapping arithmetic. RecSys never rescales a
+// CKKS ciphertext, so a product carries in its scale what BGV carries in
+// fixed-point bits, and the CSP's decode divides it out. Constants are
+// encoded to match the ciphertext their product is added to, and every
+// ciphertext stays at the top level. Masks are drawn from a seed as words
+class FHEScheme {
+ public:
+  virtual ~FHEScheme() = default;
+  static std::shared_ptr<FHEScheme> create(const seal::SEALContext& context);
+
+  virtual bool isCKKS() const = 0;
+  virtual size_t slotCount() const = 0;
+  // Scale of the CSP's encryptions, 1 for BGV
+  virtual double freshScale() const = 0;
+
+  // Slot words, encoded for encryption or at the scale of like to be added to
+  // or subtracted from it
+  virtual void encode(const std::vector<uint64_t>& slots,
+                      seal::Plaintext& plain) const = 0;
+  virtual void encode(const std::vector<uint64_t>& slots,
+                      const seal::Ciphertext& like,
+                      seal::Plaintext& plain) const = 0;
+  virtual void decode(const seal::Plaintext& plain,
+                      std::vector<uint64_t>& slots) const = 0;
+
+  // Arithmetic on slot words. sum adds count words and removes bits
+  // fractional bits, rescale removes them from every slot
+  virtual uint64_t add(uint64_t a, uint64_t b) const = 0;
+  virtual uint64_t sum(const uint64_t* slots, size_t count, int bits) const = 0;
+  virtual void rescale(std::vector<uint64_t>& slots, int bits) const = 0;
+  virtual uint64_t fromReal(double value, int bits) const = 0;
+  virtual uint64_t fromInteger(uint64_t value) const = 0;
+
+  // The mask of a seed over the first slots slots, as added and as it is once
+  // the CSP has removed bits fractional bits
+  virtual std::vector<uint64_t> maskFromSeed(uint64_t seed,
+                                             size_t slots,
+                                             int bits) const = 0;
+  virtual void addMaskFromSeed(uint64_t seed,
+                               size_t slots,
+                               std::vector<uint64_t>& sum,
+                               int bits) const = 0;
+
+  // out = in * value, value with bits fractional bits. Given like, CKKS
+  // encodes value so that out has the scale of like instead
+  virtual void multiplyConstant(const seal::Ciphertext& in,
+                                double value,
+                                int bits,
+                                seal::Ciphertext& out) = 0;
+  virtual void multiplyConstant(const seal::Ciphertext& in,
+                                double value,
+                                int bits,
+                                const seal::Ciphertext& like,
+                                seal::Ciphertext& out) = 0;
+
+  // Slot summation with rotations, see RecSys::sumSlots
+  virtual std::vector<int> slotSumRotationSteps() const = 0;
+  virtual void sumSlots(const seal::Ciphertext& in,
+                        seal::Ciphertext& out,
+                        size_t width,
+                        const seal::RelinKeys& relinKeys,
+                        const seal::GaloisKeys& galoisKeys) const = 0;
+  // Whether training can keep the extra 2^alpha of a slot sum until Step 8
+  virtual bool slotSumTrainingFits() const = 0;
+  // Fractional bits of the predictions, 0 when they decode to real values
+  virtual int predictionScaleBits(bool slotSum) const = 0;
+  // Encoded constants held for multiplyConstant
+  virtual std::vector<seal::Plaintext> constants() const { return {}; }
+};
+
+// Exact fixed-point arithmetic modulo the plain modulus, see FixedPoint. Each
+// mask slot is uniform over the plain modulus less the margin of
+// Encoding::maskedValueBits at either end, so masked slots never wrap
+class BGVScheme : public FHEScheme {
+  using Encoding = ProtocolFixedPoint;
+
+  seal::SEALContext context;
+  seal::Evaluator evaluator;
+  seal::BatchEncoder encoder;
+  size_t slots;
+  uint64_t plainModulus;
+  int plainModulusBits;
+
+  // Constants encoded in every slot, by value and bits
+  mutable std::mutex constantsMutex;
+  std::map<std::pair<double, int>, seal::Plaintext> constantPlains;
+  const seal::Plaintext& constant(double value, int bits);
+
+ public:
+  explicit BGVScheme(const seal::SEALContext& sealContext);
+
+  bool isCKKS() const override { return false; }
+  size_t slotCount() const override { return slots; }
+  double freshScale() const override { return 1.0; }
+  void encode(const std::vector<uint64_t>& slotWords,
+              seal::Plaintext& plain) const override;
+  void encode(const std::vector<uint64_t>& slotWords,
+              const seal::Ciphertext& like,
+              seal::Plaintext& plain) const override;
+  void decode(const seal::Plaintext& plain,
+              std::vector<uint64_t>& slotWords) const override;
+  uint64_t add(uint64_t a, uint64_t b) const override;
+  uint64_t sum(const uint64_t* slotWords,
+               size_t count,
+               int bits) const override;
+  void rescale(std::vector<uint64_t>& slotWords, int bits) const override;
+  uint64_t fromReal(double value, int bits) const override;
+  uint64_t fromInteger(uint64_t value) const override;
+  std::vector<uint64_t> maskFromSeed(uint64_t seed,
+                                     size_t count,
+                                     int bits) const override;
+  void addMaskFromSeed(uint64_t seed,
+                       size_t count,
+                       std::vector<uint64_t>& sum,
+                       int bits) const override;
+  void multiplyConstant(const seal::Ciphertext& in,
+                        double value,
+                        int bits,
+                        seal::Ciphertext& out) override;
+  void multiplyConstant(const seal::Ciphertext& in,
+                        double value,
+                        int bits,
+                        const seal::Ciphertext& like,
+                        seal::Ciphertext& out) override;
+  std::vector<int> slotSumRotationSteps() const override;
+  void sumSlots(const seal::Ciphertext& in,
+                seal::Ciphertext& out,
+                size_t width,
+                const seal::RelinKeys& relinKeys,
+                const seal::GaloisKeys& galoisKeys) const override;
+  bool slotSumTrainingFits() const override;
+  int predictionScaleBits(bool slotSum) const override;
+  std::vector<seal::Plaintext> constants() const override;
+};
+
+// Approximate real arithmetic. Fresh encryptions have scale 2^ckksScaleBits
+// and products are never rescaled, so an epoch's largest scale, that of U',
+// is 2^(2 ckksScaleBits + beta). Masks are uniform in [2^maskBits,
+// 2^(maskBits+1)), so they hide values statistically rather than perfectly
+// as the BGV masks do, and masked squares stay positive for the CSP's
+// threshold comparison. A masked value v is within statistical distance
+// |v| / 2^maskBits of its mask: 20 bits of security for the ratings,
+// profiles and predictions below 2^8, less log2(k) bits over k epochs that
+// mask the same value. The CSP sums up to 2^maskSumBits masked words, a
+// profile's slots or a row's entries, which must fit in a word and, for U',
+// in the coefficient modulus with its scale. That caps maskBits, and masks
+// below 2^minMaskBits are refused
+class CKKSScheme : public FHEScheme {
+  static constexpr int fractionalBits = 20;
+  static constexpr int maskBits = 28;
+  static constexpr int minMaskBits = 24;
+  static constexpr int maskSumBits = 14;
+  static_assert(maskBits >= minMaskBits,
+                "CKKSScheme: masks below 2^24 leave less than 16 bits of "
+                "statistical security for values below 2^8");
+  static_assert(fractionalBits + maskBits + 1 + maskSumBits <= 63,
+                "CKKSScheme: sums of masked words overflow 64 bits");
+
+  seal::SEALContext context;
+  seal::Evaluator evaluator;
+  seal::CKKSEncoder encoder;
+  size_t slots;
+  double scale;
+
+  void encodeWords(const std::vector<uint64_t>& slotWords,
+                   seal::parms_id_type parmsId,
+                   double wordScale,
+                   seal::Plaintext& plain) const;
+
+ public:
+  explicit CKKSScheme(const seal::SEALContext& sealContext);
+
+  bool isCKKS() const override { return true; }
+  size_t slotCount() const override { return slots; }
+  double freshScale() const override { return scale; }
+  void encode(const std::vector<uint64_t>& slotWords,
+              seal::Plaintext& plain) const override;
+  void encode(const std::vector<uint64_t>& slotWords,
+              const seal::Ciphertext& like,
+              seal::Plaintext& plain) const override;
+  void decode(const seal::Plaintext& plain,
+              std::vector<uint64_t>& slotWords) const override;
+  uint64_t add(uint64_t a, uint64_t b) const override { return a + b; }
+  uint64_t sum(const uint64_t* slotWords,
+               size_t count,
+               int bits) const override;
+  void rescale(std::vector<uint64_t>&, int) const override {}
+  uint64_t fromReal(double value, int bits) const override;
+  uint64_t fromInteger(uint64_t value) const override;
+  std::vector<uint64_t> maskFromSeed(uint64_t seed,
+                                     size_t count,
+                                     int bits) const override;
+  void addMaskFromSeed(uint64_t seed,
+                       size_t count,
+                       std::vector<uint64_t>& sum,
+                       int bits) const override;
+  void multiplyConstant(const seal::Ciphertext& in,
+                        double value,
+                        int bits,
+                        seal::Ciphertext& out) override;
+  void multiplyConstant(const seal::Ciphertext& in,
+                        double value,
+                        int bits,
+                        const seal::Ciphertext& like,
+                        seal::Ciphertext& out) override;
+  std::vector<int> slotSumRotationSteps() const override;
+  void sumSlots(const seal::Ciphertext& in,
+                seal::Ciphertext& out,
+                size_t width,
+                const seal::RelinKeys& relinKeys,
+                const seal::GaloisKeys& galoisKeys) const override;
+  bool slotSumTrainingFits() const override { return false; }
+  int predictionScaleBits(bool) const override { return 0; }
+};
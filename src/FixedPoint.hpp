@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Bits of the BGV plain modulus, see defaultEncryptionParameters
+constexpr int defaultPlainModulusBits = 60;
+
+// Fixed-point encoding of real numbers in the plaintext slots, shared by RecSys
+// and the CSP. A real x is held as x * 2^bits, profiles with Alpha bits and
+// the gain factor with Beta bits. The scale factors are compile time
+// constants, and scales which would overflow the plain modulus fail to compile.
+// Step 6 takes gamma * 2^beta times a gradient with 2alpha bits, so U' and V'
+// carry 2alpha+beta bits until the CSP's Step 8 rescale
+template <int Alpha, int Beta, int PlainModulusBits = defaultPlainModulusBits>
+struct FixedPoint {
+  static_assert(Alpha > 0 && Beta > 0, "Fixed-point scales must be positive");
+  static_assert(PlainModulusBits < 64, "Plain modulus must fit in 64 bits");
+
+  static constexpr int alpha = Alpha;
+  static constexpr int beta = Beta;
+  static constexpr int plainModulusBits = PlainModulusBits;
+  static constexpr uint64_t twoToTheAlpha = 1ULL << Alpha;
+  static constexpr uint64_t twoToTheBeta = 1ULL << Beta;
+  static constexpr uint64_t twoToTheAlphaPlusBeta = 1ULL << (Alpha + Beta);
+
+  // Values masked for the CSP are below 2^maskedValueBits in magnitude. Masks
+  // leave that margin at both ends of the plain modulus, so a masked slot
+  // never wraps and the CSP can sum and rescale it as an integer
+  static constexpr int maskedValueBits = PlainModulusBits - 3;
+  static_assert(2 * Alpha + Beta < maskedValueBits,
+                "2^(2alpha+beta) of U' does not fit below the mask margin");
+
+  // Training with slot summation carries an extra 2^alpha into Step 6, so U'
+  // then has 3alpha+beta bits
+  static constexpr bool slotSumTrainingFits =
+      3 * Alpha + Beta < maskedValueBits;
+  static constexpr uint64_t twoToTheTwoAlphaPlusBeta =
+      slotSumTrainingFits ? 1ULL << (2 * Alpha + Beta) : 0;
+
+  ///@brief value * 2^Bits, truncated towards zero
+  template <int Bits>
+  static constexpr uint64_t encode(double value) {
+    static_assert(Bits >= 0 && Bits < PlainModulusBits,
+                  "Scale does not fit in the plain modulus");
+    return static_cast<uint64_t>(value * static_cast<double>(1ULL << Bits));
+  }
+
+  ///@brief Remove Bits fractional bits from every slot
+  template <int Bits>
+  static void rescale(std::vector<uint64_t>& values) {
+    static_assert(Bits >= 0 && Bits < 64, "Shift out of range");
+    for (uint64_t& value : values) {
+      value >>= Bits;
+    }
+  }
+
+  ///@brief Remove bits fractional bits from every slot, using the compile time
+  /// kernels for the rescales the protocol uses
+  static void rescale(std::vector<uint64_t>& values, int bits) {
+    if (bits == Alpha) {
+      rescale<Alpha>(values);
+    } else if (bits == 2 * Alpha) {
+      rescale<2 * Alpha>(values);
+    } else {
+      for (uint64_t& value : values) {
+        value >>= bits;
+      }
+    }
+  }
+};
+
+// Encoding used by the protocol. U' holds 2^36 times its value, or 2^48 with
+// slot summation, leaving 21 or 9 integer bits below the mask margin
+using ProtocolFixedPoint = FixedPoint<12, 12>;
@@ -0,0 +1,248 @@
+#include "Keystore.hpp"
+#include <cryptopp/filters.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+// A key file mapped read only for the lifetime of the object
+class MappedFile {
+  void* data = MAP_FAILED;
+  size_t length = 0;
+
+ public:
+  explicit MappedFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Keystore: cannot open " + path);
+    struct stat status;
+    if (::fstat(fd, &status) == 0 && status.st_size > 0) {
+      length = static_cast<size_t>(status.st_size);
+      data = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (data == MAP_FAILED)
+      throw std::runtime_error("Keystore: cannot map " + path);
+  }
+  ~MappedFile() { ::munmap(data, length); }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const std::byte* bytes() const {
+    return static_cast<const std::byte*>(data);
+  }
+  size_t size() const { return length; }
+};
+
+///@brief Write to a temporary file and rename it into place, so a key file is
+/// either complete or absent
+void writeFile(const std::string& path,
+               const void* data,
+               size_t size,
+               bool secret) {
+  std::string temporary = path + ".tmp";
+  int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                  secret ? 0600 : 0644);
+  if (fd < 0)
+    throw std::runtime_error("Keystore: cannot create " + temporary);
+  const char* position = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t written = ::write(fd, position, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      ::close(fd);
+      throw std::runtime_error("Keystore: failed to write " + temporary);
+    }
+    position += written;
+    size -= static_cast<size_t>(written);
+  }
+  ::close(fd);
+  if (std::rename(temporary.c_str(), path.c_str()) != 0)
+    throw std::runtime_error("Keystore: cannot rename " + temporary);
+}
+
+///@brief Save a SEAL object uncompressed, so loading it is a copy
+template <class T>
+void saveSEAL(const T& object, const std::string& path, bool secret) {
+  std::vector<std::byte> buffer(
+      static_cast<size_t>(object.save_size(seal::compr_mode_type::none)));
+  size_t size = static_cast<size_t>(object.save(
+      buffer.data(), buffer.size(), seal::compr_mode_type::none));
+  writeFile(path, buffer.data(), size, secret);
+}
+
+double msSince(std::chrono::high_resolution_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::high_resolution_clock::now() - start)
+      .count();
+}
+}  // namespace
+
+///@param keyDirectory - created if it does not exist
+Keystore::Keystore(const std::string& keyDirectory) : directory(keyDirectory) {
+  if (::mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST)
+    throw std::runtime_error("Keystore: cannot create " + directory);
+}
+
+std::string Keystore::path(const std::string& name) const {
+  return directory + "/" + name;
+}
+
+void Keystore::record(const std::string& step, double ms) {
+  timings.emplace_back(step, ms);
+}
+
+bool Keystore::has(const std::string& name) const {
+  return ::access(path(name).c_str(), R_OK) == 0;
+}
+
+///@brief The stored encryption parameters, or those from create the first
+/// time. Keys in the store are only valid for the stored parameters
+seal::EncryptionParameters Keystore::getParameters(
+    const std::function<seal::EncryptionParameters()>& create) {
+  auto start = std::chrono::high_resolution_clock::now();
+  seal::EncryptionParameters parms;
+  if (has("parms")) {
+    MappedFile file(path("parms"));
+    parms.load(file.bytes(), file.size());
+    record("parameters loaded", msSince(start));
+  } else {
+    parms = create();
+    saveSEAL(parms, path("parms"), false);
+    record("parameters created", msSince(start));
+  }
+  return parms;
+}
+
+seal::SecretKey Keystore::getSecretKey(const seal::SEALContext& context) {
+  auto start = std::chrono::high_resolution_clock::now();
+  seal::SecretKey secretKey;
+  if (has("seckey")) {
+    MappedFile file(path("seckey"));
+    secretKey.load(context, file.bytes(), file.size());
+    record("secret key loaded", msSince(start));
+  } else {
+    seal::KeyGenerator keygen(context);
+    secretKey = keygen.secret_key();
+    saveSEAL(secretKey, path("seckey"), true);
+    record("secret key generated", msSince(start));
+  }
+  return secretKey;
+}
+
+seal::PublicKey Keystore::getPublicKey(const seal::SEALContext& context,
+                                       const seal::SecretKey& secretKey) {
+  auto start = std::chrono::high_resolution_clock::now();
+  seal::PublicKey publicKey;
+  if (has("pubkey")) {
+    MappedFile file(path("pubkey"));
+    publicKey.load(context, file.bytes(), file.size());
+    record("public key loaded", msSince(start));
+  } else {
+    seal::KeyGenerator keygen(context, secretKey);
+    keygen.create_public_key(publicKey);
+    saveSEAL(publicKey, path("pubkey"), false);
+    record("public key generated", msSince(start));
+  }
+  return publicKey;
+}
+
+///@brief Relinearization keys, read on the first call only
+const seal::RelinKeys& Keystore::getRelinKeys(
+    const seal::SEALContext& context,
+    const seal::SecretKey& secretKey) {
+  if (relinKeys)
+    return *relinKeys;
+  auto start = std::chrono::high_resolution_clock::now();
+  relinKeys = std::make_shared<seal::RelinKeys>();
+  if (has("relinkeys")) {
+    MappedFile file(path("relinkeys"));
+    relinKeys->load(context, file.bytes(), file.size());
+    record("relinearization keys loaded", msSince(start));
+  } else {
+    seal::KeyGenerator keygen(context, secretKey);
+    keygen.create_relin_keys(*relinKeys);
+    saveSEAL(*relinKeys, path("relinkeys"), false);
+    record("relinearization keys generated", msSince(start));
+  }
+  return *relinKeys;
+}
+
+///@brief Galois keys for the given rotation steps, read on the first call
+/// for those steps only. Each set of steps has its own file
+const seal::GaloisKeys& Keystore::getGaloisKeys(
+    const seal::SEALContext& context,
+    const seal::SecretKey& secretKey,
+    const std::vector<int>& steps) {
+  // FNV-1a of the steps names the file
+  uint64_t digest = 14695981039346656037ULL;
+  for (int step : steps) {
+    digest = (digest ^ static_cast<uint32_t>(step)) * 1099511628211ULL;
+  }
+  auto cached = galoisKeys.find(digest);
+  if (cached != galoisKeys.end())
+    return *cached->second;
+
+  std::ostringstream name;
+  name << "galoiskeys-" << std::hex << std::setw(16) << std::setfill('0')
+       << digest;
+  auto start = std::chrono::high_resolution_clock::now();
+  auto keys = std::make_shared<seal::GaloisKeys>();
+  if (has(name.str())) {
+    MappedFile file(path(name.str()));
+    keys->load(context, file.bytes(), file.size());
+    record("Galois keys loaded", msSince(start));
+  } else {
+    seal::KeyGenerator keygen(context, secretKey);
+    keygen.create_galois_keys(steps, *keys);
+    saveSEAL(*keys, path(name.str()), false);
+    record("Galois keys generated", msSince(start));
+  }
+  galoisKeys[digest] = keys;
+  return *keys;
+}
+
+///@brief Load the CSP's ElGamal private key and elliptic curve private
+/// exponent
+///@return false if either has not been saved
+bool Keystore::loadKeysAHE(CryptoPP::ElGamalKeys::PrivateKey& elGamalKey,
+                           CryptoPP::Integer& ecKey) {
+  if (!has("ahe-elgamal") || !has("ahe-ec"))
+    return false;
+  auto start = std::chrono::high_resolution_clock::now();
+  {
+    MappedFile file(path("ahe-elgamal"));
+    CryptoPP::ArraySource source(
+        reinterpret_cast<const CryptoPP::byte*>(file.bytes()), file.size(),
+        true);
+    elGamalKey.Load(source);
+  }
+  {
+    MappedFile file(path("ahe-ec"));
+    ecKey.Decode(reinterpret_cast<const CryptoPP::byte*>(file.bytes()),
+                 file.size());
+  }
+  record("AHE keys loaded", msSince(start));
+  return true;
+}
+
+void Keystore::saveKeysAHE(const CryptoPP::ElGamalKeys::PrivateKey& elGamalKey,
+                           const CryptoPP::Integer& ecKey) {
+  std::string encoded;
+  CryptoPP::StringSink sink(encoded);
+  elGamalKey.Save(sink);
+  writeFile(path("ahe-elgamal"), encoded.data(), encoded.size(), true);
+
+  std::vector<CryptoPP::byte> ecEncoded(ecKey.MinEncodedSize());
+  ecKey.Encode(ecEncoded.data(), ecEncoded.size());
+  writeFile(path("ahe-ec"), ecEncoded.data(), ecEncoded.size(), true);
+}
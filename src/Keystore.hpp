@@ -0,0 +1,53 @@
+#pragma once
+#include <cryptopp/elgamal.h>
+#include <cryptopp/integer.h>
+#include <seal/seal.h>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Key material kept between runs in one directory - the SEAL encryption
+// parameters, secret and public keys, relinearization and Galois keys and
+// the CSP's ElGamal and elliptic curve AHE keys. Each item is generated and
+// saved the first time it is asked for, and afterwards memory mapped and
+// loaded. Relinearization and Galois keys are only read when asked for.
+// The secret keys are written readable by the owner only. Replay runs
+// derive their keys from the seed and do not use a keystore
+class Keystore {
+  std::string directory;
+  std::shared_ptr<seal::RelinKeys> relinKeys;
+  std::map<uint64_t, std::shared_ptr<seal::GaloisKeys>> galoisKeys;
+  std::vector<std::pair<std::string, double>> timings;
+
+  std::string path(const std::string& name) const;
+  void record(const std::string& step, double ms);
+
+ public:
+  explicit Keystore(const std::string& keyDirectory);
+
+  bool has(const std::string& name) const;
+  seal::EncryptionParameters getParameters(
+      const std::function<seal::EncryptionParameters()>& create);
+  seal::SecretKey getSecretKey(const seal::SEALContext& context);
+  seal::PublicKey getPublicKey(const seal::SEALContext& context,
+                               const seal::SecretKey& secretKey);
+  const seal::RelinKeys& getRelinKeys(const seal::SEALContext& context,
+                                      const seal::SecretKey& secretKey);
+  const seal::GaloisKeys& getGaloisKeys(const seal::SEALContext& context,
+                                        const seal::SecretKey& secretKey,
+                                        const std::vector<int>& steps);
+
+  bool loadKeysAHE(CryptoPP::ElGamalKeys::PrivateKey& elGamalKey,
+                   CryptoPP::Integer& ecKey);
+  void saveKeysAHE(const CryptoPP::ElGamalKeys::PrivateKey& elGamalKey,
+                   const CryptoPP::Integer& ecKey);
+
+  // Time of each load or generation in milliseconds, in the order done
+  const std::vector<std::pair<std::string, double>>& getTimings() const {
+    return timings;
+  }
+};
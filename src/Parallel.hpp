@@ -0,0 +1,38 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+///@brief Number of worker threads to use, defaulting to the hardware count
+inline size_t defaultThreadCount() {
+  size_t threads = std::thread::hardware_concurrency();
+  return threads == 0 ? 1 : threads;
+}
+
+///@brief Split [0, count) into contiguous chunks and run body(begin, end) on
+/// each chunk in its own thread
+///@param threads - maximum number of threads, 0 for the hardware count
+inline void parallelFor(size_t count,
+                        const std::function<void(size_t, size_t)>& body,
+                        size_t threads = 0) {
+  if (threads == 0)
+    threads = defaultThreadCount();
+  threads = std::min(threads, count);
+  if (threads <= 1) {
+    if (count > 0)
+      body(0, count);
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  size_t chunk = (count + threads - 1) / threads;
+  for (size_t begin = 0; begin < count; begin += chunk) {
+    size_t end = std::min(begin + chunk, count);
+    workers.emplace_back(body, begin, end);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
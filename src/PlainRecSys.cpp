@@ -0,0 +1,274 @@
+#include "PlainRecSys.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include "Parallel.hpp"
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+namespace {
+///@brief Inner product of two d-dimensional rows
+double dot(const double* a, const double* b, int d) {
+  double sum = 0;
+  int k = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256d acc = _mm256_setzero_pd();
+  for (; k + 4 <= d; k += 4) {
+    acc = _mm256_fmadd_pd(_mm256_loadu_pd(a + k), _mm256_loadu_pd(b + k), acc);
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; k < d; k++) {
+    sum += a[k] * b[k];
+  }
+  return sum;
+}
+
+///@brief y += scale * x over a d-dimensional row
+void axpy(double scale, const double* x, double* y, int d) {
+  int k = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256d s = _mm256_set1_pd(scale);
+  for (; k + 4 <= d; k += 4) {
+    _mm256_storeu_pd(y + k, _mm256_fmadd_pd(s, _mm256_loadu_pd(x + k),
+                                            _mm256_loadu_pd(y + k)));
+  }
+#endif
+  for (; k < d; k++) {
+    y[k] += scale * x[k];
+  }
+}
+}  // namespace
+
+/// PlainRecSys Constructor
+///@param dimension - number of values in each profile
+///@param threadCount - number of threads, 0 for the hardware count
+PlainRecSys::PlainRecSys(std::vector<std::pair<int, int>> providedM,
+                         std::vector<int> providedRatings,
+                         int dimension,
+                         size_t threadCount)
+    : M(providedM),
+      ratings(providedRatings),
+      d(dimension),
+      threads(threadCount == 0 ? defaultThreadCount() : threadCount) {
+  // Index the rows in the same order as the CSP aggregates them
+  for (int i = 0; i < M.size(); i++) {
+    auto [user, item] = M.at(i);
+    if (userRows.find(user) == userRows.end()) {
+      userRows.insert(std::make_pair(user, userRows.size()));
+      userEntries.emplace_back();
+    }
+    if (itemRows.find(item) == itemRows.end()) {
+      itemRows.insert(std::make_pair(item, itemRows.size()));
+    }
+    entryUserRow.push_back(userRows.find(user)->second);
+    entryItemRow.push_back(itemRows.find(item)->second);
+    userEntries[entryUserRow.back()].push_back(i);
+  }
+  userRowActive.assign(userRows.size(), true);
+  itemRowActive.assign(itemRows.size(), true);
+  UGradient.assign(userRows.size() * d, 0);
+  VGradient.assign(itemRows.size() * d, 0);
+  initialiseProfiles(1.0);
+}
+
+///@brief Set every value of every profile. The default of 1.0 is the all ones
+/// profile createEmbeddings encrypts
+void PlainRecSys::initialiseProfiles(double value) {
+  U.assign(userRows.size() * d, value);
+  V.assign(itemRows.size() * d, value);
+}
+
+///@brief Set every profile to uniform random values in [0, scale)
+void PlainRecSys::initialiseProfiles(uint64_t seed, double scale) {
+  std::mt19937_64 gen(seed);
+  std::uniform_real_distribution<double> distr(0, scale);
+  U.resize(userRows.size() * d);
+  V.resize(itemRows.size() * d);
+  for (double& value : U) {
+    value = distr(gen);
+  }
+  for (double& value : V) {
+    value = distr(gen);
+  }
+}
+
+///@brief Override the default RecSys parameters
+void PlainRecSys::setParameters(double gain,
+                                double learningRate,
+                                double stoppingThreshold,
+                                int epochs) {
+  gamma = gain;
+  lambda = learningRate;
+  threshold = stoppingThreshold;
+  maxEpochs = epochs;
+}
+
+///@brief Heavy ball momentum, as RecSys::setMomentum. Starts every row at rest
+void PlainRecSys::setMomentum(double weight) {
+  if (weight < 0 || weight >= 1)
+    throw std::invalid_argument("PlainRecSys: momentum must be in [0, 1)");
+  momentum = weight;
+  std::fill(UGradient.begin(), UGradient.end(), 0);
+  std::fill(VGradient.begin(), VGradient.end(), 0);
+}
+
+bool PlainRecSys::gradientDescent() {
+  bool stoppingCriterionCheckResult = false;
+  int curEpoch = 0;
+  std::vector<double> R(M.size());
+  // A row's previous step scaled by the momentum, or zeros without it
+  auto decay = [&](double* gradient) {
+    if (momentum == 0) {
+      std::fill(gradient, gradient + d, 0);
+      return;
+    }
+    for (int k = 0; k < d; k++) {
+      gradient[k] *= momentum;
+    }
+  };
+  while (curEpoch++ < maxEpochs && !stoppingCriterionCheckResult) {
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    // Steps 1-5 - R[i] = <u, v> - r for each entry with an active row
+    parallelFor(
+        M.size(),
+        [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; i++) {
+            int u = entryUserRow[i], v = entryItemRow[i];
+            if (!userRowActive[u] && !itemRowActive[v])
+              continue;
+            R[i] = dot(&U[u * d], &V[v * d], d) - ratings[i];
+          }
+        },
+        threads);
+
+    // Step 6 - UGradient = sum R[i] * v + lambda * u + momentum * UGradient,
+    // split by user so each thread owns its rows
+    parallelFor(
+        userEntries.size(),
+        [&](size_t begin, size_t end) {
+          for (size_t u = begin; u < end; u++) {
+            if (!userRowActive[u])
+              continue;
+            double* gradient = &UGradient[u * d];
+            decay(gradient);
+            axpy(lambda, &U[u * d], gradient, d);
+            for (int i : userEntries[u]) {
+              axpy(R[i], &V[entryItemRow[i] * d], gradient, d);
+            }
+          }
+        },
+        threads);
+
+    // Step 6 - VGradient = sum R[i] * u + lambda * v + momentum * VGradient,
+    // accumulated per thread then reduced
+    std::vector<std::vector<double>> partialVGradient;
+    std::mutex partialMutex;
+    parallelFor(
+        M.size(),
+        [&](size_t begin, size_t end) {
+          std::vector<double> partial(VGradient.size(), 0);
+          for (size_t i = begin; i < end; i++) {
+            int v = entryItemRow[i];
+            if (itemRowActive[v])
+              axpy(R[i], &U[entryUserRow[i] * d], &partial[v * d], d);
+          }
+          std::lock_guard<std::mutex> lock(partialMutex);
+          partialVGradient.push_back(std::move(partial));
+        },
+        threads);
+    for (int v = 0; v < itemRowActive.size(); v++) {
+      if (!itemRowActive[v])
+        continue;
+      double* gradient = &VGradient[v * d];
+      decay(gradient);
+      axpy(lambda, &V[v * d], gradient, d);
+      for (const auto& partial : partialVGradient) {
+        axpy(1, &partial[v * d], gradient, d);
+      }
+    }
+
+    // Step 8 - U = UHat - gamma * UGradient, V = VHat - gamma * VGradient
+    for (int u = 0; u < userRowActive.size(); u++) {
+      if (userRowActive[u])
+        axpy(-gamma, &UGradient[u * d], &U[u * d], d);
+    }
+    for (int v = 0; v < itemRowActive.size(); v++) {
+      if (itemRowActive[v])
+        axpy(-gamma, &VGradient[v * d], &V[v * d], d);
+    }
+
+    stoppingCriterionCheckResult = stoppingCriterionCheck();
+
+    auto stopTime = std::chrono::high_resolution_clock::now();
+    epochTimes.push_back(
+        std::chrono::duration<double, std::milli>(stopTime - startTime)
+            .count());
+  }
+  return true;
+}
+
+///@brief Freeze each row whose squared gradient is within the threshold in
+/// every dimension
+///@return true once every row has been frozen
+bool PlainRecSys::stoppingCriterionCheck() {
+  bool anyActive = false;
+  for (int u = 0; u < userRowActive.size(); u++) {
+    if (!userRowActive[u])
+      continue;
+    bool converged = true;
+    for (int k = 0; k < d && converged; k++) {
+      converged = UGradient[u * d + k] * UGradient[u * d + k] <= threshold;
+    }
+    userRowActive[u] = !converged;
+    anyActive = anyActive || !converged;
+  }
+  for (int v = 0; v < itemRowActive.size(); v++) {
+    if (!itemRowActive[v])
+      continue;
+    bool converged = true;
+    for (int k = 0; k < d && converged; k++) {
+      converged = VGradient[v * d + k] * VGradient[v * d + k] <= threshold;
+    }
+    itemRowActive[v] = !converged;
+    anyActive = anyActive || !converged;
+  }
+  return !anyActive;
+}
+
+///@brief Predicted rating of item for user
+///@return false if the user or item was not in the training data
+bool PlainRecSys::predict(int user, int item, double& prediction) const {
+  auto userRow = userRows.find(user);
+  auto itemRow = itemRows.find(item);
+  if (userRow == userRows.end() || itemRow == itemRows.end())
+    return false;
+  prediction = dot(&U[userRow->second * d], &V[itemRow->second * d], d);
+  return true;
+}
+
+///@brief RMSE over the test entries whose user and item were trained
+double PlainRecSys::rootMeanSquaredError(
+    const std::vector<std::pair<int, int>>& testM,
+    const std::vector<int>& testRatings) const {
+  double squareSum = 0;
+  int count = 0;
+  for (int i = 0; i < testM.size(); i++) {
+    double prediction;
+    if (predict(testM[i].first, testM[i].second, prediction)) {
+      double error = prediction - testRatings[i];
+      squareSum += error * error;
+      count++;
+    }
+  }
+  return count == 0 ? 0 : std::sqrt(squareSum / count);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Plaintext reference engine for matrix factorisation, following the same
+// steps as RecSys::gradientDescent without encryption or masking
+class PlainRecSys {
+  // Rating space and ratings
+  std::vector<std::pair<int, int>> M;
+  std::vector<int> ratings;
+
+  // Row of each user and item, and the entries of M belonging to each user
+  std::map<int, int> userRows, itemRows;
+  std::vector<int> entryUserRow, entryItemRow;
+  std::vector<std::vector<int>> userEntries;
+
+  // Parameters for RS - defaults match RecSys
+  int d;                   // Dimension of profiles
+  double gamma = 0.1;      // Small gain factor
+  double lambda = 0.05;    // Learning rate
+  double threshold = 0.5;  // Threshold for stopping criterion
+  int maxEpochs = 10;
+  double momentum = 0;  // See RecSys::setMomentum
+  size_t threads;
+
+  // Profiles, row-major with d values per row. With momentum the gradients
+  // are the steps, carried over from epoch to epoch
+  std::vector<double> U, V, UGradient, VGradient;
+  std::vector<bool> userRowActive, itemRowActive;
+  std::vector<double> epochTimes;
+
+  bool stoppingCriterionCheck();
+
+ public:
+  PlainRecSys(std::vector<std::pair<int, int>> providedM,
+              std::vector<int> providedRatings,
+              int dimension,
+              size_t threadCount = 0);
+
+  void initialiseProfiles(double value);
+  void initialiseProfiles(uint64_t seed, double scale);
+  void setParameters(double gain,
+                     double learningRate,
+                     double stoppingThreshold,
+                     int epochs);
+  void setMomentum(double weight);
+  bool gradientDescent();
+  bool predict(int user, int item, double& prediction) const;
+  double rootMeanSquaredError(const std::vector<std::pair<int, int>>& testM,
+                              const std::vector<int>& testRatings) const;
+  const std::vector<double>& getEpochTimes() const { return epochTimes; }
+};
@@ -0,0 +1,126 @@
+#include "PredictionScheduler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <exception>
+
+Histogram::Histogram(std::vector<double> upperBounds)
+    : bounds(std::move(upperBounds)), counts(bounds.size() + 1, 0) {}
+
+///@brief Buckets bounded by first, first * factor, first * factor^2, ...
+Histogram Histogram::exponential(double first, double factor, size_t buckets) {
+  std::vector<double> upperBounds(buckets);
+  for (size_t b = 0; b < buckets; b++) {
+    upperBounds[b] = first * std::pow(factor, static_cast<double>(b));
+  }
+  return Histogram(upperBounds);
+}
+
+void Histogram::add(double value) {
+  size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), value) -
+                  bounds.begin();
+  counts[bucket]++;
+  total++;
+}
+
+///@brief Upper bound of the bucket holding the p-th fraction of the values,
+/// infinity if it is the overflow bucket and 0 with no values
+double Histogram::percentile(double p) const {
+  if (total == 0)
+    return 0;
+  uint64_t rank = static_cast<uint64_t>(std::ceil(p * total));
+  uint64_t seen = 0;
+  for (size_t b = 0; b < bounds.size(); b++) {
+    seen += counts[b];
+    if (seen >= rank)
+      return bounds[b];
+  }
+  return INFINITY;
+}
+
+PredictionScheduler::PredictionScheduler(BatchFunction function,
+                                         const Options& schedulerOptions)
+    : batchFunction(std::move(function)),
+      options(schedulerOptions),
+      dispatcher(&PredictionScheduler::dispatch, this) {}
+
+///@brief Run what is queued, then stop
+PredictionScheduler::~PredictionScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  queued.notify_all();
+  dispatcher.join();
+}
+
+///@brief Queue a query for the predictions of user
+std::future<PredictionScheduler::Predictions> PredictionScheduler::submit(
+    int user) {
+  Query query{user, std::chrono::steady_clock::now(), {}};
+  std::future<Predictions> result = query.result.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queries.push_back(std::move(query));
+  }
+  queued.notify_all();
+  return result;
+}
+
+///@brief Dispatcher thread - wait for a full batch or the window of the
+/// oldest query, run the batch and fulfil each query
+void PredictionScheduler::dispatch() {
+  auto window = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double, std::milli>(options.windowMs));
+  size_t maxBatch = std::max<size_t>(options.maxBatch, 1);
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    queued.wait(lock, [this] { return stopping || !queries.empty(); });
+    if (queries.empty())
+      return;
+    auto deadline = queries.front().arrival + window;
+    queued.wait_until(lock, deadline, [&] {
+      return stopping || queries.size() >= maxBatch;
+    });
+
+    size_t size = std::min(queries.size(), maxBatch);
+    std::vector<Query> batch(std::make_move_iterator(queries.begin()),
+                             std::make_move_iterator(queries.begin() + size));
+    queries.erase(queries.begin(), queries.begin() + size);
+    lock.unlock();
+
+    std::vector<int> users(batch.size());
+    for (size_t q = 0; q < batch.size(); q++) {
+      users[q] = batch[q].user;
+    }
+    try {
+      std::vector<Predictions> results = batchFunction(users);
+      for (size_t q = 0; q < batch.size(); q++) {
+        batch[q].result.set_value(std::move(results.at(q)));
+      }
+    } catch (...) {
+      for (Query& query : batch) {
+        try {
+          query.result.set_exception(std::current_exception());
+        } catch (const std::future_error&) {
+          // Already fulfilled before the failure
+        }
+      }
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    lock.lock();
+    metrics.queries += batch.size();
+    metrics.batches++;
+    metrics.batchSize.add(static_cast<double>(batch.size()));
+    for (const Query& query : batch) {
+      metrics.latencyMs.add(
+          std::chrono::duration<double, std::milli>(now - query.arrival)
+              .count());
+    }
+  }
+}
+
+PredictionScheduler::Metrics PredictionScheduler::getMetrics() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return metrics;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Counts of values in buckets with the given upper bounds, plus one bucket
+// for anything larger. Percentiles are reported as the upper bound of the
+// bucket they fall in
+class Histogram {
+  std::vector<double> bounds;
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+
+ public:
+  explicit Histogram(std::vector<double> upperBounds);
+  static Histogram exponential(double first, double factor, size_t buckets);
+
+  void add(double value);
+  uint64_t count() const { return total; }
+  double percentile(double p) const;
+  const std::vector<double>& getBounds() const { return bounds; }
+  const std::vector<uint64_t>& getCounts() const { return counts; }
+};
+
+// Coalesces prediction queries from many threads. A query waits until the
+// batch reaches its size limit or the oldest query in it has waited the
+// window, and the batch then runs as one call to the batch function -
+// RecSys::computePredictions for a vector of users - with the results handed
+// back to each caller. The window trades latency for fewer CSP round trips
+class PredictionScheduler {
+ public:
+  using Predictions =
+      std::pair<std::vector<int>, std::vector<seal::Ciphertext>>;
+  using BatchFunction =
+      std::function<std::vector<Predictions>(const std::vector<int>&)>;
+
+  struct Options {
+    double windowMs = 5;   // Longest a query waits for others to join it
+    size_t maxBatch = 16;  // Queries run together at most
+  };
+
+  struct Metrics {
+    uint64_t queries = 0, batches = 0;
+    Histogram latencyMs = Histogram::exponential(1, 2, 16);
+    Histogram batchSize = Histogram::exponential(1, 2, 8);
+  };
+
+ private:
+  struct Query {
+    int user;
+    std::chrono::steady_clock::time_point arrival;
+    std::promise<Predictions> result;
+  };
+
+  BatchFunction batchFunction;
+  Options options;
+  std::mutex mutex;
+  std::condition_variable queued;
+  std::vector<Query> queries;
+  Metrics metrics;
+  bool stopping = false;
+  std::thread dispatcher;
+
+  void dispatch();
+
+ public:
+  PredictionScheduler(BatchFunction function, const Options& schedulerOptions);
+  ~PredictionScheduler();
+  PredictionScheduler(const PredictionScheduler&) = delete;
+  PredictionScheduler& operator=(const PredictionScheduler&) = delete;
+
+  std::future<Predictions> submit(int user);
+  Metrics getMetrics();
+};
@@ -0,0 +1,327 @@
+#include "Profiler.hpp"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+
+namespace {
+// Hardware events, in the order of Profiler::Counters
+const uint64_t counterEvents[] = {PERF_COUNT_HW_CPU_CYCLES,
+                                  PERF_COUNT_HW_INSTRUCTIONS,
+                                  PERF_COUNT_HW_CACHE_MISSES};
+
+void closeCounters(std::vector<int>& fds) {
+  for (int fd : fds) {
+    ::close(fd);
+  }
+  fds.clear();
+}
+
+double MiB(uint64_t bytes) {
+  return bytes / (1024.0 * 1024.0);
+}
+
+std::string jsonString(const std::string& value) {
+  std::string quoted = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      quoted += escaped;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+}  // namespace
+
+Profiler::Scope::Scope(Profiler* owner, const std::string& stepName)
+    : profiler(owner) {
+  begin(stepName);
+}
+
+Profiler::Scope::~Scope() {
+  finish();
+}
+
+void Profiler::Scope::begin(const std::string& stepName) {
+  if (!profiler)
+    return;
+  name = stepName;
+  containers.clear();
+  counterFds = profiler->openCounters();
+  for (int fd : counterFds) {
+    ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  start = std::chrono::steady_clock::now();
+}
+
+///@brief Report a container held by the step. Reporting a container again
+/// replaces it
+void Profiler::Scope::track(const std::string& container, Usage usage) {
+  if (profiler)
+    containers[container] = usage;
+}
+
+void Profiler::Scope::track(const std::string& container,
+                            const std::vector<seal::Ciphertext>& ciphertexts) {
+  if (profiler)
+    track(container, usageOf(ciphertexts));
+}
+
+void Profiler::Scope::track(const std::string& container,
+                            const std::vector<seal::Plaintext>& plaintexts) {
+  if (!profiler)
+    return;
+  Usage usage;
+  for (const seal::Plaintext& plaintext : plaintexts) {
+    usage.count++;
+    usage.bytes += bytesOf(plaintext);
+  }
+  track(container, usage);
+}
+
+///@brief Record the run, once
+void Profiler::Scope::finish() {
+  if (!profiler || name.empty())
+    return;
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  Counters counters;
+  bool counted = !counterFds.empty();
+  uint64_t* fields[] = {&counters.cycles, &counters.instructions,
+                        &counters.llcMisses};
+  for (size_t c = 0; c < counterFds.size(); c++) {
+    ::ioctl(counterFds[c], PERF_EVENT_IOC_DISABLE, 0);
+    if (::read(counterFds[c], fields[c], sizeof(uint64_t)) !=
+        sizeof(uint64_t))
+      counted = false;
+  }
+  closeCounters(counterFds);
+  profiler->record(name, ms, counted ? &counters : nullptr, containers);
+  name.clear();
+}
+
+///@brief Finish this step and start the next one in the same scope
+void Profiler::Scope::next(const std::string& stepName) {
+  finish();
+  begin(stepName);
+}
+
+///@brief Counters for the calling thread and threads it starts, disabled.
+/// Empty if perf_event_open is not permitted, which is remembered
+std::vector<int> Profiler::openCounters() {
+  std::vector<int> fds;
+  if (countersDenied)
+    return fds;
+  for (uint64_t event : counterEvents) {
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = event;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                                        PERF_FLAG_FD_CLOEXEC));
+    if (fd < 0) {
+      countersDenied = true;
+      closeCounters(fds);
+      return fds;
+    }
+    fds.push_back(fd);
+  }
+  return fds;
+}
+
+void Profiler::record(const std::string& name,
+                      double ms,
+                      const Counters* counters,
+                      const std::map<std::string, Usage>& containers) {
+  uint64_t rss = currentRssBytes(), peakRss = peakRssBytes();
+  uint64_t pool = seal::MemoryManager::GetPool().alloc_byte_count();
+  std::lock_guard<std::mutex> lock(mutex);
+  auto [position, added] = stepIndex.emplace(name, steps.size());
+  if (added) {
+    steps.emplace_back();
+    steps.back().name = name;
+    steps.back().countersAvailable = counters != nullptr;
+  }
+  Step& step = steps[position->second];
+  step.calls++;
+  step.totalMs += ms;
+  step.rssBytes = std::max(step.rssBytes, rss);
+  step.peakRssBytes = std::max(step.peakRssBytes, peakRss);
+  step.poolBytes = std::max(step.poolBytes, pool);
+  if (counters) {
+    step.counters.cycles += counters->cycles;
+    step.counters.instructions += counters->instructions;
+    step.counters.llcMisses += counters->llcMisses;
+  } else {
+    step.countersAvailable = false;
+  }
+  for (const auto& [container, usage] : containers) {
+    Usage& largest = step.containers[container];
+    if (usage.bytes >= largest.bytes)
+      largest = usage;
+  }
+}
+
+///@brief Bytes of the coefficient data of a ciphertext in memory
+uint64_t Profiler::bytesOf(const seal::Ciphertext& ciphertext) {
+  return static_cast<uint64_t>(ciphertext.size()) *
+         ciphertext.poly_modulus_degree() * ciphertext.coeff_modulus_size() *
+         sizeof(uint64_t);
+}
+
+uint64_t Profiler::bytesOf(const seal::Plaintext& plaintext) {
+  return static_cast<uint64_t>(plaintext.coeff_count()) * sizeof(uint64_t);
+}
+
+///@brief Count and bytes of the ciphertexts that hold data
+Profiler::Usage Profiler::usageOf(
+    const std::vector<seal::Ciphertext>& ciphertexts) {
+  Usage usage;
+  for (const seal::Ciphertext& ciphertext : ciphertexts) {
+    if (ciphertext.size() == 0)
+      continue;
+    usage.count++;
+    usage.bytes += bytesOf(ciphertext);
+  }
+  return usage;
+}
+
+uint64_t Profiler::currentRssBytes() {
+  long pages = 0, resident = 0;
+  std::FILE* statm = std::fopen("/proc/self/statm", "r");
+  if (!statm)
+    return 0;
+  if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  std::fclose(statm);
+  return static_cast<uint64_t>(resident) * ::sysconf(_SC_PAGESIZE);
+}
+
+uint64_t Profiler::peakRssBytes() {
+  rusage usage{};
+  ::getrusage(RUSAGE_SELF, &usage);
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;  // Kilobytes on Linux
+}
+
+std::vector<Profiler::Step> Profiler::getSteps() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return steps;
+}
+
+///@brief Add the steps of another profiler, such as one in a worker process,
+/// aggregating runs of the same step as record does
+void Profiler::merge(const std::vector<Step>& otherSteps) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const Step& other : otherSteps) {
+    auto [position, added] = stepIndex.emplace(other.name, steps.size());
+    if (added) {
+      steps.push_back(other);
+      continue;
+    }
+    Step& step = steps[position->second];
+    step.calls += other.calls;
+    step.totalMs += other.totalMs;
+    step.rssBytes = std::max(step.rssBytes, other.rssBytes);
+    step.peakRssBytes = std::max(step.peakRssBytes, other.peakRssBytes);
+    step.poolBytes = std::max(step.poolBytes, other.poolBytes);
+    step.countersAvailable = step.countersAvailable && other.countersAvailable;
+    step.counters.cycles += other.counters.cycles;
+    step.counters.instructions += other.counters.instructions;
+    step.counters.llcMisses += other.counters.llcMisses;
+    for (const auto& [container, usage] : other.containers) {
+      Usage& largest = step.containers[container];
+      if (usage.bytes >= largest.bytes)
+        largest = usage;
+    }
+  }
+}
+
+void Profiler::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  steps.clear();
+  stepIndex.clear();
+}
+
+///@brief One row per step, followed by the containers it held
+void Profiler::writeTable(std::ostream& out) {
+  std::vector<Step> snapshot = getSteps();
+  out << std::left << std::setw(28) << "Step" << std::right << std::setw(7)
+      << "Calls" << std::setw(11) << "Total ms" << std::setw(10) << "RSS MiB"
+      << std::setw(10) << "Peak MiB" << std::setw(10) << "Pool MiB"
+      << std::setw(12) << "Mcycles" << std::setw(6) << "IPC" << std::setw(12)
+      << "LLC misses" << std::endl;
+  out << std::fixed;
+  for (const Step& step : snapshot) {
+    out << std::left << std::setw(28) << step.name << std::right
+        << std::setw(7) << step.calls << std::setprecision(1)
+        << std::setw(11) << step.totalMs << std::setw(10)
+        << MiB(step.rssBytes) << std::setw(10) << MiB(step.peakRssBytes)
+        << std::setw(10) << MiB(step.poolBytes);
+    if (step.countersAvailable) {
+      double ipc = step.counters.cycles > 0
+                       ? static_cast<double>(step.counters.instructions) /
+                             step.counters.cycles
+                       : 0;
+      out << std::setw(12) << step.counters.cycles / 1e6
+          << std::setprecision(2) << std::setw(6) << ipc << std::setw(12)
+          << step.counters.llcMisses;
+    } else {
+      out << std::setw(12) << "-" << std::setw(6) << "-" << std::setw(12)
+          << "-";
+    }
+    out << std::endl;
+    for (const auto& [container, usage] : step.containers) {
+      out << "    " << std::left << std::setw(24) << container << std::right
+          << std::setw(7) << usage.count << std::setprecision(1)
+          << std::setw(11) << MiB(usage.bytes) << " MiB" << std::endl;
+    }
+  }
+}
+
+///@brief The steps as a JSON document, with null counters where
+/// perf_event_open was not permitted
+void Profiler::writeJson(std::ostream& out) {
+  std::vector<Step> snapshot = getSteps();
+  out << "{\"steps\": [";
+  for (size_t s = 0; s < snapshot.size(); s++) {
+    const Step& step = snapshot[s];
+    out << (s == 0 ? "" : ",") << "\n  {\"name\": " << jsonString(step.name)
+        << ", \"calls\": " << step.calls << ", \"total_ms\": " << step.totalMs
+        << ", \"rss_bytes\": " << step.rssBytes
+        << ", \"peak_rss_bytes\": " << step.peakRssBytes
+        << ", \"seal_pool_bytes\": " << step.poolBytes << ", \"counters\": ";
+    if (step.countersAvailable) {
+      out << "{\"cycles\": " << step.counters.cycles
+          << ", \"instructions\": " << step.counters.instructions
+          << ", \"llc_misses\": " << step.counters.llcMisses << "}";
+    } else {
+      out << "null";
+    }
+    out << ", \"containers\": {";
+    bool first = true;
+    for (const auto& [container, usage] : step.containers) {
+      out << (first ? "" : ", ") << jsonString(container)
+          << ": {\"count\": " << usage.count << ", \"bytes\": " << usage.bytes
+          << "}";
+      first = false;
+    }
+    out << "}}";
+  }
+  out << "\n]}" << std::endl;
+}
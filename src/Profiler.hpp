@@ -0,0 +1,95 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Memory and hardware counter profile of named protocol steps. A Scope
+// measures one run of a step: wall time, resident set size, the SEAL memory
+// pool and, where the kernel allows perf_event_open, cycles, instructions and
+// last level cache misses of the thread running it and the threads it
+// starts. The step reports the ciphertexts and plaintexts it holds by
+// container before it finishes. Runs of the same step are aggregated, with
+// memory figures the largest seen. Scopes nest, so a RecSys step includes the
+// CSP methods it calls
+class Profiler {
+ public:
+  struct Usage {
+    uint64_t count = 0, bytes = 0;
+  };
+
+  struct Counters {
+    uint64_t cycles = 0, instructions = 0, llcMisses = 0;
+  };
+
+  struct Step {
+    std::string name;
+    uint64_t calls = 0;
+    double totalMs = 0;
+    uint64_t rssBytes = 0;      // Resident set size at the end of the step
+    uint64_t peakRssBytes = 0;  // High-water mark of the process
+    uint64_t poolBytes = 0;     // SEAL memory pool, which never shrinks
+    bool countersAvailable = false;
+    Counters counters;  // Summed over the calls
+    std::map<std::string, Usage> containers;
+  };
+
+  // One run of a step, recorded by finish or the destructor. A null profiler
+  // makes every call a no-op, so steps are always instrumented
+  class Scope {
+    Profiler* profiler;
+    std::string name;
+    std::chrono::steady_clock::time_point start;
+    std::vector<int> counterFds;
+    std::map<std::string, Usage> containers;
+
+    void begin(const std::string& stepName);
+
+   public:
+    Scope(Profiler* owner, const std::string& stepName);
+    ~Scope();
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    bool active() const { return profiler != nullptr; }
+    void track(const std::string& container, Usage usage);
+    void track(const std::string& container,
+               const std::vector<seal::Ciphertext>& ciphertexts);
+    void track(const std::string& container,
+               const std::vector<seal::Plaintext>& plaintexts);
+    void finish();
+    void next(const std::string& stepName);
+  };
+
+ private:
+  std::mutex mutex;
+  std::vector<Step> steps;  // In order of first run
+  std::map<std::string, size_t> stepIndex;
+  std::atomic<bool> countersDenied{false};
+
+  std::vector<int> openCounters();
+  void record(const std::string& name,
+              double ms,
+              const Counters* counters,
+              const std::map<std::string, Usage>& containers);
+
+ public:
+  static uint64_t bytesOf(const seal::Ciphertext& ciphertext);
+  static uint64_t bytesOf(const seal::Plaintext& plaintext);
+  static Usage usageOf(const std::vector<seal::Ciphertext>& ciphertexts);
+  static uint64_t currentRssBytes();
+  static uint64_t peakRssBytes();
+
+  std::vector<Step> getSteps();
+  void merge(const std::vector<Step>& otherSteps);
+  void clear();
+  void writeTable(std::ostream& out);
+  void writeJson(std::ostream& out);
+};
@@ -2,266 +2,826 @@
 #include <seal/ciphertext.h>
 #include <seal/plaintext.h>
 #include <sys/types.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <ostream>
 #include <set>
+#include <stdexcept>
+#include <string>
+#include <tuple>
 #include <vector>
 #include "MessageHandler.hpp"
+#include "Setup.hpp"
 
-/// @brief Generate Random Mask for FHE encoded plaintext/ciphertexts
+/// @brief Generate Random Mask for FHE encoded plaintext/ciphertexts, over
+/// the d slots of a profile
 /// @return Mask as uint64_t vector
 std::vector<uint64_t> RecSys::generateMaskFHE() {
-  std::vector<uint64_t> maskVector(sealSlotCount, 0ULL);
-  for (int i = 0; i < sealSlotCount; i++) {
-    maskVector[i] = distr(gen) % 2 ^ 60;
+  return generateMaskFHE(d);
+}
+
+/// @brief Mask the first slots slots, leaving the rest zero. Elsewhere only
+/// the seed of a mask is kept until it is removed, see
+/// FHEScheme::maskFromSeed
+std::vector<uint64_t> RecSys::generateMaskFHE(size_t slots) {
+  return fheScheme->maskFromSeed(distr(gen), slots, 0);
+}
+
+///@brief Bytes the ciphertexts take on the wire, uncompressed
+uint64_t RecSys::serialisedSize(
+    const std::vector<seal::Ciphertext>& ciphertexts) {
+  uint64_t total = 0;
+  for (const seal::Ciphertext& ciphertext : ciphertexts) {
+    total += ciphertext.save_size(seal::compr_mode_type::none);
   }
-  return maskVector;
+  return total;
+}
+
+///@brief Record one request to the CSP and its reply
+void RecSys::countRoundTrip(uint64_t bytesSent, uint64_t bytesReceived) {
+  traffic.bytesSent += bytesSent;
+  traffic.bytesReceived += bytesReceived;
+  traffic.roundTrips++;
 }
 
 ///@brief Generates a random mask for use with the ElGamalAHE scheme - Upload
 /// Phase
-///@return byte cast implicitly as uint8_t of random mask
-uint8_t RecSys::generateMaskAHE() {
-  return rng.GenerateByte();
+///@return random mask of aheMaskBits bits
+uint64_t RecSys::generateMaskAHE() {
+  uint64_t word = replay ? distr(gen) : rng.GenerateWord32();
+  return word & ((1ULL << aheMaskBits) - 1);
+}
+
+///@brief Replay mode - draw every FHE and AHE mask from a seeded generator so
+/// runs with the same seed are identical
+void RecSys::setSeed(uint64_t seed) {
+  gen.seed(seed);
+  distr.reset();
+  replay = true;
+}
+
+///@brief Heavy ball momentum - each row steps by gamma times its gradient
+/// plus weight times its previous step. The previous steps are kept encrypted
+/// here and reach the CSP masked inside the Step 6 gradients, so the usual
+/// Step 8 and 9 rescale applies them without another round trip. The stopping
+/// criterion then checks the steps rather than the gradients. 0 restores
+/// plain gradient descent. Starts every row at rest
+void RecSys::setMomentum(double weight) {
+  if (weight < 0 || weight >= 1)
+    throw std::invalid_argument("RecSys: momentum must be in [0, 1)");
+  momentum = weight;
+  UVelocity.assign(UVelocity.size(), seal::Ciphertext());
+  VVelocity.assign(VVelocity.size(), seal::Ciphertext());
+}
+
+///@brief Epochs run by each call to gradientDescent at most. Frozen rows and
+/// momentum carry over between calls, so training can be run epoch by epoch
+void RecSys::setMaxEpochs(int epochs) {
+  if (epochs <= 0)
+    throw std::invalid_argument("RecSys: epochs must be positive");
+  maxEpochs = epochs;
+}
+
+///@brief AHE encryptor for the CSP's public key, building its fixed-base
+/// tables on first use
+std::shared_ptr<AHEEncryptor> RecSys::getEncryptorAHE(AHEScheme scheme) {
+  if (scheme == AHEScheme::ECElGamal) {
+    if (!aheEncryptorEC)
+      aheEncryptorEC = std::make_shared<ECElGamalAHEEncryptor>(
+          CSPInstance->getGroupParametersECAHE(),
+          CSPInstance->getPublicKeyECAHE());
+    return aheEncryptorEC;
+  }
+  if (!aheEncryptorElGamal)
+    aheEncryptorElGamal =
+        std::make_shared<ElGamalAHEEncryptor>(CSPInstance->getPublicKeyAHE());
+  return aheEncryptorElGamal;
 }
 
 ///@brief Upload rating from user, using CSP to convert from AHE to FHE
 bool RecSys::uploadRating(EncryptedRatingAHE rating) {
-  // Add Mask
-  rating.rating = rating.rating + (CryptoPP::SecByteBlock)generateMaskAHE();
-  // Get FHE rating and add to vector
-  ratings.push_back(CSPInstance->convertRatingAHEtoFHE(rating));
+  return uploadRatings({rating});
+}
+
+///@brief Upload a batch of ratings, masking them homomorphically in bulk and
+/// having the CSP convert them into packed FHE ciphertexts
+bool RecSys::uploadRatings(const std::vector<EncryptedRatingAHE>& ratings,
+                           AHEScheme scheme) {
+  // Add Masks
+  std::vector<uint64_t> masks(ratings.size());
+  std::vector<CryptoPP::SecByteBlock> ciphertexts;
+  ciphertexts.reserve(ratings.size());
+  for (int i = 0; i < ratings.size(); i++) {
+    masks[i] = generateMaskAHE();
+    ciphertexts.push_back(ratings[i].rating);
+  }
+  std::vector<CryptoPP::SecByteBlock> maskedCiphertexts =
+      getEncryptorAHE(scheme)->addPlainBatch(ciphertexts, masks);
+  std::vector<EncryptedRatingAHE> maskedRatings;
+  maskedRatings.reserve(ratings.size());
+  for (int i = 0; i < ratings.size(); i++) {
+    maskedRatings.emplace_back(ratings[i].userID, ratings[i].itemID,
+                               maskedCiphertexts[i]);
+  }
+
+  // Get packed FHE ratings
+  std::vector<seal::Ciphertext> converted =
+      CSPInstance->convertRatingsAHEtoFHE(maskedRatings, scheme);
+
+  // Remove masks slot-wise and record where each rating is
+  for (size_t k = 0; k < converted.size(); k++) {
+    std::vector<uint64_t> maskSlots(sealSlotCount, 0ULL);
+    for (size_t s = 0; s < sealSlotCount; s++) {
+      size_t index = k * sealSlotCount + s;
+      if (index < ratings.size()) {
+        maskSlots[s] = fheScheme->fromInteger(masks[index]);
+        uploadedM.push_back(
+            std::make_pair(ratings[index].userID, ratings[index].itemID));
+        uploadedSlots.push_back(std::make_pair(packedRatings.size(), s));
+      }
+    }
+    seal::Plaintext maskPlain;
+    fheScheme->encode(maskSlots, converted[k], maskPlain);
+    sealEvaluator.sub_plain_inplace(converted[k], maskPlain);
+    packedRatings.push_back(converted[k]);
+  }
   return true;
 }
 
+///@brief Set the ratings of the entries of M from the uploaded ratings, the
+/// latest upload of an entry winning, and drop the uploads. The packed
+/// ratings are masked slot-wise and unpacked by the CSP into the layout of
+/// setRatings. Entries without an upload keep their rating. Throws, keeping
+/// the uploads, if one is for an entry not in M
+///@return number of entries set
+size_t RecSys::loadUploadedRatings() {
+  std::map<std::pair<int, int>, size_t> entryOf;
+  for (size_t i = 0; i < M.size(); i++) {
+    entryOf.emplace(M[i], i);
+  }
+  std::map<size_t, size_t> latestUpload;  // Entry of M to upload
+  for (size_t u = 0; u < uploadedM.size(); u++) {
+    auto entry = entryOf.find(uploadedM[u]);
+    if (entry == entryOf.end())
+      throw std::invalid_argument(
+          "RecSys: uploaded rating for user " +
+          std::to_string(uploadedM[u].first) + " and item " +
+          std::to_string(uploadedM[u].second) + " is not in M");
+    latestUpload[entry->second] = u;
+  }
+  if (latestUpload.empty())
+    return 0;
+
+  // Mask, keeping the seed of each packed ciphertext's mask
+  std::vector<uint64_t> packedSeed(packedRatings.size());
+  std::vector<seal::Ciphertext> maskedPacked(packedRatings.size());
+  for (size_t k = 0; k < packedRatings.size(); k++) {
+    packedSeed[k] = distr(gen);
+    seal::Plaintext maskPlain;
+    fheScheme->encode(
+        fheScheme->maskFromSeed(packedSeed[k], sealSlotCount, 0),
+        packedRatings[k], maskPlain);
+    sealEvaluator.add_plain(packedRatings[k], maskPlain, maskedPacked[k]);
+  }
+  std::vector<std::pair<size_t, size_t>> slots;
+  for (const auto& [entry, upload] : latestUpload) {
+    slots.push_back(uploadedSlots[upload]);
+  }
+  std::vector<seal::Ciphertext> unpacked =
+      CSPInstance->unpackRatings(maskedPacked, slots);
+  countRoundTrip(serialisedSize(maskedPacked), serialisedSize(unpacked));
+
+  // Remove the mask of each rating's slot, which is now in slot 0
+  std::map<size_t, std::vector<uint64_t>> masks;
+  if (r.size() < M.size())
+    r.resize(M.size());
+  size_t k = 0;
+  for (const auto& [entry, upload] : latestUpload) {
+    auto [ciphertext, slot] = uploadedSlots[upload];
+    auto mask = masks.find(ciphertext);
+    if (mask == masks.end())
+      mask = masks.emplace(ciphertext,
+                           fheScheme->maskFromSeed(packedSeed[ciphertext],
+                                                   sealSlotCount, 0))
+                 .first;
+    std::vector<uint64_t> maskSlots(sealSlotCount, 0ULL);
+    maskSlots[0] = mask->second[slot];
+    seal::Plaintext maskPlain;
+    fheScheme->encode(maskSlots, unpacked[k], maskPlain);
+    sealEvaluator.sub_plain_inplace(unpacked[k], maskPlain);
+    r.set(entry, unpacked[k]);
+    k++;
+  }
+
+  packedRatings.clear();
+  uploadedM.clear();
+  uploadedSlots.clear();
+  return latestUpload.size();
+}
+
+///@brief Add the uploaded entries which are not yet in M to the model, then
+/// load every uploaded rating as loadUploadedRatings does. Trained profiles
+/// are kept: a new entry of a known user or item starts from that row's
+/// profile, and a new user or item from a fresh profile drawn as
+/// createEmbeddings does. M stays sorted by user and then item, and each row's
+/// hat moves to the row's first entry, with fresh encryptions of zero at the
+/// others. Known rows keep their momentum, and every row is active again.
+/// Not available with a ShardedCSP, whose M is fixed when its workers fork
+///@return number of entries set
+size_t RecSys::addUploadedEntries(const seal::Encryptor& encryptor,
+                                  const SetupOptions& options) {
+  std::set<std::pair<int, int>> known(M.begin(), M.end());
+  std::set<std::pair<int, int>> added;
+  for (const auto& entry : uploadedM) {
+    if (known.find(entry) == known.end())
+      added.insert(entry);
+  }
+  if (added.empty())
+    return loadUploadedRatings();
+  std::vector<std::pair<int, int>> newEntries(added.begin(), added.end());
+  Embeddings fresh =
+      fheScheme->isCKKS()
+          ? createEmbeddingsCKKS(newEntries, encryptor,
+                                 seal::CKKSEncoder(sealContext), options)
+          : createEmbeddings(newEntries, encryptor,
+                             seal::BatchEncoder(sealContext), options);
+
+  // Merge, recording the old index or the new entry index of each entry
+  std::vector<std::pair<int, int>> merged;
+  std::vector<int> oldIndex, newIndex;
+  for (size_t i = 0, k = 0; i < M.size() || k < newEntries.size();) {
+    bool takeOld = k == newEntries.size() ||
+                   (i < M.size() && M[i] < newEntries[k]);
+    merged.push_back(takeOld ? M[i] : newEntries[k]);
+    oldIndex.push_back(takeOld ? static_cast<int>(i++) : -1);
+    newIndex.push_back(takeOld ? -1 : static_cast<int>(k++));
+  }
+
+  // Each entry's profile and hat, for users and then items
+  auto layout = [&](bool byUser, CiphertextStore& profiles,
+                    CiphertextStore& hats,
+                    const std::vector<seal::Ciphertext>& freshProfiles) {
+    auto rowOf = [byUser](const std::pair<int, int>& entry) {
+      return byUser ? entry.first : entry.second;
+    };
+    std::map<int, int> oldFirst;  // First old entry of each known row
+    for (int i = 0; i < M.size(); i++) {
+      oldFirst.emplace(rowOf(M[i]), i);
+    }
+    std::vector<CiphertextHandle> mergedProfiles(merged.size()),
+        mergedHats(merged.size());
+    std::set<int> placed;
+    for (size_t j = 0; j < merged.size(); j++) {
+      int row = rowOf(merged[j]);
+      auto first = oldFirst.find(row);
+      if (oldIndex[j] >= 0)
+        mergedProfiles[j] = profiles.get(oldIndex[j]);
+      else if (first != oldFirst.end())
+        mergedProfiles[j] = profiles.get(first->second);
+      else
+        mergedProfiles[j] = freshProfiles[newIndex[j]];
+
+      if (placed.insert(row).second) {
+        mergedHats[j] = first != oldFirst.end() ? hats.get(first->second)
+                                                : mergedProfiles[j];
+      } else if (oldIndex[j] >= 0 && oldIndex[j] != first->second) {
+        mergedHats[j] = hats.get(oldIndex[j]);
+      } else {
+        seal::Ciphertext zero;
+        encryptor.encrypt_zero(zero);
+        zero.scale() = fheScheme->freshScale();
+        mergedHats[j] = std::move(zero);
+      }
+    }
+    profiles.resize(merged.size());
+    hats.resize(merged.size());
+    for (size_t j = 0; j < merged.size(); j++) {
+      profiles.set(j, mergedProfiles[j]);
+      hats.set(j, mergedHats[j]);
+    }
+  };
+  layout(true, U, UHat, fresh.U);
+  layout(false, V, VHat, fresh.V);
+
+  // New entries are rated by their uploads, loaded below
+  std::vector<CiphertextHandle> ratings(merged.size());
+  for (size_t j = 0; j < merged.size(); j++) {
+    if (oldIndex[j] >= 0)
+      ratings[j] = r.get(oldIndex[j]);
+  }
+  r.resize(merged.size());
+  for (size_t j = 0; j < merged.size(); j++) {
+    r.set(j, ratings[j]);
+  }
+
+  // Carry the momentum of known rows over to their new row indices
+  std::vector<int> oldUserRow = entryUserRow, oldItemRow = entryItemRow;
+  std::vector<seal::Ciphertext> oldUVelocity = UVelocity,
+                                oldVVelocity = VVelocity;
+  setM(merged);
+  for (size_t j = 0; j < merged.size(); j++) {
+    if (oldIndex[j] < 0)
+      continue;
+    UVelocity[entryUserRow[j]] = oldUVelocity[oldUserRow[oldIndex[j]]];
+    VVelocity[entryItemRow[j]] = oldVVelocity[oldItemRow[oldIndex[j]]];
+  }
+  CSPInstance->setM(M);
+  return loadUploadedRatings();
+}
+
 bool RecSys::gradientDescent() {
   int curEpoch = 0;
   while (curEpoch++ < maxEpochs && !stoppingCriterionCheckResult) {
     std::cout << "Iteration: " << curEpoch << std::endl;
+    auto epochStartTime = std::chrono::high_resolution_clock::now();
+    // Only entries with an active user or item take part in this epoch
+    std::vector<int> entries = activeEntries();
+    std::vector<int> userEntries = activeUserEntries();
+    std::vector<int> itemEntries = activeItemEntries();
+    epochActiveEntries.push_back(entries.size());
+
     // Steps 1-2  (Component-Wise Multiplication and Rating Addition)
-    std::vector<std::vector<uint64_t>> epsilonMask(RecSys::M.size(),
-                                                   std::vector<uint64_t>());
-    for (int i = 0; i < RecSys::M.size(); i++) {
+    Profiler::Scope step(profiler.get(), "Steps 1-2");
+    // Only the slot sum of each mask is needed to remove it
+    std::vector<uint64_t> epsilonMaskSum(entries.size(), 0ULL);
+    std::vector<seal::Ciphertext> activeF(entries.size());
+    for (int k = 0; k < entries.size(); k++) {
+      int i = entries[k];
       // f[i] = U[i] * V[i]
-      sealEvaluator.multiply(RecSys::U[i], RecSys::V[i], RecSys::f[i]);
+      seal::Ciphertext fi;
+      sealEvaluator.multiply(U.get(i), V.get(i), fi);
 
-      // Scale the rating to the same alpha number of integer bits as U and V
+      // U and V have alpha fractional bits, so their product has 2alpha
       seal::Ciphertext scaledRating;
-      sealEvaluator.multiply_plain(RecSys::r[i], twoToTheAlpha, scaledRating);
+      fheScheme->multiplyConstant(r.get(i), 1.0, 2 * alpha, fi, scaledRating);
 
       // Subtract scaled rating from f
-      sealEvaluator.sub_inplace(RecSys::f[i], scaledRating);
+      sealEvaluator.sub_inplace(fi, scaledRating);
+      f.set(i, fi);
 
-      // Add the mask
-      epsilonMask[i] = generateMaskFHE();
-      seal::Plaintext mask;
-      sealBatchEncoder.encode(epsilonMask[i], mask);
-      sealEvaluator.add_plain_inplace(RecSys::f[i], mask);
+      // Add the mask, unless the slots are summed here rather than by the CSP
+      if (!slotSumTraining) {
+        // The CSP sums the slots and removes alpha bits, leaving the sum of
+        // the masks >> alpha
+        uint64_t seed = distr(gen);
+        std::vector<uint64_t> removedMask(sealSlotCount, 0ULL);
+        fheScheme->addMaskFromSeed(seed, d, removedMask, alpha);
+        epsilonMaskSum[k] = fheScheme->sum(removedMask.data(), d, 0);
+        seal::Plaintext mask;
+        fheScheme->encode(fheScheme->maskFromSeed(seed, d, alpha), fi, mask);
+        sealEvaluator.add_plain(fi, mask, activeF[k]);
+      }
+    }
+
+    trackContainers(step);
+    step.track("f masked", activeF);
+    step.track("masks", seedUsage(epsilonMaskSum.size()));
+    step.next("Steps 3-4");
+
+    // Steps 3-5 with rotations - R[i] is the slot sum of f[i], keeping the
+    // 2^alpha the CSP would have removed until the Step 8 rescale
+    if (slotSumTraining) {
+      for (int i : entries) {
+        seal::Ciphertext Ri;
+        sumSlots(f.get(i), Ri);
+        R.set(i, Ri);
+      }
     }
 
     // Steps 3-4 (Summation)
-    std::vector<seal::Ciphertext> RPrimePrime = CSPInstance->sumF(RecSys::f);
+    std::vector<seal::Ciphertext> RPrimePrime;
+    if (!slotSumTraining) {
+      RPrimePrime = CSPInstance->sumF(activeF);
+      countRoundTrip(serialisedSize(activeF), serialisedSize(RPrimePrime));
+    }
+
+    trackContainers(step);
+    step.track("f masked", activeF);
+    step.track("R masked", RPrimePrime);
+    step.next("Step 5");
 
     // Steps 5-7 (Component-Wise Multiplication and Addition)
     // Step 5 - Remove mask by summing it and then subtracting
-    std::vector<std::vector<uint64_t>> epsilonMaskSum(
-        RecSys::M.size(), std::vector<uint64_t>(sealSlotCount));
-    for (int i = 0; i < RecSys::M.size(); i++) {
-      // Calculate sum for i entry
-      uint64_t jSum = 0;
-      for (int j = 0; j < sealSlotCount; j++) {
-        jSum += epsilonMask[i][j];
-      }
-      // Set all of i and j entry to sum
-      for (int j = 0; j < sealSlotCount; j++) {
-        epsilonMaskSum[i][j] = jSum;
-      }
+    for (int k = 0; k < entries.size() && !slotSumTraining; k++) {
       // Encode and subtract sum of mask
       seal::Plaintext epsilonMaskSumPlaintext;
-      sealBatchEncoder.encode(epsilonMaskSum[i], epsilonMaskSumPlaintext);
-      sealEvaluator.sub_plain(RPrimePrime[i], epsilonMaskSumPlaintext,
-                              RecSys::R[i]);
+      seal::Ciphertext Rk;
+      fheScheme->encode(
+          std::vector<uint64_t>(sealSlotCount, epsilonMaskSum[k]),
+          RPrimePrime[k], epsilonMaskSumPlaintext);
+      sealEvaluator.sub_plain(RPrimePrime[k], epsilonMaskSumPlaintext, Rk);
+      R.set(entries[k], Rk);
     }
 
-    // Steps 6-7 - Calculate U Gradient , V Gradient, U', V' and add Masks
-    std::vector<seal::Ciphertext> UGradientPrime(RecSys::M.size()),
-        VGradientPrime(RecSys::M.size()), UPrime(RecSys::M.size()),
-        VPrime(RecSys::M.size());
-    for (int i = 0; i < RecSys::M.size(); i++) {
-      // UGradient'[i] = v[i] * R[i][j] + twoToTheAlpha * lambda * UHat[i][j]
-      seal::Ciphertext UHatLambdaMul, VHatLambdaMul;
-      sealEvaluator.multiply(RecSys::R[i], RecSys::V[i], UGradientPrime[i]);
-      sealEvaluator.multiply_plain(UHat[i], scaledLambda, UHatLambdaMul);
-      sealEvaluator.add_inplace(UGradientPrime[i], UHatLambdaMul);
+    // Fractional bits of the constants of Steps 6-8, carrying an extra
+    // 2^alpha when R was summed with rotations. The previous steps have alpha
+    // fractional bits and the Step 6 gradients 2alpha, or 3alpha
+    const int lambdaBits = slotSumTraining ? 2 * alpha : alpha;
+    const int hatScaleBits = slotSumTraining ? 2 * alpha + beta : alpha + beta;
+    const int momentumBits = slotSumTraining ? 2 * alpha : alpha;
+    // With momentum, the first entry of each row also carries momentum times
+    // the row's previous step. The CSP sums it into the row's new step in
+    // Step 9 and takes gamma times it from the profile in Step 8
+    auto addVelocity = [&](const std::vector<seal::Ciphertext>& velocity,
+                           int row, std::vector<bool>& rowSeen,
+                           seal::Ciphertext& gradientPrime) {
+      if (rowSeen[row])
+        return;
+      rowSeen[row] = true;
+      if (momentum == 0 || velocity[row].size() == 0)
+        return;
+      seal::Ciphertext velocityTerm;
+      fheScheme->multiplyConstant(velocity[row], momentum, momentumBits,
+                                  gradientPrime, velocityTerm);
+      sealEvaluator.add_inplace(gradientPrime, velocityTerm);
+    };
+    // Step 8 takes U' and V' back to alpha bits, and Step 9 the gradients
+    int rescaleBits = slotSumTraining ? 2 * alpha : alpha;
+    int primeRescaleBits = rescaleBits + beta;
 
-      // VGradient'[i] = u * R[i][j] + twoToTheAlpha * lambda * VHat[i][j]
-      sealEvaluator.multiply(RecSys::R[i], RecSys::U[i], VGradientPrime[i]);
-      sealEvaluator.multiply_plain(VHat[i], scaledLambda, VHatLambdaMul);
-      sealEvaluator.add_inplace(UGradientPrime[i], VHatLambdaMul);
+    trackContainers(step);
+    step.next("Steps 6-7");
+
+    // Steps 6-7 - Calculate U Gradient, U' for entries of active users and
+    // add masks, keeping the seed of each mask
+    std::vector<seal::Ciphertext> UGradientPrime(userEntries.size()),
+        UPrime(userEntries.size());
+    std::vector<uint64_t> UPrimeSeed(userEntries.size()),
+        UGradientPrimeSeed(userEntries.size());
+    std::vector<bool> userRowSeen(userRowActive.size(), false);
+    for (int k = 0; k < userEntries.size(); k++) {
+      int i = userEntries[k];
+      // UGradient'[i] = v[i] * R[i][j] + twoToTheAlpha * lambda * UHat[i][j]
+      seal::Ciphertext UHatLambdaMul;
+      CiphertextHandle UHati = UHat.get(i);
+      sealEvaluator.multiply(R.get(i), V.get(i), UGradientPrime[k]);
+      fheScheme->multiplyConstant(UHati, lambda, lambdaBits,
+                                  UGradientPrime[k], UHatLambdaMul);
+      sealEvaluator.add_inplace(UGradientPrime[k], UHatLambdaMul);
+      addVelocity(UVelocity, entryUserRow[i], userRowSeen, UGradientPrime[k]);
 
-      // TODO(Check #1 scaling (alpha, beta))
       // U'[i] = twoToTheAlphaPlusBeta * UHat[i] - gamma * twoToTheBeta *
       // UGradient'[i]
-      seal::Ciphertext gammaUGradient, gammaVGradient;
-      sealEvaluator.multiply_plain(UHat[i], twoToTheAlphaPlusBeta, UPrime[i]);
-      sealEvaluator.multiply_plain(UGradientPrime[i], scaledGamma,
-                                   gammaUGradient);
-      sealEvaluator.sub_inplace(UPrime[i], gammaUGradient);
+      seal::Ciphertext gammaUGradient;
+      fheScheme->multiplyConstant(UGradientPrime[k], gamma, beta,
+                                  gammaUGradient);
+      fheScheme->multiplyConstant(UHati, 1.0, hatScaleBits, gammaUGradient,
+                                  UPrime[k]);
+      sealEvaluator.sub_inplace(UPrime[k], gammaUGradient);
+
+      // Step 7 - Generate and add masks
+      UPrimeSeed[k] = distr(gen);
+      UGradientPrimeSeed[k] = distr(gen);
+      seal::Plaintext UPrimeMask, UGradientPrimeMask;
+      // The CSP rescales both, so the masks are multiples of 2^bits removed
+      fheScheme->encode(
+          fheScheme->maskFromSeed(UGradientPrimeSeed[k], d, rescaleBits),
+          UGradientPrime[k], UGradientPrimeMask);
+      fheScheme->encode(
+          fheScheme->maskFromSeed(UPrimeSeed[k], d, primeRescaleBits),
+          UPrime[k], UPrimeMask);
+      sealEvaluator.add_plain_inplace(UGradientPrime[k], UGradientPrimeMask);
+      sealEvaluator.add_plain_inplace(UPrime[k], UPrimeMask);
+    }
+
+    // Steps 6-7 - Calculate V Gradient, V' for entries of active items and
+    // add masks, keeping the seed of each mask
+    std::vector<seal::Ciphertext> VGradientPrime(itemEntries.size()),
+        VPrime(itemEntries.size());
+    std::vector<uint64_t> VPrimeSeed(itemEntries.size()),
+        VGradientPrimeSeed(itemEntries.size());
+    std::vector<bool> itemRowSeen(itemRowActive.size(), false);
+    for (int k = 0; k < itemEntries.size(); k++) {
+      int i = itemEntries[k];
+      // VGradient'[i] = u * R[i][j] + twoToTheAlpha * lambda * VHat[i][j]
+      seal::Ciphertext VHatLambdaMul;
+      CiphertextHandle VHati = VHat.get(i);
+      sealEvaluator.multiply(R.get(i), U.get(i), VGradientPrime[k]);
+      fheScheme->multiplyConstant(VHati, lambda, lambdaBits,
+                                  VGradientPrime[k], VHatLambdaMul);
+      sealEvaluator.add_inplace(VGradientPrime[k], VHatLambdaMul);
+      addVelocity(VVelocity, entryItemRow[i], itemRowSeen, VGradientPrime[k]);
 
       // V'[i] = twoToTheAlphaPlusBeta * VHat[i] - gamma *
       // twoToTheBeta * VGradient'[i]
-      sealEvaluator.multiply_plain(VHat[i], twoToTheAlphaPlusBeta, VPrime[i]);
-      sealEvaluator.multiply_plain(VGradientPrime[i], scaledGamma,
-                                   gammaVGradient);
-      sealEvaluator.sub_inplace(VPrime[i], gammaVGradient);
-    }
-    // Step 7 - Generate and add masks
-    std::vector<std::vector<uint64_t>> UGradientPrimeMaskEncodingVector(
-        RecSys::M.size()),
-        VGradientPrimeMaskEncodingVector(RecSys::M.size()),
-        UPrimeMaskEncodingVector(RecSys::M.size()),
-        VPrimeMaskEncodingVector(RecSys::M.size());
-    std::vector<seal::Plaintext> UGradientPrimeMask(RecSys::M.size()),
-        VGradientPrimeMask(RecSys::M.size()), UPrimeMask(RecSys::M.size()),
-        VPrimeMask(RecSys::M.size());
-    std::vector<uint64_t> UMaskSum(sealSlotCount, 0ULL),
-        VMaskSum(sealSlotCount, 0ULL), UGradientMaskSum(sealSlotCount, 0ULL),
-        VGradientMaskSum(sealSlotCount, 0ULL);
-    for (int i = 0; i < RecSys::M.size(); i++) {
-      UPrimeMaskEncodingVector[i] = generateMaskFHE();
-      UGradientPrimeMaskEncodingVector[i] = generateMaskFHE();
-      sealBatchEncoder.encode(UGradientPrimeMaskEncodingVector[i],
-                              UGradientPrimeMask[i]);
-      sealBatchEncoder.encode(UPrimeMaskEncodingVector[i], UPrimeMask[i]);
-
-      sealEvaluator.add_plain_inplace(UGradientPrime[i], UGradientPrimeMask[i]);
-      sealEvaluator.add_plain_inplace(UPrime[i], UPrimeMask[i]);
-
-      VPrimeMaskEncodingVector[i] = generateMaskFHE();
-      VGradientPrimeMaskEncodingVector[i] = generateMaskFHE();
-      sealBatchEncoder.encode(VGradientPrimeMaskEncodingVector[i],
-                              VGradientPrimeMask[i]);
-      sealBatchEncoder.encode(VPrimeMaskEncodingVector[i], VPrimeMask[i]);
-
-      sealEvaluator.add_plain_inplace(VGradientPrime[i], VGradientPrimeMask[i]);
-      sealEvaluator.add_plain_inplace(VPrime[i], VPrimeMask[i]);
-      for (int j = 0; j < sealSlotCount; j++) {
-        UMaskSum[j] += UPrimeMaskEncodingVector[i][j];
-        VMaskSum[j] += VPrimeMaskEncodingVector[i][j];
-        UGradientMaskSum[j] += UGradientPrimeMaskEncodingVector[i][j];
-        VGradientMaskSum[j] += VGradientPrimeMaskEncodingVector[i][j];
-      }
+      seal::Ciphertext gammaVGradient;
+      fheScheme->multiplyConstant(VGradientPrime[k], gamma, beta,
+                                  gammaVGradient);
+      fheScheme->multiplyConstant(VHati, 1.0, hatScaleBits, gammaVGradient,
+                                  VPrime[k]);
+      sealEvaluator.sub_inplace(VPrime[k], gammaVGradient);
+
+      // Step 7 - Generate and add masks
+      VPrimeSeed[k] = distr(gen);
+      VGradientPrimeSeed[k] = distr(gen);
+      seal::Plaintext VPrimeMask, VGradientPrimeMask;
+      // The CSP rescales both, so the masks are multiples of 2^bits removed
+      fheScheme->encode(
+          fheScheme->maskFromSeed(VGradientPrimeSeed[k], d, rescaleBits),
+          VGradientPrime[k], VGradientPrimeMask);
+      fheScheme->encode(
+          fheScheme->maskFromSeed(VPrimeSeed[k], d, primeRescaleBits),
+          VPrime[k], VPrimeMask);
+      sealEvaluator.add_plain_inplace(VGradientPrime[k], VGradientPrimeMask);
+      sealEvaluator.add_plain_inplace(VPrime[k], VPrimeMask);
     }
 
+    auto trackPrimes = [&]() {
+      step.track("U'", UPrime);
+      step.track("V'", VPrime);
+      step.track("UGradient'", UGradientPrime);
+      step.track("VGradient'", VGradientPrime);
+      step.track("masks", seedUsage(2 * (userEntries.size() +
+                                         itemEntries.size())));
+    };
+    trackContainers(step);
+    trackPrimes();
+    step.next("Steps 8-9");
+
     // Step 8
     auto [UPrimePrime, UHatPrimePrime] =
-        CSPInstance->calculateNewUandUHat(UPrime);
+        CSPInstance->calculateNewUandUHat(UPrime, userEntries,
+                                           primeRescaleBits);
     auto [VPrimePrime, VHatPrimePrime] =
-        CSPInstance->calculateNewVandVHat(VPrime);
+        CSPInstance->calculateNewVandVHat(VPrime, itemEntries,
+                                           primeRescaleBits);
     // Step 9
     std::vector<seal::Ciphertext> UGradientPrimePrime =
-        CSPInstance->calculateNewUGradient(UGradientPrime);
+        CSPInstance->calculateNewUGradient(UGradientPrime, userEntries,
+                                           rescaleBits);
     std::vector<seal::Ciphertext> VGradientPrimePrime =
-        CSPInstance->calculateNewVGradient(VGradientPrime);
-
-    // Step 10 - Remove masks
-    // Sum masks
-    seal::Plaintext UMaskSumPlain, VMaskSumPlain, UGradientMaskSumPlain,
-        VGradientMaskSumPlain;
-    sealBatchEncoder.encode(UMaskSum, UMaskSumPlain);
-    sealBatchEncoder.encode(VMaskSum, VMaskSumPlain);
-    sealBatchEncoder.encode(UGradientMaskSum, UGradientMaskSumPlain);
-    sealBatchEncoder.encode(VGradientMaskSum, VGradientMaskSumPlain);
-    for (int i = 0; i < UPrimePrime.size(); i++) {
-      sealEvaluator.sub_plain(UPrimePrime[i], UMaskSumPlain, U[i]);
-      sealEvaluator.sub_plain(UHatPrimePrime[i], UMaskSumPlain, UHat[i]);
+        CSPInstance->calculateNewVGradient(VGradientPrime, itemEntries,
+                                           rescaleBits);
+    countRoundTrip(serialisedSize(UPrime), serialisedSize(UPrimePrime) +
+                                           serialisedSize(UHatPrimePrime));
+    countRoundTrip(serialisedSize(VPrime), serialisedSize(VPrimePrime) +
+                                           serialisedSize(VHatPrimePrime));
+    countRoundTrip(serialisedSize(UGradientPrime),
+                   serialisedSize(UGradientPrimePrime));
+    countRoundTrip(serialisedSize(VGradientPrime),
+                   serialisedSize(VGradientPrimePrime));
+
+    auto trackPrimePrimes = [&]() {
+      step.track("U''", UPrimePrime);
+      step.track("UHat''", UHatPrimePrime);
+      step.track("V''", VPrimePrime);
+      step.track("VHat''", VHatPrimePrime);
+      step.track("UGradient''", UGradientPrimePrime);
+      step.track("VGradient''", VGradientPrimePrime);
+    };
+    trackContainers(step);
+    trackPrimes();
+    trackPrimePrimes();
+    step.next("Step 10");
+
+    // Step 10 - Regenerate the masks of each row from their seeds, sum them
+    // slot-wise and remove the sum. Positions in userEntries and itemEntries
+    // are grouped by row in the order the CSP aggregates them
+    std::vector<std::vector<int>> userGroups, itemGroups;
+    int prevUserRow = -1;
+    for (int k = 0; k < userEntries.size(); k++) {
+      if (entryUserRow[userEntries[k]] != prevUserRow) {
+        userGroups.emplace_back();
+        prevUserRow = entryUserRow[userEntries[k]];
+      }
+      userGroups.back().push_back(k);
     }
-    for (int i = 0; i < VPrimePrime.size(); i++) {
-      sealEvaluator.sub_plain(VPrimePrime[i], VMaskSumPlain, V[i]);
-      sealEvaluator.sub_plain(VHatPrimePrime[i], VMaskSumPlain, VHat[i]);
+    std::map<int, int> itemRowToGroup;
+    for (int k = 0; k < itemEntries.size(); k++) {
+      auto group = itemRowToGroup.insert(
+          std::make_pair(entryItemRow[itemEntries[k]], itemGroups.size()));
+      if (group.second)
+        itemGroups.emplace_back();
+      itemGroups[group.first->second].push_back(k);
     }
-    UGradient.resize(UGradientPrimePrime.size());
-    VGradient.resize(VGradientPrimePrime.size());
-    for (int i = 0; i < UGradientPrimePrime.size(); i++) {
-      sealEvaluator.sub_plain(UGradientPrimePrime[i], UGradientMaskSumPlain,
-                              UGradient[i]);
+    auto rowMaskSum = [&](const std::vector<int>& group,
+                          const std::vector<uint64_t>& seeds, int bits,
+                          const seal::Ciphertext& like,
+                          seal::Plaintext& sumPlain) {
+      std::vector<uint64_t> sum(sealSlotCount, 0ULL);
+      for (int k : group) {
+        fheScheme->addMaskFromSeed(seeds[k], d, sum, bits);
+      }
+      fheScheme->encode(sum, like, sumPlain);
+    };
+    auto removeRowMasks =
+        [&](const std::vector<std::vector<int>>& groups,
+            const std::vector<int>& rowEntries,
+            const std::vector<uint64_t>& primeSeeds,
+            const std::vector<uint64_t>& gradientSeeds,
+            const std::vector<seal::Ciphertext>& primePrime,
+            const std::vector<seal::Ciphertext>& hatPrimePrime,
+            const std::vector<seal::Ciphertext>& gradientPrimePrime,
+            CiphertextStore& profiles,
+            CiphertextStore& hats,
+            std::vector<seal::Ciphertext>& gradient) {
+          gradient.resize(groups.size());
+          for (int g = 0; g < groups.size(); g++) {
+            seal::Plaintext maskSum, gradientMaskSum;
+            rowMaskSum(groups[g], primeSeeds, primeRescaleBits,
+                       primePrime[groups[g].front()], maskSum);
+            rowMaskSum(groups[g], gradientSeeds, rescaleBits,
+                       gradientPrimePrime[g], gradientMaskSum);
+            // Every entry of a row holds the same profile, and the hat of the
+            // first entry equals it, so the row keeps one unmasked buffer. The
+            // other hats are zero and share the first of them
+            CiphertextHandle profile, zeroHat;
+            sealEvaluator.sub_plain(primePrime[groups[g].front()], maskSum,
+                                    profile.mutate());
+            for (int k : groups[g]) {
+              profiles.set(rowEntries[k], profile);
+              if (k == groups[g].front()) {
+                hats.set(rowEntries[k], profile);
+              } else {
+                if (zeroHat->size() == 0)
+                  zeroHat = hatPrimePrime[k];
+                hats.set(rowEntries[k], zeroHat);
+              }
+            }
+            sealEvaluator.sub_plain(gradientPrimePrime[g], gradientMaskSum,
+                                    gradient[g]);
+          }
+        };
+    removeRowMasks(userGroups, userEntries, UPrimeSeed, UGradientPrimeSeed,
+                   UPrimePrime, UHatPrimePrime, UGradientPrimePrime, U, UHat,
+                   UGradient);
+    removeRowMasks(itemGroups, itemEntries, VPrimeSeed, VGradientPrimeSeed,
+                   VPrimePrime, VHatPrimePrime, VGradientPrimePrime, V, VHat,
+                   VGradient);
+    // The step just taken is each row's velocity for the next epoch
+    for (int g = 0; g < userGroups.size() && momentum != 0; g++) {
+      UVelocity[entryUserRow[userEntries[userGroups[g].front()]]] =
+          UGradient[g];
     }
-    for (int i = 0; i < VGradientPrimePrime.size(); i++) {
-      sealEvaluator.sub_plain(VGradientPrimePrime[i], VGradientMaskSumPlain,
-                              VGradient[i]);
+    for (int g = 0; g < itemGroups.size() && momentum != 0; g++) {
+      VVelocity[entryItemRow[itemEntries[itemGroups[g].front()]]] =
+          VGradient[g];
     }
+    trackContainers(step);
+    trackPrimes();
+    trackPrimePrimes();
+    step.finish();
+    modelChanged();
     stoppingCriterionCheckResult =
         RecSys::stoppingCriterionCheck(UGradient, VGradient);
+
+    auto epochStopTime = std::chrono::high_resolution_clock::now();
+    epochTimes.push_back(std::chrono::duration<double, std::milli>(
+                             epochStopTime - epochStartTime)
+                             .count());
   }
   return true;
 }
 
-/// @brief Check if either the user or item gradient is less than the threshold
+/// @brief Check the gradient of every active user and item row against the
+/// threshold, freezing the rows which have converged
+/// @return true once every user and item row has been frozen
 bool RecSys::stoppingCriterionCheck(
     const std::vector<seal::Ciphertext>& UGradientParam,
     const std::vector<seal::Ciphertext>& VGradientParam) {
   std::vector<seal::Ciphertext> UGradientSquare(UGradientParam.size()),
       VGradientSquare(VGradientParam.size());
-  std::vector<std::vector<uint64_t>> UGradientSquareMaskVector(
-      UGradientParam.size()),
-      VGradientSquareMaskVector(VGradientParam.size());
+  std::vector<std::vector<uint64_t>> Su(UGradientParam.size()),
+      Sv(VGradientParam.size());
   // Square UGradient and mask
   for (int i = 0; i < UGradientParam.size(); i++) {
     sealEvaluator.square(UGradientParam[i], UGradientSquare[i]);
 
     // Generate and add mask
-    UGradientSquareMaskVector[i] = generateMaskFHE();
+    Su[i] = generateMaskFHE();
     seal::Plaintext UGradientSquareMaskPlaintext;
-    sealBatchEncoder.encode(UGradientSquareMaskVector[i],
-                            UGradientSquareMaskPlaintext);
+    fheScheme->encode(Su[i], UGradientSquare[i],
+                      UGradientSquareMaskPlaintext);
     sealEvaluator.add_plain_inplace(UGradientSquare[i],
                                     UGradientSquareMaskPlaintext);
+
+    // Calculate threshold vector for the row, over the d slots the CSP
+    // compares
+    Su[i].resize(d);
+    for (int j = 0; j < d; j++) {
+      Su[i][j] += scaledThreshold;
+    }
   }
 
   // Square VGradient and mask
   for (int i = 0; i < VGradientParam.size(); i++) {
     sealEvaluator.square(VGradientParam[i], VGradientSquare[i]);
-    VGradientSquareMaskVector[i] = generateMaskFHE();
 
     // Generate and add mask
-    VGradientSquareMaskVector[i] = generateMaskFHE();
+    Sv[i] = generateMaskFHE();
     seal::Plaintext VGradientSquareMaskPlaintext;
-    sealBatchEncoder.encode(VGradientSquareMaskVector[i],
-                            VGradientSquareMaskPlaintext);
+    fheScheme->encode(Sv[i], VGradientSquare[i],
+                      VGradientSquareMaskPlaintext);
     sealEvaluator.add_plain_inplace(VGradientSquare[i],
                                     VGradientSquareMaskPlaintext);
-  }
 
-  // Sum mask vectors
-  std::vector<uint64_t> UMaskSum(sealSlotCount, 0ULL),
-      VMaskSum(sealSlotCount, 0ULL), Su(sealSlotCount), Sv(sealSlotCount);
+    // Calculate threshold vector for the row, over the d slots the CSP
+    // compares
+    Sv[i].resize(d);
+    for (int j = 0; j < d; j++) {
+      Sv[i][j] += scaledThreshold;
+    }
+  }
 
-  for (int i = 0; i < UGradientSquareMaskVector.size(); i++) {
-    for (int j = 0; j < sealSlotCount; j++) {
-      UMaskSum[j] += UGradientSquareMaskVector[i][j];
+  // Get per-row stopping criterion flags
+  Profiler::Scope step(profiler.get(), "Stopping criterion");
+  auto [UConverged, VConverged] = CSPInstance->calculateStoppingVector(
+      UGradientSquare, VGradientSquare, Su, Sv);
+  countRoundTrip(serialisedSize(UGradientSquare) +
+                     serialisedSize(VGradientSquare) +
+                     (Su.size() + Sv.size()) * d * sizeof(uint64_t),
+                 (UConverged.size() + VConverged.size() + 7) / 8);
+  trackContainers(step);
+  step.track("UGradient squared", UGradientSquare);
+  step.track("VGradient squared", VGradientSquare);
+  Profiler::Usage thresholds;
+  for (const auto* S : {&Su, &Sv}) {
+    for (const std::vector<uint64_t>& row : *S) {
+      thresholds.count++;
+      thresholds.bytes += row.size() * sizeof(uint64_t);
     }
   }
-  for (int i = 0; i < VGradientSquareMaskVector.size(); i++) {
-    for (int j = 0; j < sealSlotCount; j++) {
-      VMaskSum[j] += VGradientSquareMaskVector[i][j];
+  step.track("masks", thresholds);
+  step.finish();
+
+  // The gradients are given in order of the active rows, so freeze the matching
+  // rows which have converged
+  int k = 0;
+  for (int row = 0; row < userRowActive.size(); row++) {
+    if (userRowActive[row] && UConverged.at(k++))
+      userRowActive[row] = false;
+  }
+  k = 0;
+  for (int row = 0; row < itemRowActive.size(); row++) {
+    if (itemRowActive[row] && VConverged.at(k++))
+      itemRowActive[row] = false;
+  }
+
+  // Stop once there are no active rows left
+  return activeEntries().empty();
+}
+
+/// @brief Assign every entry of M to its user row and item row, in the order
+/// that the CSP aggregates them, and mark every row as active
+void RecSys::indexRows() {
+  entryUserRow.assign(M.size(), -1);
+  entryItemRow.assign(M.size(), -1);
+  std::map<int, int> itemRows{};
+  int prevUser = -1;
+  int userRows = 0;
+  for (int i = 0; i < M.size(); i++) {
+    // Users are aggregated in runs of M
+    if (M.at(i).first != prevUser) {
+      prevUser = M.at(i).first;
+      userRows++;
     }
+    entryUserRow[i] = userRows - 1;
+
+    // Items are aggregated in order of first appearance
+    if (itemRows.find(M.at(i).second) == itemRows.end()) {
+      itemRows.insert(std::make_pair(M.at(i).second, itemRows.size()));
+    }
+    entryItemRow[i] = itemRows.find(M.at(i).second)->second;
   }
+  userRowActive.assign(userRows, true);
+  itemRowActive.assign(itemRows.size(), true);
+  UVelocity.assign(userRows, seal::Ciphertext());
+  VVelocity.assign(itemRows.size(), seal::Ciphertext());
+  stoppingCriterionCheckResult = false;
+}
 
-  // Calculate threshold vectors
-  for (int i = 0; i < sealSlotCount; i++) {
-    Su[i] = UMaskSum[i] + threshold;
-    Sv[i] = VMaskSum[i] + threshold;
+/// @brief Indices of M whose user row is still active
+std::vector<int> RecSys::activeUserEntries() {
+  std::vector<int> entries;
+  for (int i = 0; i < M.size(); i++) {
+    if (userRowActive[entryUserRow[i]])
+      entries.push_back(i);
   }
+  return entries;
+}
 
-  // Get stopping criterion bool pair
-  std::pair<bool, bool> stoppingCriterionPair =
-      CSPInstance->calculateStoppingVector(UGradientSquare, VGradientSquare, Su,
-                                           Sv);
+/// @brief Indices of M whose item row is still active
+std::vector<int> RecSys::activeItemEntries() {
+  std::vector<int> entries;
+  for (int i = 0; i < M.size(); i++) {
+    if (itemRowActive[entryItemRow[i]])
+      entries.push_back(i);
+  }
+  return entries;
+}
 
-  // Return true if either the user or item gradient is less than the threshold
-  return (stoppingCriterionPair.first || stoppingCriterionPair.second);
+/// @brief Indices of M whose user row or item row is still active
+std::vector<int> RecSys::activeEntries() {
+  std::vector<int> entries;
+  for (int i = 0; i < M.size(); i++) {
+    if (userRowActive[entryUserRow[i]] || itemRowActive[entryItemRow[i]])
+      entries.push_back(i);
+  }
+  return entries;
 }
 
 /// RecSys Constructor
@@ -274,145 +834,494 @@ RecSys::RecSys(std::shared_ptr<CSP> csp,
       gen(rd()),
       sealContext(sealcontext),
       sealEvaluator(sealcontext),
-      sealBatchEncoder(sealcontext),
+      fheScheme(FHEScheme::create(sealcontext)),
       M(providedM),
-      f(providedM.size()),
-      R(providedM.size()),
+      r(sealcontext, "r"),
+      f(sealcontext, "f", providedM.size()),
+      R(sealcontext, "R", providedM.size()),
+      U(sealcontext, "U"),
+      V(sealcontext, "V"),
+      UHat(sealcontext, "UHat"),
+      VHat(sealcontext, "VHat"),
       UGradient(providedM.size()),
       VGradient(providedM.size()) {
-  // Save slot count
-  sealSlotCount = sealBatchEncoder.slot_count();
+  // Save slot count. The scheme encodes the constants on first use
+  sealSlotCount = fheScheme->slotCount();
+  d = sealSlotCount;
+
+  // The squared gradients have 2alpha fractional bits
+  scaledThreshold = fheScheme->fromReal(threshold, 2 * alpha);
+
+  // Every row starts active
+  indexRows();
+}
+
+///@brief Galois steps needed by sumSlots - on BGV powers of two up to a
+/// quarter of the slots for the row rotations, and 0 for the column swap
+std::vector<int> RecSys::slotSumRotationSteps() const {
+  return fheScheme->slotSumRotationSteps();
+}
+
+///@brief Sum slots with rotations rather than through the CSP. The keys must
+/// cover slotSumRotationSteps
+void RecSys::enableSlotSum(const seal::RelinKeys& relinKeys,
+                           const seal::GaloisKeys& galoisKeys) {
+  sealRelinKeys = relinKeys;
+  sealGaloisKeys = galoisKeys;
+  slotSumEnabled = true;
+  modelChanged();  // Predictions change scale
+
+  // Training keeps an extra 2^alpha until Step 8, so Step 6 needs
+  // 2^(3alpha+beta) to fit in the plain modulus. On CKKS the extra product
+  // would overflow the coefficient modulus, as nothing is rescaled
+  slotSumTraining = fheScheme->slotSumTrainingFits();
+  if (!slotSumTraining)
+    std::cout << "Slot summation: 2^(3alpha+beta) does not fit the scheme, "
+              << "training uses the CSP" << std::endl;
+}
+
+///@brief Every slot of out is the sum of the slots of in - rotate and add in
+/// log(slots) steps, on BGV along the rows and then across the swapped rows.
+/// With a width below the slot count only log(width) steps are taken, and the
+/// first slot of each width block holds the sum of the block
+void RecSys::sumSlots(const seal::Ciphertext& in,
+                      seal::Ciphertext& out,
+                      size_t width) {
+  if (width == 0)
+    width = sealSlotCount;
+  fheScheme->sumSlots(in, out, width, sealRelinKeys, sealGaloisKeys);
+}
+
+///@brief Profiles take the first d slots of each ciphertext instead of every
+/// slot, and predictions pack slot count / d items to a ciphertext. The
+/// embeddings must be set with the same dimension, see SetupOptions
+void RecSys::setDimension(int dimension) {
+  if (dimension <= 0 || !isValidDimension(dimension, sealSlotCount))
+    throw std::invalid_argument("RecSys: invalid profile dimension " +
+                                std::to_string(dimension));
+  d = dimension;
+  CSPInstance->setDimension(dimension);
+  modelChanged();
+}
 
-  // Encode 2^alpha
-  std::vector<uint64_t> twoToTheAlphaEncodingVector(sealSlotCount, 0ULL),
-      scaledLambdaEncodingVector(sealSlotCount, 0ULL);
-  for (int i = 0; i < sealSlotCount; i++) {
-    twoToTheAlphaEncodingVector[i] = static_cast<uint64_t>(pow(2, alpha));
-    scaledLambdaEncodingVector[i] =
-        static_cast<uint64_t>(pow(2, alpha) * lambda);
+///@brief get the encrypted predictions of all films for user i, packed slot
+/// count / d to a ciphertext - see predictionSlot. With the prediction cache
+/// enabled, repeat queries for the same model are served from the cache, and
+/// other users reuse the cached item vectors so only their own profile goes
+/// to the CSP. A user without ratings gets no items
+std::pair<std::vector<int>, std::vector<seal::Ciphertext>>
+RecSys::computePredictions(int user) {
+  if (cacheVersion != modelVersion) {
+    clearPredictionCache();
+    cacheVersion = modelVersion;
+  }
+  auto cached = predictionCache.find(user);
+  if (cached != predictionCache.end()) {
+    predictionCacheMetrics.hits++;
+    predictionLru.splice(predictionLru.begin(), predictionLru,
+                         cached->second.lruPosition);
+    return {cachedItems, cached->second.results};
   }
-  sealBatchEncoder.encode(twoToTheAlphaEncodingVector, twoToTheAlpha);
-  sealBatchEncoder.encode(scaledLambdaEncodingVector, scaledLambda);
+  if (std::none_of(M.begin(), M.end(), [user](const std::pair<int, int>& m) {
+        return m.first == user;
+      }))
+    return {};
+  if (predictionCacheLimit > 0)
+    predictionCacheMetrics.misses++;
+
+  Profiler::Scope step(profiler.get(), "Predictions");
+  std::vector<int> orderofItems;
+  std::vector<seal::Ciphertext> UVector, VVector;
+  seal::Ciphertext cachedUVector;
+  if (!cachedVVectors.empty() && cachedUserVector(user, cachedUVector)) {
+    orderofItems = cachedItems;
+    VVector = cachedVVectors;
+    UVector.assign(VVector.size(), cachedUVector);
+  } else {
+    // Mask and send UHat and VHat, keeping the seed of each mask
+    std::vector<uint64_t> UHatSeed(UHat.size()), VHatSeed(VHat.size());
+    std::vector<seal::Ciphertext> maskedUHat(UHat.size()),
+        maskedVHat(VHat.size());
+
+    for (int i = 0; i < UHat.size(); i++) {
+      UHatSeed[i] = distr(gen);
+
+      seal::Plaintext maskPlain;
+      CiphertextHandle UHati = UHat.get(i);
+      fheScheme->encode(fheScheme->maskFromSeed(UHatSeed[i], d, 0), UHati,
+                        maskPlain);
+      sealEvaluator.add_plain(UHati, maskPlain, maskedUHat[i]);
+    }
+    for (int i = 0; i < VHat.size(); i++) {
+      VHatSeed[i] = distr(gen);
+
+      seal::Plaintext maskPlain;
+      CiphertextHandle VHati = VHat.get(i);
+      fheScheme->encode(fheScheme->maskFromSeed(VHatSeed[i], d, 0), VHati,
+                        maskPlain);
+      sealEvaluator.add_plain(VHati, maskPlain, maskedVHat[i]);
+    }
+
+    // Get masked ui and v vectors from CSP
+    std::tie(UVector, VVector) =
+        CSPInstance->calculateUiandVVectors(user, maskedUHat, maskedVHat);
+    countRoundTrip(serialisedSize(maskedUHat) + serialisedSize(maskedVHat),
+                   serialisedSize(UVector) + serialisedSize(VVector));
+
+    // Remove the masks, placed in the same blocks as the CSP packed the
+    // profiles
+    for (int i = 0; i < RecSys::M.size(); i++) {
+      if (M.at(i).first == user) {
+        seal::Plaintext uMaskPackedPlain =
+            packedProfileMask(UHatSeed.at(i), UVector.front());
+        for (int k = 0; k < UVector.size(); k++) {
+          sealEvaluator.sub_plain_inplace(UVector.at(k), uMaskPackedPlain);
+        }
+        break;
+      }
+    }
+    orderofItems = removeItemMasks(VHatSeed, VVector);
 
-  // Encode 2^beta
-  std::vector<uint64_t> twoToTheBetaEncodingVector(sealSlotCount, 0ULL),
-      scaledGammaEncodingVector(sealSlotCount, 0ULL);
-  for (int i = 0; i < sealSlotCount; i++) {
-    twoToTheBetaEncodingVector[i] = static_cast<uint64_t>(pow(2, beta));
-    scaledGammaEncodingVector[i] = static_cast<uint64_t>(pow(2, beta) * gamma);
+    cacheItemVectors(orderofItems, VVector);
   }
-  sealBatchEncoder.encode(twoToTheBetaEncodingVector, twoToTheBeta);
-  sealBatchEncoder.encode(scaledGammaEncodingVector, scaledGamma);
 
-  // Encode 2^(alpha+beta)
-  std::vector<uint64_t> twoToTheAlphaPlusBetaEncodingVector(sealSlotCount,
-                                                            0ULL);
-  for (int i = 0; i < sealSlotCount; i++) {
-    twoToTheAlphaPlusBetaEncodingVector[i] = 1 << (alpha + beta);
+  // Multiply the two resultant vectors
+  std::vector<seal::Ciphertext> dDimensionalMultiplication(UVector.size());
+  for (int i = 0; i < UVector.size(); i++) {
+    sealEvaluator.multiply(UVector.at(i), VVector.at(i),
+                           dDimensionalMultiplication[i]);
   }
-  sealBatchEncoder.encode(twoToTheAlphaPlusBetaEncodingVector,
-                          twoToTheAlphaPlusBeta);
+
+  std::vector<seal::Ciphertext> result =
+      reducePredictions(dDimensionalMultiplication);
+  trackContainers(step);
+  step.track("U vectors", UVector);
+  step.track("V vectors", VVector);
+  step.track("products", dDimensionalMultiplication);
+  step.track("results", result);
+  step.finish();
+  cachePredictions(user, result);
+  return {orderofItems, result};
 }
 
-///@brief get the encrypted predictions of all films for user i
-std::pair<std::vector<int>, std::vector<seal::Ciphertext>>
-RecSys::computePredictions(int user) {
-  // Mask and send UHat and VHat
-  std::vector<std::vector<uint64_t>> UHatMask(UHat.size()),
-      VHatMask(VHat.size());
-  std::vector<seal::Ciphertext> maskedUHat(UHat.size()),
-      maskedVHat(VHat.size());
+///@brief Predictions for several users at once, as computePredictions for
+/// each. The item vectors and the profiles of every uncached user are fetched
+/// from the CSP in one exchange, and all of their products are reduced in
+/// one more, in place of two round trips per user. Users without ratings get
+/// no items
+std::vector<std::pair<std::vector<int>, std::vector<seal::Ciphertext>>>
+RecSys::computePredictions(const std::vector<int>& requestedUsers) {
+  if (cacheVersion != modelVersion) {
+    clearPredictionCache();
+    cacheVersion = modelVersion;
+  }
+  std::vector<std::pair<std::vector<int>, std::vector<seal::Ciphertext>>>
+      predictions(requestedUsers.size());
+
+  // Serve cached users, and collect the first entry of each other user once
+  std::map<int, int> firstEntry;
+  for (int i = 0; i < M.size(); i++) {
+    firstEntry.emplace(M.at(i).first, i);
+  }
+  std::vector<int> batchUsers;
+  std::map<int, size_t> batchIndex;
+  for (size_t q = 0; q < requestedUsers.size(); q++) {
+    int user = requestedUsers[q];
+    auto cached = predictionCache.find(user);
+    if (cached != predictionCache.end()) {
+      predictionCacheMetrics.hits++;
+      predictionLru.splice(predictionLru.begin(), predictionLru,
+                           cached->second.lruPosition);
+      predictions[q] = {cachedItems, cached->second.results};
+    } else if (firstEntry.count(user) > 0 && batchIndex.count(user) == 0) {
+      if (predictionCacheLimit > 0)
+        predictionCacheMetrics.misses++;
+      batchIndex[user] = batchUsers.size();
+      batchUsers.push_back(user);
+    }
+  }
+  if (batchUsers.empty())
+    return predictions;
+  Profiler::Scope step(profiler.get(), "Predictions batch");
 
-  for (int i = 0; i < UHat.size(); i++) {
-    UHatMask[i] = generateMaskFHE();
+  // Item vectors, unless cached for this model, and the profile of each user
+  // in the batch, sent to the CSP together
+  std::vector<int> orderofItems = cachedItems;
+  std::vector<seal::Ciphertext> VVector = cachedVVectors;
+  std::vector<uint64_t> VHatSeed;
+  std::vector<seal::Ciphertext> maskedVHat;
+  if (VVector.empty()) {
+    VHatSeed.resize(VHat.size());
+    maskedVHat.resize(VHat.size());
+    for (int i = 0; i < VHat.size(); i++) {
+      VHatSeed[i] = distr(gen);
 
-    seal::Plaintext maskPlain;
-    sealBatchEncoder.encode(UHatMask[i], maskPlain);
-    sealEvaluator.add_plain(UHat[i], maskPlain, maskedUHat[i]);
+      seal::Plaintext maskPlain;
+      CiphertextHandle VHati = VHat.get(i);
+      fheScheme->encode(fheScheme->maskFromSeed(VHatSeed[i], d, 0), VHati,
+                        maskPlain);
+      sealEvaluator.add_plain(VHati, maskPlain, maskedVHat[i]);
+    }
   }
-  for (int i = 0; i < VHat.size(); i++) {
-    VHatMask[i] = generateMaskFHE();
+  std::vector<uint64_t> UHatSeed(batchUsers.size());
+  std::vector<seal::Ciphertext> maskedUHat(batchUsers.size());
+  for (size_t b = 0; b < batchUsers.size(); b++) {
+    UHatSeed[b] = distr(gen);
 
     seal::Plaintext maskPlain;
-    sealBatchEncoder.encode(VHatMask[i], maskPlain);
-    sealEvaluator.add_plain(VHat[i], maskPlain, maskedVHat[i]);
+    CiphertextHandle UHatFirst = UHat.get(firstEntry.at(batchUsers[b]));
+    fheScheme->encode(fheScheme->maskFromSeed(UHatSeed[b], d, 0), UHatFirst,
+                      maskPlain);
+    sealEvaluator.add_plain(UHatFirst, maskPlain, maskedUHat[b]);
   }
+  if (!maskedVHat.empty())
+    VVector = CSPInstance->calculateVVectors(maskedVHat);
+  std::vector<seal::Ciphertext> UVectors =
+      CSPInstance->calculateUiVectors(maskedUHat);
+  countRoundTrip(serialisedSize(maskedVHat) + serialisedSize(maskedUHat),
+                 (maskedVHat.empty() ? 0 : serialisedSize(VVector)) +
+                     serialisedSize(UVectors));
 
-  // Get masked ui and v vectors from CSP
-  auto [UVector, VVector] =
-      CSPInstance->calculateUiandVVectors(user, maskedUHat, maskedVHat);
+  if (!maskedVHat.empty()) {
+    orderofItems = removeItemMasks(VHatSeed, VVector);
+    cacheItemVectors(orderofItems, VVector);
+  }
+  for (size_t b = 0; b < batchUsers.size(); b++) {
+    sealEvaluator.sub_plain_inplace(
+        UVectors[b], packedProfileMask(UHatSeed[b], UVectors[b]));
+  }
 
-  // Remove mask and multiply
-  seal::Plaintext uMaskEntryPlain;
-  for (int i = 0; i < RecSys::M.size(); i++) {
-    if (M.at(i).first == user) {
-      sealBatchEncoder.encode(UHatMask.at(i), uMaskEntryPlain);
-      break;
+  // Multiply every user vector with every item vector and reduce them all
+  std::vector<seal::Ciphertext> dDimensionalMultiplication(
+      batchUsers.size() * VVector.size());
+  size_t perUser = VVector.size();
+  for (size_t b = 0; b < batchUsers.size(); b++) {
+    for (size_t k = 0; k < perUser; k++) {
+      sealEvaluator.multiply(UVectors[b], VVector[k],
+                             dDimensionalMultiplication[b * perUser + k]);
     }
   }
-  for (int i = 0; i < UVector.size(); i++) {
-    sealEvaluator.sub_plain_inplace(UVector.at(i), uMaskEntryPlain);
+  std::vector<seal::Ciphertext> result =
+      reducePredictions(dDimensionalMultiplication);
+  trackContainers(step);
+  step.track("U vectors", UVectors);
+  step.track("V vectors", VVector);
+  step.track("products", dDimensionalMultiplication);
+  step.track("results", result);
+  step.finish();
+
+  // Fan the results back out to the users
+  std::vector<std::vector<seal::Ciphertext>> userResults(batchUsers.size());
+  for (size_t b = 0; b < batchUsers.size(); b++) {
+    userResults[b].assign(result.begin() + b * perUser,
+                          result.begin() + (b + 1) * perUser);
+    cachePredictions(batchUsers[b], userResults[b]);
+  }
+  for (size_t q = 0; q < requestedUsers.size(); q++) {
+    auto index = batchIndex.find(requestedUsers[q]);
+    if (index != batchIndex.end())
+      predictions[q] = {orderofItems, userResults[index->second]};
   }
+  return predictions;
+}
+
+///@brief Remove the masks of the hats of each item's first entry from the
+/// item vectors, placed in the blocks the CSP packed the profiles into
+///@return the items in order of first appearance, as packed
+std::vector<int> RecSys::removeItemMasks(
+    const std::vector<uint64_t>& VHatSeed,
+    std::vector<seal::Ciphertext>& VVector) {
+  std::vector<int> orderofItems;
   // Keep track of order that the items are found to remove correct mask
   std::set<int> observedItems{};
-  std::vector<int> orderofItems;
-  int index = 0;
+  std::vector<std::vector<uint64_t>> VMaskPacked(
+      VVector.size(), std::vector<uint64_t>(sealSlotCount, 0ULL));
   for (int i = 0; i < RecSys::M.size(); i++) {
     if (observedItems.find(M.at(i).second) == observedItems.end()) {
       observedItems.insert(M.at(i).second);
+      auto [k, slot] = predictionSlot(orderofItems.size());
       orderofItems.push_back(M.at(i).second);
-      seal::Plaintext plainRes;
-      sealBatchEncoder.encode(VHatMask.at(i), plainRes);
-      sealEvaluator.sub_plain_inplace(VVector.at(index++), plainRes);
+      std::vector<uint64_t> VHatMask =
+          fheScheme->maskFromSeed(VHatSeed.at(i), d, 0);
+      std::copy(VHatMask.begin(), VHatMask.begin() + d,
+                VMaskPacked.at(k).begin() + slot);
     }
   }
+  for (int k = 0; k < VVector.size(); k++) {
+    seal::Plaintext plainRes;
+    fheScheme->encode(VMaskPacked[k], VVector.at(k), plainRes);
+    sealEvaluator.sub_plain_inplace(VVector.at(k), plainRes);
+  }
+  return orderofItems;
+}
 
-  // Multiply the two resultant vectors
-  std::vector<seal::Ciphertext> dDimensionalMultiplication(UVector.size());
-  for (int i = 0; i < UVector.size(); i++) {
-    sealEvaluator.multiply(UVector.at(i), VVector.at(i),
-                           dDimensionalMultiplication[i]);
+///@brief The profile mask of a seed repeated in every block, as the CSP
+/// packs a user profile, encoded to be removed from like
+seal::Plaintext RecSys::packedProfileMask(uint64_t seed,
+                                          const seal::Ciphertext& like) {
+  std::vector<uint64_t> mask = fheScheme->maskFromSeed(seed, d, 0);
+  std::vector<uint64_t> maskPacked(sealSlotCount, 0ULL);
+  for (size_t block = 0; block < sealSlotCount; block += d) {
+    std::copy(mask.begin(), mask.begin() + d, maskPacked.begin() + block);
+  }
+  seal::Plaintext maskPackedPlain;
+  fheScheme->encode(maskPacked, like, maskPackedPlain);
+  return maskPackedPlain;
+}
+
+///@brief Sum each d dimension block of the products of user and item
+/// vectors into its first slot - with rotations when the keys are available,
+/// otherwise masked through the CSP
+std::vector<seal::Ciphertext> RecSys::reducePredictions(
+    std::vector<seal::Ciphertext>& dDimensionalMultiplication) {
+  // Sum each profile with rotations when the keys are available, leaving the
+  // 2^alpha the CSP would have removed - see getPredictionScaleBits
+  if (slotSumEnabled) {
+    std::vector<seal::Ciphertext> result(dDimensionalMultiplication.size());
+    for (int i = 0; i < dDimensionalMultiplication.size(); i++) {
+      sumSlots(dDimensionalMultiplication[i], result[i], d);
+    }
+    return result;
   }
 
-  // Mask d-dimensional multiplication result
-  std::vector<std::vector<uint64_t>> dDimensionalMultiplicationMask(
+  // Mask d-dimensional multiplication result, every block of it. The CSP
+  // removes alpha bits from the block sums
+  std::vector<uint64_t> dDimensionalMultiplicationSeed(
       dDimensionalMultiplication.size());
   for (int i = 0; i < dDimensionalMultiplication.size(); i++) {
-    dDimensionalMultiplicationMask[i] = generateMaskFHE();
+    dDimensionalMultiplicationSeed[i] = distr(gen);
     seal::Plaintext encodedMaskRow;
-    sealBatchEncoder.encode(dDimensionalMultiplicationMask[i], encodedMaskRow);
+    fheScheme->encode(
+        fheScheme->maskFromSeed(dDimensionalMultiplicationSeed[i],
+                                sealSlotCount, alpha),
+        dDimensionalMultiplication.at(i), encodedMaskRow);
     sealEvaluator.add_plain_inplace(dDimensionalMultiplication.at(i),
                                     encodedMaskRow);
   }
 
-  // Get masked entry wise sum from CSP
+  // Get masked blockwise sums from CSP
   std::vector<seal::Ciphertext> result =
       CSPInstance->reducePredictionVector(dDimensionalMultiplication);
+  countRoundTrip(serialisedSize(dDimensionalMultiplication),
+                 serialisedSize(result));
 
-  // Remove entry wise sum of mask
+  // Remove the sum of the mask of each block
   for (int i = 0; i < result.size(); i++) {
+    std::vector<uint64_t> curRowMask(sealSlotCount, 0ULL);
+    fheScheme->addMaskFromSeed(dDimensionalMultiplicationSeed.at(i),
+                               sealSlotCount, curRowMask, alpha);
     std::vector<uint64_t> curRowMaskSum(sealSlotCount, 0ULL);
-    for (int j = 0; j < sealSlotCount; j++) {
-      curRowMaskSum[0] += dDimensionalMultiplicationMask.at(i).at(j);
+    for (size_t block = 0; block < sealSlotCount; block += d) {
+      curRowMaskSum[block] = fheScheme->sum(curRowMask.data() + block, d, 0);
     }
-    curRowMaskSum[0] = curRowMaskSum[0] >> alpha;
     seal::Plaintext curRowMaskSumPlain;
-    sealBatchEncoder.encode(curRowMaskSum, curRowMaskSumPlain);
+    fheScheme->encode(curRowMaskSum, result.at(i), curRowMaskSumPlain);
     sealEvaluator.sub_plain_inplace(result.at(i), curRowMaskSumPlain);
   }
 
-  return {orderofItems, result};
+  return result;
+}
+
+///@brief The packed profile of a user for cached item vectors, with one
+/// CSP round trip for the hat of the user's first entry
+///@return false if the user has no entries
+bool RecSys::cachedUserVector(int user, seal::Ciphertext& UVector) {
+  int first = -1;
+  for (int i = 0; i < M.size() && first < 0; i++) {
+    if (M.at(i).first == user)
+      first = i;
+  }
+  if (first < 0)
+    return false;
+
+  std::vector<uint64_t> UHatMask = generateMaskFHE();
+  seal::Plaintext maskPlain;
+  seal::Ciphertext maskedUHat;
+  CiphertextHandle UHatFirst = UHat.get(first);
+  fheScheme->encode(UHatMask, UHatFirst, maskPlain);
+  sealEvaluator.add_plain(UHatFirst, maskPlain, maskedUHat);
+  UVector = CSPInstance->calculateUiVector(maskedUHat);
+  countRoundTrip(serialisedSize({maskedUHat}), serialisedSize({UVector}));
+
+  std::vector<uint64_t> uMaskPacked(sealSlotCount, 0ULL);
+  for (size_t block = 0; block < sealSlotCount; block += d) {
+    std::copy(UHatMask.begin(), UHatMask.begin() + d,
+              uMaskPacked.begin() + block);
+  }
+  seal::Plaintext uMaskPackedPlain;
+  fheScheme->encode(uMaskPacked, UVector, uMaskPackedPlain);
+  sealEvaluator.sub_plain_inplace(UVector, uMaskPackedPlain);
+  return true;
+}
+
+///@brief Keep the unmasked item vectors for the other users of this model,
+/// when they fit the limit. They are fetched once per model version, and are
+/// not evicted to make room for users
+void RecSys::cacheItemVectors(const std::vector<int>& items,
+                              const std::vector<seal::Ciphertext>& VVector) {
+  uint64_t bytes = serialisedSize(VVector);
+  if (predictionCacheLimit == 0 || bytes > predictionCacheLimit ||
+      !cachedVVectors.empty())
+    return;
+  cachedItems = items;
+  cachedVVectors = VVector;
+  predictionCacheMetrics.itemVectorBytes = bytes;
+}
+
+///@brief Keep a user's predictions, evicting the least recently used users
+/// until the cache is back within its limit
+void RecSys::cachePredictions(int user,
+                              const std::vector<seal::Ciphertext>& results) {
+  if (predictionCacheLimit == 0)
+    return;
+  uint64_t bytes = serialisedSize(results);
+  predictionLru.push_front(user);
+  predictionCache[user] = {results, bytes, predictionLru.begin()};
+  predictionCacheMetrics.bytes += bytes;
+  while (predictionCacheMetrics.bytes > predictionCacheLimit &&
+         !predictionLru.empty()) {
+    auto victim = predictionCache.find(predictionLru.back());
+    predictionCacheMetrics.bytes -= victim->second.bytes;
+    predictionCacheMetrics.evictions++;
+    predictionCache.erase(victim);
+    predictionLru.pop_back();
+  }
+}
+
+///@brief Drop every cached prediction and item vector
+void RecSys::clearPredictionCache() {
+  predictionCache.clear();
+  predictionLru.clear();
+  cachedItems.clear();
+  cachedVVectors.clear();
+  predictionCacheMetrics.bytes = 0;
+  predictionCacheMetrics.itemVectorBytes = 0;
+}
+
+///@brief U or V have changed, so cached predictions are stale
+void RecSys::modelChanged() {
+  modelVersion++;
+}
+
+///@brief Bound the memory of the prediction cache in bytes of serialised
+/// ciphertexts, 0 to disable it. Clears the cache
+void RecSys::setPredictionCacheLimit(uint64_t bytes) {
+  predictionCacheLimit = bytes;
+  clearPredictionCache();
 }
 
 /// @brief Set the space of ratings
 void RecSys::setM(const std::vector<std::pair<int, int>> providedM) {
   M = providedM;
-  RecSys::f.reserve(M.size());
+  RecSys::f.resize(M.size());
+  RecSys::R.resize(M.size());
+  indexRows();
+  modelChanged();
 }
 
 /// Set the encrypted ratings vector
 void RecSys::setRatings(const std::vector<seal::Ciphertext> providedRatings) {
-  r = providedRatings;
+  r.assign(providedRatings);
 }
 
 /// Set the embedding vectors
@@ -420,8 +1329,65 @@ void RecSys::setEmbeddings(const std::vector<seal::Ciphertext> providedU,
                            const std::vector<seal::Ciphertext> providedV,
                            const std::vector<seal::Ciphertext> providedUHat,
                            const std::vector<seal::Ciphertext> providedVHat) {
-  U = providedU;
-  V = providedV;
-  UHat = providedUHat;
-  VHat = providedVHat;
+  U.assign(providedU);
+  V.assign(providedV);
+  UHat.assign(providedUHat);
+  VHat.assign(providedVHat);
+  // New profiles start at rest
+  UVelocity.assign(UVelocity.size(), seal::Ciphertext());
+  VVelocity.assign(VVelocity.size(), seal::Ciphertext());
+  modelChanged();
+}
+
+/// @brief Chunking and memory limit of every per-entry ciphertext vector.
+/// Call before setRatings and setEmbeddings so nothing is held in memory twice
+void RecSys::setStorageOptions(const CiphertextStore::Options& options) {
+  for (CiphertextStore* store : {&r, &f, &R, &U, &V, &UHat, &VHat}) {
+    store->configure(options);
+  }
+}
+
+///@brief Profile gradientDescent and computePredictions step by step, and
+/// the CSP methods when the CSP shares the profiler. Null turns it off
+void RecSys::setProfiler(std::shared_ptr<Profiler> stepProfiler) {
+  profiler = std::move(stepProfiler);
+}
+
+///@brief Report the containers RecSys holds between steps to a profiled step
+void RecSys::trackContainers(Profiler::Scope& step) {
+  if (!step.active())
+    return;
+  const std::pair<const char*, CiphertextStore*> stores[] = {
+      {"r", &r}, {"f", &f},       {"R", &R},      {"U", &U},
+      {"V", &V}, {"UHat", &UHat}, {"VHat", &VHat}};
+  for (const auto& [name, store] : stores) {
+    step.track(name, store->getMemoryUsage());
+  }
+  step.track("UGradient", UGradient);
+  step.track("VGradient", VGradient);
+  step.track("UVelocity", UVelocity);
+  step.track("VVelocity", VVelocity);
+  step.track("packed ratings", packedRatings);
+  step.track("constants", fheScheme->constants());
+  Profiler::Usage cache = Profiler::usageOf(cachedVVectors);
+  for (const auto& [user, cached] : predictionCache) {
+    Profiler::Usage results = Profiler::usageOf(cached.results);
+    cache.count += results.count;
+    cache.bytes += results.bytes;
+  }
+  step.track("prediction cache", cache);
+}
+
+///@brief Memory held by mask seeds, one word each
+Profiler::Usage RecSys::seedUsage(size_t seeds) {
+  return {seeds, seeds * sizeof(uint64_t)};
+}
+
+/// @brief Cache metrics summed over every per-entry ciphertext vector
+CiphertextStore::Metrics RecSys::getStorageMetrics() {
+  CiphertextStore::Metrics metrics;
+  for (CiphertextStore* store : {&r, &f, &R, &U, &V, &UHat, &VHat}) {
+    metrics += store->getMetrics();
+  }
+  return metrics;
 }
\ No newline at end of file
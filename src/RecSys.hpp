@@ -2,11 +2,19 @@
 #include <math.h>
 #include <seal/ciphertext.h>
 #include <seal/seal.h>
+#include <list>
+#include <map>
 #include <memory>
 #include <vector>
+#include "AHE.hpp"
 #include "CSP.hpp"
+#include "CiphertextStore.hpp"
+#include "FHEScheme.hpp"
+#include "FixedPoint.hpp"
 #include "MessageHandler.hpp"
+#include "Profiler.hpp"
 #include "Ratings.hpp"
+#include "Setup.hpp"
 
 // AHE libraries
 #include <cryptopp/osrng.h>
@@ -15,13 +23,11 @@
 #include <limits>
 #include <random>
 
-#define scaled0point1 104857
 class RecSys {
   // Values and Variables
   std::shared_ptr<CSP> CSPInstance;
   std::shared_ptr<MessageHandler> MessageHandlerInstance;
   CryptoPP::AutoSeededRandomPool rng;
-  std::vector<EncryptedRating> ratings;
   std::vector<int> users;
   std::vector<int> movies;
 
@@ -31,36 +37,128 @@ class RecSys {
   std::random_device rd;
   std::mt19937_64 gen;
   std::uniform_int_distribution<unsigned long long> distr;
+  bool replay = false;  // Masks come from the seeded gen only
+
+  // Upload phase - AHE encryptors for masking, built on first use, and the
+  // packed converted ratings with the (user, item) and (ciphertext, slot) of
+  // each uploaded rating, held until loadUploadedRatings moves them into r
+  int aheMaskBits = 20;  // Bits of the AHE masks
+  std::shared_ptr<AHEEncryptor> aheEncryptorElGamal, aheEncryptorEC;
+  std::vector<seal::Ciphertext> packedRatings;
+  std::vector<std::pair<int, int>> uploadedM;
+  std::vector<std::pair<size_t, size_t>> uploadedSlots;
 
   // SEAL values and variables
   seal::SEALContext sealContext;
   seal::Evaluator sealEvaluator;
-  seal::BatchEncoder sealBatchEncoder;
+  std::shared_ptr<FHEScheme> fheScheme;  // Encodes constants, masks, slots
   size_t sealSlotCount;
 
   // Parameters for RS
-  int d;                   // Dimension of profiles
-  int alpha = 20;          // Number of integer bits for real numbers
-  int beta = 20;           // Number of fractional bits for real numbers
+  using Encoding = ProtocolFixedPoint;
+  static constexpr int alpha = Encoding::alpha;  // Bits for profiles
+  static constexpr int beta = Encoding::beta;    // Bits for the gain factor
+  int d;                   // Dimension of profiles, see setDimension
   double gamma = 0.1;      // Small gain factor
   double lambda = 0.05;    // Learning rate
   double threshold = 0.5;  // Threshold for stopping criterion
   int maxEpochs = 10;  // Maximum number of iterations for gradient descent -
                        // regardless of if stopping criterion met
+  double momentum = 0;  // Weight of each row's previous step, see setMomentum
 
-  // Intermediate values for gradient descent
+  // Intermediate values for gradient descent. The per-entry vectors are
+  // stores which may spill to disk, see setStorageOptions
   std::vector<std::pair<int, int>> M;
-  std::vector<seal::Ciphertext> R, r, f, U, V, UHat, VHat, UGradient, VGradient;
-  seal::Plaintext twoToTheAlpha, twoToTheBeta, twoToTheAlphaPlusBeta,
-      scaledLambda, scaledGamma;
+  CiphertextStore r, f, R, U, V, UHat, VHat;
+  std::vector<seal::Ciphertext> UGradient, VGradient;
+  // Previous step of each user and item row with momentum, empty until the
+  // row is first updated. UGradient and VGradient then hold the new steps
+  std::vector<seal::Ciphertext> UVelocity, VVelocity;
+  uint64_t scaledThreshold;
+
+  // Slot summation with Galois rotations instead of a CSP round trip. Training
+  // only uses it when the extra 2^alpha fits in the plain modulus
+  bool slotSumEnabled = false, slotSumTraining = false;
+  seal::RelinKeys sealRelinKeys;
+  seal::GaloisKeys sealGaloisKeys;
 
   bool stoppingCriterionCheckResult = false;
+  std::vector<double> epochTimes;  // Wall time of each epoch in milliseconds
+  std::vector<size_t> epochActiveEntries;  // Entries of M trained each epoch
+  std::shared_ptr<Profiler> profiler;  // Null unless setProfiler is called
+
+ public:
+  // Data exchanged with the CSP during training and prediction, with
+  // ciphertexts counted at their uncompressed serialised size
+  struct Traffic {
+    uint64_t bytesSent = 0, bytesReceived = 0;
+    uint64_t roundTrips = 0;
+  };
+
+ private:
+  Traffic traffic;
+
+  // Prediction cache - the unmasked packed item vectors and each user's
+  // prediction ciphertexts, valid for one model version. The version changes
+  // whenever U or V do. Users are evicted least recently used first once
+  // their predictions exceed the byte limit, see setPredictionCacheLimit. The
+  // item vectors are kept apart from that budget, when they fit the limit
+  struct CachedPredictions {
+    std::vector<seal::Ciphertext> results;
+    uint64_t bytes;
+    std::list<int>::iterator lruPosition;
+  };
+  uint64_t modelVersion = 0, cacheVersion = 0;
+  uint64_t predictionCacheLimit = 0;  // Bytes, 0 disables the cache
+  std::vector<int> cachedItems;
+  std::vector<seal::Ciphertext> cachedVVectors;
+  std::map<int, CachedPredictions> predictionCache;
+  std::list<int> predictionLru;
+
+ public:
+  struct PredictionCacheMetrics {
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    uint64_t bytes = 0;            // Held by user predictions now
+    uint64_t itemVectorBytes = 0;  // Held by the item vectors now
+  };
+
+ private:
+  PredictionCacheMetrics predictionCacheMetrics;
+
+  // Convergence tracking - the row of each entry of M and whether the row is
+  // still being trained. Converged rows are frozen and skipped in later epochs
+  std::vector<int> entryUserRow, entryItemRow;
+  std::vector<bool> userRowActive, itemRowActive;
+
   // Functions
   std::vector<uint64_t> generateMaskFHE();
-  uint8_t generateMaskAHE();
+  std::vector<uint64_t> generateMaskFHE(size_t slots);
+  uint64_t generateMaskAHE();
+  std::shared_ptr<AHEEncryptor> getEncryptorAHE(AHEScheme scheme);
   bool stoppingCriterionCheck(
       const std::vector<seal::Ciphertext>& UGradientParam,
       const std::vector<seal::Ciphertext>& VGradientParam);
+  void indexRows();
+  std::vector<int> activeUserEntries();
+  std::vector<int> activeItemEntries();
+  std::vector<int> activeEntries();
+  static uint64_t serialisedSize(
+      const std::vector<seal::Ciphertext>& ciphertexts);
+  void countRoundTrip(uint64_t bytesSent, uint64_t bytesReceived);
+  void modelChanged();
+  void clearPredictionCache();
+  void cachePredictions(int user, const std::vector<seal::Ciphertext>& results);
+  void cacheItemVectors(const std::vector<int>& items,
+                        const std::vector<seal::Ciphertext>& VVector);
+  bool cachedUserVector(int user, seal::Ciphertext& UVector);
+  std::vector<int> removeItemMasks(const std::vector<uint64_t>& VHatSeed,
+                                   std::vector<seal::Ciphertext>& VVector);
+  seal::Plaintext packedProfileMask(uint64_t seed,
+                                    const seal::Ciphertext& like);
+  std::vector<seal::Ciphertext> reducePredictions(
+      std::vector<seal::Ciphertext>& dDimensionalMultiplication);
+  void trackContainers(Profiler::Scope& step);
+  static Profiler::Usage seedUsage(size_t seeds);
 
  public:
   RecSys(std::shared_ptr<CSP> csp,
@@ -69,13 +167,63 @@ class RecSys {
          std::vector<std::pair<int, int>> providedM);
 
   bool uploadRating(EncryptedRatingAHE rating);
+  bool uploadRatings(const std::vector<EncryptedRatingAHE>& ratings,
+                     AHEScheme scheme = AHEScheme::ElGamal);
+  size_t loadUploadedRatings();
+  size_t addUploadedEntries(const seal::Encryptor& encryptor,
+                            const SetupOptions& options = SetupOptions());
+  const std::vector<seal::Ciphertext>& getPackedRatings() const {
+    return packedRatings;
+  }
+  const std::vector<std::pair<int, int>>& getUploadedM() const {
+    return uploadedM;
+  }
+  const std::vector<std::pair<size_t, size_t>>& getUploadedSlots() const {
+    return uploadedSlots;
+  }
+  std::vector<int> slotSumRotationSteps() const;
+  void enableSlotSum(const seal::RelinKeys& relinKeys,
+                     const seal::GaloisKeys& galoisKeys);
+  void sumSlots(const seal::Ciphertext& in,
+                seal::Ciphertext& out,
+                size_t width = 0);
+  void setDimension(int dimension);
+  int getDimension() const { return d; }
+  // Fractional bits of the predictions from computePredictions, 0 on CKKS
+  int getPredictionScaleBits() const {
+    return fheScheme->predictionScaleBits(slotSumEnabled);
+  }
+  // Ciphertext and slot of the prediction for item index of
+  // computePredictions, with slot count / d predictions per ciphertext
+  std::pair<size_t, size_t> predictionSlot(size_t index) const {
+    size_t perCiphertext = sealSlotCount / d;
+    return {index / perCiphertext, (index % perCiphertext) * d};
+  }
+  void setSeed(uint64_t seed);
+  void setMomentum(double weight);
+  void setMaxEpochs(int epochs);
   bool gradientDescent();
   std::pair<std::vector<int>, std::vector<seal::Ciphertext>> computePredictions(
       int user);
+  std::vector<std::pair<std::vector<int>, std::vector<seal::Ciphertext>>>
+  computePredictions(const std::vector<int>& requestedUsers);
   void setM(const std::vector<std::pair<int, int>> providedM);
+  const std::vector<std::pair<int, int>>& getM() const { return M; }
   void setRatings(const std::vector<seal::Ciphertext> providedRatings);
   void setEmbeddings(const std::vector<seal::Ciphertext> providedU,
                      const std::vector<seal::Ciphertext> providedV,
                      const std::vector<seal::Ciphertext> providedUHat,
                      const std::vector<seal::Ciphertext> providedVHat);
+  void setStorageOptions(const CiphertextStore::Options& options);
+  CiphertextStore::Metrics getStorageMetrics();
+  void setProfiler(std::shared_ptr<Profiler> stepProfiler);
+  const std::vector<double>& getEpochTimes() const { return epochTimes; }
+  const std::vector<size_t>& getEpochActiveEntries() const {
+    return epochActiveEntries;
+  }
+  const Traffic& getTraffic() const { return traffic; }
+  void setPredictionCacheLimit(uint64_t bytes);
+  const PredictionCacheMetrics& getPredictionCacheMetrics() const {
+    return predictionCacheMetrics;
+  }
 };
\ No newline at end of file
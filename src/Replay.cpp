@@ -0,0 +1,76 @@
+#include "Replay.hpp"
+#include <cstddef>
+#include "Setup.hpp"
+
+namespace {
+///@brief SplitMix64 step, expanding one seed into many independent words
+uint64_t splitMix64(uint64_t& state) {
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+seal::prng_seed_type expandSeed(uint64_t seed) {
+  seal::prng_seed_type expanded;
+  for (uint64_t& word : expanded) {
+    word = splitMix64(seed);
+  }
+  return expanded;
+}
+}  // namespace
+
+///@brief Split the configured seed into one seed per source of randomness
+ReplaySeeds deriveReplaySeeds(uint64_t seed) {
+  ReplaySeeds seeds;
+  seeds.seal = splitMix64(seed);
+  seeds.masks = splitMix64(seed);
+  seeds.csp = splitMix64(seed);
+  seeds.dataset = splitMix64(seed);
+  return seeds;
+}
+
+ReplayPRNGFactory::ReplayPRNGFactory(uint64_t seed)
+    : seal::UniformRandomGeneratorFactory(expandSeed(seed)),
+      baseSeed(expandSeed(seed)) {}
+
+///@brief The n-th generator is seeded with the base seed mixed with n
+std::shared_ptr<seal::UniformRandomGenerator> ReplayPRNGFactory::create_impl(
+    seal::prng_seed_type) {
+  uint64_t counter = created++;
+  seal::prng_seed_type seed = baseSeed;
+  for (uint64_t& word : seed) {
+    word ^= splitMix64(counter);
+  }
+  return std::make_shared<seal::Blake2xbPRNG>(seed);
+}
+
+ReplayRandomNumberGenerator::ReplayRandomNumberGenerator(uint64_t seed) {
+  seal::prng_seed_type expanded = expandSeed(seed);
+  const CryptoPP::byte* bytes =
+      reinterpret_cast<const CryptoPP::byte*>(expanded.data());
+  // AES-256 key and a 16 byte IV from the expanded seed
+  SetKeyWithIV(bytes, 32, bytes + 32, 16);
+}
+
+///@brief defaultEncryptionParameters drawing all randomness from the seed
+seal::EncryptionParameters replayEncryptionParameters(uint64_t seed) {
+  seal::EncryptionParameters parms = defaultEncryptionParameters();
+  parms.set_random_generator(std::make_shared<ReplayPRNGFactory>(seed));
+  return parms;
+}
+
+uint64_t ciphertextDigest(const std::vector<seal::Ciphertext>& ciphertexts,
+                          uint64_t digest) {
+  std::vector<std::byte> buffer;
+  for (const seal::Ciphertext& ciphertext : ciphertexts) {
+    buffer.resize(ciphertext.save_size(seal::compr_mode_type::none));
+    size_t size = ciphertext.save(buffer.data(), buffer.size(),
+                                  seal::compr_mode_type::none);
+    for (size_t i = 0; i < size; i++) {
+      digest ^= static_cast<uint64_t>(buffer[i]);
+      digest *= 1099511628211ULL;
+    }
+  }
+  return digest;
+}
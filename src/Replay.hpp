@@ -0,0 +1,48 @@
+#pragma once
+#include <cryptopp/aes.h>
+#include <cryptopp/modes.h>
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Deterministic replay for benchmarking. One configured seed is split into
+// independent seeds for the SEAL keys and encryptions, the RecSys masks, the
+// CSP's AHE keys and dataset sampling, so identical inputs do identical work.
+// Replay mode is not secure and must not be used outside of benchmarks
+
+struct ReplaySeeds {
+  uint64_t seal, masks, csp, dataset;
+};
+
+ReplaySeeds deriveReplaySeeds(uint64_t seed);
+
+// SEAL random generator factory handing out a distinct Blake2xb generator per
+// request, each seeded from the base seed and a counter. Requests made in the
+// same order give the same keys and ciphertexts
+class ReplayPRNGFactory : public seal::UniformRandomGeneratorFactory {
+  seal::prng_seed_type baseSeed;
+  std::atomic<uint64_t> created{0};
+
+ protected:
+  std::shared_ptr<seal::UniformRandomGenerator> create_impl(
+      seal::prng_seed_type seed) override;
+
+ public:
+  explicit ReplayPRNGFactory(uint64_t seed);
+};
+
+// Crypto++ generator keyed from a seed, for deterministic AHE key generation
+class ReplayRandomNumberGenerator
+    : public CryptoPP::OFB_Mode<CryptoPP::AES>::Encryption {
+ public:
+  explicit ReplayRandomNumberGenerator(uint64_t seed);
+};
+
+seal::EncryptionParameters replayEncryptionParameters(uint64_t seed);
+
+// FNV-1a digest of the serialised ciphertexts, to compare traces between runs
+uint64_t ciphertextDigest(const std::vector<seal::Ciphertext>& ciphertexts,
+                          uint64_t digest = 14695981039346656037ULL);
@@ -0,0 +1,139 @@
+#include "ResultContainer.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+ResultContainerWriter::ResultContainerWriter(size_t dimension, int scaleBits) {
+  std::copy(std::begin(ResultContainer::magic),
+            std::end(ResultContainer::magic), header.magic);
+  header.version = ResultContainer::version;
+  header.dimension = static_cast<uint32_t>(dimension);
+  header.scaleBits = static_cast<uint32_t>(scaleBits);
+}
+
+///@brief Append the predictions of one user, as returned by
+/// computePredictions, serialising the ciphertexts into the payload
+void ResultContainerWriter::add(int user,
+                                const std::vector<int>& userItems,
+                                const std::vector<seal::Ciphertext>& results) {
+  ResultContainer::UserEntry entry{};
+  entry.user = user;
+  entry.itemCount = static_cast<uint32_t>(userItems.size());
+  entry.firstItem = static_cast<uint32_t>(items.size());
+  entry.firstCiphertext = static_cast<uint32_t>(offsets.size());
+  entry.ciphertextCount = static_cast<uint32_t>(results.size());
+  users.push_back(entry);
+  items.insert(items.end(), userItems.begin(), userItems.end());
+
+  for (const seal::Ciphertext& ciphertext : results) {
+    size_t offset = payload.size();
+    payload.resize(offset + ciphertext.save_size());
+    size_t size = ciphertext.save(payload.data() + offset,
+                                  payload.size() - offset);
+    payload.resize(offset + size);
+    offsets.push_back({offset, size});
+  }
+}
+
+///@brief Write the header, tables and payload to path in one write
+///@return bytes written
+uint64_t ResultContainerWriter::write(const std::string& path) const {
+  ResultContainer::Header fullHeader = header;
+  fullHeader.userCount = static_cast<uint32_t>(users.size());
+  fullHeader.itemCount = static_cast<uint32_t>(items.size());
+  fullHeader.ciphertextCount = static_cast<uint32_t>(offsets.size());
+
+  size_t tablesSize = sizeof(fullHeader) +
+                      users.size() * sizeof(ResultContainer::UserEntry) +
+                      items.size() * sizeof(int32_t) +
+                      offsets.size() * sizeof(ResultContainer::CiphertextEntry);
+  std::vector<char> buffer(tablesSize + payload.size());
+  char* position = buffer.data();
+  auto append = [&](const void* data, size_t size) {
+    if (size > 0)
+      std::memcpy(position, data, size);
+    position += size;
+  };
+  append(&fullHeader, sizeof(fullHeader));
+  append(users.data(), users.size() * sizeof(ResultContainer::UserEntry));
+  append(items.data(), items.size() * sizeof(int32_t));
+  append(offsets.data(),
+         offsets.size() * sizeof(ResultContainer::CiphertextEntry));
+  append(payload.data(), payload.size());
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(buffer.data(), buffer.size());
+  if (!out)
+    throw std::runtime_error("ResultContainer: failed to write " + path);
+  return buffer.size();
+}
+
+///@brief Open a container and read its tables
+ResultContainerReader::ResultContainerReader(
+    const seal::SEALContext& sealcontext,
+    const std::string& containerPath)
+    : context(sealcontext), path(containerPath) {
+  std::ifstream in(path, std::ios::binary);
+  in.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (!in || !std::equal(std::begin(ResultContainer::magic),
+                         std::end(ResultContainer::magic), header.magic))
+    throw std::runtime_error("ResultContainer: " + path +
+                             " is not a result container");
+  if (header.version != ResultContainer::version)
+    throw std::runtime_error("ResultContainer: unsupported version " +
+                             std::to_string(header.version));
+
+  users.resize(header.userCount);
+  items.resize(header.itemCount);
+  offsets.resize(header.ciphertextCount);
+  in.read(reinterpret_cast<char*>(users.data()),
+          users.size() * sizeof(ResultContainer::UserEntry));
+  in.read(reinterpret_cast<char*>(items.data()),
+          items.size() * sizeof(int32_t));
+  in.read(reinterpret_cast<char*>(offsets.data()),
+          offsets.size() * sizeof(ResultContainer::CiphertextEntry));
+  if (!in)
+    throw std::runtime_error("ResultContainer: truncated tables in " + path);
+  payloadStart = static_cast<uint64_t>(in.tellg());
+}
+
+std::vector<int> ResultContainerReader::getUsers() const {
+  std::vector<int> result;
+  for (const ResultContainer::UserEntry& entry : users) {
+    result.push_back(entry.user);
+  }
+  return result;
+}
+
+///@brief Load the items and prediction ciphertexts of one user, seeking to
+/// their part of the payload
+///@return false if the user is not in the container
+bool ResultContainerReader::read(
+    int user,
+    std::vector<int>& userItems,
+    std::vector<seal::Ciphertext>& results) const {
+  auto entry = std::find_if(
+      users.begin(), users.end(),
+      [user](const ResultContainer::UserEntry& e) { return e.user == user; });
+  if (entry == users.end())
+    return false;
+  userItems.assign(items.begin() + entry->firstItem,
+                   items.begin() + entry->firstItem + entry->itemCount);
+
+  std::ifstream in(path, std::ios::binary);
+  results.assign(entry->ciphertextCount, seal::Ciphertext());
+  std::vector<std::byte> buffer;
+  for (uint32_t k = 0; k < entry->ciphertextCount; k++) {
+    const ResultContainer::CiphertextEntry& offset =
+        offsets.at(entry->firstCiphertext + k);
+    buffer.resize(offset.size);
+    in.seekg(payloadStart + offset.offset);
+    in.read(reinterpret_cast<char*>(buffer.data()), offset.size);
+    if (!in)
+      throw std::runtime_error("ResultContainer: truncated payload in " +
+                               path);
+    results[k].load(context, buffer.data(), offset.size);
+  }
+  return true;
+}
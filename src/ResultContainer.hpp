@@ -0,0 +1,90 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// One file holding the prediction ciphertexts of a batch of queries, in place
+// of a file per ciphertext. The layout is
+//   header - magic, version, profile dimension d, prediction scale bits and
+//            the number of users, items and ciphertexts
+//   user table - user, item count and the index of their first item and
+//                first ciphertext
+//   item table - the items of every user, in computePredictions order
+//   offset table - offset and size of every ciphertext in the payload
+//   payload - the ciphertexts, serialised with SEAL's default compression
+// The tables are read when the file is opened, and a user's ciphertexts are
+// loaded on request without reading the rest of the payload
+namespace ResultContainer {
+constexpr char magic[8] = {'P', 'P', 'R', 'S', 'R', 'E', 'S', '1'};
+constexpr uint32_t version = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t dimension, scaleBits;
+  uint32_t userCount, itemCount, ciphertextCount;
+};
+
+struct UserEntry {
+  int32_t user;
+  uint32_t itemCount, firstItem, firstCiphertext, ciphertextCount;
+};
+
+struct CiphertextEntry {
+  uint64_t offset, size;
+};
+
+///@brief Ciphertext and slot of the prediction for item index, with slot
+/// count / d predictions per ciphertext as RecSys::predictionSlot
+inline std::pair<size_t, size_t> predictionSlot(size_t index,
+                                                size_t slotCount,
+                                                size_t dimension) {
+  size_t perCiphertext = slotCount / dimension;
+  return {index / perCiphertext, (index % perCiphertext) * dimension};
+}
+}  // namespace ResultContainer
+
+// Collects the results of a query batch in memory and writes the container
+// with one buffered write
+class ResultContainerWriter {
+  ResultContainer::Header header{};
+  std::vector<ResultContainer::UserEntry> users;
+  std::vector<int32_t> items;
+  std::vector<ResultContainer::CiphertextEntry> offsets;
+  std::vector<std::byte> payload;
+
+ public:
+  ResultContainerWriter(size_t dimension, int scaleBits);
+
+  void add(int user,
+           const std::vector<int>& userItems,
+           const std::vector<seal::Ciphertext>& results);
+  uint64_t write(const std::string& path) const;
+};
+
+// Reads a container written by ResultContainerWriter, for the frontend
+class ResultContainerReader {
+  seal::SEALContext context;
+  std::string path;
+  ResultContainer::Header header{};
+  std::vector<ResultContainer::UserEntry> users;
+  std::vector<int32_t> items;
+  std::vector<ResultContainer::CiphertextEntry> offsets;
+  uint64_t payloadStart = 0;
+
+ public:
+  ResultContainerReader(const seal::SEALContext& sealcontext,
+                        const std::string& containerPath);
+
+  std::vector<int> getUsers() const;
+  bool read(int user,
+            std::vector<int>& userItems,
+            std::vector<seal::Ciphertext>& results) const;
+  size_t getDimension() const { return header.dimension; }
+  int getScaleBits() const { return static_cast<int>(header.scaleBits); }
+};
@@ -0,0 +1,253 @@
+#include "Setup.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include "FixedPoint.hpp"
+#include "Parallel.hpp"
+
+///@brief BGV parameters used by the protocol
+seal::EncryptionParameters defaultEncryptionParameters() {
+  seal::EncryptionParameters parms(seal::scheme_type::bgv);
+  size_t poly_modulus_degree =
+      16384;  // Change to 4096 for optimal speed, however this will need to be
+              // changed in the frontend too if using that
+  parms.set_poly_modulus_degree(poly_modulus_degree);
+  parms.set_coeff_modulus(seal::CoeffModulus::BFVDefault(poly_modulus_degree));
+  parms.set_plain_modulus(
+      seal::PlainModulus::Batching(poly_modulus_degree,
+                                   defaultPlainModulusBits));
+  return parms;
+}
+
+///@brief CKKS parameters for the approximate backend. Nothing is rescaled,
+/// so the 140 bits below the 60 bit key switching prime hold U' at scale
+/// 2^(2 ckksScaleBits + beta) with its mask
+seal::EncryptionParameters ckksEncryptionParameters() {
+  seal::EncryptionParameters parms(seal::scheme_type::ckks);
+  size_t poly_modulus_degree = 8192;
+  parms.set_poly_modulus_degree(poly_modulus_degree);
+  parms.set_coeff_modulus(seal::CoeffModulus::Create(
+      poly_modulus_degree, {60, ckksScaleBits, ckksScaleBits, 60}));
+  return parms;
+}
+
+///@brief Whether profiles of dimension d can be packed slotCount / d to a
+/// ciphertext - d must be every slot, or a power of two fitting in a row so
+/// that rotations sum each profile on its own
+bool isValidDimension(size_t dimension, size_t slotCount) {
+  if (dimension == slotCount)
+    return true;
+  return dimension > 0 && dimension <= slotCount / 2 &&
+         (dimension & (dimension - 1)) == 0;
+}
+
+namespace {
+///@brief Run encrypt(i) for every i in [0, count), with threads taking
+/// batches of consecutive indices from a shared counter until none are left
+void encryptInBatches(size_t count,
+                      const SetupOptions& options,
+                      const std::function<void(size_t)>& encrypt) {
+  size_t batchSize = std::max<size_t>(options.batchSize, 1);
+  size_t batches = (count + batchSize - 1) / batchSize;
+  size_t threads = options.threads == 0 ? defaultThreadCount()
+                                        : options.threads;
+  std::atomic<size_t> nextBatch{0};
+  parallelFor(
+      std::min(threads, batches),
+      [&](size_t, size_t) {
+        for (size_t batch = nextBatch++; batch < batches;
+             batch = nextBatch++) {
+          size_t end = std::min(count, (batch + 1) * batchSize);
+          for (size_t i = batch * batchSize; i < end; i++) {
+            encrypt(i);
+          }
+        }
+      },
+      threads);
+}
+
+///@brief Profile of every key, all ones or uniform in [1, randomMax] drawn
+/// from the seeded generator in key order, in the first dimension slots. The
+/// values have the alpha fractional bits RecSys trains profiles with
+std::map<int, seal::Plaintext> encodeProfiles(
+    const std::set<int>& keys,
+    const SetupOptions& options,
+    std::mt19937_64& gen,
+    const seal::BatchEncoder& encoder) {
+  std::map<int, seal::Plaintext> profiles;
+  size_t dimension =
+      options.dimension == 0 ? encoder.slot_count() : options.dimension;
+  std::vector<uint64_t> values(encoder.slot_count(), 0ULL);
+  if (options.randomMax == 0) {
+    // Every profile is the same, so encode it once
+    std::fill(values.begin(), values.begin() + dimension,
+              ProtocolFixedPoint::twoToTheAlpha);
+    seal::Plaintext ones;
+    encoder.encode(values, ones);
+    for (int key : keys) {
+      profiles.emplace(key, ones);
+    }
+    return profiles;
+  }
+  std::uniform_int_distribution<uint64_t> distr(1, options.randomMax);
+  for (int key : keys) {
+    for (size_t j = 0; j < dimension; j++) {
+      values[j] = distr(gen) << ProtocolFixedPoint::alpha;
+    }
+    encoder.encode(values, profiles[key]);
+  }
+  return profiles;
+}
+}  // namespace
+
+///@brief Encrypt each rating into slot 0 of its own ciphertext, encoding each
+/// distinct rating once
+std::vector<seal::Ciphertext> encryptRatings(
+    const std::vector<int>& ratings,
+    const seal::Encryptor& encryptor,
+    const seal::BatchEncoder& encoder,
+    const SetupOptions& options) {
+  std::map<int, seal::Plaintext> ratingPlains;
+  for (int rating : ratings) {
+    if (ratingPlains.find(rating) != ratingPlains.end())
+      continue;
+    std::vector<uint64_t> ratingEncodingVector(encoder.slot_count(), 0ULL);
+    ratingEncodingVector[0] = static_cast<uint64_t>(rating);
+    encoder.encode(ratingEncodingVector, ratingPlains[rating]);
+  }
+
+  std::vector<seal::Ciphertext> encryptedRatings(ratings.size());
+  encryptInBatches(ratings.size(), options, [&](size_t i) {
+    encryptor.encrypt(ratingPlains.at(ratings[i]), encryptedRatings[i]);
+  });
+  return encryptedRatings;
+}
+
+///@brief Encrypt initial U and V for every entry of M, with UHat and VHat
+/// holding U or V at the first entry of each user or item and zero elsewhere.
+/// Each user and item profile is encoded once and shared by its entries
+Embeddings createEmbeddings(const std::vector<std::pair<int, int>>& M,
+                            const seal::Encryptor& encryptor,
+                            const seal::BatchEncoder& encoder,
+                            const SetupOptions& options) {
+  if (options.dimension != 0 &&
+      !isValidDimension(options.dimension, encoder.slot_count()))
+    throw std::invalid_argument("createEmbeddings: invalid profile dimension");
+  std::set<int> users, items;
+  for (auto [user, item] : M) {
+    users.insert(user);
+    items.insert(item);
+  }
+  std::mt19937_64 gen(options.seed);
+  std::map<int, seal::Plaintext> userProfiles =
+      encodeProfiles(users, options, gen, encoder);
+  std::map<int, seal::Plaintext> itemProfiles =
+      encodeProfiles(items, options, gen, encoder);
+
+  // The first entry of each user and item, whose hat copies the profile
+  std::vector<bool> firstOfUser(M.size()), firstOfItem(M.size());
+  int prevUser = -1;
+  std::set<int> observedItems{};
+  for (int i = 0; i < M.size(); i++) {
+    firstOfUser[i] = M[i].first != prevUser;
+    firstOfItem[i] = observedItems.insert(M[i].second).second;
+    prevUser = M[i].first;
+  }
+
+  Embeddings embeddings;
+  embeddings.U.resize(M.size());
+  embeddings.V.resize(M.size());
+  embeddings.UHat.resize(M.size());
+  embeddings.VHat.resize(M.size());
+  encryptInBatches(M.size(), options, [&](size_t i) {
+    encryptor.encrypt(userProfiles.at(M[i].first), embeddings.U[i]);
+    encryptor.encrypt(itemProfiles.at(M[i].second), embeddings.V[i]);
+    if (firstOfUser[i])
+      embeddings.UHat[i] = embeddings.U[i];
+    else
+      encryptor.encrypt_zero(embeddings.UHat[i]);
+    if (firstOfItem[i])
+      embeddings.VHat[i] = embeddings.V[i];
+    else
+      encryptor.encrypt_zero(embeddings.VHat[i]);
+  });
+  return embeddings;
+}
+
+///@brief Encrypt each rating into slot 0 of its own ciphertext, as
+/// encryptRatings does, encoding each distinct rating once
+std::vector<seal::Ciphertext> encryptRatingsCKKS(
+    const std::vector<int>& ratings,
+    const seal::Encryptor& encryptor,
+    const seal::CKKSEncoder& encoder,
+    const SetupOptions& options) {
+  double scale = std::ldexp(1.0, ckksScaleBits);
+  std::map<int, seal::Plaintext> ratingPlains;
+  for (int rating : ratings) {
+    if (ratingPlains.find(rating) != ratingPlains.end())
+      continue;
+    std::vector<double> ratingEncodingVector(encoder.slot_count(), 0.0);
+    ratingEncodingVector[0] = rating;
+    encoder.encode(ratingEncodingVector, scale, ratingPlains[rating]);
+  }
+
+  std::vector<seal::Ciphertext> encryptedRatings(ratings.size());
+  encryptInBatches(ratings.size(), options, [&](size_t i) {
+    encryptor.encrypt(ratingPlains.at(ratings[i]), encryptedRatings[i]);
+  });
+  return encryptedRatings;
+}
+
+///@brief createEmbeddings for CKKS, with all ones profiles. Zero hats are
+/// encryptions of an encoded zero so they share the scale of the profiles
+Embeddings createEmbeddingsCKKS(const std::vector<std::pair<int, int>>& M,
+                                const seal::Encryptor& encryptor,
+                                const seal::CKKSEncoder& encoder,
+                                const SetupOptions& options) {
+  if (options.dimension != 0 &&
+      !isValidDimension(options.dimension, encoder.slot_count()))
+    throw std::invalid_argument(
+        "createEmbeddingsCKKS: invalid profile dimension");
+  size_t dimension =
+      options.dimension == 0 ? encoder.slot_count() : options.dimension;
+  double scale = std::ldexp(1.0, ckksScaleBits);
+  std::vector<double> values(encoder.slot_count(), 0.0);
+  seal::Plaintext zeros, ones;
+  encoder.encode(values, scale, zeros);
+  std::fill(values.begin(), values.begin() + dimension, 1.0);
+  encoder.encode(values, scale, ones);
+
+  std::vector<bool> firstOfUser(M.size()), firstOfItem(M.size());
+  int prevUser = -1;
+  std::set<int> observedItems{};
+  for (int i = 0; i < M.size(); i++) {
+    firstOfUser[i] = M[i].first != prevUser;
+    firstOfItem[i] = observedItems.insert(M[i].second).second;
+    prevUser = M[i].first;
+  }
+
+  Embeddings embeddings;
+  embeddings.U.resize(M.size());
+  embeddings.V.resize(M.size());
+  embeddings.UHat.resize(M.size());
+  embeddings.VHat.resize(M.size());
+  encryptInBatches(M.size(), options, [&](size_t i) {
+    encryptor.encrypt(ones, embeddings.U[i]);
+    encryptor.encrypt(ones, embeddings.V[i]);
+    if (firstOfUser[i])
+      embeddings.UHat[i] = embeddings.U[i];
+    else
+      encryptor.encrypt(zeros, embeddings.UHat[i]);
+    if (firstOfItem[i])
+      embeddings.VHat[i] = embeddings.V[i];
+    else
+      encryptor.encrypt(zeros, embeddings.VHat[i]);
+  });
+  return embeddings;
+}
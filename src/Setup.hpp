@@ -0,0 +1,54 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Encrypted embeddings for every entry of M
+struct Embeddings {
+  std::vector<seal::Ciphertext> U, V, UHat, VHat;
+};
+
+// Initial encryption - threads take batches of ciphertexts to encrypt. With
+// randomMax set every user and item profile slot is drawn uniformly from
+// [1, randomMax] with the seeded generator, otherwise profiles are all ones.
+// Profiles fill the first dimension slots and the rest are zero. BGV profiles
+// are encoded with the ProtocolFixedPoint alpha fractional bits, and ratings
+// as integers
+struct SetupOptions {
+  size_t threads = 0;      // 0 for the hardware count
+  size_t batchSize = 32;   // Ciphertexts per batch
+  uint64_t randomMax = 0;  // 0 for all ones profiles
+  uint64_t seed = 0;       // Seed for random profiles
+  size_t dimension = 0;    // Profile dimension d, 0 for every slot
+};
+
+// Bits of the CKKS scale, see ckksEncryptionParameters
+constexpr int ckksScaleBits = 40;
+
+seal::EncryptionParameters defaultEncryptionParameters();
+seal::EncryptionParameters ckksEncryptionParameters();
+bool isValidDimension(size_t dimension, size_t slotCount);
+std::vector<seal::Ciphertext> encryptRatings(
+    const std::vector<int>& ratings,
+    const seal::Encryptor& encryptor,
+    const seal::BatchEncoder& encoder,
+    const SetupOptions& options = SetupOptions());
+Embeddings createEmbeddings(const std::vector<std::pair<int, int>>& M,
+                            const seal::Encryptor& encryptor,
+                            const seal::BatchEncoder& encoder,
+                            const SetupOptions& options = SetupOptions());
+
+// CKKS variants, encoding at scale 2^ckksScaleBits with the same layout, for
+// RecSys and the CSP on CKKS parameters
+std::vector<seal::Ciphertext> encryptRatingsCKKS(
+    const std::vector<int>& ratings,
+    const seal::Encryptor& encryptor,
+    const seal::CKKSEncoder& encoder,
+    const SetupOptions& options = SetupOptions());
+Embeddings createEmbeddingsCKKS(const std::vector<std::pair<int, int>>& M,
+                                const seal::Encryptor& encryptor,
+                                const seal::CKKSEncoder& encoder,
+                                const SetupOptions& options = SetupOptions());
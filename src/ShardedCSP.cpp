@@ -0,0 +1,629 @@
+#include "ShardedCSP.hpp"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include "Parallel.hpp"
+#include "WorkPlan.hpp"
+
+namespace {
+// Blocking socket I/O - requests and responses are length prefixed and the
+// ciphertexts are sent uncompressed
+void writeAll(int socket, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t written = ::send(socket, bytes, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      throw std::runtime_error("ShardedCSP: worker socket write failed");
+    bytes += written;
+    size -= written;
+  }
+}
+
+void readAll(int socket, void* data, size_t size) {
+  char* bytes = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t received = ::recv(socket, bytes, size, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      throw std::runtime_error("ShardedCSP: worker socket read failed");
+    bytes += received;
+    size -= received;
+  }
+}
+
+template <class T>
+void writeValue(int socket, T value) {
+  writeAll(socket, &value, sizeof(value));
+}
+
+template <class T>
+T readValue(int socket) {
+  T value;
+  readAll(socket, &value, sizeof(value));
+  return value;
+}
+
+void writeCiphertexts(int socket,
+                      const std::vector<seal::Ciphertext>& ciphertexts) {
+  writeValue<uint64_t>(socket, ciphertexts.size());
+  std::vector<std::byte> buffer;
+  for (const seal::Ciphertext& ciphertext : ciphertexts) {
+    buffer.resize(ciphertext.save_size(seal::compr_mode_type::none));
+    uint64_t size = ciphertext.save(buffer.data(), buffer.size(),
+                                    seal::compr_mode_type::none);
+    writeValue<uint64_t>(socket, size);
+    writeAll(socket, buffer.data(), size);
+  }
+}
+
+std::vector<seal::Ciphertext> readCiphertexts(
+    int socket,
+    const seal::SEALContext& context) {
+  std::vector<seal::Ciphertext> ciphertexts(readValue<uint64_t>(socket));
+  std::vector<std::byte> buffer;
+  for (seal::Ciphertext& ciphertext : ciphertexts) {
+    buffer.resize(readValue<uint64_t>(socket));
+    readAll(socket, buffer.data(), buffer.size());
+    ciphertext.load(context, buffer.data(), buffer.size());
+  }
+  return ciphertexts;
+}
+
+void writeEntries(int socket, const std::vector<int>& entries) {
+  writeValue<uint64_t>(socket, entries.size());
+  writeAll(socket, entries.data(), entries.size() * sizeof(int));
+}
+
+std::vector<int> readEntries(int socket) {
+  std::vector<int> entries(readValue<uint64_t>(socket));
+  readAll(socket, entries.data(), entries.size() * sizeof(int));
+  return entries;
+}
+
+void writeString(int socket, const std::string& value) {
+  writeValue<uint64_t>(socket, value.size());
+  writeAll(socket, value.data(), value.size());
+}
+
+std::string readString(int socket) {
+  std::string value(readValue<uint64_t>(socket), '\0');
+  readAll(socket, value.data(), value.size());
+  return value;
+}
+
+// Profiled steps of a worker, sent after each result
+void writeSteps(int socket, const std::vector<Profiler::Step>& steps) {
+  writeValue<uint64_t>(socket, steps.size());
+  for (const Profiler::Step& step : steps) {
+    writeString(socket, step.name);
+    writeValue(socket, step.calls);
+    writeValue(socket, step.totalMs);
+    writeValue(socket, step.rssBytes);
+    writeValue(socket, step.peakRssBytes);
+    writeValue(socket, step.poolBytes);
+    writeValue<uint8_t>(socket, step.countersAvailable);
+    writeValue(socket, step.counters);
+    writeValue<uint64_t>(socket, step.containers.size());
+    for (const auto& [container, usage] : step.containers) {
+      writeString(socket, container);
+      writeValue(socket, usage);
+    }
+  }
+}
+
+std::vector<Profiler::Step> readSteps(int socket) {
+  std::vector<Profiler::Step> steps(readValue<uint64_t>(socket));
+  for (Profiler::Step& step : steps) {
+    step.name = readString(socket);
+    step.calls = readValue<uint64_t>(socket);
+    step.totalMs = readValue<double>(socket);
+    step.rssBytes = readValue<uint64_t>(socket);
+    step.peakRssBytes = readValue<uint64_t>(socket);
+    step.poolBytes = readValue<uint64_t>(socket);
+    step.countersAvailable = readValue<uint8_t>(socket) != 0;
+    step.counters = readValue<Profiler::Counters>(socket);
+    uint64_t containers = readValue<uint64_t>(socket);
+    for (uint64_t c = 0; c < containers; c++) {
+      std::string container = readString(socket);
+      step.containers[container] = readValue<Profiler::Usage>(socket);
+    }
+  }
+  return steps;
+}
+
+template <class T>
+std::vector<T> select(const std::vector<T>& values,
+                      const std::vector<size_t>& positions) {
+  std::vector<T> result;
+  result.reserve(positions.size());
+  for (size_t position : positions) {
+    result.push_back(values.at(position));
+  }
+  return result;
+}
+}  // namespace
+
+/// @brief Fork the worker processes
+/// @param workerCount - number of workers, 0 for one per hardware thread
+ShardedCSP::ShardedCSP(std::shared_ptr<MessageHandler> messagehandler,
+                       seal::SEALContext& sealcontext,
+                       seal::PublicKey const& sealhpk,
+                       seal::SecretKey const& sealprivatekey,
+                       std::vector<std::pair<int, int>> providedM,
+                       size_t workerCount)
+    : CSP(messagehandler, sealcontext, sealhpk, sealprivatekey, providedM),
+      shardContext(sealcontext) {
+  if (workerCount == 0)
+    workerCount = defaultThreadCount();
+  assignRows(workerCount);
+
+  for (size_t i = 0; i < workerCount; i++) {
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+      throw std::runtime_error("ShardedCSP: socketpair failed");
+
+    pid_t pid = ::fork();
+    if (pid < 0)
+      throw std::runtime_error("ShardedCSP: fork failed");
+    if (pid == 0) {
+      // Worker - drop the coordinator's ends and serve until shutdown,
+      // aggregating on its share of the hardware threads
+      ::close(sockets[0]);
+      for (const Worker& worker : workers) {
+        ::close(worker.socket);
+      }
+      setAggregationThreads(
+          std::max<size_t>(defaultThreadCount() / workerCount, 1));
+      serve(sockets[1]);
+      ::_exit(0);
+    }
+    ::close(sockets[1]);
+    workers.push_back(Worker{pid, sockets[0]});
+  }
+}
+
+ShardedCSP::~ShardedCSP() {
+  for (const Worker& worker : workers) {
+    try {
+      writeValue<uint32_t>(worker.socket,
+                           static_cast<uint32_t>(Operation::Shutdown));
+    } catch (const std::runtime_error&) {
+      // Worker already gone
+    }
+    ::close(worker.socket);
+    ::waitpid(worker.pid, nullptr, 0);
+  }
+}
+
+/// @brief Worker loop - answer requests with the single process CSP
+/// implementation over this worker's rows
+void ShardedCSP::serve(int socket) {
+  while (true) {
+    Operation operation;
+    int rescaleBits = 0;
+    uint64_t dimension = 0;
+    std::vector<int> entries;
+    std::vector<seal::Ciphertext> in;
+    EncryptionPool::Options poolOptions;
+    bool profiling = false;
+    try {
+      operation = static_cast<Operation>(readValue<uint32_t>(socket));
+      switch (operation) {
+        case Operation::Shutdown:
+          return;
+        case Operation::SetEncryptionPool:
+          poolOptions.depth = readValue<uint64_t>(socket);
+          poolOptions.threads = readValue<uint64_t>(socket);
+          poolOptions.symmetric = readValue<uint8_t>(socket) != 0;
+          break;
+        case Operation::SetProfiling:
+          profiling = readValue<uint8_t>(socket) != 0;
+          break;
+        case Operation::PoolMetrics:
+          break;
+        default:
+          rescaleBits = readValue<int32_t>(socket);
+          dimension = readValue<uint64_t>(socket);
+          entries = readEntries(socket);
+          in = readCiphertexts(socket, shardContext);
+      }
+    } catch (const std::runtime_error&) {
+      return;  // Coordinator gone
+    }
+
+    // Settings carry no result, and steps only follow the results
+    bool settings = operation == Operation::SetEncryptionPool ||
+                    operation == Operation::SetProfiling;
+    std::vector<std::vector<seal::Ciphertext>> out;
+    std::string error;
+    try {
+      switch (operation) {
+        case Operation::SetEncryptionPool:
+          CSP::setEncryptionPool(poolOptions);
+          break;
+        case Operation::SetProfiling:
+          CSP::setProfiler(profiling ? std::make_shared<Profiler>()
+                                     : nullptr);
+          break;
+        case Operation::PoolMetrics:
+          break;
+        case Operation::SumF:
+          setDimension(dimension);
+          out.push_back(CSP::sumF(in));
+          break;
+        case Operation::NewUandUHat: {
+          setDimension(dimension);
+          auto [newU, newUHat] =
+              CSP::calculateNewUandUHat(in, entries, rescaleBits);
+          out = {newU, newUHat};
+          break;
+        }
+        case Operation::NewVandVHat: {
+          setDimension(dimension);
+          auto [newV, newVHat] =
+              CSP::calculateNewVandVHat(in, entries, rescaleBits);
+          out = {newV, newVHat};
+          break;
+        }
+        case Operation::NewUGradient:
+          setDimension(dimension);
+          out.push_back(CSP::calculateNewUGradient(in, entries, rescaleBits));
+          break;
+        case Operation::NewVGradient:
+          setDimension(dimension);
+          out.push_back(CSP::calculateNewVGradient(in, entries, rescaleBits));
+          break;
+        default:
+          error = "unknown operation";
+      }
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+
+    // Status, then either the error or the response - the pool metrics, or
+    // the result vectors and the steps profiled since the last response
+    try {
+      writeValue<uint32_t>(socket, error.empty() ? 0 : 1);
+      if (!error.empty()) {
+        writeString(socket, error);
+        continue;
+      }
+      if (settings)
+        continue;
+      if (operation == Operation::PoolMetrics) {
+        writeValue(socket, CSP::getEncryptionPoolMetrics());
+        continue;
+      }
+      writeValue<uint32_t>(socket, out.size());
+      for (const auto& ciphertexts : out) {
+        writeCiphertexts(socket, ciphertexts);
+      }
+      std::vector<Profiler::Step> steps;
+      if (profiler) {
+        steps = profiler->getSteps();
+        profiler->clear();
+      }
+      writeSteps(socket, steps);
+    } catch (const std::runtime_error&) {
+      return;
+    }
+  }
+}
+
+/// @brief The workers were forked with M and own its rows, so the rating
+/// space cannot change
+void ShardedCSP::setM(const std::vector<std::pair<int, int>>&) {
+  throw std::logic_error("ShardedCSP: M is fixed once the workers are forked");
+}
+
+/// @brief Pool the coordinator's re-encryptions and those of every worker.
+/// Each worker re-encrypts the rows it owns, so it keeps its share of the
+/// depth
+void ShardedCSP::setEncryptionPool(const EncryptionPool::Options& options) {
+  CSP::setEncryptionPool(options);
+  EncryptionPool::Options workerOptions = options;
+  if (options.depth > 0)
+    workerOptions.depth = (options.depth + workers.size() - 1) / workers.size();
+  broadcast(
+      Operation::SetEncryptionPool,
+      [&](int socket) {
+        writeValue<uint64_t>(socket, workerOptions.depth);
+        writeValue<uint64_t>(socket, workerOptions.threads);
+        writeValue<uint8_t>(socket, workerOptions.symmetric);
+      },
+      [](int) {});
+}
+
+/// @brief Pool metrics summed over the coordinator and the workers
+EncryptionPool::Metrics ShardedCSP::getEncryptionPoolMetrics() {
+  EncryptionPool::Metrics total = CSP::getEncryptionPoolMetrics();
+  broadcast(
+      Operation::PoolMetrics, [](int) {},
+      [&](int socket) {
+        auto metrics = readValue<EncryptionPool::Metrics>(socket);
+        total.hits += metrics.hits;
+        total.misses += metrics.misses;
+        total.generated += metrics.generated;
+        total.available += metrics.available;
+      });
+  return total;
+}
+
+/// @brief Profile the workers too. Their steps are added to methodProfiler
+/// as each response arrives, named after the worker
+void ShardedCSP::setProfiler(std::shared_ptr<Profiler> methodProfiler) {
+  CSP::setProfiler(methodProfiler);
+  bool profiling = methodProfiler != nullptr;
+  broadcast(
+      Operation::SetProfiling,
+      [&](int socket) { writeValue<uint8_t>(socket, profiling); },
+      [](int) {});
+}
+
+/// @brief Send a request without ciphertexts to each worker in turn, and
+/// read its response once the status shows it succeeded
+void ShardedCSP::broadcast(Operation operation,
+                           const std::function<void(int)>& writeRequest,
+                           const std::function<void(int)>& readResponse) {
+  for (size_t s = 0; s < workers.size(); s++) {
+    int socket = workers[s].socket;
+    writeValue<uint32_t>(socket, static_cast<uint32_t>(operation));
+    writeRequest(socket);
+    if (readValue<uint32_t>(socket) != 0)
+      throw std::runtime_error("ShardedCSP: worker " + std::to_string(s) +
+                               ": " + readString(socket));
+    readResponse(socket);
+  }
+}
+
+/// @brief Give each user and each item of M to a worker, balancing the
+/// entries of M rather than the number of rows. Rows stay whole, as a worker
+/// needs every entry of a row for its hat and its aggregate
+void ShardedCSP::assignRows(size_t workerCount) {
+  for (bool byUser : {true, false}) {
+    std::map<int, uint64_t> entriesOfRow;
+    for (const auto& [user, item] : M) {
+      entriesOfRow[byUser ? user : item]++;
+    }
+    std::vector<int> rows;
+    std::vector<uint64_t> units;
+    for (const auto& [row, count] : entriesOfRow) {
+      rows.push_back(row);
+      units.push_back(count);
+    }
+    WorkPlan plan = WorkPlan::byCost(units, workerCount, false);
+    std::map<int, size_t>& shards = byUser ? userShards : itemShards;
+    for (size_t r = 0; r < rows.size(); r++) {
+      shards[rows[r]] = plan.owners[r];
+    }
+  }
+}
+
+/// @brief Worker owning a user or item row
+size_t ShardedCSP::shardOfRow(int row, bool byUser) const {
+  const std::map<int, size_t>& shards = byUser ? userShards : itemShards;
+  auto owner = shards.find(row);
+  if (owner == shards.end())
+    throw std::invalid_argument("ShardedCSP: row " + std::to_string(row) +
+                                " is not in M");
+  return owner->second;
+}
+
+/// @brief Split entries by the worker owning their user or item, keeping the
+/// order of entries within each worker
+/// @param positions - set to the positions in entries given to each worker
+std::vector<std::vector<int>> ShardedCSP::partitionEntries(
+    const std::vector<int>& entries,
+    bool byUser,
+    std::vector<std::vector<size_t>>& positions) const {
+  std::vector<std::vector<int>> shardEntries(workers.size());
+  positions.assign(workers.size(), {});
+  for (size_t k = 0; k < entries.size(); k++) {
+    const auto& [user, item] = M.at(entries[k]);
+    size_t shard = shardOfRow(byUser ? user : item, byUser);
+    shardEntries[shard].push_back(entries[k]);
+    positions[shard].push_back(k);
+  }
+  return shardEntries;
+}
+
+/// @brief Send one request to every worker with input and wait for all the
+/// responses. Workers with no ciphertexts are skipped and get no result
+std::vector<std::vector<std::vector<seal::Ciphertext>>> ShardedCSP::fanOut(
+    Operation operation,
+    const std::vector<std::vector<seal::Ciphertext>>& ciphertexts,
+    const std::vector<std::vector<int>>& entries,
+    int rescaleBits) {
+  std::vector<std::vector<std::vector<seal::Ciphertext>>> results(
+      workers.size());
+  std::vector<std::string> errors(workers.size());
+  parallelFor(
+      workers.size(),
+      [&](size_t begin, size_t end) {
+        for (size_t s = begin; s < end; s++) {
+          if (ciphertexts[s].empty())
+            continue;
+          try {
+            int socket = workers[s].socket;
+            writeValue<uint32_t>(socket, static_cast<uint32_t>(operation));
+            writeValue<int32_t>(socket, rescaleBits);
+            writeValue<uint64_t>(socket, getDimension());
+            writeEntries(socket, entries[s]);
+            writeCiphertexts(socket, ciphertexts[s]);
+
+            if (readValue<uint32_t>(socket) != 0) {
+              errors[s] = readString(socket);
+              continue;
+            }
+            results[s].resize(readValue<uint32_t>(socket));
+            for (auto& result : results[s]) {
+              result = readCiphertexts(socket, shardContext);
+            }
+            std::vector<Profiler::Step> steps = readSteps(socket);
+            for (Profiler::Step& step : steps) {
+              step.name += " (worker " + std::to_string(s) + ")";
+            }
+            if (profiler)
+              profiler->merge(steps);
+          } catch (const std::exception& e) {
+            errors[s] = e.what();
+          }
+        }
+      },
+      workers.size());
+
+  for (size_t s = 0; s < workers.size(); s++) {
+    if (!errors[s].empty())
+      throw std::runtime_error("ShardedCSP: worker " + std::to_string(s) +
+                               ": " + errors[s]);
+  }
+  return results;
+}
+
+/// @brief Interleave per-row results from the workers into the order rows
+/// first appear in entries, as the single process aggregation returns them
+std::vector<seal::Ciphertext> ShardedCSP::mergeRows(
+    const std::vector<int>& entries,
+    bool byUser,
+    const std::vector<std::vector<seal::Ciphertext>>& shardRows) const {
+  std::vector<seal::Ciphertext> result;
+  std::vector<size_t> next(workers.size(), 0);
+  std::set<int> seen;
+  for (int entry : entries) {
+    const auto& [user, item] = M.at(entry);
+    int row = byUser ? user : item;
+    if (!seen.insert(row).second)
+      continue;
+    size_t shard = shardOfRow(row, byUser);
+    result.push_back(shardRows[shard].at(next[shard]++));
+  }
+  return result;
+}
+
+/// @brief Steps 3-4, split evenly as each ciphertext is summed on its own
+std::vector<seal::Ciphertext> ShardedCSP::sumF(
+    std::vector<seal::Ciphertext> f) {
+  std::vector<std::vector<seal::Ciphertext>> chunks(workers.size());
+  size_t chunk = (f.size() + workers.size() - 1) / workers.size();
+  for (size_t i = 0; i < f.size(); i++) {
+    chunks[i / chunk].push_back(f[i]);
+  }
+  auto results = fanOut(Operation::SumF, chunks,
+                        std::vector<std::vector<int>>(workers.size()), 0);
+
+  std::vector<seal::Ciphertext> result;
+  result.reserve(f.size());
+  for (const auto& shardResult : results) {
+    if (!shardResult.empty())
+      result.insert(result.end(), shardResult[0].begin(),
+                    shardResult[0].end());
+  }
+  return result;
+}
+
+/// @brief Step 8, with users partitioned across the workers
+std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
+ShardedCSP::calculateNewUandUHat(std::vector<seal::Ciphertext> maskedUPrime,
+                                 const std::vector<int>& entries,
+                                 int rescaleBits) {
+  std::vector<std::vector<size_t>> positions;
+  std::vector<std::vector<int>> shardEntries =
+      partitionEntries(entries, true, positions);
+  std::vector<std::vector<seal::Ciphertext>> shardInput(workers.size());
+  for (size_t s = 0; s < workers.size(); s++) {
+    shardInput[s] = select(maskedUPrime, positions[s]);
+  }
+  auto results = fanOut(Operation::NewUandUHat, shardInput, shardEntries,
+                        rescaleBits);
+
+  // The first entry of each user is on the worker owning it, so UHat is
+  // correct entry by entry
+  std::vector<seal::Ciphertext> newU(entries.size()), newUHat(entries.size());
+  for (size_t s = 0; s < workers.size(); s++) {
+    for (size_t k = 0; k < positions[s].size(); k++) {
+      newU[positions[s][k]] = results[s].at(0).at(k);
+      newUHat[positions[s][k]] = results[s].at(1).at(k);
+    }
+  }
+  return std::make_pair(newU, newUHat);
+}
+
+/// @brief Step 8, with items partitioned across the workers
+std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
+ShardedCSP::calculateNewVandVHat(std::vector<seal::Ciphertext> maskedVPrime,
+                                 const std::vector<int>& entries,
+                                 int rescaleBits) {
+  std::vector<std::vector<size_t>> positions;
+  std::vector<std::vector<int>> shardEntries =
+      partitionEntries(entries, false, positions);
+  std::vector<std::vector<seal::Ciphertext>> shardInput(workers.size());
+  for (size_t s = 0; s < workers.size(); s++) {
+    shardInput[s] = select(maskedVPrime, positions[s]);
+  }
+  auto results = fanOut(Operation::NewVandVHat, shardInput, shardEntries,
+                        rescaleBits);
+
+  std::vector<seal::Ciphertext> newV(entries.size()), newVHat(entries.size());
+  for (size_t s = 0; s < workers.size(); s++) {
+    for (size_t k = 0; k < positions[s].size(); k++) {
+      newV[positions[s][k]] = results[s].at(0).at(k);
+      newVHat[positions[s][k]] = results[s].at(1).at(k);
+    }
+  }
+  return std::make_pair(newV, newVHat);
+}
+
+/// @brief Step 9, each worker aggregating the users it owns
+std::vector<seal::Ciphertext> ShardedCSP::calculateNewUGradient(
+    std::vector<seal::Ciphertext> maskedUGradientPrime,
+    const std::vector<int>& entries,
+    int rescaleBits) {
+  std::vector<std::vector<size_t>> positions;
+  std::vector<std::vector<int>> shardEntries =
+      partitionEntries(entries, true, positions);
+  std::vector<std::vector<seal::Ciphertext>> shardInput(workers.size());
+  for (size_t s = 0; s < workers.size(); s++) {
+    shardInput[s] = select(maskedUGradientPrime, positions[s]);
+  }
+  auto results = fanOut(Operation::NewUGradient, shardInput, shardEntries,
+                        rescaleBits);
+
+  std::vector<std::vector<seal::Ciphertext>> shardRows(workers.size());
+  for (size_t s = 0; s < workers.size(); s++) {
+    if (!results[s].empty())
+      shardRows[s] = results[s][0];
+  }
+  return mergeRows(entries, true, shardRows);
+}
+
+/// @brief Step 9, each worker aggregating the items it owns
+std::vector<seal::Ciphertext> ShardedCSP::calculateNewVGradient(
+    std::vector<seal::Ciphertext> maskedVGradientPrime,
+    const std::vector<int>& entries,
+    int rescaleBits) {
+  std::vector<std::vector<size_t>> positions;
+  std::vector<std::vector<int>> shardEntries =
+      partitionEntries(entries, false, positions);
+  std::vector<std::vector<seal::Ciphertext>> shardInput(workers.size());
+  for (size_t s = 0; s < workers.size(); s++) {
+    shardInput[s] = select(maskedVGradientPrime, positions[s]);
+  }
+  auto results = fanOut(Operation::NewVGradient, shardInput, shardEntries,
+                        rescaleBits);
+
+  std::vector<std::vector<seal::Ciphertext>> shardRows(workers.size());
+  for (size_t s = 0; s < workers.size(); s++) {
+    if (!results[s].empty())
+      shardRows[s] = results[s][0];
+  }
+  return mergeRows(entries, false, shardRows);
+}
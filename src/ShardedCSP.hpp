@@ -0,0 +1,104 @@
+#pragma once
+#include <seal/ciphertext.h>
+#include <seal/seal.h>
+#include <sys/types.h>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "CSP.hpp"
+#include "EncryptionPool.hpp"
+#include "MessageHandler.hpp"
+#include "Profiler.hpp"
+
+// CSP whose decrypt-aggregate-encrypt steps are spread over local worker
+// processes. Each worker is forked from the coordinator, so it shares the key
+// material, and owns users (Step 8/9 U side) and items (V side) handed out by
+// their number of entries in M, heaviest first to the least loaded worker.
+// Rows never span workers, so the partial aggregations only need to be put
+// back in the order of the entries. M must be sorted by user, as RecSys
+// requires. Every aggregation request carries the profile dimension. The
+// encryption pool and profiler settings are passed on to the workers, whose
+// profiled steps come back with their results
+class ShardedCSP : public CSP {
+  // Request types understood by the workers
+  enum class Operation : uint32_t {
+    SumF,
+    NewUandUHat,
+    NewVandVHat,
+    NewUGradient,
+    NewVGradient,
+    SetEncryptionPool,
+    SetProfiling,
+    PoolMetrics,
+    Shutdown
+  };
+
+  struct Worker {
+    pid_t pid;
+    int socket;
+  };
+
+  seal::SEALContext shardContext;
+  std::vector<Worker> workers;
+  std::map<int, size_t> userShards, itemShards;  // Owner of each row of M
+
+  void assignRows(size_t workerCount);
+  size_t shardOfRow(int row, bool byUser) const;
+  std::vector<std::vector<int>> partitionEntries(
+      const std::vector<int>& entries,
+      bool byUser,
+      std::vector<std::vector<size_t>>& positions) const;
+  std::vector<std::vector<std::vector<seal::Ciphertext>>> fanOut(
+      Operation operation,
+      const std::vector<std::vector<seal::Ciphertext>>& ciphertexts,
+      const std::vector<std::vector<int>>& entries,
+      int rescaleBits);
+  void broadcast(Operation operation,
+                 const std::function<void(int)>& writeRequest,
+                 const std::function<void(int)>& readResponse);
+  std::vector<seal::Ciphertext> mergeRows(
+      const std::vector<int>& entries,
+      bool byUser,
+      const std::vector<std::vector<seal::Ciphertext>>& shardRows) const;
+  void serve(int socket);
+
+ public:
+  ShardedCSP(std::shared_ptr<MessageHandler> messagehandler,
+             seal::SEALContext& sealcontext,
+             seal::PublicKey const& sealhpk,
+             seal::SecretKey const& sealprivatekey,
+             std::vector<std::pair<int, int>> providedM,
+             size_t workerCount);
+  ~ShardedCSP() override;
+  ShardedCSP(const ShardedCSP&) = delete;
+  ShardedCSP& operator=(const ShardedCSP&) = delete;
+
+  size_t getWorkerCount() const { return workers.size(); }
+  /// @brief Throws: the workers own the rows of the M they were forked with,
+  /// so RecSys::addUploadedEntries cannot be used with a sharded CSP
+  void setM(const std::vector<std::pair<int, int>>& providedM) override;
+  void setEncryptionPool(const EncryptionPool::Options& options) override;
+  EncryptionPool::Metrics getEncryptionPoolMetrics() override;
+  void setProfiler(std::shared_ptr<Profiler> methodProfiler) override;
+
+  std::vector<seal::Ciphertext> sumF(std::vector<seal::Ciphertext> f) override;
+  std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
+  calculateNewUandUHat(std::vector<seal::Ciphertext> maskedUPrime,
+                       const std::vector<int>& entries,
+                       int rescaleBits) override;
+  std::pair<std::vector<seal::Ciphertext>, std::vector<seal::Ciphertext>>
+  calculateNewVandVHat(std::vector<seal::Ciphertext> maskedVPrime,
+                       const std::vector<int>& entries,
+                       int rescaleBits) override;
+  std::vector<seal::Ciphertext> calculateNewUGradient(
+      std::vector<seal::Ciphertext> maskedUGradientPrime,
+      const std::vector<int>& entries,
+      int rescaleBits) override;
+  std::vector<seal::Ciphertext> calculateNewVGradient(
+      std::vector<seal::Ciphertext> maskedVGradientPrime,
+      const std::vector<int>& entries,
+      int rescaleBits) override;
+};
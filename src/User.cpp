@@ -1,21 +1,16 @@
 #include "User.hpp"
 
-///@brief Encrypt all the ratings in User's class
-bool User::encryptRatingsAHE() {
-  // Go through all stored ratings
-  for (auto pt : ratings) {
-    // Setup enc and plaintext variables
-    CryptoPP::SecByteBlock ratingEnc;
-    CryptoPP::SecByteBlock rating(sizeof(pt.rating));
-    *rating = pt.rating;
-
-    // Encrypt
-    ahe_Encryptor.Encrypt(rng, rating, rating.size(), ratingEnc);
+///@brief Set the ratings held by the user
+void User::setRatings(const std::vector<PlainRating> providedRatings) {
+  ratings = providedRatings;
+}
 
-    // Add the encrypted rating to the vector
-    ahe_encryptedRatings.push_back(
-        EncryptedRatingAHE(pt.userID, pt.itemID, ratingEnc));
-  }
+///@brief Encrypt all the ratings in User's class, as one batch across threads
+bool User::encryptRatingsAHE() {
+  std::vector<EncryptedRatingAHE> encrypted =
+      aheEncryptor->encryptBatch(ratings);
+  ahe_encryptedRatings.insert(ahe_encryptedRatings.end(), encrypted.begin(),
+                              encrypted.end());
   return true;
 }
 
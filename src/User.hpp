@@ -1,7 +1,9 @@
 #pragma once
 #include <cryptopp/elgamal.h>
 #include <cryptopp/osrng.h>
+#include <memory>
 #include <vector>
+#include "AHE.hpp"
 #include "CSP.hpp"
 #include "Ratings.hpp"
 
@@ -15,14 +17,23 @@ class User {
   CryptoPP::ElGamalKeys::PublicKey ahe_PublicKey;
   CryptoPP::ElGamalKeys::PublicKey ahe_CSPPublicKey;
   CryptoPP::ElGamal::Decryptor ahe_Decryptor;
-  CryptoPP::ElGamal::Encryptor ahe_Encryptor;
+  std::shared_ptr<AHEEncryptor> aheEncryptor;
 
  public:
-  User(CSP csp) {
+  User(const CSP& csp, AHEScheme scheme = AHEScheme::ElGamal) {
     ahe_CSPPublicKey = csp.getPublicKeyAHE();
-    ahe_Encryptor = CryptoPP::ElGamal::Encryptor(ahe_CSPPublicKey);
+    if (scheme == AHEScheme::ECElGamal) {
+      aheEncryptor = std::make_shared<ECElGamalAHEEncryptor>(
+          csp.getGroupParametersECAHE(), csp.getPublicKeyECAHE());
+    } else {
+      aheEncryptor = std::make_shared<ElGamalAHEEncryptor>(ahe_CSPPublicKey);
+    }
   };
 
+  void setRatings(const std::vector<PlainRating> providedRatings);
   bool encryptRatingsAHE();
+  const std::vector<EncryptedRatingAHE>& getEncryptedRatingsAHE() const {
+    return ahe_encryptedRatings;
+  }
   bool uploadRatings();
-};
\ No newline at end of file
+};
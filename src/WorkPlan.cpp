@@ -0,0 +1,148 @@
+#include "WorkPlan.hpp"
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+size_t unitsOf(const WorkSegment& segment) {
+  return segment.end - segment.begin;
+}
+
+WorkPlan emptyPlan(size_t groups, size_t workerCount) {
+  if (workerCount == 0)
+    throw std::invalid_argument("WorkPlan: worker count must be positive");
+  WorkPlan plan;
+  plan.workers.resize(workerCount);
+  plan.loads.assign(workerCount, 0);
+  plan.parts.assign(groups, 1);
+  plan.owners.assign(groups, 0);
+  return plan;
+}
+}  // namespace
+
+///@brief Largest segments first, each to the least loaded worker. Groups
+/// above the fair share of a worker are cut into segments of at most that
+/// share when splitHeavy is set
+///@param units - size of each group, in units of equal cost
+WorkPlan WorkPlan::byCost(const std::vector<uint64_t>& units,
+                          size_t workerCount,
+                          bool splitHeavy) {
+  WorkPlan plan = emptyPlan(units.size(), workerCount);
+  uint64_t total = std::accumulate(units.begin(), units.end(), uint64_t{0});
+  uint64_t share = std::max<uint64_t>((total + workerCount - 1) / workerCount,
+                                      1);
+
+  std::vector<WorkSegment> segments;
+  segments.reserve(units.size());
+  for (size_t group = 0; group < units.size(); group++) {
+    size_t count = 1;
+    if (splitHeavy && units[group] > share) {
+      count = (units[group] + share - 1) / share;
+      plan.heavyGroups++;
+    }
+    plan.parts[group] = count;
+    for (size_t part = 0; part < count; part++) {
+      segments.push_back({group, units[group] * part / count,
+                          units[group] * (part + 1) / count, part});
+    }
+  }
+
+  std::stable_sort(segments.begin(), segments.end(),
+                   [](const WorkSegment& a, const WorkSegment& b) {
+                     return unitsOf(a) > unitsOf(b);
+                   });
+  for (const WorkSegment& segment : segments) {
+    size_t worker = std::min_element(plan.loads.begin(), plan.loads.end()) -
+                    plan.loads.begin();
+    plan.workers[worker].push_back(segment);
+    plan.loads[worker] += unitsOf(segment);
+    if (segment.part == 0)
+      plan.owners[segment.group] = worker;
+  }
+
+  // Walk each worker's groups in order, as the single threaded loops do
+  for (auto& workerSegments : plan.workers) {
+    std::sort(workerSegments.begin(), workerSegments.end(),
+              [](const WorkSegment& a, const WorkSegment& b) {
+                return a.group != b.group ? a.group < b.group
+                                          : a.part < b.part;
+              });
+  }
+  return plan;
+}
+
+///@brief Equal runs of consecutive groups, whatever their size
+WorkPlan WorkPlan::byCount(const std::vector<uint64_t>& units,
+                           size_t workerCount) {
+  WorkPlan plan = emptyPlan(units.size(), workerCount);
+  size_t chunk = std::max<size_t>(
+      (units.size() + workerCount - 1) / workerCount, 1);
+  for (size_t group = 0; group < units.size(); group++) {
+    size_t worker = group / chunk;
+    plan.workers[worker].push_back({group, 0, units[group], 0});
+    plan.loads[worker] += units[group];
+    plan.owners[group] = worker;
+  }
+  return plan;
+}
+
+///@brief Largest load over the mean load, 1 for a perfect balance
+double WorkPlan::imbalance() const {
+  uint64_t total = std::accumulate(loads.begin(), loads.end(), uint64_t{0});
+  if (total == 0)
+    return 1;
+  uint64_t largest = *std::max_element(loads.begin(), loads.end());
+  return static_cast<double>(largest) * loads.size() / total;
+}
+
+///@brief Run body(worker, segment) over every segment, one thread per worker
+/// with work. The first error of a worker is rethrown once all have finished
+///@return wall time of each worker in ms
+std::vector<double> WorkPlan::run(
+    const std::function<void(size_t, const WorkSegment&)>& body) const {
+  std::vector<double> ms(workers.size(), 0);
+  std::vector<std::exception_ptr> errors(workers.size());
+  auto runWorker = [&](size_t worker) {
+    auto start = std::chrono::steady_clock::now();
+    try {
+      for (const WorkSegment& segment : workers[worker]) {
+        body(worker, segment);
+      }
+    } catch (...) {
+      errors[worker] = std::current_exception();
+    }
+    ms[worker] = std::chrono::duration<double, std::milli>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  };
+
+  size_t busy = std::count_if(
+      workers.begin(), workers.end(),
+      [](const std::vector<WorkSegment>& segments) {
+        return !segments.empty();
+      });
+  if (busy <= 1) {
+    for (size_t worker = 0; worker < workers.size(); worker++) {
+      if (!workers[worker].empty())
+        runWorker(worker);
+    }
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t worker = 0; worker < workers.size(); worker++) {
+      if (!workers[worker].empty())
+        threads.emplace_back(runWorker, worker);
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  for (const std::exception_ptr& error : errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+  return ms;
+}
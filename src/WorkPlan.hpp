@@ -0,0 +1,38 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// A range of the units of one group, run by one worker
+struct WorkSegment {
+  size_t group;
+  size_t begin, end;  // Units of the group, [begin, end)
+  size_t part;        // Index of the segment among the group's segments
+};
+
+// Schedule of groups of work over threads or processes, such as the entries
+// of each user or item of a rating space. Ratings follow a power law, so a
+// few groups hold most of the units. byCost hands segments out largest first
+// to the least loaded worker, and cuts heavy groups - those above a worker's
+// fair share - into segments for different workers. The parts of a split
+// group are partial results the caller reduces once every worker is done.
+// byCount splits the groups into equal runs, as parallelFor does
+class WorkPlan {
+ public:
+  std::vector<std::vector<WorkSegment>> workers;  // In group order per worker
+  std::vector<uint64_t> loads;                    // Units given to each worker
+  std::vector<size_t> parts;  // Segments of each group, above 1 when split
+  std::vector<size_t> owners;  // Worker with the first segment of each group
+  size_t heavyGroups = 0;
+
+  static WorkPlan byCost(const std::vector<uint64_t>& units,
+                         size_t workerCount,
+                         bool splitHeavy = true);
+  static WorkPlan byCount(const std::vector<uint64_t>& units,
+                          size_t workerCount);
+
+  double imbalance() const;
+  std::vector<double> run(
+      const std::function<void(size_t, const WorkSegment&)>& body) const;
+};
@@ -8,6 +8,7 @@
 #include <seal/publickey.h>
 #include <seal/secretkey.h>
 #include <chrono>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
@@ -21,36 +22,58 @@
 #include <utility>
 #include <vector>
 #include "CSP.hpp"
+#include "Dataset.hpp"
+#include "Keystore.hpp"
 #include "MessageHandler.hpp"
 #include "RecSys.hpp"
+#include "Replay.hpp"
+#include "ResultContainer.hpp"
+#include "ShardedCSP.hpp"
+#include "Setup.hpp"
 #include "seal/seal.h"
 
-int main() {
-  // Set up seal
+///@param argv - [CSP worker processes] [replay seed] [random profile max]
+/// [profile dimension], the CSP runs in this process if 0, replay mode is off
+/// without a seed, profiles start as all ones without a maximum and fill
+/// every slot without a dimension
+int main(int argc, char* argv[]) {
+  size_t cspWorkers = argc > 1 ? std::stoul(argv[1]) : 0;
+  bool replay = argc > 2;
+  ReplaySeeds seeds = deriveReplaySeeds(replay ? std::stoull(argv[2]) : 0);
+  SetupOptions setupOptions;
+  setupOptions.randomMax = argc > 3 ? std::stoull(argv[3]) : 0;
+  setupOptions.seed = seeds.dataset;
+  setupOptions.dimension = argc > 4 ? std::stoul(argv[4]) : 0;
+  // Replayed encryptions must be made in a fixed order
+  if (replay)
+    setupOptions.threads = 1;
+
+  // Set up seal, with the key material from the keystore outside replay mode
   std::cout << "Initialising seal" << std::endl;
-  seal::EncryptionParameters parms(seal::scheme_type::bgv);
-  size_t poly_modulus_degree =
-      16384;  // Change to 4096 for optimal speed, however this will need to be
-              // changed in the frontend too if using that
-  parms.set_poly_modulus_degree(poly_modulus_degree);
-  parms.set_coeff_modulus(seal::CoeffModulus::BFVDefault(poly_modulus_degree));
-  parms.set_plain_modulus(
-      seal::PlainModulus::Batching(poly_modulus_degree, 60));
+  auto startupStartTime = std::chrono::high_resolution_clock::now();
+  std::unique_ptr<Keystore> keystore;
+  if (!replay)
+    keystore = std::make_unique<Keystore>("../data/keys");
+  seal::EncryptionParameters parms =
+      replay ? replayEncryptionParameters(seeds.seal)
+             : keystore->getParameters(defaultEncryptionParameters);
   seal::SEALContext context(parms);
-  seal::KeyGenerator keygen(context);
-  seal::SecretKey secret_key = keygen.secret_key();
+  seal::SecretKey secret_key;
   seal::PublicKey public_key;
-  keygen.create_public_key(public_key);
-
-  // Save public and private key for purposes of experimentation
-  {
-    std::ofstream publicKeyOut("../data/pubkey", std::ios::binary);
-    public_key.save(publicKeyOut);
-  }
-  {
-    std::ofstream secretKeyOut("../data/seckey", std::ios::binary);
-    secret_key.save(secretKeyOut);
+  if (replay) {
+    seal::KeyGenerator keygen(context);
+    secret_key = keygen.secret_key();
+    keygen.create_public_key(public_key);
+  } else {
+    secret_key = keystore->getSecretKey(context);
+    public_key = keystore->getPublicKey(context, secret_key);
   }
+  auto startupStopTime = std::chrono::high_resolution_clock::now();
+  std::cout << "SEAL keys ready in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   startupStopTime - startupStartTime)
+                   .count()
+            << " miliseconds" << std::endl;
 
   seal::Encryptor encryptor(context, public_key);
   seal::BatchEncoder batchEncoder(context);
@@ -58,129 +81,63 @@ int main() {
   std::shared_ptr<MessageHandler> messageHandlerInstance{};
 
   // Read test data
-  // Declare vectors to hold input
   std::cout << "Reading data" << std::endl;
-  std::set<std::tuple<int, int, int>> data;
-  std::vector<std::pair<int, int>> curM;
-  std::vector<int> ratings;
-  int maxLines = 1050;
-  int skipLines = 50;
-  int curLine = 0;
-  // Use read file stream
-  if (std::ifstream fileReader("../res/u1.base"); fileReader.is_open()) {
-    std::string line;
-
-    // Get each line
-    while (curLine++ < maxLines && std::getline(fileReader, line)) {
-      if (skipLines-- < 0) {
-        std::string column;       // Hold current column entry in line
-        int columnIndex = 0;      // Count which column of line we're in
-        int user, movie, rating;  // Variables for output
-
-        // Create a stringstream for current line so we can use getline to split
-        // by delimiter
-        std::stringstream ss;
-        ss.str(line);
-
-        // Separate line by tab delimiter
-        while (std::getline(ss, column, '\t')) {
-          // Assign the entries by column to the correct variable, ignoring the
-          // timestamp and coverting to int
-          if (columnIndex % 4 == 0)
-            user = std::stoi(column);
-          if (columnIndex % 4 == 1)
-            movie = std::stoi(column);
-          if (columnIndex % 4 == 2)
-            rating = std::stoi(column);
-          columnIndex++;
-        }
-
-        // Push current line to our vectors
-        data.insert(std::make_tuple(user, movie, rating));
-      }
-    }
-    fileReader.close();
-  } else {
-    std::cout << "Could not open file" << std::endl;
-  }
-
-  // Populate M and rating vectors
-  for (auto [user, movie, rating] : data) {
-    curM.push_back(std::make_pair(user, movie));
-    ratings.push_back(rating);
-  }
+  Dataset dataset;
+  dataset.load("../res/u1.base", 1050, 50);
+  std::vector<std::pair<int, int>> curM = dataset.M;
 
   // Encrypt ratings
   std::cout << "Encrypting ratings" << std::endl;
-  std::vector<seal::Ciphertext> encryptedRatings;
-  for (int rating : ratings) {
-    std::vector<uint64_t> ratingEncodingVector(batchEncoder.slot_count(), 0ULL);
-    ratingEncodingVector[0] = static_cast<uint64_t>(rating);
-
-    seal::Plaintext ratingPlain;
-    seal::Ciphertext ratingEnc;
-    batchEncoder.encode(ratingEncodingVector, ratingPlain);
-    encryptor.encrypt(ratingPlain, ratingEnc);
+  auto setupStartTime = std::chrono::high_resolution_clock::now();
+  std::vector<seal::Ciphertext> encryptedRatings =
+      encryptRatings(dataset.ratings, encryptor, batchEncoder, setupOptions);
 
-    encryptedRatings.push_back(ratingEnc);
-  }
-
-  // Encode random values for U, V, UHat, VHat
-  // Need to move this to main and insert it
+  // Encode initial values for U, V, UHat, VHat
   std::cout << "Creating embeddings" << std::endl;
-  std::vector<seal::Ciphertext> U(curM.size()), V(curM.size()), UHat, VHat;
-  int prevUser = -1;
-  int prevItem = -1;
-  for (int i = 0; i < curM.size(); i++) {
-    std::vector<uint64_t> UEncodingVector(batchEncoder.slot_count(), 0ULL),
-        VEncodingVector(batchEncoder.slot_count(), 0ULL);
-    for (int j = 0; j < batchEncoder.slot_count(); j++) {
-      UEncodingVector[j] = 1ULL;
-      VEncodingVector[j] = 1ULL;
-    }
-    seal::Plaintext UPlain, VPlain;
-    batchEncoder.encode(UEncodingVector, UPlain);
-    batchEncoder.encode(VEncodingVector, VPlain);
-    encryptor.encrypt(UPlain, U[i]);
-    encryptor.encrypt(VPlain, V[i]);
-
-    // Add entry for UHat
-    if (curM.at(i).first == prevUser) {
-      std::vector<uint64_t> zeroEncodingVector(batchEncoder.slot_count(), 0ULL);
-      seal::Plaintext zeroPlain;
-      seal::Ciphertext zeroEnc;
+  auto [U, V, UHat, VHat] =
+      createEmbeddings(curM, encryptor, batchEncoder, setupOptions);
+  auto setupStopTime = std::chrono::high_resolution_clock::now();
+  std::cout << "Setup took "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   setupStopTime - setupStartTime)
+                   .count()
+            << " miliseconds" << std::endl;
 
-      batchEncoder.encode(zeroEncodingVector, zeroPlain);
-      encryptor.encrypt(zeroPlain, zeroEnc);
-      UHat.push_back(zeroEnc);
-    } else {
-      UHat.push_back(U.at(i));
-    }
-
-    // Add entry for UHat
-    if (curM.at(i).second == prevItem) {
-      std::vector<uint64_t> zeroEncodingVector(batchEncoder.slot_count(), 0ULL);
-      seal::Plaintext zeroPlain;
-      seal::Ciphertext zeroEnc;
-
-      batchEncoder.encode(zeroEncodingVector, zeroPlain);
-      encryptor.encrypt(zeroPlain, zeroEnc);
-      VHat.push_back(zeroEnc);
-    } else {
-      VHat.push_back(V.at(i));
-    }
-
-    // Re-assign prevUser and prevItem
-    std::tie(prevUser, prevItem) = curM.at(i);
-  }
   // Inject data into new CSP
   std::cout << "Creating CSP Instance" << std::endl;
-  auto CSPInstance = std::make_shared<CSP>(messageHandlerInstance, context,
-                                           public_key, secret_key, curM);
+  std::shared_ptr<CSP> CSPInstance;
+  if (cspWorkers > 0) {
+    CSPInstance = std::make_shared<ShardedCSP>(messageHandlerInstance, context,
+                                               public_key, secret_key, curM,
+                                               cspWorkers);
+  } else {
+    CSPInstance = std::make_shared<CSP>(messageHandlerInstance, context,
+                                        public_key, secret_key, curM);
+  }
   // Inject data into RecSys
   std::cout << "Creating RecSys Instance" << std::endl;
   std::unique_ptr<RecSys> recSysInstance = std::make_unique<RecSys>(
       CSPInstance, messageHandlerInstance, context, curM);
+  if (replay) {
+    std::cout << "Replay mode, seed " << argv[2] << std::endl;
+    CSPInstance->setSeed(seeds.csp);
+    recSysInstance->setSeed(seeds.masks);
+  }
+  if (keystore) {
+    auto keysStartTime = std::chrono::high_resolution_clock::now();
+    CSPInstance->generateKeys(*keystore);
+    auto keysStopTime = std::chrono::high_resolution_clock::now();
+    std::cout << "CSP AHE keys ready in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     keysStopTime - keysStartTime)
+                     .count()
+              << " miliseconds" << std::endl;
+    for (const auto& [step, ms] : keystore->getTimings()) {
+      std::cout << "  " << step << " in " << ms << " ms" << std::endl;
+    }
+  }
+  if (setupOptions.dimension > 0)
+    recSysInstance->setDimension(setupOptions.dimension);
   recSysInstance->setRatings(encryptedRatings);
   recSysInstance->setEmbeddings(U, V, UHat, VHat);
 
@@ -197,41 +154,43 @@ int main() {
   std::cout << "Gradient descent took " << duration.count() << " miliseconds "
             << std::endl;
 
-  std::cout << "Computing results for user 1" << std::endl;
-  auto [items, resultsFor1] = recSysInstance->computePredictions(1);
-
-  std::cout << "Decrypted results for user 1:" << std::endl;
-  for (int i = 0; i < resultsFor1.size(); i++) {
-    {
-      std::string outputName = "../data/user1_" + std::to_string(items.at(i));
-      std::ofstream line(outputName, std::ios::binary);
-      resultsFor1.at(i).save(line);
+  // Print the predictions of a user, packed slot count / d to a ciphertext,
+  // and add them to the result container
+  ResultContainerWriter resultContainer(
+      recSysInstance->getDimension(),
+      recSysInstance->getPredictionScaleBits());
+  auto showPredictions = [&](int user) {
+    std::cout << "Computing results for user " << user << std::endl;
+    auto [items, results] = recSysInstance->computePredictions(user);
+    resultContainer.add(user, items, results);
+
+    std::cout << "Decrypted results for user " << user << ":" << std::endl;
+    std::vector<std::vector<uint64_t>> decoded(results.size());
+    for (int i = 0; i < items.size(); i++) {
+      auto [k, slot] = recSysInstance->predictionSlot(i);
+      if (decoded[k].empty()) {
+        seal::Plaintext curRowPlain;
+        decryptor.decrypt(results.at(k), curRowPlain);
+        batchEncoder.decode(curRowPlain, decoded[k]);
+      }
+      std::cout << items.at(i) << ", "
+                << std::ldexp((double)decoded[k].at(slot),
+                              -recSysInstance->getPredictionScaleBits())
+                << std::endl;
     }
-    seal::Plaintext curRowPlain;
-    std::vector<uint64_t> curRow;
-    decryptor.decrypt(resultsFor1.at(i), curRowPlain);
-    batchEncoder.decode(curRowPlain, curRow);
-    std::cout << items.at(i) << ", " << (double)curRow.at(0) / pow(2, 20)
-              << std::endl;
-  }
-
-  std::cout << "Computing results for user 2" << std::endl;
-  auto [itemsUser2, resultsFor2] = recSysInstance->computePredictions(2);
+    return results;
+  };
+  std::vector<seal::Ciphertext> resultsFor1 = showPredictions(1);
+  std::vector<seal::Ciphertext> resultsFor2 = showPredictions(2);
+  std::cout << "Saved results to ../data/predictions.pprs ("
+            << resultContainer.write("../data/predictions.pprs") << " bytes)"
+            << std::endl;
 
-  std::cout << "Decrypted results for user 2:" << std::endl;
-  for (int i = 0; i < resultsFor2.size(); i++) {
-    {
-      std::string outputName =
-          "../data/user2_" + std::to_string(itemsUser2.at(i));
-      std::ofstream line(outputName, std::ios::binary);
-      resultsFor2.at(i).save(line);
-    }
-    seal::Plaintext curRowPlain;
-    std::vector<uint64_t> curRow;
-    decryptor.decrypt(resultsFor2.at(i), curRowPlain);
-    batchEncoder.decode(curRowPlain, curRow);
-    std::cout << items.at(i) << ", " << (double)curRow.at(0) / pow(2, 20)
-              << std::endl;
+  // Runs with the same seed and inputs give the same digest
+  if (replay) {
+    std::cout << "Trace digest: " << std::hex
+              << ciphertextDigest(resultsFor2, ciphertextDigest(resultsFor1))
+              << std::dec << std::endl;
   }
 
   std::cout << "Finished" << std::endl;